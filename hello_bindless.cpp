@@ -4,7 +4,20 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <float.h>
+#include <immintrin.h>
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#if defined(__linux__)
+#include <pthread.h>
+#endif
 
 #pragma comment(lib, "user32.lib")
 
@@ -34,1329 +47,13417 @@
 #define STRINGIFY_(x)  STRINGIFY__(x)
 #define STRINGIFY(x)   STRINGIFY_(x)
 
-//------------------------------------------------------------------------
-// DXC
+#define CONCAT__(a, b) a##b
+#define CONCAT_(a, b)  CONCAT__(a, b)
+#define CONCAT(a, b)   CONCAT_(a, b)
 
-struct DXC_State
+// FNV-1a, good enough for hashing small POD keys
+uint64_t HashBytes(const void *data, size_t size, uint64_t hash = 0xCBF29CE484222325ull)
 {
-	IDxcCompiler3 *compiler;
-};
+	const uint8_t *bytes = (const uint8_t *)data;
 
-DXC_State g_dxc;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001B3ull;
+	}
 
-void DXC_Init()
+	return hash;
+}
+
+LARGE_INTEGER g_qpc_freq;
+
+LARGE_INTEGER GetTime()
 {
-	HRESULT hr;
+	LARGE_INTEGER result;
+	QueryPerformanceCounter(&result);
 
-	hr = DxcCreateInstance(CLSID_DxcCompiler, IID_PPV_ARGS(&g_dxc.compiler));
-	CHECK_HR(hr);
+	return result;
 }
 
-bool DXC_CompileShader(
-	const char    *source,
-	uint32_t       source_size,
-	const wchar_t *entry_point,
-	const wchar_t *target,
-	IDxcBlob     **result_blob,
-	IDxcBlob     **error_blob)
+double TimeElapsed(LARGE_INTEGER start, LARGE_INTEGER end)
 {
-	assert(g_dxc.compiler || !"Call DXC_Init before calling DXC_CompileShader");
+	if (!g_qpc_freq.QuadPart)
+	{
+		QueryPerformanceFrequency(&g_qpc_freq);
+	}
 
-	bool result = false;
+	return (double)(end.QuadPart - start.QuadPart) / (double)g_qpc_freq.QuadPart;
+}
 
-	const wchar_t *args[] = {
-		L"-E", entry_point,
-		L"-T", target,
-		L"-WX",
-		L"-Zi",
-	};
+// A high resolution waitable timer per thread, where there is such a thing (Windows 10 1803 on)
+thread_local HANDLE t_wait_timer;
+thread_local bool   t_wait_timer_created;
 
-	DxcBuffer source_buffer = {
-		.Ptr      = source,
-		.Size     = source_size,
-		.Encoding = 0,
-	};
+// Sleeps through most of the wait and spins the rest, since waking up is never quite on time. A high
+// resolution timer is usually within a few hundred microseconds; Sleep, the fallback, tends to
+// oversleep by up to a scheduler tick, so it has to stop further short.
+void WaitSeconds(double seconds)
+{
+	LARGE_INTEGER start = GetTime();
 
-	HRESULT hr;
+	if (!t_wait_timer_created)
+	{
+		t_wait_timer         = CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+		t_wait_timer_created = true;
+	}
 
-	IDxcResult *compile_result = nullptr;
-	hr = g_dxc.compiler->Compile(&source_buffer, args, ArrayCount(args), nullptr, IID_PPV_ARGS(&compile_result));
+	double spin_time = t_wait_timer ? 0.0005 : 0.002;
 
-	if (SUCCEEDED(hr))
+	if (seconds > spin_time)
 	{
-		HRESULT compile_hr;
-		hr = compile_result->GetStatus(&compile_hr);
+		double sleep_time = seconds - spin_time;
 
-		if (SUCCEEDED(compile_hr))
+		if (t_wait_timer)
 		{
-			if (compile_result->HasOutput(DXC_OUT_OBJECT))
-			{
-				hr = compile_result->GetOutput(DXC_OUT_OBJECT, IID_PPV_ARGS(result_blob), nullptr);
-				CHECK_HR(hr);
+			// relative times are negative, in 100 ns units
+			LARGE_INTEGER due;
+			due.QuadPart = -(LONGLONG)(sleep_time*10000000.0);
 
-				result = true;
-			}
+			SetWaitableTimer(t_wait_timer, &due, 0, nullptr, nullptr, FALSE);
+			WaitForSingleObject(t_wait_timer, INFINITE);
 		}
-
-		// even if we succeeded, we could have warnings (if I didn't pass WX above...)
-		if (compile_result->HasOutput(DXC_OUT_ERRORS))
+		else
 		{
-			hr = compile_result->GetOutput(DXC_OUT_ERRORS, IID_PPV_ARGS(error_blob), nullptr);
-			CHECK_HR(hr);
+			Sleep((DWORD)(sleep_time*1000.0));
 		}
 	}
 
-	return result;
+	while (TimeElapsed(start, GetTime()) < seconds)
+	{
+		_mm_pause();
+	}
 }
 
 //------------------------------------------------------------------------
-// D3D12
-
-static constexpr int  g_frame_latency = 3;
-static constexpr bool g_enable_gpu_based_validation = true;
-
-//------------------------------------------------------------------------
-
-enum D3D12_RootParameters
+// CPU profiler
+//
+// CPU_SCOPE("name") times the rest of the enclosing block. Each thread writes the scopes it finishes
+// into a ring buffer of its own, taken from a fixed set the first time it records anything, so
+// recording never takes a lock or touches another thread's cache lines: two GetTimes and a store.
+// CpuProfiler_WriteChromeTrace can be called from any thread while others are still recording. It
+// copies out each ring and then drops whatever got overwritten while it was copying, and writes the
+// rest in Chrome's trace event format, which Perfetto and chrome://tracing both load.
+//
+// Scope names have to be string literals, or at least live as long as the program.
+
+static constexpr uint32_t g_max_profiled_threads   = 32;
+static constexpr uint32_t g_cpu_profile_ring_size  = 16384; // scopes per thread, a power of two
+
+struct CpuProfileEvent
 {
-	D3D12_RootParameter_32bit_constants,
-	D3D12_RootParameter_pass_cbv,
-	D3D12_RootParameter_view_cbv,
-	D3D12_RootParameter_global_cbv,
-	D3D12_RootParameter_COUNT,
+	const char *name;
+	LONGLONG    begin; // GetTime
+	LONGLONG    end;
 };
 
-//------------------------------------------------------------------------
-
-ID3D12Resource *D3D12_CreateUploadBuffer(
-	ID3D12Device  *device,
-	uint32_t       size,
-	const wchar_t *debug_name,
-	const void    *initial_data      = nullptr,
-	uint32_t       initial_data_size = 0) 
+struct CpuProfileBuffer
 {
-	D3D12_HEAP_PROPERTIES heap_properties = {
-		.Type = D3D12_HEAP_TYPE_UPLOAD,
-	};
+	DWORD thread_id;
+	char  thread_name[32];
 
-	D3D12_RESOURCE_DESC desc = {
-		.Dimension        = D3D12_RESOURCE_DIMENSION_BUFFER,
-		.Width            = size,
-		.Height           = 1,
-		.DepthOrArraySize = 1,
-		.MipLevels        = 1,
-		.Format           = DXGI_FORMAT_UNKNOWN,
-		.SampleDesc       = { .Count = 1, .Quality = 0 },
-		.Layout           = D3D12_TEXTURE_LAYOUT_ROW_MAJOR,
-	};
+	// only the owner writes to it, events below it are done
+	alignas(64) volatile LONGLONG written;
 
-	ID3D12Resource *result;
-	HRESULT hr = device->CreateCommittedResource(
-		&heap_properties,
-		D3D12_HEAP_FLAG_NONE,
-		&desc,
-		D3D12_RESOURCE_STATE_COMMON,
-		nullptr,
-		IID_PPV_ARGS(&result));
+	CpuProfileEvent events[g_cpu_profile_ring_size];
+};
 
-	CHECK_HR(hr);
+struct CpuProfiler
+{
+	CpuProfileBuffer *volatile buffers[g_max_profiled_threads];
+	volatile long              buffer_count;
+	volatile long              dropped_threads; // threads that wanted a buffer once they'd run out
+};
 
-	result->SetName(debug_name);
+CpuProfiler g_cpu_profiler;
 
-	if (initial_data)
-	{
-		assert(initial_data_size <= size || !"Your initial data is too big for this upload buffer!");
+thread_local CpuProfileBuffer *t_cpu_profile_buffer;
+thread_local bool              t_cpu_profile_buffer_claimed;
 
-		void *mapped;
+CpuProfileBuffer *CpuProfiler_GetThreadBuffer()
+{
+	if (!t_cpu_profile_buffer_claimed)
+	{
+		t_cpu_profile_buffer_claimed = true;
 
-		D3D12_RANGE read_range = {};
-		hr = result->Map(0, &read_range, &mapped);
+		long index = InterlockedIncrement(&g_cpu_profiler.buffer_count) - 1;
 
-		CHECK_HR(hr);
+		if (index < (long)g_max_profiled_threads)
+		{
+			CpuProfileBuffer *buffer = (CpuProfileBuffer *)calloc(1, sizeof(CpuProfileBuffer));
+			buffer->thread_id = GetCurrentThreadId();
+			snprintf(buffer->thread_name, sizeof(buffer->thread_name), "Thread %lu", (unsigned long)buffer->thread_id);
 
-		memcpy(mapped, initial_data, initial_data_size);
+			// the buffer has to be set up before anyone exporting can see it
+			_WriteBarrier();
+			g_cpu_profiler.buffers[index] = buffer;
 
-		result->Unmap(0, nullptr);
+			t_cpu_profile_buffer = buffer;
+		}
+		else
+		{
+			InterlockedIncrement(&g_cpu_profiler.dropped_threads);
+		}
 	}
 
-	return result;
+	return t_cpu_profile_buffer;
 }
 
-//------------------------------------------------------------------------
-
-bool D3D12_Transition(
-	ID3D12Resource         *resource,
-	D3D12_RESOURCE_STATES  *current_state,
-	D3D12_RESOURCE_STATES   desired_state,
-	D3D12_RESOURCE_BARRIER *barrier)
+// Shows up as the thread's name in the trace
+void CpuProfiler_SetThreadName(const char *name)
 {
-	bool result = false;
+	CpuProfileBuffer *buffer = CpuProfiler_GetThreadBuffer();
 
-	if (*current_state != desired_state)
+	if (buffer)
 	{
-		barrier->Type  = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION;
-		barrier->Flags = D3D12_RESOURCE_BARRIER_FLAG_NONE;
-		barrier->Transition.pResource = resource;
-		barrier->Transition.Subresource = 0;
-		barrier->Transition.StateBefore = *current_state;
-		barrier->Transition.StateAfter  = desired_state;
-		*current_state = desired_state;
-
-		result = true;
+		snprintf(buffer->thread_name, sizeof(buffer->thread_name), "%s", name);
 	}
-
-	return result;
 }
 
-//------------------------------------------------------------------------
-
-struct D3D12_BufferAllocation
-{
-	ID3D12Resource           *buffer;
-	void                     *cpu_base;
-	D3D12_GPU_VIRTUAL_ADDRESS gpu_base;
-	uint32_t                  offset;
-};
-
-struct D3D12_LinearAllocator
+void CpuProfiler_Record(const char *name, LARGE_INTEGER begin, LARGE_INTEGER end)
 {
-	ID3D12Resource           *buffer;
-	char                     *cpu_base;
-	D3D12_GPU_VIRTUAL_ADDRESS gpu_base;
-	uint32_t                  at;
-	uint32_t                  capacity;
+	CpuProfileBuffer *buffer = t_cpu_profile_buffer;
 
-	void Init(ID3D12Device *device, uint32_t size)
+	if (!buffer)
 	{
-		buffer = D3D12_CreateUploadBuffer(device, size, L"Frame Allocator");
-
-		void *mapped;
+		buffer = CpuProfiler_GetThreadBuffer();
+		if (!buffer) return;
+	}
 
-		D3D12_RANGE null_range = {};
-		HRESULT hr = buffer->Map(0, &null_range, &mapped);
-		CHECK_HR(hr);
+	LONGLONG written = buffer->written;
 
-		cpu_base = (char *)mapped;
-		gpu_base = buffer->GetGPUVirtualAddress();
-		at       = 0;
-		capacity = size;
-	}
+	buffer->events[written & (g_cpu_profile_ring_size - 1)] = {
+		.name  = name,
+		.begin = begin.QuadPart,
+		.end   = end.QuadPart,
+	};
 
-	D3D12_BufferAllocation Allocate(uint32_t size, uint32_t align)
-	{
-		// evil bit hack: round up to the next multiple of `align` so long as `align` is a power of 2
-		uint32_t at_aligned = (at + (align - 1)) & (-(int32_t)align);
-		assert(at_aligned <= capacity);
+	// the event has to be visible before the count that publishes it
+	_WriteBarrier();
 
-		D3D12_BufferAllocation result = {
-			.buffer   = buffer,
-			.cpu_base = cpu_base + at_aligned,
-			.gpu_base = gpu_base + at_aligned,
-			.offset   = at_aligned,
-		};
+	buffer->written = written + 1;
+}
 
-		at = at_aligned + size;
+struct CpuScope
+{
+	const char   *name;
+	LARGE_INTEGER begin;
 
-		return result;
+	CpuScope(const char *in_name)
+	{
+		name  = in_name;
+		begin = GetTime();
 	}
 
-	void Reset()
+	~CpuScope()
 	{
-		at = 0;
+		CpuProfiler_Record(name, begin, GetTime());
 	}
+};
 
-	void Release()
+#define CPU_SCOPE(name) CpuScope CONCAT(cpu_scope_, __LINE__)(name)
+
+void CpuProfiler_WriteJSONString(FILE *file, const char *string)
+{
+	fputc('"', file);
+
+	for (const char *c = string; *c; c++)
 	{
-		buffer->Unmap(0, nullptr);
-		buffer->Release();
-		ZeroStruct(this);
+		if (*c == '"' || *c == '\\') fputc('\\', file);
+		fputc(*c, file);
 	}
-};
 
-//------------------------------------------------------------------------
-// Texture creation
+	fputc('"', file);
+}
 
-ID3D12Resource *D3D12_CreateTexture(
-	ID3D12Device              *device,
-	uint32_t                   width,
-	uint32_t                   height,
-	const wchar_t             *debug_name,
-	const void                *initial_data = nullptr,
-	ID3D12GraphicsCommandList *command_list = nullptr,
-	D3D12_LinearAllocator     *allocator    = nullptr)
+// Every thread's most recent scopes, with times in microseconds from the oldest one written
+bool CpuProfiler_WriteChromeTrace(const char *path)
 {
-	D3D12_HEAP_PROPERTIES heap_properties = {
-		.Type = D3D12_HEAP_TYPE_DEFAULT,
-	};
+	FILE *file = fopen(path, "w");
+	if (!file)
+	{
+		return false;
+	}
 
-	D3D12_RESOURCE_DESC desc = {
-		.Dimension        = D3D12_RESOURCE_DIMENSION_TEXTURE2D,
-		.Width            = width,
-		.Height           = height,
-		.DepthOrArraySize = 1,
-		.MipLevels        = 1,
-		.Format           = DXGI_FORMAT_B8G8R8A8_UNORM_SRGB,
-		.SampleDesc       = { .Count = 1, .Quality = 0 },
-		.Layout           = D3D12_TEXTURE_LAYOUT_UNKNOWN,
-	};
+	if (!g_qpc_freq.QuadPart)
+	{
+		QueryPerformanceFrequency(&g_qpc_freq);
+	}
 
-	ID3D12Resource *result;
-	HRESULT hr = device->CreateCommittedResource(
-		&heap_properties,
-		D3D12_HEAP_FLAG_NONE,
-		&desc,
-		D3D12_RESOURCE_STATE_COMMON,
-		nullptr,
-		IID_PPV_ARGS(&result));
+	//------------------------------------------------------------------------
+	// Copy out the rings. Anything the owner could have written over while it was being copied is
+	// thrown away, which is everything more than a ring behind where the owner got to by the end.
 
-	CHECK_HR(hr);
+	uint32_t buffer_count = (uint32_t)g_cpu_profiler.buffer_count;
+	if (buffer_count > g_max_profiled_threads) buffer_count = g_max_profiled_threads;
 
-	result->SetName(debug_name);
+	CpuProfileEvent *copies[g_max_profiled_threads] = {};
+	uint32_t         first [g_max_profiled_threads] = {};
+	uint32_t         counts[g_max_profiled_threads] = {};
 
-	if (initial_data)
+	LONGLONG epoch = INT64_MAX;
+
+	for (uint32_t i = 0; i < buffer_count; i++)
 	{
-		assert(allocator    || !"If you want to provide the texture with initial data, we need an allocator with an upload heap");
-		assert(command_list || !"If you want to provide the texture with initial data, we need a command list to issue a copy on");
+		CpuProfileBuffer *buffer = g_cpu_profiler.buffers[i];
 
-		// Figure out the required layout of the texture
-		uint64_t dst_size;
-		D3D12_PLACED_SUBRESOURCE_FOOTPRINT dst_layout;
-		device->GetCopyableFootprints(&desc, 0, 1, 0, &dst_layout, nullptr, nullptr, &dst_size);
+		// claimed, but not set up yet
+		if (!buffer) continue;
 
-		// Create an upload heap allocation to serve as the copy source
-		D3D12_BufferAllocation dst_alloc = allocator->Allocate((uint32_t)dst_size, D3D12_TEXTURE_DATA_PLACEMENT_ALIGNMENT);
+		copies[i] = (CpuProfileEvent *)malloc(sizeof(CpuProfileEvent)*g_cpu_profile_ring_size);
 
-		size_t src_stride = sizeof(uint32_t)*width;
-		size_t dst_stride = dst_layout.Footprint.RowPitch;
+		LONGLONG start = buffer->written;
+		_ReadBarrier();
 
-		// copy the texture data to the upload heap
-		char *src = (char *)initial_data;
-		char *dst = (char *)dst_alloc.cpu_base;
+		LONGLONG oldest = start > (LONGLONG)g_cpu_profile_ring_size ? start - (LONGLONG)g_cpu_profile_ring_size : 0;
 
-		for (size_t y = 0; y < height; y++)
+		for (LONGLONG j = oldest; j < start; j++)
 		{
-			memcpy(dst, src, sizeof(uint32_t)*width);
-
-			src += src_stride;
-			dst += dst_stride;
+			copies[i][j & (g_cpu_profile_ring_size - 1)] = buffer->events[j & (g_cpu_profile_ring_size - 1)];
 		}
 
-		// issue the copy to the texture on the command list
-		D3D12_TEXTURE_COPY_LOCATION src_loc = {
-			.pResource = dst_alloc.buffer,
-			.Type      = D3D12_TEXTURE_COPY_TYPE_PLACED_FOOTPRINT,
-			.PlacedFootprint = {
-				.Offset    = dst_alloc.offset,
-				.Footprint = dst_layout.Footprint,
-			},
-		};
+		_ReadBarrier();
+		LONGLONG end = buffer->written;
 
-		D3D12_TEXTURE_COPY_LOCATION dst_loc = {
-			.pResource        = result,
-			.Type             = D3D12_TEXTURE_COPY_TYPE_SUBRESOURCE_INDEX,
-			.SubresourceIndex = 0,
-		};
+		// the owner may be halfway through writing event end, into the slot of end - ring size, so only
+		// the ones after that are known not to have been overwritten while they were copied
+		LONGLONG intact = end >= (LONGLONG)g_cpu_profile_ring_size ? end - (LONGLONG)g_cpu_profile_ring_size + 1 : 0;
+		if (intact < oldest) intact = oldest;
 
-		command_list->CopyTextureRegion(&dst_loc, 0, 0, 0, &src_loc, nullptr);
+		first [i] = (uint32_t)(intact & (g_cpu_profile_ring_size - 1));
+		counts[i] = intact < start ? (uint32_t)(start - intact) : 0;
 
+		for (uint32_t j = 0; j < counts[i]; j++)
 		{
-			D3D12_RESOURCE_BARRIER barrier = {
-				.Type = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION,
-				.Transition = {
-					.pResource   = result,
-					.Subresource = 0,
-					.StateBefore = D3D12_RESOURCE_STATE_COPY_DEST,
-					.StateAfter  = D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE,
-				},
-			};
+			const CpuProfileEvent *event = &copies[i][(first[i] + j) & (g_cpu_profile_ring_size - 1)];
+			if (event->begin < epoch) epoch = event->begin;
+		}
+	}
 
-			command_list->ResourceBarrier(1, &barrier);
+	//------------------------------------------------------------------------
+	// Write them out, complete events sort themselves into a tree by time on each thread
+
+	double us_per_tick = 1000000.0 / (double)g_qpc_freq.QuadPart;
+
+	fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+	bool first_event = true;
+
+	for (uint32_t i = 0; i < buffer_count; i++)
+	{
+		if (!copies[i]) continue;
+
+		CpuProfileBuffer *buffer = g_cpu_profiler.buffers[i];
+
+		fprintf(file, "%s{\"ph\": \"M\", \"pid\": 1, \"tid\": %lu, \"name\": \"thread_name\", \"args\": {\"name\": ", first_event ? "" : ",\n", (unsigned long)buffer->thread_id);
+		CpuProfiler_WriteJSONString(file, buffer->thread_name);
+		fprintf(file, "}}");
+
+		first_event = false;
+
+		for (uint32_t j = 0; j < counts[i]; j++)
+		{
+			const CpuProfileEvent *event = &copies[i][(first[i] + j) & (g_cpu_profile_ring_size - 1)];
+
+			fprintf(file, ",\n{\"ph\": \"X\", \"pid\": 1, \"tid\": %lu, \"ts\": %.3f, \"dur\": %.3f, \"name\": ",
+					(unsigned long)buffer->thread_id, (double)(event->begin - epoch)*us_per_tick, (double)(event->end - event->begin)*us_per_tick);
+			CpuProfiler_WriteJSONString(file, event->name);
+			fputc('}', file);
 		}
+
+		free(copies[i]);
 	}
 
-	return result;
+	fprintf(file, "\n]}\n");
+
+	fclose(file);
+
+	return true;
 }
 
 //------------------------------------------------------------------------
-
-struct D3D12_Descriptor
+// Work queue
+//
+// A handful of worker threads with a deque of entries each, plus one for the main thread. Work gets
+// added to the deque of the thread adding it, which takes entries back off the same end (newest
+// first, while they're still warm in its cache), and threads that run out steal from the other end
+// of someone else's deque (oldest first, which tends to be the biggest chunk of work left). Deques
+// are Chase-Lev: the owner only needs an interlocked operation when it's fighting a thief for the
+// last entry.
+//
+// Entries can be added from any thread of the queue, including from inside other entries. Each one
+// can count down a WorkCounter when it's done, and waiting on a counter runs other entries in the
+// meantime, so entries can fork work off and wait for it without tying up a thread. Entries added
+// without a counter go on the queue's own, which CompleteAllWork waits on. Only the main thread (or
+// whichever thread called Init) may call that, since it waits for everything including the caller.
+//
+// Other threads that want to add work, like the render thread, need a deque of their own: Init has to
+// make room for them, and each calls RegisterThread before it first touches the queue. They should
+// wait on counters of their own rather than call CompleteAllWork.
+//
+// Unlike the rest of this file the queue doesn't need Windows: the workers are std::threads, idle
+// ones sleep on a WorkSemaphore, and the deques and counters are std::atomics. Pinning is the only
+// part that asks the OS directly, and it does nothing on platforms it doesn't know about. Workers do
+// name themselves in the CPU profiler, which is still Win32.
+
+typedef void (*WorkFunction)(void *data);
+
+struct WorkCounter
 {
-	D3D12_CPU_DESCRIPTOR_HANDLE cpu;
-	D3D12_GPU_DESCRIPTOR_HANDLE gpu;
-	uint32_t                    index;
+	std::atomic<long> pending;
 };
 
-struct D3D12_DescriptorAllocator
+struct WorkQueueEntry
 {
-	ID3D12DescriptorHeap       *heap;
-	D3D12_DESCRIPTOR_HEAP_TYPE  type;
-	D3D12_CPU_DESCRIPTOR_HANDLE cpu_base;
-	D3D12_GPU_DESCRIPTOR_HANDLE gpu_base;
-	uint32_t                    stride;
-	uint32_t                    at;
-	uint32_t                    capacity;
+	WorkFunction function;
+	void        *data;
+	WorkCounter *counter;
+};
 
-	void Init(ID3D12Device *device, D3D12_DESCRIPTOR_HEAP_TYPE in_type, uint32_t in_capacity, bool shader_visible, const wchar_t *debug_name)
-	{
-		D3D12_DESCRIPTOR_HEAP_DESC desc = {
-			.Type           = in_type,
-			.NumDescriptors = in_capacity,
-			.Flags          = shader_visible ? D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE : D3D12_DESCRIPTOR_HEAP_FLAG_NONE,
-		};
+static constexpr uint32_t g_max_worker_threads        = 15;
+static constexpr uint32_t g_max_external_work_threads = 1;
+static constexpr uint32_t g_max_work_threads          = g_max_worker_threads + 1 + g_max_external_work_threads;
+static constexpr bool     g_pin_worker_threads        = false;
+static constexpr uint32_t g_work_deque_size           = 1024; // a power of two
+static constexpr uint32_t g_work_spin_count           = 256;  // rounds of looking for work before going to sleep
 
-		HRESULT hr;
+// Which deque belongs to the current thread. The thread that created the queue is 0.
+thread_local uint32_t t_work_thread_index;
 
-		hr = device->CreateDescriptorHeap(&desc, IID_PPV_ARGS(&heap));
-		CHECK_HR(hr);
+// Puts the calling thread on one logical processor, where the platform lets us
+void WorkQueue_PinCurrentThread(uint32_t processor)
+{
+#if defined(_WIN32)
+	if (processor < 8*sizeof(DWORD_PTR))
+	{
+		SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << processor);
+	}
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(processor, &set);
+
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	(void)processor;
+#endif
+}
 
-		heap->SetName(debug_name);
+// A counting semaphore that stops counting at max_count, so a burst of adds can't bank up wakeups for
+// workers that have since found work on their own.
+struct WorkSemaphore
+{
+	std::mutex              mutex;
+	std::condition_variable condition;
+	uint32_t                count;
+	uint32_t                max_count;
 
-		cpu_base = heap->GetCPUDescriptorHandleForHeapStart();
+	void Init(uint32_t in_max_count)
+	{
+		count     = 0;
+		max_count = in_max_count;
+	}
 
-		if (shader_visible)
+	void Release(uint32_t release_count)
+	{
 		{
-			gpu_base = heap->GetGPUDescriptorHandleForHeapStart();
+			std::lock_guard<std::mutex> lock(mutex);
+			count = count + release_count < max_count ? count + release_count : max_count;
 		}
 
-		stride = device->GetDescriptorHandleIncrementSize(in_type);
-
-		type     = in_type;
-		at       = 0;
-		capacity = in_capacity;
+		if (release_count == 1) condition.notify_one();
+		else                    condition.notify_all();
 	}
 
-	D3D12_Descriptor Allocate()
+	void Wait()
 	{
-		assert(at < capacity);
-
-		uint32_t index = at++;
+		std::unique_lock<std::mutex> lock(mutex);
 
-		D3D12_Descriptor result = {
-			.cpu   = { cpu_base.ptr + stride*index },
-			.gpu   = { gpu_base.ptr + stride*index },
-			.index = index,
-		};
+		while (count == 0)
+		{
+			condition.wait(lock);
+		}
 
-		return result;
+		count -= 1;
 	}
+};
 
-	void Reset()
+struct alignas(64) WorkDeque
+{
+	// top is where thieves take from, bottom is where the owner pushes and pops. They live on separate
+	// cache lines, or every steal would be fighting the owner for the line.
+	alignas(64) std::atomic<int64_t> top;
+	alignas(64) std::atomic<int64_t> bottom;
+
+	// only written by the owner, read by whoever wants stats
+	uint32_t executed;
+	uint32_t stolen; // entries this thread took from other deques
+
+	WorkQueueEntry entries[g_work_deque_size];
+
+	// Owner only
+	void Push(const WorkQueueEntry *entry)
 	{
-		at = 0;
+		int64_t b = bottom.load(std::memory_order_relaxed);
+		assert(b - top.load(std::memory_order_acquire) < (int64_t)g_work_deque_size || !"Work deque is full");
+
+		entries[b & (g_work_deque_size - 1)] = *entry;
+
+		// the entry has to be visible before the index that publishes it
+		bottom.store(b + 1, std::memory_order_release);
 	}
 
-	void Release()
+	// Owner only, takes the newest entry
+	bool Pop(WorkQueueEntry *entry)
 	{
-		heap->Release();
-		ZeroStruct(this);
-	}
-};
+		int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+		bottom.store(b, std::memory_order_relaxed);
 
-//------------------------------------------------------------------------
+		// the store to bottom has to land before top is read, or a thief and the owner could both take
+		// the last entry
+		std::atomic_thread_fence(std::memory_order_seq_cst);
 
-struct D3D12_Frame
-{
-	uint64_t fence_value;
+		int64_t t = top.load(std::memory_order_relaxed);
 
-	D3D12_LinearAllocator      upload_arena;
-	ID3D12CommandAllocator    *command_allocator;
-	ID3D12GraphicsCommandList *command_list;
+		if (t > b)
+		{
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return false;
+		}
 
-	D3D12_RESOURCE_STATES backbuffer_state;
-	ID3D12Resource       *backbuffer;
-	D3D12_Descriptor      rtv;
-};
+		*entry = entries[b & (g_work_deque_size - 1)];
 
-struct D3D12_State
-{
-	IDXGIFactory6       *factory;
-	IDXGIAdapter1       *adapter;
-	ID3D12Device        *device;
-	ID3D12CommandQueue  *queue;
-	ID3D12Fence         *fence;
-	ID3D12RootSignature *rs_bindless;
+		bool result = true;
 
-	uint64_t frame_index;
+		if (t == b)
+		{
+			// last one, whoever moves top first gets it
+			result = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+			bottom.store(b + 1, std::memory_order_relaxed);
+		}
 
-	D3D12_DescriptorAllocator cbv_srv_uav;
-	D3D12_DescriptorAllocator rtv;
+		return result;
+	}
 
-	IDXGISwapChain1 *swap_chain;
-	int window_w;
-	int window_h;
+	// Any thread, takes the oldest entry
+	bool Steal(WorkQueueEntry *entry)
+	{
+		int64_t t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t b = bottom.load(std::memory_order_acquire);
+
+		if (t >= b)
+		{
+			return false;
+		}
+
+		*entry = entries[t & (g_work_deque_size - 1)];
 
-	D3D12_Frame frames[g_frame_latency];
+		return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+	}
 };
 
-//------------------------------------------------------------------------
+struct WorkQueue
+{
+	WorkDeque deques[g_max_work_threads];
 
-D3D12_State g_d3d;
+	uint32_t worker_count;
+	uint32_t thread_count; // workers, the thread that called Init and the external threads
 
-//------------------------------------------------------------------------
+	WorkSemaphore semaphore;
+	std::thread   threads[g_max_worker_threads];
+	bool          pin_threads;
 
-void D3D12_Init(HWND window)
-{
-	HRESULT hr;
+	std::atomic<long>     sleeping_count;
+	std::atomic<bool>     quit;
+	std::atomic<uint32_t> next_thread_index;
 
-	//------------------------------------------------------------------------
-	// Enable Debug Layer
+	WorkCounter all_work;
 
-#if BUILD_DEBUG
+	// Pinning puts each thread on its own logical processor, the creating thread on the first one.
+	// That keeps their deques and caches from moving around, but only makes sense if nothing else
+	// busy is running on the machine.
+	void Init(uint32_t in_worker_count, bool in_pin_threads = false, uint32_t external_count = 0)
 	{
-		ID3D12Debug *debug;
-
-		hr = D3D12GetDebugInterface(IID_PPV_ARGS(&debug));
-		CHECK_HR(hr);
+		assert(in_worker_count <= g_max_worker_threads);
+		assert(external_count  <= g_max_external_work_threads);
 
-		debug->EnableDebugLayer();
+		worker_count = in_worker_count;
+		pin_threads  = in_pin_threads;
 
-		if (g_enable_gpu_based_validation)
+		for (uint32_t i = 0; i < ArrayCount(deques); i++)
 		{
-			ID3D12Debug1 *debug1;
+			deques[i].top      = 0;
+			deques[i].bottom   = 0;
+			deques[i].executed = 0;
+			deques[i].stolen   = 0;
+		}
 
-			hr = debug->QueryInterface(IID_PPV_ARGS(&debug1));
-			CHECK_HR(hr);
+		thread_count      = worker_count + 1 + external_count;
+		sleeping_count    = 0;
+		quit              = false;
+		next_thread_index = 0;
+		all_work.pending  = 0;
 
-			debug1->SetEnableGPUBasedValidation(true);
-			COM_SAFE_RELEASE(debug1);
+		t_work_thread_index = 0;
+
+		semaphore.Init(worker_count + 1);
+
+		if (pin_threads)
+		{
+			WorkQueue_PinCurrentThread(0);
 		}
 
-		COM_SAFE_RELEASE(debug);
+		for (uint32_t i = 0; i < worker_count; i++)
+		{
+			threads[i] = std::thread(ThreadProc, this);
+		}
 	}
-#endif
-
-	//------------------------------------------------------------------------
-	// Create Factory
 
+	void Add(WorkFunction function, void *data, WorkCounter *counter = nullptr)
 	{
-		UINT flags = 0;
+		uint32_t thread_index = t_work_thread_index;
+		assert(thread_index < thread_count);
 
-#if BUILD_DEBUG
-		flags |= DXGI_CREATE_FACTORY_DEBUG;
-#endif
+		if (!counter) counter = &all_work;
+		counter->pending.fetch_add(1);
 
-		hr = CreateDXGIFactory2(flags, IID_PPV_ARGS(&g_d3d.factory));
-		CHECK_HR(hr);
-	}
+		WorkQueueEntry entry = {
+			.function = function,
+			.data     = data,
+			.counter  = counter,
+		};
 
-	//------------------------------------------------------------------------
-	// Create Adapter and Device
+		deques[thread_index].Push(&entry);
 
-	for (uint32_t adapter_index = 0; 
-		 g_d3d.factory->EnumAdapterByGpuPreference(adapter_index, DXGI_GPU_PREFERENCE_HIGH_PERFORMANCE, IID_PPV_ARGS(&g_d3d.adapter)) != DXGI_ERROR_NOT_FOUND;
-		 adapter_index += 1)
-	{
-		hr = D3D12CreateDevice(g_d3d.adapter, D3D_FEATURE_LEVEL_11_0, IID_PPV_ARGS(&g_d3d.device));
+		// Pairs with the fence a worker goes through between saying it's going to sleep and taking a
+		// last look for work: either it sees this entry, or this sees it sleeping
+		std::atomic_thread_fence(std::memory_order_seq_cst);
 
-		if (SUCCEEDED(hr))
+		if (sleeping_count.load() > 0)
 		{
-			break;
+			semaphore.Release(1);
 		}
-
-		COM_SAFE_RELEASE(g_d3d.adapter);
 	}
 
-	if (!g_d3d.device)
+	bool FindEntry(uint32_t thread_index, WorkQueueEntry *entry)
 	{
-		assert(!"Failed to create D3D12 device");
-	}
+		WorkDeque *own = &deques[thread_index];
 
-	//------------------------------------------------------------------------
-	// Configure info queue for helpful debug messages
+		if (own->Pop(entry))
+		{
+			return true;
+		}
 
-	ID3D12InfoQueue *info_queue;
+		// go round the others starting from the next one along, so thieves spread out
+		for (uint32_t i = 1; i < thread_count; i++)
+		{
+			uint32_t victim = (thread_index + i) % thread_count;
 
-	hr = g_d3d.device->QueryInterface(IID_PPV_ARGS(&info_queue));
+			if (deques[victim].Steal(entry))
+			{
+				own->stolen += 1;
+				return true;
+			}
+		}
 
-	if (SUCCEEDED(hr))
+		return false;
+	}
+
+	// Returns false if there was nothing to do
+	bool DoNextEntry()
 	{
-		info_queue->SetBreakOnSeverity(D3D12_MESSAGE_SEVERITY_CORRUPTION, TRUE);
-		info_queue->SetBreakOnSeverity(D3D12_MESSAGE_SEVERITY_ERROR, TRUE);
-		info_queue->SetBreakOnSeverity(D3D12_MESSAGE_SEVERITY_WARNING, TRUE);
+		uint32_t thread_index = t_work_thread_index;
 
-		D3D12_MESSAGE_SEVERITY severities[] = {
-			D3D12_MESSAGE_SEVERITY_INFO,
-		};
+		WorkQueueEntry entry;
 
-		D3D12_MESSAGE_ID deny_ids[] = {
-			D3D12_MESSAGE_ID_CLEARRENDERTARGETVIEW_MISMATCHINGCLEARVALUE,
-			D3D12_MESSAGE_ID_MAP_INVALID_NULLRANGE,
-			D3D12_MESSAGE_ID_UNMAP_INVALID_NULLRANGE,
-		};
+		if (!FindEntry(thread_index, &entry))
+		{
+			return false;
+		}
 
-		D3D12_INFO_QUEUE_FILTER filter = {
-			.DenyList = {
-				.NumSeverities = ArrayCount(severities),
-				.pSeverityList = severities,
-				.NumIDs        = ArrayCount(deny_ids),
-				.pIDList       = deny_ids,
-			},
-		};
+		entry.function(entry.data);
 
-		hr = info_queue->PushStorageFilter(&filter);
-		CHECK_HR(hr);
+		deques[thread_index].executed += 1;
 
-		COM_SAFE_RELEASE(info_queue);
-	}
+		entry.counter->pending.fetch_sub(1);
 
-	//------------------------------------------------------------------------
-	// Create command queue
+		return true;
+	}
 
+	// Runs entries until the counter reaches zero
+	void Wait(WorkCounter *counter)
 	{
-		D3D12_COMMAND_QUEUE_DESC desc = {
-			.Type     = D3D12_COMMAND_LIST_TYPE_DIRECT,
-			.Priority = D3D12_COMMAND_QUEUE_PRIORITY_NORMAL,
-		};
-
-		hr = g_d3d.device->CreateCommandQueue(&desc, IID_PPV_ARGS(&g_d3d.queue));
-		CHECK_HR(hr);
+		while (counter->pending.load() != 0)
+		{
+			if (!DoNextEntry())
+			{
+				_mm_pause();
+			}
+		}
+	}
 
-		g_d3d.queue->SetName(L"Direct Command Queue");
+	// Gives the calling thread one of the deques Init made room for external threads
+	void RegisterThread()
+	{
+		t_work_thread_index = next_thread_index.fetch_add(1) + 1;
+		assert(t_work_thread_index < thread_count || !"No deques left for another thread, pass a bigger external_count to Init");
 	}
 
-	//------------------------------------------------------------------------
-	// Create per-frame command allocator, command list, and upload arena
+	void CompleteAllWork()
+	{
+		assert(t_work_thread_index == 0 || !"Only the thread that created the work queue can wait for all of it");
+		Wait(&all_work);
+	}
 
-	for (int i = 0; i < g_frame_latency; i++)
+	// Stops and waits for the worker threads. There must not be any work left.
+	void Release()
 	{
-		D3D12_Frame *frame = &g_d3d.frames[i];
+		assert(all_work.pending == 0);
 
-		hr = g_d3d.device->CreateCommandAllocator(D3D12_COMMAND_LIST_TYPE_DIRECT, IID_PPV_ARGS(&frame->command_allocator));
-		CHECK_HR(hr);
+		quit = true;
 
-		hr = g_d3d.device->CreateCommandList(0, D3D12_COMMAND_LIST_TYPE_DIRECT, frame->command_allocator, NULL, IID_PPV_ARGS(&frame->command_list));
-		CHECK_HR(hr);
+		semaphore.Release(worker_count);
 
-		frame->command_list->Close();
+		for (uint32_t i = 0; i < worker_count; i++)
+		{
+			threads[i].join();
+		}
 
-		frame->upload_arena.Init(g_d3d.device, (uint32_t)KiB(64));
+		worker_count = 0;
+		thread_count = 1;
 	}
 
-	//------------------------------------------------------------------------
-	// Create bindless root signature
-
+	static void ThreadProc(WorkQueue *queue)
 	{
-		D3D12_ROOT_PARAMETER1 parameters[D3D12_RootParameter_COUNT] = {};
+		// threads are handed out their index in the order they get going, the order doesn't matter
+		t_work_thread_index = queue->next_thread_index.fetch_add(1) + 1;
 
-		parameters[D3D12_RootParameter_32bit_constants] = {
-			.ParameterType = D3D12_ROOT_PARAMETER_TYPE_32BIT_CONSTANTS,
-			.Constants = {
-				.ShaderRegister = 0,
-				.RegisterSpace  = 0,
-				.Num32BitValues = 58, // 58 because each root cbv takes 2 uints, and the max is 64
-			},
-		};
-
-		parameters[D3D12_RootParameter_pass_cbv] = {
-			.ParameterType = D3D12_ROOT_PARAMETER_TYPE_CBV,
-			.Descriptor = {
-				.ShaderRegister = 1,
-				.Flags = D3D12_ROOT_DESCRIPTOR_FLAG_DATA_VOLATILE,
-			},
-		};
-
-		parameters[D3D12_RootParameter_view_cbv] = {
-			.ParameterType = D3D12_ROOT_PARAMETER_TYPE_CBV,
-			.Descriptor = {
-				.ShaderRegister = 2,
-				.Flags = D3D12_ROOT_DESCRIPTOR_FLAG_DATA_VOLATILE,
-			},
-		};
-
-		parameters[D3D12_RootParameter_global_cbv] = {
-			.ParameterType = D3D12_ROOT_PARAMETER_TYPE_CBV,
-			.Descriptor = {
-				.ShaderRegister = 3,
-				.Flags = D3D12_ROOT_DESCRIPTOR_FLAG_DATA_VOLATILE,
-			},
-		};
+		if (queue->pin_threads)
+		{
+			WorkQueue_PinCurrentThread(t_work_thread_index);
+		}
 
-		D3D12_STATIC_SAMPLER_DESC samplers[] = {
-			{ // s_nearest
-				.Filter           = D3D12_FILTER_MIN_MAG_POINT_MIP_LINEAR,
-				.AddressU         = D3D12_TEXTURE_ADDRESS_MODE_WRAP,
-				.AddressV         = D3D12_TEXTURE_ADDRESS_MODE_WRAP,
-				.AddressW         = D3D12_TEXTURE_ADDRESS_MODE_WRAP,
-				.MipLODBias       = 0.0f,
-				.MinLOD           = 0.0f,
-				.MaxLOD           = D3D12_FLOAT32_MAX,
-				.ShaderRegister   = 0,
-				.RegisterSpace    = 0,
-				.ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL,
-			},
-		};
+		char name[32];
+		snprintf(name, sizeof(name), "Worker %u", t_work_thread_index);
+		CpuProfiler_SetThreadName(name);
 
-		D3D12_VERSIONED_ROOT_SIGNATURE_DESC desc = {
-			.Version = D3D_ROOT_SIGNATURE_VERSION_1_1,
-			.Desc_1_1 = {
-				.NumParameters     = ArrayCount(parameters),
-				.pParameters       = parameters,
-				.NumStaticSamplers = ArrayCount(samplers),
-				.pStaticSamplers   = samplers,
-				.Flags             = D3D12_ROOT_SIGNATURE_FLAG_CBV_SRV_UAV_HEAP_DIRECTLY_INDEXED,
-			},
-		};
+		while (!queue->quit)
+		{
+			bool found = false;
 
-		ID3DBlob *serialized_desc = nullptr;
+			for (uint32_t spin = 0; spin < g_work_spin_count && !found; spin++)
+			{
+				found = queue->DoNextEntry();
+				if (!found) _mm_pause();
+			}
 
-		hr = D3D12SerializeVersionedRootSignature(&desc, &serialized_desc, nullptr);
-		CHECK_HR(hr);
+			if (!found)
+			{
+				queue->sleeping_count.fetch_add(1);
 
-		hr = g_d3d.device->CreateRootSignature(0, serialized_desc->GetBufferPointer(), serialized_desc->GetBufferSize(), IID_PPV_ARGS(&g_d3d.rs_bindless));
-		CHECK_HR(hr);
+				// one last look now that anyone adding work will see this thread is about to sleep
+				if (!queue->DoNextEntry() && !queue->quit)
+				{
+					queue->semaphore.Wait();
+				}
 
-		serialized_desc->Release();
+				queue->sleeping_count.fetch_sub(1);
+			}
+		}
 	}
+};
 
-	//------------------------------------------------------------------------
-	// Create Fence
+WorkQueue g_work_queue;
 
-	g_d3d.frame_index = 0;
+//------------------------------------------------------------------------
+// Parallel for
+//
+// Splits [0, count) into a few ranges per thread and runs them on the work queue, returning once all
+// of them are done. There are more ranges than threads so that threads that finish early can steal
+// what's left of the slower ones. Can be called from inside work queue entries.
 
-	hr = g_d3d.device->CreateFence(g_d3d.frame_index, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(&g_d3d.fence));
-	CHECK_HR(hr);
+typedef void (*ParallelForFunction)(uint32_t first, uint32_t count, void *data);
 
-	//------------------------------------------------------------------------
-	// Initialize descriptor allocators
+static constexpr uint32_t g_parallel_for_ranges_per_thread = 4;
 
-	g_d3d.cbv_srv_uav.Init(g_d3d.device, D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV, 4096, true,  L"CBV SRV UAV Heap");
-	g_d3d.rtv        .Init(g_d3d.device, D3D12_DESCRIPTOR_HEAP_TYPE_RTV,         64,   false, L"RTV Heap");
+struct ParallelForRange
+{
+	ParallelForFunction function;
+	void               *data;
+	uint32_t            first;
+	uint32_t            count;
+};
 
-	//------------------------------------------------------------------------
-	// Create swap chain
+void ParallelForRangeProc(void *data)
+{
+	ParallelForRange *range = (ParallelForRange *)data;
+	range->function(range->first, range->count, range->data);
+}
+
+// Ranges are at least min_range_size long, apart from the last one
+void ParallelFor(WorkQueue *queue, uint32_t count, uint32_t min_range_size, ParallelForFunction function, void *data)
+{
+	uint32_t range_count = 1;
 
+	if (queue && min_range_size > 0)
 	{
-		DXGI_SWAP_CHAIN_DESC1 desc = {
-			.Format      = DXGI_FORMAT_R8G8B8A8_UNORM,
-			.SampleDesc  = { .Count = 1, .Quality = 0 },
-			.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT,
-			.BufferCount = g_frame_latency,
-			.Scaling     = DXGI_SCALING_STRETCH,
-			.SwapEffect  = DXGI_SWAP_EFFECT_FLIP_DISCARD,
-		};
+		range_count = count / min_range_size;
 
-		hr = g_d3d.factory->CreateSwapChainForHwnd(g_d3d.queue, window, &desc, nullptr, nullptr, &g_d3d.swap_chain);
-		CHECK_HR(hr);
+		uint32_t max_range_count = g_parallel_for_ranges_per_thread*queue->thread_count;
 
-		for (uint32_t i = 0; i < g_frame_latency; i++)
-		{
-			D3D12_Frame *frame = &g_d3d.frames[i];
+		if (range_count > max_range_count) range_count = max_range_count;
+		if (range_count < 1)               range_count = 1;
+	}
 
-			hr = g_d3d.swap_chain->GetBuffer(i, IID_PPV_ARGS(&frame->backbuffer));
-			CHECK_HR(hr);
+	if (range_count == 1)
+	{
+		function(0, count, data);
+		return;
+	}
 
-			frame->backbuffer_state = D3D12_RESOURCE_STATE_PRESENT;
-			frame->rtv = g_d3d.rtv.Allocate();
+	ParallelForRange ranges[g_parallel_for_ranges_per_thread*g_max_work_threads];
 
-			D3D12_RENDER_TARGET_VIEW_DESC rtv_desc = {
-				.Format        = DXGI_FORMAT_R8G8B8A8_UNORM_SRGB,
-				.ViewDimension = D3D12_RTV_DIMENSION_TEXTURE2D,
-			};
-			g_d3d.device->CreateRenderTargetView(frame->backbuffer, &rtv_desc, frame->rtv.cpu);
-		}
+	uint32_t range_size = count / range_count;
+	uint32_t remainder  = count % range_count;
+	uint32_t first      = 0;
 
-		// Figure out window dimensions
+	WorkCounter counter = {};
 
-		RECT client_rect;
-		GetClientRect(window, &client_rect);
+	for (uint32_t i = 0; i < range_count; i++)
+	{
+		uint32_t size = range_size + (i < remainder ? 1 : 0);
 
-		g_d3d.window_w = client_rect.right;
-		g_d3d.window_h = client_rect.bottom;
+		ranges[i] = {
+			.function = function,
+			.data     = data,
+			.first    = first,
+			.count    = size,
+		};
+
+		first += size;
 	}
 
-	//------------------------------------------------------------------------
-	// Disable Alt+Enter keybind
+	// pushed back to front, so the owner pops the front ranges and thieves steal from the back
+	for (uint32_t i = range_count; i > 0; i--)
+	{
+		queue->Add(ParallelForRangeProc, &ranges[i - 1], &counter);
+	}
 
-	g_d3d.factory->MakeWindowAssociation(window, DXGI_MWA_NO_ALT_ENTER);
+	queue->Wait(&counter);
 }
 
 //------------------------------------------------------------------------
-
-D3D12_Frame *D3D12_GetFrameState()
+// Radix sort
+//
+// Sorts 64 bit keys carrying a 32 bit value, with an LSD radix sort a byte at a time, and stable.
+// Packed sort keys leave most of their bytes the same for every key, so those bytes are found with a
+// quick SIMD pass over the keys and skipped. Big arrays are split into a slice per thread: each
+// thread histograms its slice, the output offsets for every slice are worked out from those, and
+// each thread scatters its slice. Really big arrays scatter through small per-digit buffers that get
+// written out a cache line at a time with streaming stores, which keeps the scattered writes from
+// thrashing the cache.
+
+static constexpr uint32_t g_radix_parallel_threshold  = 1 << 15;
+static constexpr uint32_t g_radix_streaming_threshold = 1 << 17;
+
+struct SortItem
 {
-	uint64_t index = g_d3d.frame_index % g_frame_latency;
-	return &g_d3d.frames[index];
-}
+	uint64_t key;
+	uint32_t value;
+	uint32_t pad;
+};
 
-//------------------------------------------------------------------------
+static_assert(sizeof(SortItem) == sizeof(__m128i), "The SIMD paths move a sort item as one 16 byte vector");
 
-void D3D12_BeginFrame()
+struct RadixSortSlice
 {
-	D3D12_Frame *frame = D3D12_GetFrameState();
+	const SortItem *src;
+	SortItem       *dst;
+	uint32_t        first;
+	uint32_t        count;
+	uint32_t        shift;
+	bool            streaming;
+
+	uint64_t key_or;
+	uint64_t key_and;
+
+	uint32_t histogram[256];
+	uint32_t offsets  [256];
+};
 
-	//------------------------------------------------------------------------
-	// Wait for frame
+void RadixScanKeysTask(void *data)
+{
+	RadixSortSlice *slice = (RadixSortSlice *)data;
 
-	uint64_t completed = g_d3d.fence->GetCompletedValue();
+	const SortItem *items = slice->src + slice->first;
+	uint32_t        count = slice->count;
 
-	if (completed < frame->fence_value)
-	{
-		// NOTE: If you pass nullptr for the event, this call will simply block until the fence value is reached, which is exactly what we want. So we don't even need to make an event!
-		g_d3d.fence->SetEventOnCompletion(frame->fence_value, nullptr);
-	}
+	// two keys per vector
+	__m128i acc_or  = _mm_setzero_si128();
+	__m128i acc_and = _mm_set1_epi32(-1);
 
-	//------------------------------------------------------------------------
-	// Clear frame upload arena
+	uint32_t i = 0;
 
-	frame->upload_arena.Reset();
+	for (; i + 2 <= count; i += 2)
+	{
+		__m128i a    = _mm_loadu_si128((const __m128i *)&items[i + 0]);
+		__m128i b    = _mm_loadu_si128((const __m128i *)&items[i + 1]);
+		__m128i keys = _mm_unpacklo_epi64(a, b);
 
-	//------------------------------------------------------------------------
-	// Initialize command list
+		acc_or  = _mm_or_si128 (acc_or,  keys);
+		acc_and = _mm_and_si128(acc_and, keys);
+	}
 
-	ID3D12CommandAllocator    *allocator = frame->command_allocator;
-	ID3D12GraphicsCommandList *list      = frame->command_list;
+	uint64_t lanes_or [2];
+	uint64_t lanes_and[2];
+	_mm_storeu_si128((__m128i *)lanes_or,  acc_or);
+	_mm_storeu_si128((__m128i *)lanes_and, acc_and);
 
-	allocator->Reset();
-	list     ->Reset(allocator, nullptr);
+	uint64_t key_or  = lanes_or [0] | lanes_or [1];
+	uint64_t key_and = lanes_and[0] & lanes_and[1];
 
-	list->SetDescriptorHeaps      (1, &g_d3d.cbv_srv_uav.heap);
-	list->SetGraphicsRootSignature(g_d3d.rs_bindless);
-}
+	for (; i < count; i++)
+	{
+		key_or  |= items[i].key;
+		key_and &= items[i].key;
+	}
 
-//------------------------------------------------------------------------
+	slice->key_or  = key_or;
+	slice->key_and = key_and;
+}
 
-void D3D12_EndFrame()
+// Counts into four sub-histograms, one per lane of four keys, so runs of the same digit (which packed
+// keys are full of) don't have every increment waiting on the one before it. The digits are shifted
+// and masked out two keys per vector, and the sub-histograms summed four counts per vector.
+void RadixHistogramTask(void *data)
 {
-	D3D12_Frame *frame = D3D12_GetFrameState();
+	RadixSortSlice *slice = (RadixSortSlice *)data;
 
-	//------------------------------------------------------------------------
-	// Switch render target to present state
+	const SortItem *items = slice->src + slice->first;
+	uint32_t        count = slice->count;
 
-	ID3D12GraphicsCommandList *list = frame->command_list;
+	alignas(16) uint32_t lanes[4][256];
+	memset(lanes, 0, sizeof(lanes));
 
-	{
-		D3D12_RESOURCE_BARRIER barrier;
-		if (D3D12_Transition(frame->backbuffer, &frame->backbuffer_state, D3D12_RESOURCE_STATE_PRESENT, &barrier))
-		{
-			list->ResourceBarrier(1, &barrier);
-		}
-	}
+	__m128i shift = _mm_cvtsi32_si128((int)slice->shift);
+	__m128i mask  = _mm_set1_epi64x(0xFF);
 
-	//------------------------------------------------------------------------
-	// Submit command list
+	uint32_t i = 0;
 
-	list->Close();
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i a = _mm_unpacklo_epi64(_mm_loadu_si128((const __m128i *)&items[i + 0]), _mm_loadu_si128((const __m128i *)&items[i + 1]));
+		__m128i b = _mm_unpacklo_epi64(_mm_loadu_si128((const __m128i *)&items[i + 2]), _mm_loadu_si128((const __m128i *)&items[i + 3]));
 
-	ID3D12CommandList *lists[] = { list };
-	g_d3d.queue->ExecuteCommandLists(1, lists);
+		a = _mm_and_si128(_mm_srl_epi64(a, shift), mask);
+		b = _mm_and_si128(_mm_srl_epi64(b, shift), mask);
 
-	//------------------------------------------------------------------------
-	// Present
+		// a digit per 64 bit lane, so in 16 bit words 0 and 4
+		lanes[0][_mm_cvtsi128_si32(a)]   += 1;
+		lanes[1][_mm_extract_epi16(a, 4)] += 1;
+		lanes[2][_mm_cvtsi128_si32(b)]   += 1;
+		lanes[3][_mm_extract_epi16(b, 4)] += 1;
+	}
 
-	g_d3d.swap_chain->Present(1, 0);
+	for (; i < count; i++)
+	{
+		lanes[0][(items[i].key >> slice->shift) & 0xFF] += 1;
+	}
 
-	//------------------------------------------------------------------------
-	// Advance fence
+	for (uint32_t digit = 0; digit < 256; digit += 4)
+	{
+		__m128i sum = _mm_add_epi32(_mm_add_epi32(_mm_load_si128((const __m128i *)&lanes[0][digit]), _mm_load_si128((const __m128i *)&lanes[1][digit])),
+									_mm_add_epi32(_mm_load_si128((const __m128i *)&lanes[2][digit]), _mm_load_si128((const __m128i *)&lanes[3][digit])));
 
-	frame->fence_value = ++g_d3d.frame_index;
-	g_d3d.queue->Signal(g_d3d.fence, frame->fence_value);
+		_mm_storeu_si128((__m128i *)&slice->histogram[digit], sum);
+	}
 }
 
-//------------------------------------------------------------------------
-// Shader and PSO
-
-struct Vector2D
+void RadixScatterTask(void *data)
 {
-	float x, y;
-};
+	RadixSortSlice *slice = (RadixSortSlice *)data;
 
-struct Vector3D
-{
-	float x, y, z;
-};
+	const SortItem *items   = slice->src + slice->first;
+	SortItem       *dst     = slice->dst;
+	uint32_t       *offsets = slice->offsets;
+	uint32_t        shift   = slice->shift;
 
-struct Vector4D
-{
-	float x, y, z, w;
-};
+	if (!slice->streaming)
+	{
+		for (uint32_t i = 0; i < slice->count; i++)
+		{
+			dst[offsets[(items[i].key >> shift) & 0xFF]++] = items[i];
+		}
 
-struct Vertex
-{
-	Vector2D position;
-	Vector2D uv;
-	Vector4D color;
-};
+		return;
+	}
 
-struct D3D12_PassConstants
-{
-	uint32_t vbuffer_srv;
-};
+	static constexpr uint32_t items_per_line = 64 / sizeof(SortItem);
 
-struct D3D12_RootConstants
-{
-	Vector2D offset;
-	uint32_t texture_index;
-};
+	alignas(64) SortItem buffers[256][items_per_line];
+	uint8_t              fill   [256] = {};
 
-static_assert(sizeof(D3D12_RootConstants) % 4 == 0, "Root constants have to be a multiple of 4 bytes");
+	for (uint32_t i = 0; i < slice->count; i++)
+	{
+		uint32_t digit = (items[i].key >> shift) & 0xFF;
 
-const char g_shader_source[] = "#line " STRINGIFY(__LINE__) R"(
+		SortItem *buffer = buffers[digit];
+		buffer[fill[digit]++] = items[i];
 
-//------------------------------------------------------------------------
-// Shader inputs
+		if (fill[digit] == items_per_line)
+		{
+			SortItem *out = dst + offsets[digit];
 
-struct Vertex
-{
-	float2 position;
-	float2 uv;
-	float4 color;
-};
+			for (uint32_t j = 0; j < items_per_line; j++)
+			{
+				_mm_stream_si128((__m128i *)&out[j], _mm_load_si128((const __m128i *)&buffer[j]));
+			}
 
-struct PassConstants
-{
-	uint vbuffer_index;
-};
+			offsets[digit] += items_per_line;
+			fill   [digit]  = 0;
+		}
+	}
 
-struct RootConstants
+	for (uint32_t digit = 0; digit < 256; digit++)
+	{
+		for (uint32_t j = 0; j < fill[digit]; j++)
+		{
+			dst[offsets[digit]++] = buffers[digit][j];
+		}
+	}
+
+	// streaming stores aren't ordered with anything else, they have to land before another thread reads
+	_mm_sfence();
+}
+
+void RadixRunSlices(WorkQueue *queue, RadixSortSlice *slices, uint32_t slice_count, WorkFunction function)
 {
-	float2 offset;
-	uint   texture_index;
-};
+	if (slice_count == 1)
+	{
+		function(&slices[0]);
+		return;
+	}
 
-ConstantBuffer<PassConstants> pass : register(b1);
-ConstantBuffer<RootConstants> root : register(b0);
+	WorkCounter counter = {};
 
-sampler s_nearest : register(s0);
+	for (uint32_t i = 0; i < slice_count; i++)
+	{
+		queue->Add(function, &slices[i], &counter);
+	}
 
-//------------------------------------------------------------------------
-// Vertex shader
+	queue->Wait(&counter);
+}
 
-void MainVS(
-	in  uint   in_vertex_index  : SV_VertexID,
-	out float4 out_position     : SV_Position,
-	out float2 out_uv           : TEXCOORD,
-	out float4 out_color        : COLOR)
+// Sorts by key, keeping items with equal keys in order. Depending on how many bytes of the keys had to
+// be sorted on, the result ends up in either items or scratch, which is what gets returned. The work
+// queue is optional, and only used for big arrays.
+SortItem *RadixSort(SortItem *items, SortItem *scratch, uint32_t count, WorkQueue *queue = nullptr)
 {
-    StructuredBuffer<Vertex> vbuffer = ResourceDescriptorHeap[pass.vbuffer_index];
+	if (count <= 1)
+	{
+		return items;
+	}
 
-	Vertex vertex = vbuffer.Load(in_vertex_index);
+	RadixSortSlice slices[g_max_work_threads];
 
-	out_position = float4(vertex.position + root.offset, 0, 1);
-	out_uv       = vertex.uv;
-	out_color    = vertex.color;
-}
+	uint32_t slice_count = 1;
 
-//------------------------------------------------------------------------
-// Pixel shader
+	if (queue && count >= g_radix_parallel_threshold)
+	{
+		slice_count = queue->thread_count;
+	}
 
-float4 MainPS(
-	in float4 in_position : SV_Position,
-	in float2 in_uv       : TEXCOORD,
-	in float4 in_color    : COLOR) : SV_Target
-{
-	Texture2D texture = ResourceDescriptorHeap[root.texture_index];
+	// the streaming stores need every item to start 16 byte aligned
+	bool aligned   = ((uintptr_t)items % 16) == 0 && ((uintptr_t)scratch % 16) == 0;
+	bool streaming = aligned && count >= g_radix_streaming_threshold;
 
-	float4 color = texture.SampleLevel(s_nearest, in_uv, 0);
+	uint32_t slice_size = count / slice_count;
 
-	color *= in_color;
+	for (uint32_t i = 0; i < slice_count; i++)
+	{
+		RadixSortSlice *slice = &slices[i];
 
-	return color;
-}
+		slice->src       = items;
+		slice->first     = i*slice_size;
+		slice->count     = i + 1 < slice_count ? slice_size : count - i*slice_size;
+		slice->streaming = streaming;
+	}
 
-)";
+	//------------------------------------------------------------------------
+	// Find out which bytes are the same for every key
 
-ID3D12PipelineState *D3D12_CreatePSO()
-{
-	IDxcBlob *error = nullptr;
+	RadixRunSlices(queue, slices, slice_count, RadixScanKeysTask);
 
-	//------------------------------------------------------------------------
-	// Compile vertex shader
+	uint64_t key_or  = 0;
+	uint64_t key_and = ~0ull;
 
-	IDxcBlob *vs = nullptr;
-	if (!DXC_CompileShader(g_shader_source, sizeof(g_shader_source), L"MainVS", L"vs_6_6", &vs, &error))
+	for (uint32_t i = 0; i < slice_count; i++)
 	{
-		const char *error_message = (char *)error->GetBufferPointer();
-		OutputDebugStringA("Failed to compile vertex shader:\n");
+		key_or  |= slices[i].key_or;
+		key_and &= slices[i].key_and;
+	}
+
+	uint64_t varying_bits = key_or ^ key_and;
+
+	//------------------------------------------------------------------------
+	// Sort on the rest
+
+	SortItem *src = items;
+	SortItem *dst = scratch;
+
+	for (uint32_t shift = 0; shift < 64; shift += 8)
+	{
+		if (((varying_bits >> shift) & 0xFF) == 0)
+		{
+			continue;
+		}
+
+		for (uint32_t i = 0; i < slice_count; i++)
+		{
+			slices[i].src   = src;
+			slices[i].dst   = dst;
+			slices[i].shift = shift;
+		}
+
+		RadixRunSlices(queue, slices, slice_count, RadixHistogramTask);
+
+		// items go out per digit, and within a digit in slice order
+		uint32_t offset = 0;
+
+		for (uint32_t digit = 0; digit < 256; digit++)
+		{
+			for (uint32_t i = 0; i < slice_count; i++)
+			{
+				slices[i].offsets[digit] = offset;
+				offset += slices[i].histogram[digit];
+			}
+		}
+
+		RadixRunSlices(queue, slices, slice_count, RadixScatterTask);
+
+		SortItem *temp = src;
+		src = dst;
+		dst = temp;
+	}
+
+	return src;
+}
+
+//------------------------------------------------------------------------
+// DXC
+
+struct DXC_State
+{
+	IDxcCompiler3 *compiler;
+};
+
+DXC_State g_dxc;
+
+void DXC_Init()
+{
+	HRESULT hr;
+
+	hr = DxcCreateInstance(CLSID_DxcCompiler, IID_PPV_ARGS(&g_dxc.compiler));
+	CHECK_HR(hr);
+}
+
+bool DXC_CompileShader(
+	const char    *source,
+	uint32_t       source_size,
+	const wchar_t *entry_point,
+	const wchar_t *target,
+	IDxcBlob     **result_blob,
+	IDxcBlob     **error_blob)
+{
+	CPU_SCOPE("DXC_CompileShader");
+
+	assert(g_dxc.compiler || !"Call DXC_Init before calling DXC_CompileShader");
+
+	bool result = false;
+
+	const wchar_t *args[] = {
+		L"-E", entry_point,
+		L"-T", target,
+		L"-WX",
+		L"-Zi",
+	};
+
+	DxcBuffer source_buffer = {
+		.Ptr      = source,
+		.Size     = source_size,
+		.Encoding = 0,
+	};
+
+	HRESULT hr;
+
+	IDxcResult *compile_result = nullptr;
+	hr = g_dxc.compiler->Compile(&source_buffer, args, ArrayCount(args), nullptr, IID_PPV_ARGS(&compile_result));
+
+	if (SUCCEEDED(hr))
+	{
+		HRESULT compile_hr;
+		hr = compile_result->GetStatus(&compile_hr);
+
+		if (SUCCEEDED(compile_hr))
+		{
+			if (compile_result->HasOutput(DXC_OUT_OBJECT))
+			{
+				hr = compile_result->GetOutput(DXC_OUT_OBJECT, IID_PPV_ARGS(result_blob), nullptr);
+				CHECK_HR(hr);
+
+				result = true;
+			}
+		}
+
+		// even if we succeeded, we could have warnings (if I didn't pass WX above...)
+		if (compile_result->HasOutput(DXC_OUT_ERRORS))
+		{
+			hr = compile_result->GetOutput(DXC_OUT_ERRORS, IID_PPV_ARGS(error_blob), nullptr);
+			CHECK_HR(hr);
+		}
+	}
+
+	return result;
+}
+
+//------------------------------------------------------------------------
+// D3D12
+
+static constexpr bool g_enable_gpu_based_validation = true;
+
+// Frame slots are how many frames the CPU can be recording while the GPU is still busy with earlier
+// ones, each slot with its own upload arena and command lists. The maximum frame latency is how many
+// presents DXGI queues up before the swap chain's waitable object stops signalling. Both can be
+// changed while running, see D3D12_SetFrameLatency.
+static constexpr uint32_t g_max_frame_slots           = 4;
+static constexpr uint32_t g_default_frame_slots       = 2;
+static constexpr uint32_t g_max_frame_latency         = 4;
+static constexpr uint32_t g_default_max_frame_latency = 1;
+static constexpr uint32_t g_backbuffer_count          = 3;
+
+enum D3D12_PresentMode
+{
+	D3D12_PresentMode_vsync,
+	D3D12_PresentMode_immediate, // tearing, where the system allows it
+	D3D12_PresentMode_limited,   // presents like immediate, the render thread holds frames back, see FrameLimiter
+	D3D12_PresentMode_COUNT,
+};
+
+const char *g_present_mode_names[D3D12_PresentMode_COUNT] = {
+	"vsync",
+	"immediate",
+	"limited",
+};
+
+//------------------------------------------------------------------------
+
+enum D3D12_RootParameters
+{
+	D3D12_RootParameter_32bit_constants,
+	D3D12_RootParameter_pass_cbv,
+	D3D12_RootParameter_view_cbv,
+	D3D12_RootParameter_global_cbv,
+	D3D12_RootParameter_COUNT,
+};
+
+//------------------------------------------------------------------------
+
+ID3D12Resource *D3D12_CreateUploadBuffer(
+	ID3D12Device  *device,
+	uint32_t       size,
+	const wchar_t *debug_name,
+	const void    *initial_data      = nullptr,
+	uint32_t       initial_data_size = 0) 
+{
+	D3D12_HEAP_PROPERTIES heap_properties = {
+		.Type = D3D12_HEAP_TYPE_UPLOAD,
+	};
+
+	D3D12_RESOURCE_DESC desc = {
+		.Dimension        = D3D12_RESOURCE_DIMENSION_BUFFER,
+		.Width            = size,
+		.Height           = 1,
+		.DepthOrArraySize = 1,
+		.MipLevels        = 1,
+		.Format           = DXGI_FORMAT_UNKNOWN,
+		.SampleDesc       = { .Count = 1, .Quality = 0 },
+		.Layout           = D3D12_TEXTURE_LAYOUT_ROW_MAJOR,
+	};
+
+	ID3D12Resource *result;
+	HRESULT hr = device->CreateCommittedResource(
+		&heap_properties,
+		D3D12_HEAP_FLAG_NONE,
+		&desc,
+		D3D12_RESOURCE_STATE_COMMON,
+		nullptr,
+		IID_PPV_ARGS(&result));
+
+	CHECK_HR(hr);
+
+	result->SetName(debug_name);
+
+	if (initial_data)
+	{
+		assert(initial_data_size <= size || !"Your initial data is too big for this upload buffer!");
+
+		void *mapped;
+
+		D3D12_RANGE read_range = {};
+		hr = result->Map(0, &read_range, &mapped);
+
+		CHECK_HR(hr);
+
+		memcpy(mapped, initial_data, initial_data_size);
+
+		result->Unmap(0, nullptr);
+	}
+
+	return result;
+}
+
+// Buffers the CPU doesn't write to directly: default heap buffers for the GPU to write, and readback
+// buffers to copy results into
+ID3D12Resource *D3D12_CreateBuffer(
+	ID3D12Device        *device,
+	uint64_t             size,
+	const wchar_t       *debug_name,
+	D3D12_HEAP_TYPE      heap_type = D3D12_HEAP_TYPE_DEFAULT,
+	D3D12_RESOURCE_FLAGS flags     = D3D12_RESOURCE_FLAG_NONE)
+{
+	D3D12_HEAP_PROPERTIES heap_properties = {
+		.Type = heap_type,
+	};
+
+	D3D12_RESOURCE_DESC desc = {
+		.Dimension        = D3D12_RESOURCE_DIMENSION_BUFFER,
+		.Width            = size,
+		.Height           = 1,
+		.DepthOrArraySize = 1,
+		.MipLevels        = 1,
+		.Format           = DXGI_FORMAT_UNKNOWN,
+		.SampleDesc       = { .Count = 1, .Quality = 0 },
+		.Layout           = D3D12_TEXTURE_LAYOUT_ROW_MAJOR,
+		.Flags            = flags,
+	};
+
+	// readback heap resources can't ever leave the copy dest state
+	D3D12_RESOURCE_STATES initial_state = heap_type == D3D12_HEAP_TYPE_READBACK ? D3D12_RESOURCE_STATE_COPY_DEST : D3D12_RESOURCE_STATE_COMMON;
+
+	ID3D12Resource *result;
+	HRESULT hr = device->CreateCommittedResource(
+		&heap_properties,
+		D3D12_HEAP_FLAG_NONE,
+		&desc,
+		initial_state,
+		nullptr,
+		IID_PPV_ARGS(&result));
+
+	CHECK_HR(hr);
+
+	result->SetName(debug_name);
+
+	return result;
+}
+
+//------------------------------------------------------------------------
+// Command streams
+//
+// A compact binary record of what went into a command list, so a frame can be captured, dumped to
+// text, diffed against another frame or replayed, all without going through the renderer again.
+// D3D12_CommandList writes everything that makes it past its filter into a stream when it's given
+// one (with or without a real list underneath), and D3D12_ReplayCommandStream is the D3D12 backend
+// that turns a stream back into calls on a list.
+//
+// Commands are a small header followed by their arguments, packed back to back in a buffer that is
+// reused from frame to frame. COM objects are stored as indices into a table kept next to the
+// commands, numbered in the order they're first used, so two captures of the same frame come out
+// byte for byte the same even though the pointers don't. On disk the table keeps the pointer each
+// object had when it was captured, which is only good for telling objects apart: to replay a stream
+// that was read back in, pass in objects to stand in for the table.
+//
+// Nothing walks a stream without validating it first, since a stream read from disk can be truncated
+// or corrupt: every command has to fit, be as big as its type needs, and only refer to objects that
+// are in the table replay is given.
+//
+// The commands and their validation only use fixed size types, nothing from the D3D12 headers, so
+// tools on other platforms can read captures. Enums are stored as their 32 bit values, and the
+// structs that stand in for D3D12 ones are checked against them where the recording starts.
+
+static constexpr uint32_t g_command_stream_magic   = 0x53434444; // "DDCS"
+static constexpr uint32_t g_command_stream_version = 2;
+static constexpr uint32_t g_command_stream_null    = UINT32_MAX; // object index of a null object
+
+static constexpr uint32_t g_stream_max_viewports      = 16; // D3D12_VIEWPORT_AND_SCISSORRECT_OBJECT_COUNT_PER_PIPELINE
+static constexpr uint32_t g_stream_max_render_targets = 8;  // D3D12_SIMULTANEOUS_RENDER_TARGET_COUNT
+
+enum D3D12_StreamCommandType : uint32_t
+{
+	D3D12_StreamCommand_SetPipelineState,
+	D3D12_StreamCommand_SetDescriptorHeaps,
+	D3D12_StreamCommand_SetGraphicsRootSignature,
+	D3D12_StreamCommand_SetComputeRootSignature,
+	D3D12_StreamCommand_SetGraphicsRoot32BitConstants,
+	D3D12_StreamCommand_SetComputeRoot32BitConstants,
+	D3D12_StreamCommand_SetGraphicsRootConstantBufferView,
+	D3D12_StreamCommand_SetComputeRootConstantBufferView,
+	D3D12_StreamCommand_IASetPrimitiveTopology,
+	D3D12_StreamCommand_IASetIndexBuffer,
+	D3D12_StreamCommand_RSSetViewports,
+	D3D12_StreamCommand_RSSetScissorRects,
+	D3D12_StreamCommand_OMSetRenderTargets,
+	D3D12_StreamCommand_DrawIndexedInstanced,
+	D3D12_StreamCommand_Dispatch,
+	D3D12_StreamCommand_ExecuteIndirect,
+	D3D12_StreamCommand_ClearRenderTargetView,
+	D3D12_StreamCommand_CopyBufferRegion,
+	D3D12_StreamCommand_CopyTextureRegion,
+	D3D12_StreamCommand_ResourceBarrier,
+	D3D12_StreamCommand_DiscardResource,
+	D3D12_StreamCommand_EndQuery,
+	D3D12_StreamCommand_ResolveQueryData,
+	D3D12_StreamCommand_COUNT,
+};
+
+const char *g_stream_command_names[] = {
+	"SetPipelineState",
+	"SetDescriptorHeaps",
+	"SetGraphicsRootSignature",
+	"SetComputeRootSignature",
+	"SetGraphicsRoot32BitConstants",
+	"SetComputeRoot32BitConstants",
+	"SetGraphicsRootConstantBufferView",
+	"SetComputeRootConstantBufferView",
+	"IASetPrimitiveTopology",
+	"IASetIndexBuffer",
+	"RSSetViewports",
+	"RSSetScissorRects",
+	"OMSetRenderTargets",
+	"DrawIndexedInstanced",
+	"Dispatch",
+	"ExecuteIndirect",
+	"ClearRenderTargetView",
+	"CopyBufferRegion",
+	"CopyTextureRegion",
+	"ResourceBarrier",
+	"DiscardResource",
+	"EndQuery",
+	"ResolveQueryData",
+};
+
+static_assert(ArrayCount(g_stream_command_names) == D3D12_StreamCommand_COUNT, "Every stream command needs a name");
+
+struct D3D12_StreamCommand
+{
+	D3D12_StreamCommandType type;
+	uint32_t                size; // including the header, always a multiple of 8
+};
+
+// SetPipelineState, Set*RootSignature and DiscardResource
+struct D3D12_StreamObjectCommand
+{
+	D3D12_StreamCommand header;
+	uint32_t            object;
+	uint32_t            pad;
+};
+
+struct D3D12_StreamHeapsCommand
+{
+	D3D12_StreamCommand header;
+	uint32_t            count;
+	uint32_t            heaps[2];
+};
+
+// followed by count values
+struct D3D12_StreamConstantsCommand
+{
+	D3D12_StreamCommand header;
+	uint32_t            parameter;
+	uint32_t            count;
+	uint32_t            offset;
+	uint32_t            pad;
+};
+
+struct D3D12_StreamCBVCommand
+{
+	D3D12_StreamCommand header;
+	uint32_t            parameter;
+	uint32_t            pad;
+	uint64_t            address;
+};
+
+struct D3D12_StreamTopologyCommand
+{
+	D3D12_StreamCommand header;
+	uint32_t            topology; // D3D_PRIMITIVE_TOPOLOGY
+	uint32_t            pad;
+};
+
+// Laid out like a D3D12_INDEX_BUFFER_VIEW
+struct D3D12_StreamIndexBufferCommand
+{
+	D3D12_StreamCommand header;
+	uint64_t            address;
+	uint32_t            size;
+	uint32_t            format; // DXGI_FORMAT
+};
+
+// Laid out like a D3D12_VIEWPORT
+struct D3D12_StreamViewport
+{
+	float x;
+	float y;
+	float width;
+	float height;
+	float min_depth;
+	float max_depth;
+};
+
+// Laid out like a D3D12_RECT
+struct D3D12_StreamRect
+{
+	int32_t left;
+	int32_t top;
+	int32_t right;
+	int32_t bottom;
+};
+
+// followed by count D3D12_StreamViewports, D3D12_StreamRects or D3D12_StreamBarriers
+struct D3D12_StreamArrayCommand
+{
+	D3D12_StreamCommand header;
+	uint32_t            count;
+	uint32_t            pad;
+};
+
+// followed by count render target handles
+struct D3D12_StreamRenderTargetsCommand
+{
+	D3D12_StreamCommand header;
+	uint32_t            count;
+	uint32_t            has_dsv;
+	uint64_t            dsv;
+};
+
+struct D3D12_StreamDrawCommand
+{
+	D3D12_StreamCommand header;
+	uint32_t            index_count;
+	uint32_t            instance_count;
+	uint32_t            start_index;
+	int32_t             base_vertex;
+	uint32_t            start_instance;
+	uint32_t            pad;
+};
+
+struct D3D12_StreamDispatchCommand
+{
+	D3D12_StreamCommand header;
+	uint32_t            x;
+	uint32_t            y;
+	uint32_t            z;
+	uint32_t            pad;
+};
+
+struct D3D12_StreamExecuteIndirectCommand
+{
+	D3D12_StreamCommand header;
+	uint32_t            signature;
+	uint32_t            max_count;
+	uint32_t            args;
+	uint32_t            count_buffer;
+	uint64_t            args_offset;
+	uint64_t            count_offset;
+};
+
+struct D3D12_StreamClearCommand
+{
+	D3D12_StreamCommand header;
+	uint64_t            rtv;
+	float               color[4];
+};
+
+struct D3D12_StreamCopyBufferCommand
+{
+	D3D12_StreamCommand header;
+	uint32_t            dst;
+	uint32_t            src;
+	uint64_t            dst_offset;
+	uint64_t            src_offset;
+	uint64_t            size;
+};
+
+// Only the copy from a placed footprint into a subresource, which is all texture uploads use. The
+// src_ fields are laid out like a D3D12_PLACED_SUBRESOURCE_FOOTPRINT.
+struct D3D12_StreamCopyTextureCommand
+{
+	D3D12_StreamCommand header;
+	uint32_t            dst;
+	uint32_t            dst_subresource;
+	uint32_t            src;
+	uint32_t            pad;
+	uint64_t            src_offset;
+	uint32_t            src_format; // DXGI_FORMAT
+	uint32_t            src_width;
+	uint32_t            src_height;
+	uint32_t            src_depth;
+	uint32_t            src_row_pitch;
+	uint32_t            pad2;
+};
+
+// EndQuery leaves count, dst and dst_offset zero
+struct D3D12_StreamQueryCommand
+{
+	D3D12_StreamCommand header;
+	uint32_t            heap;
+	uint32_t            type; // D3D12_QUERY_TYPE
+	uint32_t            index;
+	uint32_t            count;
+	uint32_t            dst;
+	uint32_t            pad;
+	uint64_t            dst_offset;
+};
+
+// A D3D12_RESOURCE_BARRIER with its objects swapped for indices. Aliasing barriers keep the resource
+// before in resource, and the one after in resource_after.
+struct D3D12_StreamBarrier
+{
+	uint32_t type;  // D3D12_RESOURCE_BARRIER_TYPE
+	uint32_t flags; // D3D12_RESOURCE_BARRIER_FLAGS
+	uint32_t resource;
+	uint32_t resource_after;
+	uint32_t subresource;
+	uint32_t state_before; // D3D12_RESOURCE_STATES
+	uint32_t state_after;
+	uint32_t pad;
+};
+
+//------------------------------------------------------------------------
+// Command stream validation
+
+// The size of each command without whatever array follows it
+static constexpr uint32_t g_stream_command_sizes[] = {
+	sizeof(D3D12_StreamObjectCommand),          // SetPipelineState
+	sizeof(D3D12_StreamHeapsCommand),           // SetDescriptorHeaps
+	sizeof(D3D12_StreamObjectCommand),          // SetGraphicsRootSignature
+	sizeof(D3D12_StreamObjectCommand),          // SetComputeRootSignature
+	sizeof(D3D12_StreamConstantsCommand),       // SetGraphicsRoot32BitConstants
+	sizeof(D3D12_StreamConstantsCommand),       // SetComputeRoot32BitConstants
+	sizeof(D3D12_StreamCBVCommand),             // SetGraphicsRootConstantBufferView
+	sizeof(D3D12_StreamCBVCommand),             // SetComputeRootConstantBufferView
+	sizeof(D3D12_StreamTopologyCommand),        // IASetPrimitiveTopology
+	sizeof(D3D12_StreamIndexBufferCommand),     // IASetIndexBuffer
+	sizeof(D3D12_StreamArrayCommand),           // RSSetViewports
+	sizeof(D3D12_StreamArrayCommand),           // RSSetScissorRects
+	sizeof(D3D12_StreamRenderTargetsCommand),   // OMSetRenderTargets
+	sizeof(D3D12_StreamDrawCommand),            // DrawIndexedInstanced
+	sizeof(D3D12_StreamDispatchCommand),        // Dispatch
+	sizeof(D3D12_StreamExecuteIndirectCommand), // ExecuteIndirect
+	sizeof(D3D12_StreamClearCommand),           // ClearRenderTargetView
+	sizeof(D3D12_StreamCopyBufferCommand),      // CopyBufferRegion
+	sizeof(D3D12_StreamCopyTextureCommand),     // CopyTextureRegion
+	sizeof(D3D12_StreamArrayCommand),           // ResourceBarrier
+	sizeof(D3D12_StreamObjectCommand),          // DiscardResource
+	sizeof(D3D12_StreamQueryCommand),           // EndQuery
+	sizeof(D3D12_StreamQueryCommand),           // ResolveQueryData
+};
+
+static_assert(ArrayCount(g_stream_command_sizes) == D3D12_StreamCommand_COUNT, "Every stream command needs a size");
+
+bool D3D12_IsValidStreamObject(uint32_t index, uint32_t object_count)
+{
+	return index == g_command_stream_null || index < object_count;
+}
+
+// Checks the size bytes of commands at data can be walked without reading out of bounds, that there
+// are command_count of them, and that their object indices fit in a table of object_count objects.
+// Streams read from disk have to pass this before anything walks them.
+bool D3D12_ValidateCommandStream(const uint8_t *data, size_t size, uint32_t command_count, uint32_t object_count)
+{
+	uint32_t walked_count = 0;
+
+	for (size_t at = 0; at < size; walked_count++)
+	{
+		if (size - at < sizeof(D3D12_StreamCommand))
+		{
+			return false;
+		}
+
+		const D3D12_StreamCommand *header = (const D3D12_StreamCommand *)(data + at);
+
+		// a zero sized command would have the walk going round in circles
+		if (header->type >= D3D12_StreamCommand_COUNT               ||
+			header->size <  g_stream_command_sizes[header->type]    ||
+			header->size %  8 != 0                                  ||
+			header->size >  size - at)
+		{
+			return false;
+		}
+
+		at += header->size;
+
+		// how many bytes follow the fixed part, which has to fit in what's left of the command
+		size_t trailing = 0;
+		bool   valid    = true;
+
+		switch (header->type)
+		{
+			case D3D12_StreamCommand_SetPipelineState:
+			case D3D12_StreamCommand_SetGraphicsRootSignature:
+			case D3D12_StreamCommand_SetComputeRootSignature:
+			case D3D12_StreamCommand_DiscardResource:
+			{
+				valid = D3D12_IsValidStreamObject(((const D3D12_StreamObjectCommand *)header)->object, object_count);
+			} break;
+
+			case D3D12_StreamCommand_SetDescriptorHeaps:
+			{
+				const D3D12_StreamHeapsCommand *command = (const D3D12_StreamHeapsCommand *)header;
+
+				valid = command->count <= ArrayCount(command->heaps);
+
+				for (uint32_t i = 0; valid && i < command->count; i++)
+				{
+					valid = D3D12_IsValidStreamObject(command->heaps[i], object_count);
+				}
+			} break;
+
+			case D3D12_StreamCommand_SetGraphicsRoot32BitConstants:
+			case D3D12_StreamCommand_SetComputeRoot32BitConstants:
+			{
+				trailing = (size_t)((const D3D12_StreamConstantsCommand *)header)->count*sizeof(uint32_t);
+			} break;
+
+			case D3D12_StreamCommand_RSSetViewports:
+			case D3D12_StreamCommand_RSSetScissorRects:
+			{
+				const D3D12_StreamArrayCommand *command = (const D3D12_StreamArrayCommand *)header;
+
+				valid    = command->count <= g_stream_max_viewports;
+				trailing = (size_t)command->count*(header->type == D3D12_StreamCommand_RSSetViewports ? sizeof(D3D12_StreamViewport) : sizeof(D3D12_StreamRect));
+			} break;
+
+			case D3D12_StreamCommand_OMSetRenderTargets:
+			{
+				const D3D12_StreamRenderTargetsCommand *command = (const D3D12_StreamRenderTargetsCommand *)header;
+
+				valid    = command->count <= g_stream_max_render_targets;
+				trailing = (size_t)command->count*sizeof(uint64_t);
+			} break;
+
+			case D3D12_StreamCommand_ExecuteIndirect:
+			{
+				const D3D12_StreamExecuteIndirectCommand *command = (const D3D12_StreamExecuteIndirectCommand *)header;
+
+				valid = D3D12_IsValidStreamObject(command->signature,    object_count) &&
+						D3D12_IsValidStreamObject(command->args,         object_count) &&
+						D3D12_IsValidStreamObject(command->count_buffer, object_count);
+			} break;
+
+			case D3D12_StreamCommand_CopyBufferRegion:
+			{
+				const D3D12_StreamCopyBufferCommand *command = (const D3D12_StreamCopyBufferCommand *)header;
+				valid = D3D12_IsValidStreamObject(command->dst, object_count) && D3D12_IsValidStreamObject(command->src, object_count);
+			} break;
+
+			case D3D12_StreamCommand_CopyTextureRegion:
+			{
+				const D3D12_StreamCopyTextureCommand *command = (const D3D12_StreamCopyTextureCommand *)header;
+				valid = D3D12_IsValidStreamObject(command->dst, object_count) && D3D12_IsValidStreamObject(command->src, object_count);
+			} break;
+
+			case D3D12_StreamCommand_ResourceBarrier:
+			{
+				const D3D12_StreamArrayCommand *command  = (const D3D12_StreamArrayCommand *)header;
+				const D3D12_StreamBarrier      *barriers = (const D3D12_StreamBarrier *)(command + 1);
+
+				trailing = (size_t)command->count*sizeof(D3D12_StreamBarrier);
+
+				// the barriers have to be in bounds before their objects can be looked at
+				valid = trailing <= header->size - sizeof(*command);
+
+				for (uint32_t i = 0; valid && i < command->count; i++)
+				{
+					valid = D3D12_IsValidStreamObject(barriers[i].resource,       object_count) &&
+							D3D12_IsValidStreamObject(barriers[i].resource_after, object_count);
+				}
+			} break;
+
+			case D3D12_StreamCommand_EndQuery:
+			case D3D12_StreamCommand_ResolveQueryData:
+			{
+				const D3D12_StreamQueryCommand *command = (const D3D12_StreamQueryCommand *)header;
+				valid = D3D12_IsValidStreamObject(command->heap, object_count) && D3D12_IsValidStreamObject(command->dst, object_count);
+			} break;
+
+			default: break;
+		}
+
+		if (!valid || trailing > header->size - g_stream_command_sizes[header->type])
+		{
+			return false;
+		}
+	}
+
+	return walked_count == command_count;
+}
+
+//------------------------------------------------------------------------
+// Command stream recording
+
+// The stream format only uses fixed size types, so these check it still lines up with D3D12
+static_assert(sizeof(D3D12_StreamViewport) == sizeof(D3D12_VIEWPORT),                                   "Stream viewports are copied as they are");
+static_assert(sizeof(D3D12_StreamRect)     == sizeof(D3D12_RECT),                                       "Stream rects are copied as they are");
+static_assert(g_stream_max_viewports       == D3D12_VIEWPORT_AND_SCISSORRECT_OBJECT_COUNT_PER_PIPELINE, "Stream viewport limit is out of date");
+static_assert(g_stream_max_render_targets  == D3D12_SIMULTANEOUS_RENDER_TARGET_COUNT,                   "Stream render target limit is out of date");
+
+static_assert(sizeof(D3D12_StreamIndexBufferCommand) == sizeof(D3D12_StreamCommand) + sizeof(D3D12_INDEX_BUFFER_VIEW), "Index buffers keep their D3D12 layout");
+static_assert(sizeof(D3D12_StreamCopyTextureCommand) == offsetof(D3D12_StreamCopyTextureCommand, src_offset) + sizeof(D3D12_PLACED_SUBRESOURCE_FOOTPRINT), "Footprints keep their D3D12 layout");
+
+struct D3D12_CommandStream
+{
+	uint8_t *data;
+	size_t   size;
+	size_t   capacity;
+	uint32_t command_count;
+
+	IUnknown **objects;
+	uint32_t   object_count;
+	uint32_t   object_capacity;
+
+	uint64_t *object_ids; // instead of objects, for streams read from disk
+
+	// Keeps the memory around for the next recording
+	void Reset()
+	{
+		size          = 0;
+		command_count = 0;
+		object_count  = 0;
+	}
+
+	void Release()
+	{
+		free(data);
+		free(objects);
+		free(object_ids);
+		ZeroStruct(this);
+	}
+
+	// What identifies an object in the table once it's on disk
+	uint64_t ObjectId(uint32_t index) const
+	{
+		return objects ? (uint64_t)(uintptr_t)objects[index] : object_ids[index];
+	}
+
+	void *Push(D3D12_StreamCommandType type, size_t command_size)
+	{
+		size_t aligned_size = (command_size + 7) & ~(size_t)7;
+
+		if (size + aligned_size > capacity)
+		{
+			size_t new_capacity = capacity ? capacity : KiB(4);
+			while (new_capacity < size + aligned_size) new_capacity *= 2;
+
+			data     = (uint8_t *)realloc(data, new_capacity);
+			capacity = new_capacity;
+		}
+
+		D3D12_StreamCommand *command = (D3D12_StreamCommand *)(data + size);
+
+		// padding comes out the same every time, so captures can be compared byte for byte
+		memset(command, 0, aligned_size);
+		command->type = type;
+		command->size = (uint32_t)aligned_size;
+
+		size          += aligned_size;
+		command_count += 1;
+
+		return command;
+	}
+
+	uint32_t Object(IUnknown *object)
+	{
+		if (!object)
+		{
+			return g_command_stream_null;
+		}
+
+		// the last few objects are the ones most likely to come up again
+		for (uint32_t i = object_count; i > 0; i--)
+		{
+			if (objects[i - 1] == object)
+			{
+				return i - 1;
+			}
+		}
+
+		if (object_count == object_capacity)
+		{
+			object_capacity = object_capacity ? 2*object_capacity : 64;
+			objects         = (IUnknown **)realloc(objects, object_capacity*sizeof(IUnknown *));
+		}
+
+		objects[object_count] = object;
+		return object_count++;
+	}
+
+	//------------------------------------------------------------------------
+	// Encoding, one function per command list function
+
+	void PushObject(D3D12_StreamCommandType type, IUnknown *object)
+	{
+		D3D12_StreamObjectCommand *command = (D3D12_StreamObjectCommand *)Push(type, sizeof(*command));
+		command->object = Object(object);
+	}
+
+	void PushConstants(D3D12_StreamCommandType type, uint32_t parameter, uint32_t count, const void *values, uint32_t offset)
+	{
+		D3D12_StreamConstantsCommand *command = (D3D12_StreamConstantsCommand *)Push(type, sizeof(*command) + count*sizeof(uint32_t));
+		command->parameter = parameter;
+		command->count     = count;
+		command->offset    = offset;
+		memcpy(command + 1, values, count*sizeof(uint32_t));
+	}
+
+	void PushCBV(D3D12_StreamCommandType type, uint32_t parameter, D3D12_GPU_VIRTUAL_ADDRESS address)
+	{
+		D3D12_StreamCBVCommand *command = (D3D12_StreamCBVCommand *)Push(type, sizeof(*command));
+		command->parameter = parameter;
+		command->address   = address;
+	}
+
+	void PushArray(D3D12_StreamCommandType type, uint32_t count, const void *elements, size_t element_size)
+	{
+		D3D12_StreamArrayCommand *command = (D3D12_StreamArrayCommand *)Push(type, sizeof(*command) + count*element_size);
+		command->count = count;
+		memcpy(command + 1, elements, count*element_size);
+	}
+
+	void SetPipelineState        (ID3D12PipelineState *pso)       { PushObject(D3D12_StreamCommand_SetPipelineState, pso); }
+	void SetGraphicsRootSignature(ID3D12RootSignature *signature) { PushObject(D3D12_StreamCommand_SetGraphicsRootSignature, signature); }
+	void SetComputeRootSignature (ID3D12RootSignature *signature) { PushObject(D3D12_StreamCommand_SetComputeRootSignature, signature); }
+	void DiscardResource         (ID3D12Resource *resource)       { PushObject(D3D12_StreamCommand_DiscardResource, resource); }
+
+	void SetDescriptorHeaps(uint32_t count, ID3D12DescriptorHeap *const *heaps)
+	{
+		D3D12_StreamHeapsCommand *command = (D3D12_StreamHeapsCommand *)Push(D3D12_StreamCommand_SetDescriptorHeaps, sizeof(*command));
+		assert(count <= ArrayCount(command->heaps));
+
+		command->count = count;
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			command->heaps[i] = Object(heaps[i]);
+		}
+	}
+
+	void SetGraphicsRoot32BitConstants(uint32_t parameter, uint32_t count, const void *values, uint32_t offset)
+	{
+		PushConstants(D3D12_StreamCommand_SetGraphicsRoot32BitConstants, parameter, count, values, offset);
+	}
+
+	void SetComputeRoot32BitConstants(uint32_t parameter, uint32_t count, const void *values, uint32_t offset)
+	{
+		PushConstants(D3D12_StreamCommand_SetComputeRoot32BitConstants, parameter, count, values, offset);
+	}
+
+	void SetGraphicsRootConstantBufferView(uint32_t parameter, D3D12_GPU_VIRTUAL_ADDRESS address)
+	{
+		PushCBV(D3D12_StreamCommand_SetGraphicsRootConstantBufferView, parameter, address);
+	}
+
+	void SetComputeRootConstantBufferView(uint32_t parameter, D3D12_GPU_VIRTUAL_ADDRESS address)
+	{
+		PushCBV(D3D12_StreamCommand_SetComputeRootConstantBufferView, parameter, address);
+	}
+
+	void IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY topology)
+	{
+		D3D12_StreamTopologyCommand *command = (D3D12_StreamTopologyCommand *)Push(D3D12_StreamCommand_IASetPrimitiveTopology, sizeof(*command));
+		command->topology = (uint32_t)topology;
+	}
+
+	void IASetIndexBuffer(const D3D12_INDEX_BUFFER_VIEW *view)
+	{
+		D3D12_StreamIndexBufferCommand *command = (D3D12_StreamIndexBufferCommand *)Push(D3D12_StreamCommand_IASetIndexBuffer, sizeof(*command));
+		command->address = view->BufferLocation;
+		command->size    = view->SizeInBytes;
+		command->format  = (uint32_t)view->Format;
+	}
+
+	void RSSetViewports(uint32_t count, const D3D12_VIEWPORT *viewports)
+	{
+		PushArray(D3D12_StreamCommand_RSSetViewports, count, viewports, sizeof(*viewports));
+	}
+
+	void RSSetScissorRects(uint32_t count, const D3D12_RECT *scissors)
+	{
+		PushArray(D3D12_StreamCommand_RSSetScissorRects, count, scissors, sizeof(*scissors));
+	}
+
+	void OMSetRenderTargets(uint32_t count, const D3D12_CPU_DESCRIPTOR_HANDLE *rtvs, const D3D12_CPU_DESCRIPTOR_HANDLE *dsv)
+	{
+		D3D12_StreamRenderTargetsCommand *command = (D3D12_StreamRenderTargetsCommand *)Push(D3D12_StreamCommand_OMSetRenderTargets, sizeof(*command) + count*sizeof(uint64_t));
+		command->count   = count;
+		command->has_dsv = dsv != nullptr;
+		command->dsv     = dsv ? dsv->ptr : 0;
+
+		uint64_t *handles = (uint64_t *)(command + 1);
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			handles[i] = rtvs[i].ptr;
+		}
+	}
+
+	void DrawIndexedInstanced(uint32_t index_count, uint32_t instance_count, uint32_t start_index, int32_t base_vertex, uint32_t start_instance)
+	{
+		D3D12_StreamDrawCommand *command = (D3D12_StreamDrawCommand *)Push(D3D12_StreamCommand_DrawIndexedInstanced, sizeof(*command));
+		command->index_count    = index_count;
+		command->instance_count = instance_count;
+		command->start_index    = start_index;
+		command->base_vertex    = base_vertex;
+		command->start_instance = start_instance;
+	}
+
+	void Dispatch(uint32_t x, uint32_t y, uint32_t z)
+	{
+		D3D12_StreamDispatchCommand *command = (D3D12_StreamDispatchCommand *)Push(D3D12_StreamCommand_Dispatch, sizeof(*command));
+		command->x = x;
+		command->y = y;
+		command->z = z;
+	}
+
+	void ExecuteIndirect(ID3D12CommandSignature *signature, uint32_t max_count, ID3D12Resource *args, uint64_t args_offset, ID3D12Resource *count_buffer, uint64_t count_offset)
+	{
+		D3D12_StreamExecuteIndirectCommand *command = (D3D12_StreamExecuteIndirectCommand *)Push(D3D12_StreamCommand_ExecuteIndirect, sizeof(*command));
+		command->signature    = Object(signature);
+		command->max_count    = max_count;
+		command->args         = Object(args);
+		command->count_buffer = Object(count_buffer);
+		command->args_offset  = args_offset;
+		command->count_offset = count_offset;
+	}
+
+	void ClearRenderTargetView(D3D12_CPU_DESCRIPTOR_HANDLE rtv, const float color[4])
+	{
+		D3D12_StreamClearCommand *command = (D3D12_StreamClearCommand *)Push(D3D12_StreamCommand_ClearRenderTargetView, sizeof(*command));
+		command->rtv = rtv.ptr;
+		memcpy(command->color, color, sizeof(command->color));
+	}
+
+	void CopyBufferRegion(ID3D12Resource *dst, uint64_t dst_offset, ID3D12Resource *src, uint64_t src_offset, uint64_t copy_size)
+	{
+		D3D12_StreamCopyBufferCommand *command = (D3D12_StreamCopyBufferCommand *)Push(D3D12_StreamCommand_CopyBufferRegion, sizeof(*command));
+		command->dst        = Object(dst);
+		command->src        = Object(src);
+		command->dst_offset = dst_offset;
+		command->src_offset = src_offset;
+		command->size       = copy_size;
+	}
+
+	void CopyTextureRegion(const D3D12_TEXTURE_COPY_LOCATION *dst, const D3D12_TEXTURE_COPY_LOCATION *src)
+	{
+		assert(dst->Type == D3D12_TEXTURE_COPY_TYPE_SUBRESOURCE_INDEX && src->Type == D3D12_TEXTURE_COPY_TYPE_PLACED_FOOTPRINT);
+
+		D3D12_StreamCopyTextureCommand *command = (D3D12_StreamCopyTextureCommand *)Push(D3D12_StreamCommand_CopyTextureRegion, sizeof(*command));
+		command->dst             = Object(dst->pResource);
+		command->dst_subresource = dst->SubresourceIndex;
+		command->src             = Object(src->pResource);
+		command->src_offset      = src->PlacedFootprint.Offset;
+		command->src_format      = (uint32_t)src->PlacedFootprint.Footprint.Format;
+		command->src_width       = src->PlacedFootprint.Footprint.Width;
+		command->src_height      = src->PlacedFootprint.Footprint.Height;
+		command->src_depth       = src->PlacedFootprint.Footprint.Depth;
+		command->src_row_pitch   = src->PlacedFootprint.Footprint.RowPitch;
+	}
+
+	void ResourceBarrier(uint32_t count, const D3D12_RESOURCE_BARRIER *barriers)
+	{
+		D3D12_StreamArrayCommand *command = (D3D12_StreamArrayCommand *)Push(D3D12_StreamCommand_ResourceBarrier, sizeof(*command) + count*sizeof(D3D12_StreamBarrier));
+		command->count = count;
+
+		D3D12_StreamBarrier *out = (D3D12_StreamBarrier *)(command + 1);
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			const D3D12_RESOURCE_BARRIER *barrier = &barriers[i];
+
+			out[i].type           = (uint32_t)barrier->Type;
+			out[i].flags          = (uint32_t)barrier->Flags;
+			out[i].resource_after = g_command_stream_null;
+
+			switch (barrier->Type)
+			{
+				case D3D12_RESOURCE_BARRIER_TYPE_TRANSITION:
+				{
+					out[i].resource     = Object(barrier->Transition.pResource);
+					out[i].subresource  = barrier->Transition.Subresource;
+					out[i].state_before = (uint32_t)barrier->Transition.StateBefore;
+					out[i].state_after  = (uint32_t)barrier->Transition.StateAfter;
+				} break;
+
+				case D3D12_RESOURCE_BARRIER_TYPE_ALIASING:
+				{
+					out[i].resource       = Object(barrier->Aliasing.pResourceBefore);
+					out[i].resource_after = Object(barrier->Aliasing.pResourceAfter);
+				} break;
+
+				case D3D12_RESOURCE_BARRIER_TYPE_UAV:
+				{
+					out[i].resource = Object(barrier->UAV.pResource);
+				} break;
+			}
+		}
+	}
+
+	void EndQuery(ID3D12QueryHeap *heap, D3D12_QUERY_TYPE type, uint32_t index)
+	{
+		D3D12_StreamQueryCommand *command = (D3D12_StreamQueryCommand *)Push(D3D12_StreamCommand_EndQuery, sizeof(*command));
+		command->heap  = Object(heap);
+		command->type  = (uint32_t)type;
+		command->index = index;
+		command->dst   = g_command_stream_null;
+	}
+
+	void ResolveQueryData(ID3D12QueryHeap *heap, D3D12_QUERY_TYPE type, uint32_t index, uint32_t count, ID3D12Resource *dst, uint64_t dst_offset)
+	{
+		D3D12_StreamQueryCommand *command = (D3D12_StreamQueryCommand *)Push(D3D12_StreamCommand_ResolveQueryData, sizeof(*command));
+		command->heap       = Object(heap);
+		command->type       = (uint32_t)type;
+		command->index      = index;
+		command->count      = count;
+		command->dst        = Object(dst);
+		command->dst_offset = dst_offset;
+	}
+};
+
+//------------------------------------------------------------------------
+// Command stream replay
+
+IUnknown *D3D12_StreamObject(IUnknown *const *objects, uint32_t index)
+{
+	return index == g_command_stream_null ? nullptr : objects[index];
+}
+
+// Records the stream into a list. Objects default to the ones the stream was recorded with, which only
+// works in the process that recorded it, otherwise pass in object_count objects to stand in for the
+// stream's table. Returns false without recording anything if the stream is malformed, refers to
+// objects past the end of the table, or was read from disk and given no objects to stand in.
+bool D3D12_ReplayCommandStream(ID3D12GraphicsCommandList *list, const D3D12_CommandStream *stream, IUnknown *const *objects = nullptr, uint32_t object_count = 0)
+{
+	if (!objects)
+	{
+		if (!stream->objects && stream->object_count > 0)
+		{
+			return false;
+		}
+
+		objects      = stream->objects;
+		object_count = stream->object_count;
+	}
+
+	if (!D3D12_ValidateCommandStream(stream->data, stream->size, stream->command_count, object_count))
+	{
+		return false;
+	}
+
+	for (size_t at = 0; at < stream->size;)
+	{
+		const D3D12_StreamCommand *header = (const D3D12_StreamCommand *)(stream->data + at);
+		at += header->size;
+
+		switch (header->type)
+		{
+			case D3D12_StreamCommand_SetPipelineState:
+			case D3D12_StreamCommand_SetGraphicsRootSignature:
+			case D3D12_StreamCommand_SetComputeRootSignature:
+			case D3D12_StreamCommand_DiscardResource:
+			{
+				const D3D12_StreamObjectCommand *command = (const D3D12_StreamObjectCommand *)header;
+
+				switch (header->type)
+				{
+					case D3D12_StreamCommand_SetPipelineState:         list->SetPipelineState        ((ID3D12PipelineState *)D3D12_StreamObject(objects, command->object)); break;
+					case D3D12_StreamCommand_SetGraphicsRootSignature: list->SetGraphicsRootSignature((ID3D12RootSignature *)D3D12_StreamObject(objects, command->object)); break;
+					case D3D12_StreamCommand_SetComputeRootSignature:  list->SetComputeRootSignature ((ID3D12RootSignature *)D3D12_StreamObject(objects, command->object)); break;
+					default:                                           list->DiscardResource         ((ID3D12Resource *)D3D12_StreamObject(objects, command->object), nullptr); break;
+				}
+			} break;
+
+			case D3D12_StreamCommand_SetDescriptorHeaps:
+			{
+				const D3D12_StreamHeapsCommand *command = (const D3D12_StreamHeapsCommand *)header;
+
+				ID3D12DescriptorHeap *heaps[ArrayCount(command->heaps)];
+
+				for (uint32_t i = 0; i < command->count; i++)
+				{
+					heaps[i] = (ID3D12DescriptorHeap *)D3D12_StreamObject(objects, command->heaps[i]);
+				}
+
+				list->SetDescriptorHeaps(command->count, heaps);
+			} break;
+
+			case D3D12_StreamCommand_SetGraphicsRoot32BitConstants:
+			case D3D12_StreamCommand_SetComputeRoot32BitConstants:
+			{
+				const D3D12_StreamConstantsCommand *command = (const D3D12_StreamConstantsCommand *)header;
+
+				if (header->type == D3D12_StreamCommand_SetGraphicsRoot32BitConstants)
+				{
+					list->SetGraphicsRoot32BitConstants(command->parameter, command->count, command + 1, command->offset);
+				}
+				else
+				{
+					list->SetComputeRoot32BitConstants(command->parameter, command->count, command + 1, command->offset);
+				}
+			} break;
+
+			case D3D12_StreamCommand_SetGraphicsRootConstantBufferView:
+			case D3D12_StreamCommand_SetComputeRootConstantBufferView:
+			{
+				const D3D12_StreamCBVCommand *command = (const D3D12_StreamCBVCommand *)header;
+
+				if (header->type == D3D12_StreamCommand_SetGraphicsRootConstantBufferView)
+				{
+					list->SetGraphicsRootConstantBufferView(command->parameter, command->address);
+				}
+				else
+				{
+					list->SetComputeRootConstantBufferView(command->parameter, command->address);
+				}
+			} break;
+
+			case D3D12_StreamCommand_IASetPrimitiveTopology:
+			{
+				list->IASetPrimitiveTopology((D3D_PRIMITIVE_TOPOLOGY)((const D3D12_StreamTopologyCommand *)header)->topology);
+			} break;
+
+			case D3D12_StreamCommand_IASetIndexBuffer:
+			{
+				const D3D12_StreamIndexBufferCommand *command = (const D3D12_StreamIndexBufferCommand *)header;
+
+				D3D12_INDEX_BUFFER_VIEW view = {
+					.BufferLocation = command->address,
+					.SizeInBytes    = command->size,
+					.Format         = (DXGI_FORMAT)command->format,
+				};
+
+				list->IASetIndexBuffer(&view);
+			} break;
+
+			case D3D12_StreamCommand_RSSetViewports:
+			{
+				const D3D12_StreamArrayCommand *command = (const D3D12_StreamArrayCommand *)header;
+				list->RSSetViewports(command->count, (const D3D12_VIEWPORT *)(command + 1));
+			} break;
+
+			case D3D12_StreamCommand_RSSetScissorRects:
+			{
+				const D3D12_StreamArrayCommand *command = (const D3D12_StreamArrayCommand *)header;
+				list->RSSetScissorRects(command->count, (const D3D12_RECT *)(command + 1));
+			} break;
+
+			case D3D12_StreamCommand_OMSetRenderTargets:
+			{
+				const D3D12_StreamRenderTargetsCommand *command = (const D3D12_StreamRenderTargetsCommand *)header;
+				const uint64_t                         *handles = (const uint64_t *)(command + 1);
+
+				D3D12_CPU_DESCRIPTOR_HANDLE rtvs[D3D12_SIMULTANEOUS_RENDER_TARGET_COUNT];
+				D3D12_CPU_DESCRIPTOR_HANDLE dsv = { (SIZE_T)command->dsv };
+
+				for (uint32_t i = 0; i < command->count; i++)
+				{
+					rtvs[i].ptr = (SIZE_T)handles[i];
+				}
+
+				list->OMSetRenderTargets(command->count, rtvs, false, command->has_dsv ? &dsv : nullptr);
+			} break;
+
+			case D3D12_StreamCommand_DrawIndexedInstanced:
+			{
+				const D3D12_StreamDrawCommand *command = (const D3D12_StreamDrawCommand *)header;
+				list->DrawIndexedInstanced(command->index_count, command->instance_count, command->start_index, command->base_vertex, command->start_instance);
+			} break;
+
+			case D3D12_StreamCommand_Dispatch:
+			{
+				const D3D12_StreamDispatchCommand *command = (const D3D12_StreamDispatchCommand *)header;
+				list->Dispatch(command->x, command->y, command->z);
+			} break;
+
+			case D3D12_StreamCommand_ExecuteIndirect:
+			{
+				const D3D12_StreamExecuteIndirectCommand *command = (const D3D12_StreamExecuteIndirectCommand *)header;
+
+				list->ExecuteIndirect(
+					(ID3D12CommandSignature *)D3D12_StreamObject(objects, command->signature),
+					command->max_count,
+					(ID3D12Resource *)D3D12_StreamObject(objects, command->args),
+					command->args_offset,
+					(ID3D12Resource *)D3D12_StreamObject(objects, command->count_buffer),
+					command->count_offset);
+			} break;
+
+			case D3D12_StreamCommand_ClearRenderTargetView:
+			{
+				const D3D12_StreamClearCommand *command = (const D3D12_StreamClearCommand *)header;
+				list->ClearRenderTargetView({ (SIZE_T)command->rtv }, command->color, 0, nullptr);
+			} break;
+
+			case D3D12_StreamCommand_CopyBufferRegion:
+			{
+				const D3D12_StreamCopyBufferCommand *command = (const D3D12_StreamCopyBufferCommand *)header;
+
+				list->CopyBufferRegion(
+					(ID3D12Resource *)D3D12_StreamObject(objects, command->dst), command->dst_offset,
+					(ID3D12Resource *)D3D12_StreamObject(objects, command->src), command->src_offset,
+					command->size);
+			} break;
+
+			case D3D12_StreamCommand_CopyTextureRegion:
+			{
+				const D3D12_StreamCopyTextureCommand *command = (const D3D12_StreamCopyTextureCommand *)header;
+
+				D3D12_TEXTURE_COPY_LOCATION dst = {
+					.pResource        = (ID3D12Resource *)D3D12_StreamObject(objects, command->dst),
+					.Type             = D3D12_TEXTURE_COPY_TYPE_SUBRESOURCE_INDEX,
+					.SubresourceIndex = command->dst_subresource,
+				};
+
+				D3D12_TEXTURE_COPY_LOCATION src = {
+					.pResource       = (ID3D12Resource *)D3D12_StreamObject(objects, command->src),
+					.Type            = D3D12_TEXTURE_COPY_TYPE_PLACED_FOOTPRINT,
+					.PlacedFootprint = {
+						.Offset    = command->src_offset,
+						.Footprint = {
+							.Format   = (DXGI_FORMAT)command->src_format,
+							.Width    = command->src_width,
+							.Height   = command->src_height,
+							.Depth    = command->src_depth,
+							.RowPitch = command->src_row_pitch,
+						},
+					},
+				};
+
+				list->CopyTextureRegion(&dst, 0, 0, 0, &src, nullptr);
+			} break;
+
+			case D3D12_StreamCommand_ResourceBarrier:
+			{
+				const D3D12_StreamArrayCommand *command  = (const D3D12_StreamArrayCommand *)header;
+				const D3D12_StreamBarrier      *barriers = (const D3D12_StreamBarrier *)(command + 1);
+
+				// barriers go through in batches, to keep them off the heap
+				D3D12_RESOURCE_BARRIER batch[64];
+				uint32_t               batch_count = 0;
+
+				for (uint32_t i = 0; i < command->count; i++)
+				{
+					const D3D12_StreamBarrier *barrier = &barriers[i];
+					D3D12_RESOURCE_BARRIER    *out     = &batch[batch_count++];
+
+					ZeroStruct(out);
+					out->Type  = (D3D12_RESOURCE_BARRIER_TYPE)barrier->type;
+					out->Flags = (D3D12_RESOURCE_BARRIER_FLAGS)barrier->flags;
+
+					switch (barrier->type)
+					{
+						case D3D12_RESOURCE_BARRIER_TYPE_TRANSITION:
+						{
+							out->Transition.pResource   = (ID3D12Resource *)D3D12_StreamObject(objects, barrier->resource);
+							out->Transition.Subresource = barrier->subresource;
+							out->Transition.StateBefore = (D3D12_RESOURCE_STATES)barrier->state_before;
+							out->Transition.StateAfter  = (D3D12_RESOURCE_STATES)barrier->state_after;
+						} break;
+
+						case D3D12_RESOURCE_BARRIER_TYPE_ALIASING:
+						{
+							out->Aliasing.pResourceBefore = (ID3D12Resource *)D3D12_StreamObject(objects, barrier->resource);
+							out->Aliasing.pResourceAfter  = (ID3D12Resource *)D3D12_StreamObject(objects, barrier->resource_after);
+						} break;
+
+						case D3D12_RESOURCE_BARRIER_TYPE_UAV:
+						{
+							out->UAV.pResource = (ID3D12Resource *)D3D12_StreamObject(objects, barrier->resource);
+						} break;
+					}
+
+					if (batch_count == ArrayCount(batch) || i + 1 == command->count)
+					{
+						list->ResourceBarrier(batch_count, batch);
+						batch_count = 0;
+					}
+				}
+			} break;
+
+			case D3D12_StreamCommand_EndQuery:
+			{
+				const D3D12_StreamQueryCommand *command = (const D3D12_StreamQueryCommand *)header;
+				list->EndQuery((ID3D12QueryHeap *)D3D12_StreamObject(objects, command->heap), (D3D12_QUERY_TYPE)command->type, command->index);
+			} break;
+
+			case D3D12_StreamCommand_ResolveQueryData:
+			{
+				const D3D12_StreamQueryCommand *command = (const D3D12_StreamQueryCommand *)header;
+
+				list->ResolveQueryData(
+					(ID3D12QueryHeap *)D3D12_StreamObject(objects, command->heap), (D3D12_QUERY_TYPE)command->type, command->index, command->count,
+					(ID3D12Resource *)D3D12_StreamObject(objects, command->dst), command->dst_offset);
+			} break;
+
+			default:
+			{
+				assert(!"Unknown command in command stream");
+			} break;
+		}
+	}
+
+	return true;
+}
+
+//------------------------------------------------------------------------
+// Command stream inspection and storage
+
+void D3D12_PrintStreamObject(FILE *out, uint32_t index)
+{
+	if (index == g_command_stream_null) fprintf(out, " null");
+	else                                fprintf(out, " #%u", index);
+}
+
+// One command per line, for reading and diffing. GPU addresses and descriptor handles are printed as
+// they are, so they'll differ between runs.
+void D3D12_PrintCommandStream(FILE *out, const D3D12_CommandStream *stream)
+{
+	if (!D3D12_ValidateCommandStream(stream->data, stream->size, stream->command_count, stream->object_count))
+	{
+		fprintf(out, "// malformed command stream\n");
+		return;
+	}
+
+	for (size_t at = 0; at < stream->size;)
+	{
+		const D3D12_StreamCommand *header = (const D3D12_StreamCommand *)(stream->data + at);
+		at += header->size;
+
+		fprintf(out, "%s", g_stream_command_names[header->type]);
+
+		switch (header->type)
+		{
+			case D3D12_StreamCommand_SetPipelineState:
+			case D3D12_StreamCommand_SetGraphicsRootSignature:
+			case D3D12_StreamCommand_SetComputeRootSignature:
+			case D3D12_StreamCommand_DiscardResource:
+			{
+				D3D12_PrintStreamObject(out, ((const D3D12_StreamObjectCommand *)header)->object);
+			} break;
+
+			case D3D12_StreamCommand_SetDescriptorHeaps:
+			{
+				const D3D12_StreamHeapsCommand *command = (const D3D12_StreamHeapsCommand *)header;
+
+				for (uint32_t i = 0; i < command->count; i++)
+				{
+					D3D12_PrintStreamObject(out, command->heaps[i]);
+				}
+			} break;
+
+			case D3D12_StreamCommand_SetGraphicsRoot32BitConstants:
+			case D3D12_StreamCommand_SetComputeRoot32BitConstants:
+			{
+				const D3D12_StreamConstantsCommand *command = (const D3D12_StreamConstantsCommand *)header;
+				const uint32_t                     *values  = (const uint32_t *)(command + 1);
+
+				fprintf(out, " param %u offset %u:", command->parameter, command->offset);
+
+				for (uint32_t i = 0; i < command->count; i++)
+				{
+					fprintf(out, " %08X", values[i]);
+				}
+			} break;
+
+			case D3D12_StreamCommand_SetGraphicsRootConstantBufferView:
+			case D3D12_StreamCommand_SetComputeRootConstantBufferView:
+			{
+				const D3D12_StreamCBVCommand *command = (const D3D12_StreamCBVCommand *)header;
+				fprintf(out, " param %u: %llX", command->parameter, (unsigned long long)command->address);
+			} break;
+
+			case D3D12_StreamCommand_IASetPrimitiveTopology:
+			{
+				fprintf(out, " %d", (int)((const D3D12_StreamTopologyCommand *)header)->topology);
+			} break;
+
+			case D3D12_StreamCommand_IASetIndexBuffer:
+			{
+				const D3D12_StreamIndexBufferCommand *command = (const D3D12_StreamIndexBufferCommand *)header;
+				fprintf(out, " %llX size %u format %d", (unsigned long long)command->address, command->size, (int)command->format);
+			} break;
+
+			case D3D12_StreamCommand_RSSetViewports:
+			{
+				const D3D12_StreamArrayCommand *command   = (const D3D12_StreamArrayCommand *)header;
+				const D3D12_StreamViewport     *viewports = (const D3D12_StreamViewport *)(command + 1);
+
+				for (uint32_t i = 0; i < command->count; i++)
+				{
+					const D3D12_StreamViewport *v = &viewports[i];
+					fprintf(out, " (%g %g %g %g %g %g)", v->x, v->y, v->width, v->height, v->min_depth, v->max_depth);
+				}
+			} break;
+
+			case D3D12_StreamCommand_RSSetScissorRects:
+			{
+				const D3D12_StreamArrayCommand *command = (const D3D12_StreamArrayCommand *)header;
+				const D3D12_StreamRect         *rects   = (const D3D12_StreamRect *)(command + 1);
+
+				for (uint32_t i = 0; i < command->count; i++)
+				{
+					fprintf(out, " (%ld %ld %ld %ld)", (long)rects[i].left, (long)rects[i].top, (long)rects[i].right, (long)rects[i].bottom);
+				}
+			} break;
+
+			case D3D12_StreamCommand_OMSetRenderTargets:
+			{
+				const D3D12_StreamRenderTargetsCommand *command = (const D3D12_StreamRenderTargetsCommand *)header;
+				const uint64_t                         *handles = (const uint64_t *)(command + 1);
+
+				for (uint32_t i = 0; i < command->count; i++)
+				{
+					fprintf(out, " %llX", (unsigned long long)handles[i]);
+				}
+
+				if (command->has_dsv) fprintf(out, " dsv %llX", (unsigned long long)command->dsv);
+			} break;
+
+			case D3D12_StreamCommand_DrawIndexedInstanced:
+			{
+				const D3D12_StreamDrawCommand *command = (const D3D12_StreamDrawCommand *)header;
+				fprintf(out, " %u %u %u %d %u", command->index_count, command->instance_count, command->start_index, command->base_vertex, command->start_instance);
+			} break;
+
+			case D3D12_StreamCommand_Dispatch:
+			{
+				const D3D12_StreamDispatchCommand *command = (const D3D12_StreamDispatchCommand *)header;
+				fprintf(out, " %u %u %u", command->x, command->y, command->z);
+			} break;
+
+			case D3D12_StreamCommand_ExecuteIndirect:
+			{
+				const D3D12_StreamExecuteIndirectCommand *command = (const D3D12_StreamExecuteIndirectCommand *)header;
+
+				D3D12_PrintStreamObject(out, command->signature);
+				fprintf(out, " max %u args", command->max_count);
+				D3D12_PrintStreamObject(out, command->args);
+				fprintf(out, "+%llu count", (unsigned long long)command->args_offset);
+				D3D12_PrintStreamObject(out, command->count_buffer);
+				fprintf(out, "+%llu", (unsigned long long)command->count_offset);
+			} break;
+
+			case D3D12_StreamCommand_ClearRenderTargetView:
+			{
+				const D3D12_StreamClearCommand *command = (const D3D12_StreamClearCommand *)header;
+				fprintf(out, " %llX (%g %g %g %g)", (unsigned long long)command->rtv, command->color[0], command->color[1], command->color[2], command->color[3]);
+			} break;
+
+			case D3D12_StreamCommand_CopyBufferRegion:
+			{
+				const D3D12_StreamCopyBufferCommand *command = (const D3D12_StreamCopyBufferCommand *)header;
+
+				D3D12_PrintStreamObject(out, command->dst);
+				fprintf(out, "+%llu <-", (unsigned long long)command->dst_offset);
+				D3D12_PrintStreamObject(out, command->src);
+				fprintf(out, "+%llu size %llu", (unsigned long long)command->src_offset, (unsigned long long)command->size);
+			} break;
+
+			case D3D12_StreamCommand_CopyTextureRegion:
+			{
+				const D3D12_StreamCopyTextureCommand *command = (const D3D12_StreamCopyTextureCommand *)header;
+
+				D3D12_PrintStreamObject(out, command->dst);
+				fprintf(out, "[%u] <-", command->dst_subresource);
+				D3D12_PrintStreamObject(out, command->src);
+				fprintf(out, "+%llu", (unsigned long long)command->src_offset);
+			} break;
+
+			case D3D12_StreamCommand_ResourceBarrier:
+			{
+				const D3D12_StreamArrayCommand *command  = (const D3D12_StreamArrayCommand *)header;
+				const D3D12_StreamBarrier      *barriers = (const D3D12_StreamBarrier *)(command + 1);
+
+				for (uint32_t i = 0; i < command->count; i++)
+				{
+					const D3D12_StreamBarrier *barrier = &barriers[i];
+
+					fprintf(out, "\n   ");
+
+					switch (barrier->type)
+					{
+						case D3D12_RESOURCE_BARRIER_TYPE_TRANSITION:
+						{
+							fprintf(out, " transition");
+							D3D12_PrintStreamObject(out, barrier->resource);
+							fprintf(out, "[%u] %X -> %X", barrier->subresource, (uint32_t)barrier->state_before, (uint32_t)barrier->state_after);
+						} break;
+
+						case D3D12_RESOURCE_BARRIER_TYPE_ALIASING:
+						{
+							fprintf(out, " aliasing");
+							D3D12_PrintStreamObject(out, barrier->resource);
+							fprintf(out, " ->");
+							D3D12_PrintStreamObject(out, barrier->resource_after);
+						} break;
+
+						case D3D12_RESOURCE_BARRIER_TYPE_UAV:
+						{
+							fprintf(out, " uav");
+							D3D12_PrintStreamObject(out, barrier->resource);
+						} break;
+					}
+
+					if (barrier->flags & D3D12_RESOURCE_BARRIER_FLAG_BEGIN_ONLY) fprintf(out, " begin");
+					if (barrier->flags & D3D12_RESOURCE_BARRIER_FLAG_END_ONLY)   fprintf(out, " end");
+				}
+			} break;
+
+			case D3D12_StreamCommand_EndQuery:
+			case D3D12_StreamCommand_ResolveQueryData:
+			{
+				const D3D12_StreamQueryCommand *command = (const D3D12_StreamQueryCommand *)header;
+
+				D3D12_PrintStreamObject(out, command->heap);
+				fprintf(out, " type %d", (int)command->type);
+
+				if (header->type == D3D12_StreamCommand_EndQuery)
+				{
+					fprintf(out, " [%u]", command->index);
+				}
+				else
+				{
+					fprintf(out, " [%u, %u) ->", command->index, command->index + command->count);
+					D3D12_PrintStreamObject(out, command->dst);
+					fprintf(out, "+%llu", (unsigned long long)command->dst_offset);
+				}
+			} break;
+
+			default: break;
+		}
+
+		fprintf(out, "\n");
+	}
+}
+
+struct D3D12_CommandStreamFileHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t stream_count;
+	uint32_t pad;
+};
+
+// Followed by size bytes of commands, then object_count uint64_t object ids
+struct D3D12_CommandStreamFileEntry
+{
+	uint64_t size;
+	uint32_t command_count;
+	uint32_t object_count;
+};
+
+// Writes the streams in order, meant for all the lists of a frame in submission order
+bool D3D12_WriteCommandStreams(const char *path, const D3D12_CommandStream *const *streams, uint32_t stream_count)
+{
+	FILE *file = fopen(path, "wb");
+	if (!file)
+	{
+		return false;
+	}
+
+	D3D12_CommandStreamFileHeader header = {
+		.magic        = g_command_stream_magic,
+		.version      = g_command_stream_version,
+		.stream_count = stream_count,
+	};
+
+	bool result = fwrite(&header, sizeof(header), 1, file) == 1;
+
+	for (uint32_t i = 0; result && i < stream_count; i++)
+	{
+		const D3D12_CommandStream *stream = streams[i];
+
+		D3D12_CommandStreamFileEntry entry = {
+			.size          = stream->size,
+			.command_count = stream->command_count,
+			.object_count  = stream->object_count,
+		};
+
+		result = fwrite(&entry, sizeof(entry), 1, file) == 1 && (stream->size == 0 || fwrite(stream->data, stream->size, 1, file) == 1);
+
+		for (uint32_t j = 0; result && j < stream->object_count; j++)
+		{
+			uint64_t id = stream->ObjectId(j);
+			result = fwrite(&id, sizeof(id), 1, file) == 1;
+		}
+	}
+
+	fclose(file);
+
+	return result;
+}
+
+// Reads streams written by D3D12_WriteCommandStreams into the given streams, which may be reused ones.
+// Their object tables come back as ids only, replaying them needs the objects passed in. Returns how
+// many streams were read, or 0 if the file couldn't be read, doesn't fit or holds a malformed stream.
+uint32_t D3D12_ReadCommandStreams(const char *path, D3D12_CommandStream *streams, uint32_t max_stream_count)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+	{
+		return 0;
+	}
+
+	D3D12_CommandStreamFileHeader header;
+
+	bool valid =
+		fread(&header, sizeof(header), 1, file) == 1 &&
+		header.magic        == g_command_stream_magic &&
+		header.version      == g_command_stream_version &&
+		header.stream_count <= max_stream_count;
+
+	for (uint32_t i = 0; valid && i < header.stream_count; i++)
+	{
+		D3D12_CommandStream *stream = &streams[i];
+
+		stream->Reset();
+
+		free(stream->objects);
+		stream->objects         = nullptr;
+		stream->object_capacity = 0;
+
+		D3D12_CommandStreamFileEntry entry;
+		valid = fread(&entry, sizeof(entry), 1, file) == 1;
+
+		// a corrupt size can ask for more than there is, which realloc gets to turn down
+		if (valid && stream->capacity < entry.size)
+		{
+			uint8_t *data = (uint8_t *)realloc(stream->data, (size_t)entry.size);
+			valid = data != nullptr;
+
+			if (valid)
+			{
+				stream->data     = data;
+				stream->capacity = (size_t)entry.size;
+			}
+		}
+
+		valid = valid && (entry.size == 0 || fread(stream->data, (size_t)entry.size, 1, file) == 1);
+
+		if (valid && entry.object_count > 0)
+		{
+			uint64_t *ids = (uint64_t *)realloc(stream->object_ids, (size_t)entry.object_count*sizeof(uint64_t));
+			valid = ids != nullptr;
+
+			if (valid)
+			{
+				stream->object_ids = ids;
+				valid = fread(stream->object_ids, sizeof(uint64_t), entry.object_count, file) == entry.object_count;
+			}
+		}
+
+		// only a stream that was read in full and walks cleanly gets a size
+		if (valid)
+		{
+			stream->size          = (size_t)entry.size;
+			stream->command_count = entry.command_count;
+			stream->object_count  = entry.object_count;
+
+			valid = D3D12_ValidateCommandStream(stream->data, stream->size, stream->command_count, stream->object_count);
+		}
+
+		if (!valid)
+		{
+			stream->Reset();
+		}
+	}
+
+	fclose(file);
+
+	return valid ? header.stream_count : 0;
+}
+
+//------------------------------------------------------------------------
+// Command list state filtering
+//
+// Wraps a command list and shadows the state bound on it, dropping calls that wouldn't change
+// anything. Passes end up setting the same PSO, viewport and so on over and over, and every one of
+// those calls costs CPU time in the driver even when it does nothing. Root constants are compared per
+// value, and only the range that actually changed gets set.
+//
+// All state changes on a wrapped list have to go through the wrapper, or the shadow state goes stale.
+// The list can be left null, in which case nothing is forwarded and the wrapper only filters and
+// counts, which is how it can be driven without a device. Whatever gets through to the list also goes
+// into the command stream, if there is one.
+
+static constexpr uint32_t g_max_root_parameters      = 8;
+static constexpr uint32_t g_max_root_constant_values = 64;
+
+struct D3D12_RootArguments
+{
+	ID3D12RootSignature      *signature;
+	uint32_t                  constants      [g_max_root_parameters][g_max_root_constant_values];
+	uint64_t                  constants_valid[g_max_root_parameters]; // a bit per value
+	D3D12_GPU_VIRTUAL_ADDRESS cbvs           [g_max_root_parameters];
+
+	void Invalidate()
+	{
+		memset(constants_valid, 0, sizeof(constants_valid));
+		memset(cbvs,            0, sizeof(cbvs));
+	}
+};
+
+struct D3D12_CommandListStats
+{
+	uint32_t calls;          // state setting calls made on the wrapper
+	uint32_t calls_filtered; // ...that were dropped because they were redundant
+	uint32_t root_constants;
+	uint32_t root_constants_filtered;
+	uint32_t draws;
+	uint32_t dispatches;
+};
+
+struct D3D12_CommandList
+{
+	ID3D12GraphicsCommandList *list;
+	D3D12_CommandStream       *stream;
+
+	ID3D12PipelineState        *pso;
+	ID3D12DescriptorHeap       *heaps[2];
+	uint32_t                    heap_count;
+	D3D12_RootArguments         graphics;
+	D3D12_RootArguments         compute;
+	D3D_PRIMITIVE_TOPOLOGY      topology;
+	D3D12_INDEX_BUFFER_VIEW     ibv;
+	D3D12_VIEWPORT              viewports[D3D12_VIEWPORT_AND_SCISSORRECT_OBJECT_COUNT_PER_PIPELINE];
+	uint32_t                    viewport_count;
+	D3D12_RECT                  scissors[D3D12_VIEWPORT_AND_SCISSORRECT_OBJECT_COUNT_PER_PIPELINE];
+	uint32_t                    scissor_count;
+	D3D12_CPU_DESCRIPTOR_HANDLE rtvs[D3D12_SIMULTANEOUS_RENDER_TARGET_COUNT];
+	uint32_t                    rtv_count;
+	D3D12_CPU_DESCRIPTOR_HANDLE dsv;
+
+	D3D12_CommandListStats stats;
+
+	// Call whenever the underlying list is reset, which clears all its state
+	void Reset(ID3D12GraphicsCommandList *in_list, D3D12_CommandStream *in_stream = nullptr)
+	{
+		ZeroStruct(this);
+		list   = in_list;
+		stream = in_stream;
+	}
+
+	// Counts the call, and whether it got dropped
+	bool Filter(bool redundant)
+	{
+		stats.calls += 1;
+
+		if (redundant)
+		{
+			stats.calls_filtered += 1;
+		}
+
+		return !redundant;
+	}
+
+	//------------------------------------------------------------------------
+	// Filtered state
+
+	void SetPipelineState(ID3D12PipelineState *in_pso)
+	{
+		bool redundant = pso == in_pso;
+		pso = in_pso;
+
+		if (Filter(redundant))
+		{
+			if (stream) stream->SetPipelineState(in_pso);
+			if (list)   list->SetPipelineState(in_pso);
+		}
+	}
+
+	void SetDescriptorHeaps(uint32_t count, ID3D12DescriptorHeap *const *in_heaps)
+	{
+		assert(count <= ArrayCount(heaps));
+
+		bool redundant = heap_count == count && memcmp(heaps, in_heaps, count*sizeof(*in_heaps)) == 0;
+
+		heap_count = count;
+		memcpy(heaps, in_heaps, count*sizeof(*in_heaps));
+
+		if (Filter(redundant))
+		{
+			if (stream) stream->SetDescriptorHeaps(count, in_heaps);
+			if (list)   list->SetDescriptorHeaps(count, in_heaps);
+		}
+	}
+
+	// Changing the root signature leaves all root arguments undefined
+	bool SetRootSignature(D3D12_RootArguments *arguments, ID3D12RootSignature *signature)
+	{
+		bool redundant = arguments->signature == signature;
+
+		if (!redundant)
+		{
+			arguments->signature = signature;
+			arguments->Invalidate();
+		}
+
+		return Filter(redundant);
+	}
+
+	void SetGraphicsRootSignature(ID3D12RootSignature *signature)
+	{
+		if (SetRootSignature(&graphics, signature))
+		{
+			if (stream) stream->SetGraphicsRootSignature(signature);
+			if (list)   list->SetGraphicsRootSignature(signature);
+		}
+	}
+
+	void SetComputeRootSignature(ID3D12RootSignature *signature)
+	{
+		if (SetRootSignature(&compute, signature))
+		{
+			if (stream) stream->SetComputeRootSignature(signature);
+			if (list)   list->SetComputeRootSignature(signature);
+		}
+	}
+
+	// Trims the range down to the values that changed. Returns false if none did.
+	bool SetRootConstants(D3D12_RootArguments *arguments, uint32_t parameter, uint32_t *count, const void **data, uint32_t *offset)
+	{
+		assert(parameter < g_max_root_parameters);
+		assert(*offset + *count <= g_max_root_constant_values);
+
+		const uint32_t *values = (const uint32_t *)*data;
+
+		uint32_t *shadow = arguments->constants[parameter];
+		uint64_t  valid  = arguments->constants_valid[parameter];
+
+		uint32_t first = *count;
+		uint32_t last  = 0;
+
+		for (uint32_t i = 0; i < *count; i++)
+		{
+			uint32_t value_index = *offset + i;
+
+			if (!(valid & (1ull << value_index)) || shadow[value_index] != values[i])
+			{
+				if (first == *count) first = i;
+				last = i;
+
+				shadow[value_index] = values[i];
+				valid |= 1ull << value_index;
+			}
+		}
+
+		arguments->constants_valid[parameter] = valid;
+
+		bool redundant = first == *count;
+
+		stats.root_constants += *count;
+
+		if (redundant)
+		{
+			stats.root_constants_filtered += *count;
+		}
+		else
+		{
+			stats.root_constants_filtered += *count - (last - first + 1);
+
+			*data    = values + first;
+			*offset += first;
+			*count   = last - first + 1;
+		}
+
+		return Filter(redundant);
+	}
+
+	void SetGraphicsRoot32BitConstants(uint32_t parameter, uint32_t count, const void *data, uint32_t offset)
+	{
+		if (SetRootConstants(&graphics, parameter, &count, &data, &offset))
+		{
+			if (stream) stream->SetGraphicsRoot32BitConstants(parameter, count, data, offset);
+			if (list)   list->SetGraphicsRoot32BitConstants(parameter, count, data, offset);
+		}
+	}
+
+	void SetComputeRoot32BitConstants(uint32_t parameter, uint32_t count, const void *data, uint32_t offset)
+	{
+		if (SetRootConstants(&compute, parameter, &count, &data, &offset))
+		{
+			if (stream) stream->SetComputeRoot32BitConstants(parameter, count, data, offset);
+			if (list)   list->SetComputeRoot32BitConstants(parameter, count, data, offset);
+		}
+	}
+
+	bool SetRootCBV(D3D12_RootArguments *arguments, uint32_t parameter, D3D12_GPU_VIRTUAL_ADDRESS address)
+	{
+		assert(parameter < g_max_root_parameters);
+
+		bool redundant = arguments->cbvs[parameter] == address;
+		arguments->cbvs[parameter] = address;
+
+		return Filter(redundant);
+	}
+
+	void SetGraphicsRootConstantBufferView(uint32_t parameter, D3D12_GPU_VIRTUAL_ADDRESS address)
+	{
+		if (SetRootCBV(&graphics, parameter, address))
+		{
+			if (stream) stream->SetGraphicsRootConstantBufferView(parameter, address);
+			if (list)   list->SetGraphicsRootConstantBufferView(parameter, address);
+		}
+	}
+
+	void SetComputeRootConstantBufferView(uint32_t parameter, D3D12_GPU_VIRTUAL_ADDRESS address)
+	{
+		if (SetRootCBV(&compute, parameter, address))
+		{
+			if (stream) stream->SetComputeRootConstantBufferView(parameter, address);
+			if (list)   list->SetComputeRootConstantBufferView(parameter, address);
+		}
+	}
+
+	void IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY in_topology)
+	{
+		bool redundant = topology == in_topology;
+		topology = in_topology;
+
+		if (Filter(redundant))
+		{
+			if (stream) stream->IASetPrimitiveTopology(in_topology);
+			if (list)   list->IASetPrimitiveTopology(in_topology);
+		}
+	}
+
+	void IASetIndexBuffer(const D3D12_INDEX_BUFFER_VIEW *view)
+	{
+		bool redundant = 
+			ibv.BufferLocation == view->BufferLocation &&
+			ibv.SizeInBytes    == view->SizeInBytes    &&
+			ibv.Format         == view->Format;
+
+		ibv = *view;
+
+		if (Filter(redundant))
+		{
+			if (stream) stream->IASetIndexBuffer(view);
+			if (list)   list->IASetIndexBuffer(view);
+		}
+	}
+
+	void RSSetViewports(uint32_t count, const D3D12_VIEWPORT *in_viewports)
+	{
+		assert(count <= ArrayCount(viewports));
+
+		bool redundant = viewport_count == count && memcmp(viewports, in_viewports, count*sizeof(*in_viewports)) == 0;
+
+		viewport_count = count;
+		memcpy(viewports, in_viewports, count*sizeof(*in_viewports));
+
+		if (Filter(redundant))
+		{
+			if (stream) stream->RSSetViewports(count, in_viewports);
+			if (list)   list->RSSetViewports(count, in_viewports);
+		}
+	}
+
+	void RSSetScissorRects(uint32_t count, const D3D12_RECT *in_scissors)
+	{
+		assert(count <= ArrayCount(scissors));
+
+		bool redundant = scissor_count == count && memcmp(scissors, in_scissors, count*sizeof(*in_scissors)) == 0;
+
+		scissor_count = count;
+		memcpy(scissors, in_scissors, count*sizeof(*in_scissors));
+
+		if (Filter(redundant))
+		{
+			if (stream) stream->RSSetScissorRects(count, in_scissors);
+			if (list)   list->RSSetScissorRects(count, in_scissors);
+		}
+	}
+
+	// Doesn't do the single handle to a descriptor range variant
+	void OMSetRenderTargets(uint32_t count, const D3D12_CPU_DESCRIPTOR_HANDLE *in_rtvs, const D3D12_CPU_DESCRIPTOR_HANDLE *in_dsv)
+	{
+		assert(count <= ArrayCount(rtvs));
+
+		D3D12_CPU_DESCRIPTOR_HANDLE new_dsv = in_dsv ? *in_dsv : D3D12_CPU_DESCRIPTOR_HANDLE{};
+
+		bool redundant = rtv_count == count && dsv.ptr == new_dsv.ptr;
+
+		for (uint32_t i = 0; redundant && i < count; i++)
+		{
+			redundant = rtvs[i].ptr == in_rtvs[i].ptr;
+		}
+
+		rtv_count = count;
+		dsv       = new_dsv;
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			rtvs[i] = in_rtvs[i];
+		}
+
+		if (Filter(redundant))
+		{
+			if (stream) stream->OMSetRenderTargets(count, in_rtvs, in_dsv);
+			if (list)   list->OMSetRenderTargets(count, in_rtvs, false, in_dsv);
+		}
+	}
+
+	//------------------------------------------------------------------------
+	// Passed straight through
+
+	void DrawIndexedInstanced(uint32_t index_count, uint32_t instance_count, uint32_t start_index, int32_t base_vertex, uint32_t start_instance)
+	{
+		stats.draws += 1;
+		if (stream) stream->DrawIndexedInstanced(index_count, instance_count, start_index, base_vertex, start_instance);
+		if (list)   list->DrawIndexedInstanced(index_count, instance_count, start_index, base_vertex, start_instance);
+	}
+
+	void Dispatch(uint32_t x, uint32_t y, uint32_t z)
+	{
+		stats.dispatches += 1;
+		if (stream) stream->Dispatch(x, y, z);
+		if (list)   list->Dispatch(x, y, z);
+	}
+
+	// The command signature may change root arguments, and what it leaves them as afterwards isn't
+	// defined, so they all have to be assumed stale
+	void ExecuteIndirect(ID3D12CommandSignature *signature, uint32_t max_count, ID3D12Resource *args, uint64_t args_offset, ID3D12Resource *count_buffer, uint64_t count_offset)
+	{
+		graphics.Invalidate();
+		compute .Invalidate();
+
+		stats.draws += 1;
+		if (stream) stream->ExecuteIndirect(signature, max_count, args, args_offset, count_buffer, count_offset);
+		if (list)   list->ExecuteIndirect(signature, max_count, args, args_offset, count_buffer, count_offset);
+	}
+
+	void ClearRenderTargetView(D3D12_CPU_DESCRIPTOR_HANDLE rtv, const float color[4])
+	{
+		if (stream) stream->ClearRenderTargetView(rtv, color);
+		if (list)   list->ClearRenderTargetView(rtv, color, 0, nullptr);
+	}
+
+	void CopyBufferRegion(ID3D12Resource *dst, uint64_t dst_offset, ID3D12Resource *src, uint64_t src_offset, uint64_t size)
+	{
+		if (stream) stream->CopyBufferRegion(dst, dst_offset, src, src_offset, size);
+		if (list)   list->CopyBufferRegion(dst, dst_offset, src, src_offset, size);
+	}
+
+	void CopyTextureRegion(const D3D12_TEXTURE_COPY_LOCATION *dst, const D3D12_TEXTURE_COPY_LOCATION *src)
+	{
+		if (stream) stream->CopyTextureRegion(dst, src);
+		if (list)   list->CopyTextureRegion(dst, 0, 0, 0, src, nullptr);
+	}
+
+	// Barriers don't touch any bound state
+	void ResourceBarrier(uint32_t count, const D3D12_RESOURCE_BARRIER *barriers)
+	{
+		if (stream) stream->ResourceBarrier(count, barriers);
+		if (list)   list->ResourceBarrier(count, barriers);
+	}
+
+	void DiscardResource(ID3D12Resource *resource)
+	{
+		if (stream) stream->DiscardResource(resource);
+		if (list)   list->DiscardResource(resource, nullptr);
+	}
+
+	void EndQuery(ID3D12QueryHeap *heap, D3D12_QUERY_TYPE type, uint32_t index)
+	{
+		if (stream) stream->EndQuery(heap, type, index);
+		if (list)   list->EndQuery(heap, type, index);
+	}
+
+	void ResolveQueryData(ID3D12QueryHeap *heap, D3D12_QUERY_TYPE type, uint32_t index, uint32_t count, ID3D12Resource *dst, uint64_t dst_offset)
+	{
+		if (stream) stream->ResolveQueryData(heap, type, index, count, dst, dst_offset);
+		if (list)   list->ResolveQueryData(heap, type, index, count, dst, dst_offset);
+	}
+};
+
+//------------------------------------------------------------------------
+
+// Resource state tracking
+//
+// Every tracked resource has its state recorded per subresource. Callers say what state they need a
+// resource in, and the tracker works out which barriers that takes, batching them up until Flush
+// issues them all in a single ResourceBarrier call. It knows about the implicit COMMON state
+// promotion and decay rules, so transitions the runtime does for us don't become barriers. Nothing
+// in here touches the device, so the state logic can be driven by hand.
+
+static constexpr D3D12_RESOURCE_STATES g_read_only_states =
+	D3D12_RESOURCE_STATE_VERTEX_AND_CONSTANT_BUFFER|
+	D3D12_RESOURCE_STATE_INDEX_BUFFER|
+	D3D12_RESOURCE_STATE_DEPTH_READ|
+	D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE|
+	D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE|
+	D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT|
+	D3D12_RESOURCE_STATE_COPY_SOURCE|
+	D3D12_RESOURCE_STATE_RESOLVE_SOURCE;
+
+bool D3D12_IsReadOnlyState(D3D12_RESOURCE_STATES state)
+{
+	return state != D3D12_RESOURCE_STATE_COMMON && (state & ~g_read_only_states) == 0;
+}
+
+bool D3D12_CanPromoteFromCommon(bool promotes_to_any, D3D12_RESOURCE_STATES state)
+{
+	if (promotes_to_any)
+	{
+		// buffers and simultaneous-access textures can be promoted to anything
+		return true;
+	}
+
+	D3D12_RESOURCE_STATES promotable =
+		D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE|
+		D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE|
+		D3D12_RESOURCE_STATE_COPY_DEST|
+		D3D12_RESOURCE_STATE_COPY_SOURCE;
+
+	return (state & ~promotable) == 0;
+}
+
+uint32_t D3D12_GetSubresourceCount(const D3D12_RESOURCE_DESC *desc)
+{
+	if (desc->Dimension == D3D12_RESOURCE_DIMENSION_BUFFER ||
+		desc->Dimension == D3D12_RESOURCE_DIMENSION_TEXTURE3D)
+	{
+		return desc->MipLevels > 0 ? desc->MipLevels : 1;
+	}
+
+	return (desc->MipLevels > 0 ? desc->MipLevels : 1)*desc->DepthOrArraySize;
+}
+
+//------------------------------------------------------------------------
+
+struct D3D12_SubresourceState
+{
+	D3D12_RESOURCE_STATES state;
+	bool                  promoted; // implicitly promoted out of COMMON since the last decay
+};
+
+enum D3D12_TransitionResult
+{
+	D3D12_TransitionResult_redundant, // already in the desired state
+	D3D12_TransitionResult_promoted,  // the runtime promotes it implicitly, no barrier needed
+	D3D12_TransitionResult_barrier,   // needs an explicit barrier from *before
+};
+
+// Works out what it takes to get a subresource into the desired state and updates it
+D3D12_TransitionResult D3D12_ResolveTransition(
+	bool                    promotes_to_any,
+	D3D12_SubresourceState *sub,
+	D3D12_RESOURCE_STATES   desired,
+	D3D12_RESOURCE_STATES  *before)
+{
+	D3D12_RESOURCE_STATES current = sub->state;
+
+	if (current == desired)
+	{
+		return D3D12_TransitionResult_redundant;
+	}
+
+	// already in a combined read state that covers what we need
+	if (D3D12_IsReadOnlyState(current) && D3D12_IsReadOnlyState(desired) && (current & desired) == desired)
+	{
+		return D3D12_TransitionResult_redundant;
+	}
+
+	if (current == D3D12_RESOURCE_STATE_COMMON && D3D12_CanPromoteFromCommon(promotes_to_any, desired))
+	{
+		sub->state    = desired;
+		sub->promoted = true;
+
+		return D3D12_TransitionResult_promoted;
+	}
+
+	// once promoted to a read state, further read states are promoted into as well
+	if (sub->promoted && 
+		D3D12_IsReadOnlyState(current) && 
+		D3D12_IsReadOnlyState(desired) && 
+		D3D12_CanPromoteFromCommon(promotes_to_any, desired))
+	{
+		sub->state = current|desired;
+
+		return D3D12_TransitionResult_promoted;
+	}
+
+	*before = current;
+
+	sub->state    = desired;
+	sub->promoted = false;
+
+	return D3D12_TransitionResult_barrier;
+}
+
+//------------------------------------------------------------------------
+
+struct D3D12_TrackedResource
+{
+	ID3D12Resource         *resource;
+	uint32_t                subresource_count;
+	bool                    promotes_to_any; // buffers and simultaneous-access textures
+	D3D12_SubresourceState *subresources;
+};
+
+struct D3D12_StateTrackerStats
+{
+	uint64_t transitions_requested;
+	uint64_t transitions_redundant;
+	uint64_t transitions_promoted;
+	uint64_t barriers_merged;
+	uint64_t barriers_issued;
+	uint64_t flushes;
+};
+
+struct D3D12_StateTracker
+{
+	D3D12_TrackedResource *records;
+	uint32_t               capacity; // power of 2, linear probing
+	uint32_t               count;
+
+	D3D12_RESOURCE_BARRIER *pending;
+	uint32_t                pending_count;
+	uint32_t                pending_capacity;
+
+	D3D12_StateTrackerStats stats;
+
+	void Init(uint32_t max_resources)
+	{
+		capacity = 1;
+		while (capacity < 2*max_resources)
+		{
+			capacity *= 2;
+		}
+
+		records = (D3D12_TrackedResource *)calloc(capacity, sizeof(D3D12_TrackedResource));
+		count   = 0;
+
+		pending_capacity = 64;
+		pending_count    = 0;
+		pending          = (D3D12_RESOURCE_BARRIER *)malloc(sizeof(D3D12_RESOURCE_BARRIER)*pending_capacity);
+
+		ZeroStruct(&stats);
+	}
+
+	void Register(ID3D12Resource *resource, uint32_t subresource_count, D3D12_RESOURCE_STATES initial_state, bool promotes_to_any)
+	{
+		assert(resource);
+		assert(2*(count + 1) <= capacity || !"Too many tracked resources, bump max_resources");
+		assert(!Find(resource) || !"This resource is already being tracked");
+
+		uint32_t mask = capacity - 1;
+		uint32_t slot = (uint32_t)HashBytes(&resource, sizeof(resource)) & mask;
+
+		while (records[slot].resource)
+		{
+			slot = (slot + 1) & mask;
+		}
+
+		D3D12_TrackedResource *record = &records[slot];
+		record->resource          = resource;
+		record->subresource_count = subresource_count;
+		record->promotes_to_any   = promotes_to_any;
+		record->subresources      = (D3D12_SubresourceState *)malloc(sizeof(D3D12_SubresourceState)*subresource_count);
+
+		for (uint32_t i = 0; i < subresource_count; i++)
+		{
+			record->subresources[i] = { .state = initial_state, .promoted = false };
+		}
+
+		count += 1;
+	}
+
+	void Unregister(ID3D12Resource *resource)
+	{
+		D3D12_TrackedResource *record = Find(resource);
+		assert(record || !"Unregistering a resource that was never registered");
+
+		free(record->subresources);
+		ZeroStruct(record);
+
+		count -= 1;
+
+		// backward shift deletion, so lookups never have to step over tombstones
+		uint32_t mask = capacity - 1;
+		uint32_t hole = (uint32_t)(record - records);
+
+		for (uint32_t slot = (hole + 1) & mask; records[slot].resource; slot = (slot + 1) & mask)
+		{
+			uint32_t home = (uint32_t)HashBytes(&records[slot].resource, sizeof(ID3D12Resource *)) & mask;
+
+			// leave the record be if its home slot lies cyclically in (hole, slot]
+			bool stays = hole <= slot ? (hole < home && home <= slot) : (hole < home || home <= slot);
+
+			if (!stays)
+			{
+				records[hole] = records[slot];
+				ZeroStruct(&records[slot]);
+				hole = slot;
+			}
+		}
+	}
+
+	D3D12_TrackedResource *Find(ID3D12Resource *resource)
+	{
+		uint32_t mask = capacity - 1;
+
+		for (uint32_t slot = (uint32_t)HashBytes(&resource, sizeof(resource)) & mask; records[slot].resource; slot = (slot + 1) & mask)
+		{
+			if (records[slot].resource == resource)
+			{
+				return &records[slot];
+			}
+		}
+
+		return nullptr;
+	}
+
+	D3D12_RESOURCE_STATES GetState(ID3D12Resource *resource, uint32_t subresource = 0)
+	{
+		D3D12_TrackedResource *record = Find(resource);
+		assert(record && subresource < record->subresource_count);
+
+		return record->subresources[subresource].state;
+	}
+
+	// Pass D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES to transition the whole resource
+	void Transition(ID3D12Resource *resource, uint32_t subresource, D3D12_RESOURCE_STATES desired)
+	{
+		D3D12_TrackedResource *record = Find(resource);
+		assert(record || !"Transitioning a resource that isn't tracked, call Register first");
+
+		stats.transitions_requested += 1;
+
+		if (subresource != D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES)
+		{
+			assert(subresource < record->subresource_count);
+			TransitionSubresource(record, subresource, desired, subresource);
+			return;
+		}
+
+		bool uniform = true;
+
+		for (uint32_t i = 1; i < record->subresource_count; i++)
+		{
+			if (record->subresources[i].state    != record->subresources[0].state ||
+				record->subresources[i].promoted != record->subresources[0].promoted)
+			{
+				uniform = false;
+				break;
+			}
+		}
+
+		// a whole resource barrier can't be folded into ones already waiting for single subresources
+		if (uniform && !HasPendingSubresourceBarrier(record->resource))
+		{
+			// resolve once, and if that took a barrier issue it for all subresources at once
+			TransitionSubresource(record, 0, desired, D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES);
+
+			for (uint32_t i = 1; i < record->subresource_count; i++)
+			{
+				record->subresources[i] = record->subresources[0];
+			}
+		}
+		else
+		{
+			for (uint32_t i = 0; i < record->subresource_count; i++)
+			{
+				TransitionSubresource(record, i, desired, i);
+			}
+		}
+	}
+
+	void TransitionSubresource(D3D12_TrackedResource *record, uint32_t state_index, D3D12_RESOURCE_STATES desired, uint32_t barrier_subresource)
+	{
+		D3D12_SubresourceState *sub = &record->subresources[state_index];
+
+		D3D12_RESOURCE_STATES before = D3D12_RESOURCE_STATE_COMMON;
+
+		switch (D3D12_ResolveTransition(record->promotes_to_any, sub, desired, &before))
+		{
+			case D3D12_TransitionResult_redundant: stats.transitions_redundant += 1; return;
+			case D3D12_TransitionResult_promoted:  stats.transitions_promoted  += 1; return;
+			case D3D12_TransitionResult_barrier:   break;
+		}
+
+		if (barrier_subresource != D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES)
+		{
+			SplitPendingBarrier(record);
+		}
+
+		// if this subresource already has a barrier waiting, fold the two into one
+		for (uint32_t i = 0; i < pending_count; i++)
+		{
+			D3D12_RESOURCE_TRANSITION_BARRIER *transition = &pending[i].Transition;
+
+			if (transition->pResource   == record->resource &&
+				transition->Subresource == barrier_subresource)
+			{
+				stats.barriers_merged += 1;
+
+				transition->StateAfter = desired;
+
+				if (transition->StateBefore == transition->StateAfter)
+				{
+					pending[i] = pending[--pending_count];
+				}
+
+				return;
+			}
+		}
+
+		AddPendingBarrier(record->resource, barrier_subresource, before, desired);
+	}
+
+	void AddPendingBarrier(ID3D12Resource *resource, uint32_t subresource, D3D12_RESOURCE_STATES before, D3D12_RESOURCE_STATES after)
+	{
+		if (pending_count == pending_capacity)
+		{
+			pending_capacity *= 2;
+			pending = (D3D12_RESOURCE_BARRIER *)realloc(pending, sizeof(D3D12_RESOURCE_BARRIER)*pending_capacity);
+		}
+
+		pending[pending_count++] = {
+			.Type  = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION,
+			.Flags = D3D12_RESOURCE_BARRIER_FLAG_NONE,
+			.Transition = {
+				.pResource   = resource,
+				.Subresource = subresource,
+				.StateBefore = before,
+				.StateAfter  = after,
+			},
+		};
+	}
+
+	bool HasPendingSubresourceBarrier(ID3D12Resource *resource)
+	{
+		for (uint32_t i = 0; i < pending_count; i++)
+		{
+			if (pending[i].Transition.pResource   == resource &&
+				pending[i].Transition.Subresource != D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES)
+			{
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	// Before a single subresource takes a barrier, one still waiting for the whole resource is split
+	// into one per subresource, so the single one has something to fold into. There's at most one,
+	// since whole resource barriers fold into each other.
+	void SplitPendingBarrier(D3D12_TrackedResource *record)
+	{
+		for (uint32_t i = 0; i < pending_count; i++)
+		{
+			D3D12_RESOURCE_TRANSITION_BARRIER whole = pending[i].Transition;
+
+			if (whole.pResource   == record->resource &&
+				whole.Subresource == D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES)
+			{
+				pending[i] = pending[--pending_count];
+
+				for (uint32_t sub = 0; sub < record->subresource_count; sub++)
+				{
+					AddPendingBarrier(whole.pResource, sub, whole.StateBefore, whole.StateAfter);
+				}
+
+				return;
+			}
+		}
+	}
+
+	void Flush(D3D12_CommandList *list)
+	{
+		if (pending_count > 0)
+		{
+			list->ResourceBarrier(pending_count, pending);
+
+			stats.barriers_issued += pending_count;
+			stats.flushes         += 1;
+
+			pending_count = 0;
+		}
+	}
+
+	// Call after ExecuteCommandLists: buffers, simultaneous-access textures and anything that was
+	// promoted to a read-only state decay back to COMMON once the GPU is done with the lists.
+	void Decay()
+	{
+		assert(pending_count == 0 || !"Decaying with barriers still pending, did you forget to Flush?");
+
+		for (uint32_t slot = 0; slot < capacity; slot++)
+		{
+			D3D12_TrackedResource *record = &records[slot];
+
+			if (!record->resource)
+			{
+				continue;
+			}
+
+			for (uint32_t i = 0; i < record->subresource_count; i++)
+			{
+				D3D12_SubresourceState *sub = &record->subresources[i];
+
+				if (record->promotes_to_any || (sub->promoted && D3D12_IsReadOnlyState(sub->state)))
+				{
+					sub->state = D3D12_RESOURCE_STATE_COMMON;
+				}
+
+				sub->promoted = false;
+			}
+		}
+	}
+
+	void Release()
+	{
+		for (uint32_t slot = 0; slot < capacity; slot++)
+		{
+			free(records[slot].subresources);
+		}
+
+		free(records);
+		free(pending);
+		ZeroStruct(this);
+	}
+};
+
+//------------------------------------------------------------------------
+// Split barrier scheduling
+//
+// When the passes of a frame are known up front, a transition doesn't have to wait until right
+// before the pass that needs it. It can begin (D3D12_RESOURCE_BARRIER_FLAG_BEGIN_ONLY) as soon as
+// the last pass touching the resource is done, and end (END_ONLY) just before the next one, which
+// gives the GPU the passes in between to overlap the transition with.
+//
+// Usage: Begin, then AddPass/AddAccess for every pass in execution order, then Compile against the
+// state tracker. While recording, call Issue(pass_index) right before each pass.
+//
+// Both halves of a split barrier have to be on the same command list. Whoever closes a list partway
+// through the passes (D3D12_RecordParallel) calls EndSplitBarriers on it first, which ends whatever
+// has begun early, and Issue then skips those END_ONLYs.
+
+struct D3D12_PlannedAccess
+{
+	ID3D12Resource       *resource;
+	uint32_t              subresource; // or D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES
+	D3D12_RESOURCE_STATES state;
+	uint32_t              pass_index;
+	bool                  allow_early_begin;
+};
+
+struct D3D12_PlannedPass
+{
+	uint32_t work; // draws, dispatches, whatever gives a feel for how much GPU time the pass takes
+
+	uint32_t first_barrier;
+	uint32_t barrier_count;
+};
+
+struct D3D12_BarrierScheduleStats
+{
+	uint32_t split_barriers;
+	uint32_t regular_barriers;
+	uint32_t passes_overlapped;  // passes sitting between a BEGIN_ONLY and its END_ONLY, summed
+	uint64_t work_overlapped;    // the work of those passes, summed
+	uint32_t splits_ended_early; // by EndSplitBarriers, because the list they began on was closed
+};
+
+struct D3D12_BarrierScheduler
+{
+	D3D12_PlannedPass *passes;
+	uint32_t           pass_count;
+	uint32_t           pass_capacity;
+
+	D3D12_PlannedAccess *accesses;
+	uint32_t             access_count;
+	uint32_t             access_capacity;
+
+	// barriers are sorted by the pass they're issued before once Compile is done
+	D3D12_RESOURCE_BARRIER *barriers;
+	uint32_t               *barrier_slots;
+	uint32_t                barrier_count;
+	uint32_t                barrier_capacity;
+
+	// Grow along with barriers. Scratch is where Compile sorts into and Issue filters into, the open
+	// splits are BEGIN_ONLYs issued on the current list that haven't ended yet.
+	D3D12_RESOURCE_BARRIER *scratch;
+	D3D12_RESOURCE_BARRIER *open_splits;
+	uint32_t                open_split_count;
+
+	D3D12_BarrierScheduleStats stats;
+
+	void Init()
+	{
+		ZeroStruct(this);
+	}
+
+	void Begin()
+	{
+		assert(open_split_count == 0 || !"The last schedule left split barriers open");
+
+		pass_count       = 0;
+		access_count     = 0;
+		barrier_count    = 0;
+		open_split_count = 0;
+
+		ZeroStruct(&stats);
+	}
+
+	uint32_t AddPass(uint32_t work)
+	{
+		if (pass_count == pass_capacity)
+		{
+			pass_capacity = pass_capacity ? 2*pass_capacity : 16;
+			passes = (D3D12_PlannedPass *)realloc(passes, sizeof(D3D12_PlannedPass)*pass_capacity);
+		}
+
+		uint32_t index = pass_count++;
+
+		passes[index] = {
+			.work = work,
+		};
+
+		return index;
+	}
+
+	// Adds an access to the most recently added pass. A pass can only access a given subresource in one
+	// state, so OR together read states if a pass reads a resource in multiple ways. If the resource
+	// isn't accessed by an earlier pass in the plan its transition may begin at the start of the frame,
+	// unless allow_early_begin is false (e.g. for aliased memory that is still in use by someone else).
+	void AddAccess(ID3D12Resource *resource, uint32_t subresource, D3D12_RESOURCE_STATES state, bool allow_early_begin = true)
+	{
+		assert(pass_count > 0 || !"Call AddPass before adding accesses to it");
+
+		if (access_count == access_capacity)
+		{
+			access_capacity = access_capacity ? 2*access_capacity : 64;
+			accesses = (D3D12_PlannedAccess *)realloc(accesses, sizeof(D3D12_PlannedAccess)*access_capacity);
+		}
+
+		accesses[access_count++] = {
+			.resource          = resource,
+			.subresource       = subresource,
+			.state             = state,
+			.pass_index        = pass_count - 1,
+			.allow_early_begin = allow_early_begin,
+		};
+	}
+
+	// Works out the barriers for the planned passes, starting from the states in the tracker, and leaves
+	// the tracker in the state it will be in once all passes have been recorded.
+	void Compile(D3D12_StateTracker *tracker)
+	{
+		assert(tracker->pending_count == 0 || !"Flush the state tracker before compiling a barrier schedule");
+
+		for (uint32_t access_index = 0; access_index < access_count; access_index++)
+		{
+			D3D12_PlannedAccess *access = &accesses[access_index];
+
+			D3D12_TrackedResource *record = tracker->Find(access->resource);
+			assert(record || !"Planned access to a resource that isn't tracked");
+
+			//------------------------------------------------------------------------
+			// Find the last pass before this one touching the same resource; the transition can start
+			// right after it. Plans are a handful of passes, so a backwards scan is plenty.
+
+			int32_t last_pass = -1;
+
+			for (uint32_t i = access_index; i-- > 0;)
+			{
+				D3D12_PlannedAccess *other = &accesses[i];
+
+				bool overlaps = other->resource == access->resource &&
+					(other->subresource == access->subresource ||
+					 other->subresource == D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES ||
+					 access->subresource == D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES);
+
+				if (overlaps)
+				{
+					assert(other->pass_index != access->pass_index || !"A pass can only access a subresource in one state");
+
+					last_pass = (int32_t)other->pass_index;
+					break;
+				}
+			}
+
+			uint32_t begin_slot = (uint32_t)(last_pass + 1);
+			uint32_t end_slot   = access->pass_index;
+
+			if (last_pass == -1 && !access->allow_early_begin)
+			{
+				begin_slot = end_slot;
+			}
+
+			//------------------------------------------------------------------------
+			// Resolve the transition per subresource, or once for the whole resource if its subresources all
+			// agree on their state
+
+			bool uniform = true;
+
+			if (access->subresource == D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES)
+			{
+				for (uint32_t i = 1; i < record->subresource_count; i++)
+				{
+					if (record->subresources[i].state    != record->subresources[0].state ||
+						record->subresources[i].promoted != record->subresources[0].promoted)
+					{
+						uniform = false;
+						break;
+					}
+				}
+			}
+
+			uint32_t first_sub = access->subresource;
+			uint32_t sub_count = 1;
+
+			if (access->subresource == D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES)
+			{
+				first_sub = 0;
+				sub_count = uniform ? 1 : record->subresource_count;
+			}
+
+			for (uint32_t sub = first_sub; sub < first_sub + sub_count; sub++)
+			{
+				uint32_t barrier_sub = (access->subresource == D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES && uniform) ? 
+					D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES : sub;
+
+				D3D12_RESOURCE_STATES before = D3D12_RESOURCE_STATE_COMMON;
+
+				if (D3D12_ResolveTransition(record->promotes_to_any, &record->subresources[sub], access->state, &before) != D3D12_TransitionResult_barrier)
+				{
+					continue;
+				}
+
+				D3D12_RESOURCE_BARRIER barrier = {
+					.Type  = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION,
+					.Flags = D3D12_RESOURCE_BARRIER_FLAG_NONE,
+					.Transition = {
+						.pResource   = access->resource,
+						.Subresource = barrier_sub,
+						.StateBefore = before,
+						.StateAfter  = access->state,
+					},
+				};
+
+				if (begin_slot < end_slot)
+				{
+					barrier.Flags = D3D12_RESOURCE_BARRIER_FLAG_BEGIN_ONLY;
+					PushBarrier(begin_slot, barrier);
+
+					barrier.Flags = D3D12_RESOURCE_BARRIER_FLAG_END_ONLY;
+					PushBarrier(end_slot, barrier);
+
+					stats.split_barriers    += 1;
+					stats.passes_overlapped += end_slot - begin_slot;
+
+					for (uint32_t pass_index = begin_slot; pass_index < end_slot; pass_index++)
+					{
+						stats.work_overlapped += passes[pass_index].work;
+					}
+				}
+				else
+				{
+					PushBarrier(end_slot, barrier);
+
+					stats.regular_barriers += 1;
+				}
+			}
+
+			if (access->subresource == D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES && uniform)
+			{
+				for (uint32_t i = 1; i < record->subresource_count; i++)
+				{
+					record->subresources[i] = record->subresources[0];
+				}
+			}
+		}
+
+		//------------------------------------------------------------------------
+		// Counting sort the barriers by the pass they go in front of. The sort is stable, which keeps
+		// the BEGIN_ONLY half of a split barrier in front of anything else touching it in the same slot.
+
+		for (uint32_t pass_index = 0; pass_index < pass_count; pass_index++)
+		{
+			passes[pass_index].barrier_count = 0;
+		}
+
+		for (uint32_t i = 0; i < barrier_count; i++)
+		{
+			passes[barrier_slots[i]].barrier_count += 1;
+		}
+
+		uint32_t at = 0;
+
+		for (uint32_t pass_index = 0; pass_index < pass_count; pass_index++)
+		{
+			passes[pass_index].first_barrier = at;
+			at += passes[pass_index].barrier_count;
+		}
+
+		for (uint32_t pass_index = 0; pass_index < pass_count; pass_index++)
+		{
+			passes[pass_index].barrier_count = 0;
+		}
+
+		for (uint32_t i = 0; i < barrier_count; i++)
+		{
+			D3D12_PlannedPass *pass = &passes[barrier_slots[i]];
+			scratch[pass->first_barrier + pass->barrier_count++] = barriers[i];
+		}
+
+		D3D12_RESOURCE_BARRIER *sorted = scratch;
+
+		scratch  = barriers;
+		barriers = sorted;
+	}
+
+	void PushBarrier(uint32_t slot, const D3D12_RESOURCE_BARRIER &barrier)
+	{
+		if (barrier_count == barrier_capacity)
+		{
+			barrier_capacity = barrier_capacity ? 2*barrier_capacity : 64;
+			barriers      = (D3D12_RESOURCE_BARRIER *)realloc(barriers,      sizeof(D3D12_RESOURCE_BARRIER)*barrier_capacity);
+			barrier_slots = (uint32_t *)              realloc(barrier_slots, sizeof(uint32_t)*barrier_capacity);
+			scratch       = (D3D12_RESOURCE_BARRIER *)realloc(scratch,       sizeof(D3D12_RESOURCE_BARRIER)*barrier_capacity);
+			open_splits   = (D3D12_RESOURCE_BARRIER *)realloc(open_splits,   sizeof(D3D12_RESOURCE_BARRIER)*barrier_capacity);
+		}
+
+		barriers     [barrier_count] = barrier;
+		barrier_slots[barrier_count] = slot;
+		barrier_count += 1;
+	}
+
+	static bool IsSameTransition(const D3D12_RESOURCE_BARRIER &a, const D3D12_RESOURCE_BARRIER &b)
+	{
+		return a.Transition.pResource   == b.Transition.pResource   &&
+			   a.Transition.Subresource == b.Transition.Subresource &&
+			   a.Transition.StateBefore == b.Transition.StateBefore &&
+			   a.Transition.StateAfter  == b.Transition.StateAfter;
+	}
+
+	// Issues the barriers that go in front of the given pass, minus the END_ONLYs of splits that were
+	// already ended by EndSplitBarriers
+	void Issue(uint32_t pass_index, D3D12_CommandList *list)
+	{
+		D3D12_PlannedPass *pass = &passes[pass_index];
+
+		uint32_t count = 0;
+
+		for (uint32_t i = pass->first_barrier; i < pass->first_barrier + pass->barrier_count; i++)
+		{
+			const D3D12_RESOURCE_BARRIER &barrier = barriers[i];
+
+			if (barrier.Flags == D3D12_RESOURCE_BARRIER_FLAG_BEGIN_ONLY)
+			{
+				open_splits[open_split_count++] = barrier;
+			}
+			else if (barrier.Flags == D3D12_RESOURCE_BARRIER_FLAG_END_ONLY)
+			{
+				uint32_t open = 0;
+				while (open < open_split_count && !IsSameTransition(open_splits[open], barrier)) open++;
+
+				if (open == open_split_count)
+				{
+					continue;
+				}
+
+				open_splits[open] = open_splits[--open_split_count];
+			}
+
+			scratch[count++] = barrier;
+		}
+
+		if (count > 0)
+		{
+			list->ResourceBarrier(count, scratch);
+		}
+	}
+
+	// Ends every split barrier begun on the list, call before closing it partway through the passes
+	void EndSplitBarriers(D3D12_CommandList *list)
+	{
+		if (open_split_count == 0)
+		{
+			return;
+		}
+
+		for (uint32_t i = 0; i < open_split_count; i++)
+		{
+			open_splits[i].Flags = D3D12_RESOURCE_BARRIER_FLAG_END_ONLY;
+		}
+
+		list->ResourceBarrier(open_split_count, open_splits);
+
+		stats.splits_ended_early += open_split_count;
+		open_split_count = 0;
+	}
+
+	void Release()
+	{
+		free(passes);
+		free(accesses);
+		free(barriers);
+		free(barrier_slots);
+		free(scratch);
+		free(open_splits);
+		ZeroStruct(this);
+	}
+};
+
+//------------------------------------------------------------------------
+
+struct D3D12_BufferAllocation
+{
+	ID3D12Resource           *buffer;
+	void                     *cpu_base;
+	D3D12_GPU_VIRTUAL_ADDRESS gpu_base;
+	uint32_t                  offset;
+};
+
+struct D3D12_LinearAllocator
+{
+	ID3D12Device             *device;
+	ID3D12Resource           *buffer;
+	char                     *cpu_base;
+	D3D12_GPU_VIRTUAL_ADDRESS gpu_base;
+	uint32_t                  at;
+	uint32_t                  capacity;
+
+	// Buffers outgrown since the last reset. Allocations made from them are still in use until then.
+	ID3D12Resource *outgrown[8];
+	uint32_t        outgrown_count;
+
+	void Init(ID3D12Device *in_device, uint32_t size)
+	{
+		device         = in_device;
+		outgrown_count = 0;
+
+		CreateAndMap(size);
+	}
+
+	void CreateAndMap(uint32_t size)
+	{
+		buffer = D3D12_CreateUploadBuffer(device, size, L"Frame Allocator");
+
+		void *mapped;
+
+		D3D12_RANGE null_range = {};
+		HRESULT hr = buffer->Map(0, &null_range, &mapped);
+		CHECK_HR(hr);
+
+		cpu_base = (char *)mapped;
+		gpu_base = buffer->GetGPUVirtualAddress();
+		at       = 0;
+		capacity = size;
+	}
+
+	D3D12_BufferAllocation Allocate(uint32_t size, uint32_t align)
+	{
+		uint32_t at_aligned = AlignUp(at, align);
+
+		if (at_aligned + size > capacity)
+		{
+			// Carry on in a bigger buffer, the old one has to stick around until the GPU is done with what's
+			// already been handed out from it
+			assert(outgrown_count < ArrayCount(outgrown) || !"Frame allocator outgrown too often in one frame");
+
+			outgrown[outgrown_count++] = buffer;
+			buffer->Unmap(0, nullptr);
+
+			uint32_t new_capacity = 2*capacity;
+			while (new_capacity < size + align) new_capacity *= 2;
+
+			CreateAndMap(new_capacity);
+
+			at_aligned = AlignUp(at, align);
+		}
+
+		D3D12_BufferAllocation result = {
+			.buffer   = buffer,
+			.cpu_base = cpu_base + at_aligned,
+			.gpu_base = gpu_base + at_aligned,
+			.offset   = at_aligned,
+		};
+
+		at = at_aligned + size;
+
+		return result;
+	}
+
+	static uint32_t AlignUp(uint32_t value, uint32_t align)
+	{
+		if ((align & (align - 1)) == 0)
+		{
+			// evil bit hack: round up to the next multiple of `align` so long as `align` is a power of 2
+			return (value + (align - 1)) & (-(int32_t)align);
+		}
+		else
+		{
+			// structured buffer views have to start on a multiple of their stride, which needn't be a power of 2
+			return (value + (align - 1)) / align * align;
+		}
+	}
+
+	// Only once the GPU is done with everything allocated since the last reset
+	void Reset()
+	{
+		for (uint32_t i = 0; i < outgrown_count; i++)
+		{
+			outgrown[i]->Release();
+		}
+
+		outgrown_count = 0;
+		at             = 0;
+	}
+
+	void Release()
+	{
+		Reset();
+
+		buffer->Unmap(0, nullptr);
+		buffer->Release();
+		ZeroStruct(this);
+	}
+};
+
+//------------------------------------------------------------------------
+// Texture creation
+
+ID3D12Resource *D3D12_CreateTexture(
+	ID3D12Device              *device,
+	D3D12_StateTracker        *state_tracker,
+	uint32_t                   width,
+	uint32_t                   height,
+	const wchar_t             *debug_name,
+	const void                *initial_data = nullptr,
+	D3D12_CommandList         *command_list = nullptr,
+	D3D12_LinearAllocator     *allocator    = nullptr)
+{
+	CPU_SCOPE("D3D12_CreateTexture");
+
+	D3D12_HEAP_PROPERTIES heap_properties = {
+		.Type = D3D12_HEAP_TYPE_DEFAULT,
+	};
+
+	D3D12_RESOURCE_DESC desc = {
+		.Dimension        = D3D12_RESOURCE_DIMENSION_TEXTURE2D,
+		.Width            = width,
+		.Height           = height,
+		.DepthOrArraySize = 1,
+		.MipLevels        = 1,
+		.Format           = DXGI_FORMAT_B8G8R8A8_UNORM_SRGB,
+		.SampleDesc       = { .Count = 1, .Quality = 0 },
+		.Layout           = D3D12_TEXTURE_LAYOUT_UNKNOWN,
+	};
+
+	ID3D12Resource *result;
+	HRESULT hr = device->CreateCommittedResource(
+		&heap_properties,
+		D3D12_HEAP_FLAG_NONE,
+		&desc,
+		D3D12_RESOURCE_STATE_COMMON,
+		nullptr,
+		IID_PPV_ARGS(&result));
+
+	CHECK_HR(hr);
+
+	result->SetName(debug_name);
+
+	state_tracker->Register(result, D3D12_GetSubresourceCount(&desc), D3D12_RESOURCE_STATE_COMMON, false);
+
+	if (initial_data)
+	{
+		assert(allocator    || !"If you want to provide the texture with initial data, we need an allocator with an upload heap");
+		assert(command_list || !"If you want to provide the texture with initial data, we need a command list to issue a copy on");
+
+		// Figure out the required layout of the texture
+		uint64_t dst_size;
+		D3D12_PLACED_SUBRESOURCE_FOOTPRINT dst_layout;
+		device->GetCopyableFootprints(&desc, 0, 1, 0, &dst_layout, nullptr, nullptr, &dst_size);
+
+		// Create an upload heap allocation to serve as the copy source
+		D3D12_BufferAllocation dst_alloc = allocator->Allocate((uint32_t)dst_size, D3D12_TEXTURE_DATA_PLACEMENT_ALIGNMENT);
+
+		size_t src_stride = sizeof(uint32_t)*width;
+		size_t dst_stride = dst_layout.Footprint.RowPitch;
+
+		// copy the texture data to the upload heap
+		char *src = (char *)initial_data;
+		char *dst = (char *)dst_alloc.cpu_base;
+
+		for (size_t y = 0; y < height; y++)
+		{
+			memcpy(dst, src, sizeof(uint32_t)*width);
+
+			src += src_stride;
+			dst += dst_stride;
+		}
+
+		// issue the copy to the texture on the command list
+		D3D12_TEXTURE_COPY_LOCATION src_loc = {
+			.pResource = dst_alloc.buffer,
+			.Type      = D3D12_TEXTURE_COPY_TYPE_PLACED_FOOTPRINT,
+			.PlacedFootprint = {
+				.Offset    = dst_alloc.offset,
+				.Footprint = dst_layout.Footprint,
+			},
+		};
+
+		D3D12_TEXTURE_COPY_LOCATION dst_loc = {
+			.pResource        = result,
+			.Type             = D3D12_TEXTURE_COPY_TYPE_SUBRESOURCE_INDEX,
+			.SubresourceIndex = 0,
+		};
+
+		// COMMON -> COPY_DEST is an implicit promotion, so this won't actually issue a barrier
+		state_tracker->Transition(result, 0, D3D12_RESOURCE_STATE_COPY_DEST);
+		state_tracker->Flush(command_list);
+
+		command_list->CopyTextureRegion(&dst_loc, &src_loc);
+
+		state_tracker->Transition(result, 0, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE);
+		state_tracker->Flush(command_list);
+	}
+
+	return result;
+}
+
+//------------------------------------------------------------------------
+
+struct D3D12_Descriptor
+{
+	D3D12_CPU_DESCRIPTOR_HANDLE cpu;
+	D3D12_GPU_DESCRIPTOR_HANDLE gpu;
+	uint32_t                    index;
+};
+
+struct D3D12_DescriptorAllocator
+{
+	ID3D12DescriptorHeap       *heap;
+	D3D12_DESCRIPTOR_HEAP_TYPE  type;
+	D3D12_CPU_DESCRIPTOR_HANDLE cpu_base;
+	D3D12_GPU_DESCRIPTOR_HANDLE gpu_base;
+	uint32_t                    stride;
+	uint32_t                    at;
+	uint32_t                    capacity;
+
+	// descriptors handed back through Free get recycled before we bump `at`
+	uint32_t                   *free_indices;
+	uint32_t                    free_count;
+
+	void Init(ID3D12Device *device, D3D12_DESCRIPTOR_HEAP_TYPE in_type, uint32_t in_capacity, bool shader_visible, const wchar_t *debug_name)
+	{
+		D3D12_DESCRIPTOR_HEAP_DESC desc = {
+			.Type           = in_type,
+			.NumDescriptors = in_capacity,
+			.Flags          = shader_visible ? D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE : D3D12_DESCRIPTOR_HEAP_FLAG_NONE,
+		};
+
+		HRESULT hr;
+
+		hr = device->CreateDescriptorHeap(&desc, IID_PPV_ARGS(&heap));
+		CHECK_HR(hr);
+
+		heap->SetName(debug_name);
+
+		cpu_base = heap->GetCPUDescriptorHandleForHeapStart();
+
+		if (shader_visible)
+		{
+			gpu_base = heap->GetGPUDescriptorHandleForHeapStart();
+		}
+
+		stride = device->GetDescriptorHandleIncrementSize(in_type);
+
+		type     = in_type;
+		at       = 0;
+		capacity = in_capacity;
+
+		free_indices = (uint32_t *)malloc(sizeof(uint32_t)*in_capacity);
+		free_count   = 0;
+	}
+
+	D3D12_Descriptor Allocate()
+	{
+		uint32_t index;
+
+		if (free_count > 0)
+		{
+			index = free_indices[--free_count];
+		}
+		else
+		{
+			assert(at < capacity);
+			index = at++;
+		}
+
+		D3D12_Descriptor result = {
+			.cpu   = { cpu_base.ptr + stride*index },
+			.gpu   = { gpu_base.ptr + stride*index },
+			.index = index,
+		};
+
+		return result;
+	}
+
+	void Free(D3D12_Descriptor descriptor)
+	{
+		assert(descriptor.index < at);
+		assert(free_count < capacity);
+
+		free_indices[free_count++] = descriptor.index;
+	}
+
+	void Reset()
+	{
+		at         = 0;
+		free_count = 0;
+	}
+
+	void Release()
+	{
+		heap->Release();
+		free(free_indices);
+		ZeroStruct(this);
+	}
+};
+
+//------------------------------------------------------------------------
+// View cache: asking for the same view of the same resource twice hands back the same
+// descriptor (and so the same bindless index) and bumps a reference count, instead of
+// creating a duplicate descriptor in the heap.
+
+enum D3D12_ViewKind
+{
+	D3D12_ViewKind_srv,
+	D3D12_ViewKind_uav,
+	D3D12_ViewKind_cbv,
+};
+
+struct D3D12_ViewKey
+{
+	D3D12_ViewKind  kind;
+	bool            has_desc;
+	ID3D12Resource *resource;
+	ID3D12Resource *counter_resource;
+
+	union
+	{
+		D3D12_SHADER_RESOURCE_VIEW_DESC  srv;
+		D3D12_UNORDERED_ACCESS_VIEW_DESC uav;
+		D3D12_CONSTANT_BUFFER_VIEW_DESC  cbv;
+	};
+};
+
+struct D3D12_ViewCacheEntry
+{
+	uint64_t         hash;      // 0 means the slot has never been used
+	D3D12_ViewKey    key;
+	D3D12_Descriptor descriptor;
+	uint32_t         ref_count; // 0 with a non-zero hash is a tombstone
+};
+
+struct D3D12_ViewCache
+{
+	ID3D12Device              *device;
+	D3D12_DescriptorAllocator *allocator;
+
+	D3D12_ViewCacheEntry *entries;
+	uint32_t             *slot_from_descriptor;
+	uint32_t              capacity;
+	uint32_t              count;
+	uint32_t              tombstones;
+
+	uint64_t hits;
+	uint64_t misses;
+
+	void Init(ID3D12Device *in_device, D3D12_DescriptorAllocator *in_allocator)
+	{
+		device    = in_device;
+		allocator = in_allocator;
+
+		// there can never be more live views than descriptors, so sizing the table at twice the heap keeps
+		// the load factor under 50% without ever having to grow
+		capacity = 1;
+		while (capacity < 2*in_allocator->capacity)
+		{
+			capacity *= 2;
+		}
+
+		entries              = (D3D12_ViewCacheEntry *)calloc(capacity, sizeof(D3D12_ViewCacheEntry));
+		slot_from_descriptor = (uint32_t *)malloc(sizeof(uint32_t)*in_allocator->capacity);
+		count                = 0;
+		tombstones           = 0;
+		hits                 = 0;
+		misses               = 0;
+	}
+
+	D3D12_Descriptor GetSRV(ID3D12Resource *resource, const D3D12_SHADER_RESOURCE_VIEW_DESC *desc)
+	{
+		D3D12_ViewKey key;
+		ZeroStruct(&key);
+
+		key.kind     = D3D12_ViewKind_srv;
+		key.resource = resource;
+
+		if (desc)
+		{
+			key.has_desc = true;
+			memcpy(&key.srv, desc, sizeof(*desc));
+		}
+
+		return GetOrCreate(&key);
+	}
+
+	D3D12_Descriptor GetUAV(ID3D12Resource *resource, ID3D12Resource *counter_resource, const D3D12_UNORDERED_ACCESS_VIEW_DESC *desc)
+	{
+		D3D12_ViewKey key;
+		ZeroStruct(&key);
+
+		key.kind             = D3D12_ViewKind_uav;
+		key.resource         = resource;
+		key.counter_resource = counter_resource;
+
+		if (desc)
+		{
+			key.has_desc = true;
+			memcpy(&key.uav, desc, sizeof(*desc));
+		}
+
+		return GetOrCreate(&key);
+	}
+
+	D3D12_Descriptor GetCBV(const D3D12_CONSTANT_BUFFER_VIEW_DESC *desc)
+	{
+		D3D12_ViewKey key;
+		ZeroStruct(&key);
+
+		key.kind     = D3D12_ViewKind_cbv;
+		key.has_desc = true;
+		memcpy(&key.cbv, desc, sizeof(*desc));
+
+		return GetOrCreate(&key);
+	}
+
+	void ReleaseView(D3D12_Descriptor descriptor)
+	{
+		uint32_t slot = slot_from_descriptor[descriptor.index];
+
+		D3D12_ViewCacheEntry *entry = &entries[slot];
+		assert(entry->ref_count > 0 && entry->descriptor.index == descriptor.index);
+
+		entry->ref_count -= 1;
+
+		if (entry->ref_count == 0)
+		{
+			allocator->Free(entry->descriptor);
+
+			count      -= 1;
+			tombstones += 1;
+		}
+	}
+
+	void Release()
+	{
+		free(entries);
+		free(slot_from_descriptor);
+		ZeroStruct(this);
+	}
+
+	//------------------------------------------------------------------------
+
+	D3D12_Descriptor GetOrCreate(const D3D12_ViewKey *key)
+	{
+		// NOTE: The key is compared bytewise, so if the caller's desc had garbage in its padding we just miss
+		// the cache and create a duplicate view. We can never hand back the wrong view.
+		uint64_t hash = HashBytes(key, sizeof(*key));
+		if (hash == 0) hash = 1;
+
+		uint32_t mask        = capacity - 1;
+		uint32_t insert_slot = UINT32_MAX;
+
+		for (uint32_t slot = (uint32_t)hash & mask;; slot = (slot + 1) & mask)
+		{
+			D3D12_ViewCacheEntry *entry = &entries[slot];
+
+			if (entry->hash == 0)
+			{
+				if (insert_slot == UINT32_MAX)
+				{
+					insert_slot = slot;
+				}
+				break;
+			}
+
+			if (entry->ref_count == 0)
+			{
+				if (insert_slot == UINT32_MAX)
+				{
+					insert_slot = slot;
+				}
+				continue;
+			}
+
+			if (entry->hash == hash && memcmp(&entry->key, key, sizeof(*key)) == 0)
+			{
+				entry->ref_count += 1;
+				hits += 1;
+
+				return entry->descriptor;
+			}
+		}
+
+		//------------------------------------------------------------------------
+		// Miss: create the view
+
+		misses += 1;
+
+		D3D12_ViewCacheEntry *entry = &entries[insert_slot];
+
+		if (entry->hash != 0)
+		{
+			tombstones -= 1;
+		}
+
+		entry->hash       = hash;
+		entry->key        = *key;
+		entry->descriptor = allocator->Allocate();
+		entry->ref_count  = 1;
+
+		count += 1;
+
+		slot_from_descriptor[entry->descriptor.index] = insert_slot;
+
+		// without a device there's only the bookkeeping, which is all Bench_ViewCache looks at
+		if (device)
+		{
+			switch (key->kind)
+			{
+				case D3D12_ViewKind_srv:
+				{
+					device->CreateShaderResourceView(key->resource, key->has_desc ? &key->srv : nullptr, entry->descriptor.cpu);
+				} break;
+
+				case D3D12_ViewKind_uav:
+				{
+					device->CreateUnorderedAccessView(key->resource, key->counter_resource, key->has_desc ? &key->uav : nullptr, entry->descriptor.cpu);
+				} break;
+
+				case D3D12_ViewKind_cbv:
+				{
+					device->CreateConstantBufferView(&key->cbv, entry->descriptor.cpu);
+				} break;
+			}
+		}
+
+		D3D12_Descriptor result = entry->descriptor;
+
+		if (4*(count + tombstones) > 3*capacity)
+		{
+			Rehash();
+		}
+
+		return result;
+	}
+
+	void Rehash()
+	{
+		D3D12_ViewCacheEntry *old_entries = entries;
+
+		entries    = (D3D12_ViewCacheEntry *)calloc(capacity, sizeof(D3D12_ViewCacheEntry));
+		tombstones = 0;
+
+		uint32_t mask = capacity - 1;
+
+		for (uint32_t old_slot = 0; old_slot < capacity; old_slot++)
+		{
+			D3D12_ViewCacheEntry *old_entry = &old_entries[old_slot];
+
+			if (old_entry->ref_count == 0)
+			{
+				continue;
+			}
+
+			uint32_t slot = (uint32_t)old_entry->hash & mask;
+			while (entries[slot].hash != 0)
+			{
+				slot = (slot + 1) & mask;
+			}
+
+			entries[slot] = *old_entry;
+			slot_from_descriptor[old_entry->descriptor.index] = slot;
+		}
+
+		free(old_entries);
+	}
+};
+
+//------------------------------------------------------------------------
+// Render graph
+//
+// Passes declare which resources they read and write, and the graph does the rest: passes whose
+// output nobody looks at are culled, barriers are placed through the barrier scheduler (split where
+// there's room to), and transient render targets that are never alive at the same time share heap
+// memory. Compile only looks at the declared passes and resources and never touches the device;
+// D3D12_ExecuteRenderGraph creates the transient resources and records the passes.
+//
+// Passes run in declaration order. A pass can only see what earlier passes wrote, so declaration order
+// is always a valid order for the dependencies, and it keeps the result deterministic.
+
+static constexpr uint32_t g_rg_max_passes    = 64;
+static constexpr uint32_t g_rg_max_resources = 64;
+static constexpr uint32_t g_rg_max_accesses  = 256;
+
+struct D3D12_RenderGraph;
+
+typedef void (*D3D12_RenderPassFunction)(D3D12_RenderGraph *graph, D3D12_CommandList *list, void *user_data);
+
+struct D3D12_RGHandle
+{
+	uint32_t index;
+};
+
+struct D3D12_RGResource
+{
+	const char *name;
+
+	// imported resources live outside of the graph, so whatever is written to them is considered used
+	ID3D12Resource  *imported;
+	D3D12_Descriptor imported_rtv;
+
+	// transient resources are placed in the graph's heap
+	D3D12_RESOURCE_DESC            desc;
+	D3D12_RESOURCE_ALLOCATION_INFO allocation;
+
+	// filled in by Compile
+	uint32_t              ref_count;
+	uint32_t              first_pass; // index into the execution order, UINT32_MAX if unused
+	uint32_t              last_pass;
+	D3D12_RESOURCE_STATES first_state;
+	uint64_t              heap_offset;
+	bool                  needs_aliasing_barrier;
+
+	// filled in by D3D12_ExecuteRenderGraph
+	ID3D12Resource  *resource;
+	D3D12_Descriptor rtv;
+	D3D12_Descriptor srv;
+};
+
+struct D3D12_RGAccess
+{
+	uint32_t              pass_index;
+	uint32_t              resource_index;
+	D3D12_RESOURCE_STATES state;
+	bool                  write;
+};
+
+struct D3D12_RGPass
+{
+	const char              *name;
+	D3D12_RenderPassFunction execute;
+	void                    *user_data;
+	uint32_t                 work;
+	bool                     has_side_effects;
+
+	uint32_t ref_count;
+	bool     culled;
+};
+
+struct D3D12_RenderGraphStats
+{
+	uint32_t passes_declared;
+	uint32_t passes_culled;
+	uint32_t transient_resources;
+	uint64_t transient_bytes_unaliased;
+	uint64_t transient_bytes_aliased;
+
+	D3D12_BarrierScheduleStats barriers;
+};
+
+struct D3D12_RenderGraph
+{
+	D3D12_RGPass passes[g_rg_max_passes];
+	uint32_t     pass_count;
+
+	D3D12_RGResource resources[g_rg_max_resources];
+	uint32_t         resource_count;
+
+	D3D12_RGAccess accesses[g_rg_max_accesses];
+	uint32_t       access_count;
+
+	uint32_t order[g_rg_max_passes];
+	uint32_t order_count;
+
+	uint64_t heap_size;
+
+	D3D12_RenderGraphStats stats;
+
+	void Reset()
+	{
+		pass_count     = 0;
+		resource_count = 0;
+		access_count   = 0;
+		order_count    = 0;
+		heap_size      = 0;
+	}
+
+	//------------------------------------------------------------------------
+	// Declaring the graph
+
+	// The resource must be registered with the state tracker the graph is executed with
+	D3D12_RGHandle Import(const char *name, ID3D12Resource *resource, D3D12_Descriptor rtv = {})
+	{
+		assert(resource_count < g_rg_max_resources);
+
+		D3D12_RGResource *rg_resource = &resources[resource_count];
+		ZeroStruct(rg_resource);
+
+		rg_resource->name         = name;
+		rg_resource->imported     = resource;
+		rg_resource->imported_rtv = rtv;
+
+		return { resource_count++ };
+	}
+
+	// Transient resources only live for the duration of the graph. Their contents are undefined on
+	// first use, so the first pass to use one has to write it.
+	D3D12_RGHandle CreateTexture(const char *name, const D3D12_RESOURCE_DESC &desc, D3D12_RESOURCE_ALLOCATION_INFO allocation)
+	{
+		assert(resource_count < g_rg_max_resources);
+		assert(desc.Flags & (D3D12_RESOURCE_FLAG_ALLOW_RENDER_TARGET|D3D12_RESOURCE_FLAG_ALLOW_DEPTH_STENCIL) ||
+			   !"Transient resources are render or depth targets, they share a heap that only allows those");
+
+		D3D12_RGResource *rg_resource = &resources[resource_count];
+		ZeroStruct(rg_resource);
+
+		rg_resource->name       = name;
+		rg_resource->desc       = desc;
+		rg_resource->allocation = allocation;
+
+		return { resource_count++ };
+	}
+
+	void AddPass(const char *name, uint32_t work, D3D12_RenderPassFunction execute, void *user_data, bool has_side_effects = false)
+	{
+		assert(pass_count < g_rg_max_passes);
+
+		passes[pass_count++] = {
+			.name             = name,
+			.execute          = execute,
+			.user_data        = user_data,
+			.work             = work,
+			.has_side_effects = has_side_effects,
+		};
+	}
+
+	void Read(D3D12_RGHandle handle, D3D12_RESOURCE_STATES state)
+	{
+		AddAccess(handle, state, false);
+	}
+
+	void Write(D3D12_RGHandle handle, D3D12_RESOURCE_STATES state)
+	{
+		AddAccess(handle, state, true);
+	}
+
+	void AddAccess(D3D12_RGHandle handle, D3D12_RESOURCE_STATES state, bool write)
+	{
+		assert(pass_count > 0 || !"Call AddPass before declaring its reads and writes");
+		assert(handle.index < resource_count);
+		assert(access_count < g_rg_max_accesses);
+
+		uint32_t pass_index = pass_count - 1;
+
+		for (uint32_t i = access_count; i-- > 0 && accesses[i].pass_index == pass_index;)
+		{
+			assert(accesses[i].resource_index != handle.index || !"A pass can only access a resource once, OR together the states");
+		}
+
+		accesses[access_count++] = {
+			.pass_index     = pass_index,
+			.resource_index = handle.index,
+			.state          = state,
+			.write          = write,
+		};
+	}
+
+	//------------------------------------------------------------------------
+	// Compile
+
+	void Compile()
+	{
+		ZeroStruct(&stats);
+		stats.passes_declared = pass_count;
+
+		//------------------------------------------------------------------------
+		// Cull: a pass is referenced by the resources it writes, a resource by the passes reading it.
+		// Whatever ends up with no references is dropped, which can in turn orphan what it read.
+
+		for (uint32_t i = 0; i < pass_count; i++)
+		{
+			passes[i].ref_count = 0;
+			passes[i].culled    = false;
+		}
+
+		for (uint32_t i = 0; i < resource_count; i++)
+		{
+			resources[i].ref_count = resources[i].imported ? 1 : 0;
+		}
+
+		for (uint32_t i = 0; i < access_count; i++)
+		{
+			D3D12_RGAccess *access = &accesses[i];
+
+			if (access->write) passes   [access->pass_index    ].ref_count += 1;
+			else               resources[access->resource_index].ref_count += 1;
+		}
+
+		uint32_t unreferenced[g_rg_max_resources];
+		uint32_t unreferenced_count = 0;
+
+		for (uint32_t i = 0; i < resource_count; i++)
+		{
+			if (resources[i].ref_count == 0)
+			{
+				unreferenced[unreferenced_count++] = i;
+			}
+		}
+
+		while (unreferenced_count > 0)
+		{
+			uint32_t resource_index = unreferenced[--unreferenced_count];
+
+			for (uint32_t i = 0; i < access_count; i++)
+			{
+				D3D12_RGAccess *write = &accesses[i];
+
+				if (!write->write || write->resource_index != resource_index)
+				{
+					continue;
+				}
+
+				D3D12_RGPass *pass = &passes[write->pass_index];
+
+				if (pass->culled || pass->has_side_effects || --pass->ref_count > 0)
+				{
+					continue;
+				}
+
+				pass->culled = true;
+				stats.passes_culled += 1;
+
+				for (uint32_t j = 0; j < access_count; j++)
+				{
+					D3D12_RGAccess *read = &accesses[j];
+
+					if (read->pass_index == write->pass_index && !read->write)
+					{
+						if (--resources[read->resource_index].ref_count == 0)
+						{
+							unreferenced[unreferenced_count++] = read->resource_index;
+						}
+					}
+				}
+			}
+		}
+
+		//------------------------------------------------------------------------
+		// Order and lifetimes
+
+		order_count = 0;
+
+		for (uint32_t i = 0; i < pass_count; i++)
+		{
+			if (!passes[i].culled)
+			{
+				order[order_count++] = i;
+			}
+		}
+
+		for (uint32_t i = 0; i < resource_count; i++)
+		{
+			resources[i].first_pass = UINT32_MAX;
+			resources[i].last_pass  = 0;
+		}
+
+		for (uint32_t order_index = 0; order_index < order_count; order_index++)
+		{
+			for (uint32_t i = 0; i < access_count; i++)
+			{
+				D3D12_RGAccess *access = &accesses[i];
+
+				if (access->pass_index != order[order_index])
+				{
+					continue;
+				}
+
+				D3D12_RGResource *resource = &resources[access->resource_index];
+
+				if (resource->first_pass == UINT32_MAX)
+				{
+					assert(resource->imported || access->write || !"The first pass to use a transient resource has to write it");
+					resource->first_pass  = order_index;
+					resource->first_state = access->state;
+				}
+
+				resource->last_pass = order_index;
+			}
+		}
+
+		//------------------------------------------------------------------------
+		// Alias transient resources: biggest first, each goes at the lowest offset that doesn't collide
+		// with anything already placed whose lifetime overlaps its own
+
+		uint32_t sorted[g_rg_max_resources];
+		uint32_t sorted_count = 0;
+
+		for (uint32_t i = 0; i < resource_count; i++)
+		{
+			D3D12_RGResource *resource = &resources[i];
+
+			if (resource->imported || resource->first_pass == UINT32_MAX)
+			{
+				continue;
+			}
+
+			// insertion sort, descending size, ties broken by declaration order
+			uint32_t at = sorted_count++;
+			while (at > 0 && resources[sorted[at - 1]].allocation.SizeInBytes < resource->allocation.SizeInBytes)
+			{
+				sorted[at] = sorted[at - 1];
+				at -= 1;
+			}
+			sorted[at] = i;
+
+			stats.transient_resources       += 1;
+			stats.transient_bytes_unaliased += resource->allocation.SizeInBytes;
+		}
+
+		heap_size = 0;
+
+		for (uint32_t i = 0; i < sorted_count; i++)
+		{
+			D3D12_RGResource *resource = &resources[sorted[i]];
+
+			uint64_t size   = resource->allocation.SizeInBytes;
+			uint64_t align  = resource->allocation.Alignment ? resource->allocation.Alignment : D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT;
+			uint64_t offset = 0;
+
+			for (bool moved = true; moved;)
+			{
+				moved = false;
+
+				for (uint32_t j = 0; j < i; j++)
+				{
+					D3D12_RGResource *placed = &resources[sorted[j]];
+
+					bool lifetimes_overlap = placed->first_pass <= resource->last_pass && resource->first_pass <= placed->last_pass;
+					bool memory_overlaps   = placed->heap_offset < offset + size && offset < placed->heap_offset + placed->allocation.SizeInBytes;
+
+					if (lifetimes_overlap && memory_overlaps)
+					{
+						offset = (placed->heap_offset + placed->allocation.SizeInBytes + align - 1) & ~(align - 1);
+						moved  = true;
+					}
+				}
+			}
+
+			resource->heap_offset = offset;
+
+			if (heap_size < offset + size)
+			{
+				heap_size = offset + size;
+			}
+		}
+
+		// Anything sharing memory with another resource needs an aliasing barrier before its first use, the
+		// one used first in the frame included, since the memory was someone else's at the end of last frame.
+		for (uint32_t i = 0; i < sorted_count; i++)
+		{
+			D3D12_RGResource *resource = &resources[sorted[i]];
+			resource->needs_aliasing_barrier = false;
+
+			for (uint32_t j = 0; j < sorted_count; j++)
+			{
+				D3D12_RGResource *other = &resources[sorted[j]];
+
+				if (i != j &&
+					other->heap_offset < resource->heap_offset + resource->allocation.SizeInBytes &&
+					resource->heap_offset < other->heap_offset + other->allocation.SizeInBytes)
+				{
+					resource->needs_aliasing_barrier = true;
+					break;
+				}
+			}
+		}
+
+		stats.transient_bytes_aliased = heap_size;
+	}
+
+	//------------------------------------------------------------------------
+	// For use in pass functions
+
+	ID3D12Resource *GetResource(D3D12_RGHandle handle)
+	{
+		D3D12_RGResource *resource = &resources[handle.index];
+		return resource->imported ? resource->imported : resource->resource;
+	}
+
+	D3D12_Descriptor GetRTV(D3D12_RGHandle handle)
+	{
+		D3D12_RGResource *resource = &resources[handle.index];
+		return resource->imported ? resource->imported_rtv : resource->rtv;
+	}
+
+	D3D12_Descriptor GetSRV(D3D12_RGHandle handle)
+	{
+		D3D12_RGResource *resource = &resources[handle.index];
+		assert(!resource->imported || !"Imported resources bring their own views");
+		return resource->srv;
+	}
+};
+
+//------------------------------------------------------------------------
+// The heap transient resources live in, and the placed resources created in it. Placed resources are
+// kept around between frames for as long as the graph keeps asking for the same thing at the same
+// spot in the heap.
+
+static constexpr uint32_t g_max_transient_resources = 64;
+
+struct D3D12_TransientResource
+{
+	ID3D12Resource     *resource;
+	D3D12_RESOURCE_DESC desc;
+	uint64_t            heap_offset;
+	uint64_t            last_used_frame;
+	D3D12_Descriptor    rtv;
+	D3D12_Descriptor    srv;
+	bool                has_rtv;
+	bool                has_srv;
+};
+
+struct D3D12_TransientHeap
+{
+	ID3D12Heap *heap;
+	uint64_t    size;
+
+	D3D12_TransientResource resources[g_max_transient_resources];
+	uint32_t                resource_count;
+};
+
+//------------------------------------------------------------------------
+
+//------------------------------------------------------------------------
+// Command pool
+//
+// Hands out command allocator/list pairs for one queue type. Once submitted, a pair is retired with the
+// fence value signalled after it, and only handed out again once the GPU has passed that value. Pairs
+// are created as the demand grows and kept around after, so once the demand settles recording doesn't
+// create anything.
+//
+// D3D12 doesn't tell you how much memory an allocator is holding on to (they grow to fit the largest
+// list recorded into them, and never shrink unless released), so the pool reports allocator counts,
+// which is what the memory scales with.
+
+static constexpr uint32_t g_max_pooled_command_lists  = 256;
+static constexpr uint32_t g_command_pool_stats_window = 64; // frames
+
+struct D3D12_CommandContext
+{
+	ID3D12CommandAllocator    *allocator;
+	ID3D12GraphicsCommandList *list;
+	D3D12_CommandList          filtered;    // record through this, not the list itself
+	D3D12_CommandStream        stream;      // what was recorded, when the frame is being captured
+	uint64_t                   fence_value; // valid while retired
+};
+
+struct D3D12_CommandPoolStats
+{
+	uint32_t allocators_created;       // peak, they're never released before the pool is
+	uint32_t allocators_outstanding;   // acquired or waiting on their fence right now
+	uint32_t allocators_steady_state;  // most outstanding at once over the last stats window
+	uint32_t acquires;
+	uint32_t acquires_created;         // acquires that had to create a new pair
+	uint32_t acquires_stalled;         // ...while pairs were retired but still in use by the GPU
+};
+
+struct D3D12_CommandPool
+{
+	ID3D12Device           *device;
+	ID3D12Fence            *fence;
+	D3D12_COMMAND_LIST_TYPE type;
+	uint64_t                completed_fence_value;
+
+	D3D12_CommandContext contexts[g_max_pooled_command_lists];
+	uint32_t             context_count;
+
+	// Submission order is fence order, so retired contexts complete front to back
+	uint32_t retired[g_max_pooled_command_lists];
+	uint32_t retired_head;
+	uint32_t retired_count;
+
+	uint32_t available[g_max_pooled_command_lists];
+	uint32_t available_count;
+
+	uint32_t outstanding_per_frame[g_command_pool_stats_window];
+	uint32_t stats_frame;
+
+	D3D12_CommandPoolStats stats;
+
+	void Init(ID3D12Device *in_device, D3D12_COMMAND_LIST_TYPE in_type, ID3D12Fence *in_fence, uint32_t prewarm_count)
+	{
+		assert(prewarm_count <= g_max_pooled_command_lists);
+
+		device                = in_device;
+		fence                 = in_fence;
+		type                  = in_type;
+		completed_fence_value = 0;
+		context_count         = 0;
+		retired_head          = 0;
+		retired_count         = 0;
+		available_count       = 0;
+		stats_frame           = 0;
+
+		memset(outstanding_per_frame, 0, sizeof(outstanding_per_frame));
+		ZeroStruct(&stats);
+
+		for (uint32_t i = 0; i < prewarm_count; i++)
+		{
+			available[available_count++] = CreateContext();
+		}
+	}
+
+	uint32_t CreateContext()
+	{
+		assert(context_count < g_max_pooled_command_lists || !"Command pool is out of contexts");
+
+		uint32_t              index   = context_count++;
+		D3D12_CommandContext *context = &contexts[index];
+
+		HRESULT hr;
+
+		hr = device->CreateCommandAllocator(type, IID_PPV_ARGS(&context->allocator));
+		CHECK_HR(hr);
+
+		hr = device->CreateCommandList(0, type, context->allocator, NULL, IID_PPV_ARGS(&context->list));
+		CHECK_HR(hr);
+
+		context->list->Close();
+		context->fence_value = 0;
+
+		stats.allocators_created = context_count;
+
+		return index;
+	}
+
+	void RecycleCompleted()
+	{
+		while (retired_count > 0)
+		{
+			D3D12_CommandContext *context = &contexts[retired[retired_head]];
+
+			if (context->fence_value > completed_fence_value)
+			{
+				// only ask the fence when the cached value isn't enough to go on
+				completed_fence_value = fence->GetCompletedValue();
+
+				if (context->fence_value > completed_fence_value)
+				{
+					break;
+				}
+			}
+
+			available[available_count++] = retired[retired_head];
+
+			retired_head   = (retired_head + 1) % g_max_pooled_command_lists;
+			retired_count -= 1;
+		}
+	}
+
+	// Returns a context with its allocator and list reset and ready to record into
+	D3D12_CommandContext *Acquire()
+	{
+		RecycleCompleted();
+
+		stats.acquires += 1;
+
+		uint32_t index;
+
+		if (available_count > 0)
+		{
+			index = available[--available_count];
+		}
+		else
+		{
+			if (retired_count > 0) stats.acquires_stalled += 1;
+
+			stats.acquires_created += 1;
+			index = CreateContext();
+		}
+
+		D3D12_CommandContext *context = &contexts[index];
+
+		context->allocator->Reset();
+		context->list     ->Reset(context->allocator, nullptr);
+
+		uint32_t outstanding = context_count - available_count;
+		stats.allocators_outstanding = outstanding;
+
+		uint32_t *frame_outstanding = &outstanding_per_frame[stats_frame % g_command_pool_stats_window];
+		if (*frame_outstanding < outstanding) *frame_outstanding = outstanding;
+
+		return context;
+	}
+
+	// Hand back a context after the list was submitted, with the fence value signalled after it on the
+	// queue. The list must be closed.
+	void Retire(D3D12_CommandContext *context, uint64_t fence_value)
+	{
+		assert(context >= contexts && context < contexts + context_count);
+		assert(retired_count < g_max_pooled_command_lists);
+
+		if (retired_count > 0)
+		{
+			uint32_t last = retired[(retired_head + retired_count - 1) % g_max_pooled_command_lists];
+			assert(contexts[last].fence_value <= fence_value || !"Contexts must be retired in fence order");
+		}
+
+		uint32_t index = (uint32_t)(context - contexts);
+
+		context->fence_value = fence_value;
+
+		retired[(retired_head + retired_count) % g_max_pooled_command_lists] = index;
+		retired_count += 1;
+	}
+
+	// Rolls the steady state window along, call once a frame
+	void EndFrame()
+	{
+		uint32_t steady_state = 0;
+
+		for (uint32_t i = 0; i < g_command_pool_stats_window; i++)
+		{
+			if (steady_state < outstanding_per_frame[i]) steady_state = outstanding_per_frame[i];
+		}
+
+		stats.allocators_steady_state = steady_state;
+
+		stats_frame += 1;
+		outstanding_per_frame[stats_frame % g_command_pool_stats_window] = 0;
+	}
+
+	// The GPU must be done with everything retired to the pool
+	void Release()
+	{
+		for (uint32_t i = 0; i < context_count; i++)
+		{
+			COM_SAFE_RELEASE(contexts[i].list);
+			COM_SAFE_RELEASE(contexts[i].allocator);
+
+			contexts[i].stream.Release();
+		}
+
+		context_count   = 0;
+		retired_count   = 0;
+		available_count = 0;
+	}
+};
+
+// D3D12_RecordParallel takes one list per thread, plus a fresh one to carry on recording into afterwards
+static constexpr uint32_t g_max_command_lists_per_frame = 2*g_max_work_threads + 4;
+static constexpr uint32_t g_max_gpu_scopes              = 128; // per frame, including the frame itself
+
+// A scope opened with D3D12_BeginGpuScope. Its timestamps are 2*index and 2*index + 1 in the frame
+// slot's part of the profiler's query heap, see D3D12_GpuProfiler.
+struct D3D12_GpuScope
+{
+	uint32_t stats_index; // which D3D12_GpuScopeStats it counts towards
+	uint32_t parent;      // scope index, UINT32_MAX for the frame
+};
+
+struct D3D12_Frame
+{
+	uint64_t fence_value;
+
+	D3D12_LinearAllocator upload_arena;
+
+	// Contexts acquired from the pool for this frame, retired by D3D12_EndFrame
+	D3D12_CommandContext *contexts[g_max_command_lists_per_frame];
+	uint32_t              context_count;
+
+	// closed lists waiting for D3D12_EndFrame to submit them, in order
+	ID3D12CommandList *submission[g_max_command_lists_per_frame];
+	uint32_t           submission_count;
+
+	D3D12_CommandList *open_list;
+
+	// Record every list into its context's command stream, and write them out at the end of the frame
+	bool capturing;
+
+	// whichever backbuffer the swap chain handed out when the frame began
+	ID3D12Resource  *backbuffer;
+	D3D12_Descriptor rtv;
+
+	// when what the frame shows was sampled, see D3D12_BeginFrame
+	LARGE_INTEGER input_time;
+
+	// GPU scopes in the order they were begun, the first one is the whole frame
+	D3D12_GpuScope gpu_scopes[g_max_gpu_scopes];
+	uint32_t       gpu_scope_count;
+
+	// the scopes' timestamps have been resolved into the slot's part of the readback
+	bool timestamped;
+};
+
+// COM objects and shader visible views the GPU might still be using get released once the frame that
+// last used them retires
+struct D3D12_DeferredRelease
+{
+	IUnknown        *object;
+	D3D12_Descriptor view;
+	uint64_t         fence_value;
+};
+
+// Where the time goes for frames drawn with one setting of D3D12_SetFrameLatency. The display latency
+// is from a frame's input time to the vblank it was shown at, as far as DXGI's frame statistics tell.
+struct D3D12_LatencyStats
+{
+	uint32_t frames;
+	double   waitable_wait; // seconds waiting on the swap chain's waitable object
+	double   fence_wait;    // seconds waiting for the GPU to finish with the frame slot
+
+	uint32_t displayed;     // frames a display time turned up for
+	double   display_latency;
+	double   max_display_latency;
+};
+
+// How long D3D12_BeginFrame waited for the frame just begun, and how long the GPU spent on the last
+// frame that used the same slot, which is the latest one known to be done. Measured between the starts
+// of two D3D12_BeginFrames, so a frame's time is the last frame's work plus this frame's waits.
+struct D3D12_FrameTimes
+{
+	double   frame_time;
+	double   limiter_wait; // filled in by whoever held the frame back, see FrameLimiter
+	double   waitable_wait;
+	double   fence_wait;
+	double   gpu_time;     // zero until a frame has come back
+	uint32_t frames_ahead; // submitted but not finished by the GPU when the frame began
+};
+
+enum D3D12_FrameBound
+{
+	D3D12_FrameBound_cpu,
+	D3D12_FrameBound_gpu,
+	D3D12_FrameBound_display, // neither was busy, waiting on the swap chain or the frame limiter
+	D3D12_FrameBound_COUNT,
+};
+
+const char *g_frame_bound_names[D3D12_FrameBound_COUNT] = {
+	"CPU",
+	"GPU",
+	"display",
+};
+
+// How much of a frame the CPU and GPU each spent busy, see D3D12_GetFrameOverlap
+struct D3D12_FrameOverlap
+{
+	float            cpu_busy; // percent of the frame not spent waiting on the GPU or the swap chain
+	float            gpu_busy; // percent of the frame the GPU was working on a frame
+	D3D12_FrameBound bound;
+};
+
+// Timings of a scope path (a name under a parent), for every frame it turned up in
+struct D3D12_GpuScopeStats
+{
+	const char *name;
+	uint32_t    parent; // stats index, UINT32_MAX at the top
+	uint32_t    depth;
+
+	uint64_t frames;
+	double   total;   // seconds
+	double   max;
+	double   average; // weighted towards the last g_gpu_scope_average_frames frames
+	double   last;
+};
+
+// A scope of the latest frame to come back from the GPU, in GetTime's clock
+struct D3D12_GpuScopeTiming
+{
+	const char   *name;
+	uint32_t      parent; // timing index, UINT32_MAX for the frame
+	uint32_t      depth;
+	LARGE_INTEGER begin;
+	LARGE_INTEGER end;
+	double        duration;
+};
+
+static constexpr uint32_t g_max_gpu_scope_depth            = 16;
+static constexpr uint32_t g_max_gpu_scope_stats            = 128;
+static constexpr double   g_gpu_scope_average_frames       = 64.0;
+static constexpr double   g_gpu_clock_calibration_interval = 1.0; // seconds
+
+// Timestamps around nested, named scopes, see D3D12_BeginGpuScope. Each frame slot has its own part
+// of the query heap and readback buffer, which the frame's scopes are resolved into at the end of the
+// frame and read from once the slot comes round again, when its fence says the GPU is done with it.
+struct D3D12_GpuProfiler
+{
+	ID3D12QueryHeap *query_heap; // 2*g_max_gpu_scopes timestamps per frame slot
+	ID3D12Resource  *readback;
+	uint64_t        *values;     // the readback, mapped for good
+	uint64_t         frequency;
+
+	// a GPU timestamp and QPC value taken at the same moment, to line the two clocks up with
+	uint64_t      calibration_gpu;
+	LARGE_INTEGER calibration_cpu;
+
+	// of the frame being recorded
+	uint32_t open_scopes[g_max_gpu_scope_depth];
+	uint32_t open_count;
+	uint32_t dropped_scopes; // for the whole run, from going over g_max_gpu_scopes
+
+	D3D12_GpuScopeStats stats[g_max_gpu_scope_stats];
+	uint32_t            stats_count;
+
+	// the latest frame to come back, in the order its scopes were begun
+	D3D12_GpuScopeTiming timings[g_max_gpu_scopes];
+	uint32_t             timing_count;
+	uint64_t             timing_frame_index;
+};
+
+// What was presented when, kept until the frame statistics say it's been shown
+struct D3D12_PresentRecord
+{
+	UINT          present_count;
+	LARGE_INTEGER input_time;
+};
+
+struct D3D12_State
+{
+	IDXGIFactory6       *factory;
+	IDXGIAdapter1       *adapter;
+	ID3D12Device        *device;
+	ID3D12CommandQueue  *queue;
+	ID3D12Fence         *fence;
+	ID3D12RootSignature *rs_bindless;
+
+	uint64_t frame_index;
+
+	D3D12_CommandPool direct_pool;
+
+	// summed over every list of the last frame
+	D3D12_CommandListStats command_list_stats;
+
+	// Set to have the next frame captured, see D3D12_WriteFrameCapture
+	bool capture_next_frame;
+
+	D3D12_DescriptorAllocator cbv_srv_uav;
+	D3D12_DescriptorAllocator rtv;
+	D3D12_ViewCache           view_cache;
+
+	D3D12_StateTracker     state_tracker;
+	D3D12_BarrierScheduler barrier_scheduler;
+	D3D12_RenderGraph      render_graph;
+	D3D12_TransientHeap    transient_heap;
+
+	D3D12_DeferredRelease deferred_releases[256];
+	uint32_t              deferred_release_count;
+
+	IDXGISwapChain3 *swap_chain;
+	HANDLE           frame_latency_waitable;
+	bool             tearing_supported;
+
+	D3D12_PresentMode present_mode;
+	int window_w;
+	int window_h;
+
+	ID3D12Resource  *backbuffers    [g_backbuffer_count];
+	D3D12_Descriptor backbuffer_rtvs[g_backbuffer_count];
+
+	// one per fence D3D12_WaitForFences can wait on at once
+	HANDLE fence_events[8];
+
+	// Changed with D3D12_SetFrameLatency, only frame_slot_count of the frames are used
+	uint32_t    max_frame_latency;
+	uint32_t    frame_slot_count;
+	D3D12_Frame frames[g_max_frame_slots];
+
+	// Indexed by [max_frame_latency - 1][frame_slot_count - 1], for the whole run
+	D3D12_LatencyStats latency_stats[g_max_frame_latency][g_max_frame_slots];
+
+	D3D12_PresentRecord presents[16];
+	UINT                last_displayed_present;
+
+	D3D12_GpuProfiler gpu_profiler;
+
+	D3D12_FrameTimes frame_times;
+	LARGE_INTEGER    frame_start;
+};
+
+//------------------------------------------------------------------------
+
+D3D12_State g_d3d;
+
+//------------------------------------------------------------------------
+
+void D3D12_Init(HWND window)
+{
+	HRESULT hr;
+
+	//------------------------------------------------------------------------
+	// Enable Debug Layer
+
+#if BUILD_DEBUG
+	{
+		ID3D12Debug *debug;
+
+		hr = D3D12GetDebugInterface(IID_PPV_ARGS(&debug));
+		CHECK_HR(hr);
+
+		debug->EnableDebugLayer();
+
+		if (g_enable_gpu_based_validation)
+		{
+			ID3D12Debug1 *debug1;
+
+			hr = debug->QueryInterface(IID_PPV_ARGS(&debug1));
+			CHECK_HR(hr);
+
+			debug1->SetEnableGPUBasedValidation(true);
+			COM_SAFE_RELEASE(debug1);
+		}
+
+		COM_SAFE_RELEASE(debug);
+	}
+#endif
+
+	//------------------------------------------------------------------------
+	// Create Factory
+
+	{
+		UINT flags = 0;
+
+#if BUILD_DEBUG
+		flags |= DXGI_CREATE_FACTORY_DEBUG;
+#endif
+
+		hr = CreateDXGIFactory2(flags, IID_PPV_ARGS(&g_d3d.factory));
+		CHECK_HR(hr);
+	}
+
+	//------------------------------------------------------------------------
+	// Create Adapter and Device
+
+	for (uint32_t adapter_index = 0; 
+		 g_d3d.factory->EnumAdapterByGpuPreference(adapter_index, DXGI_GPU_PREFERENCE_HIGH_PERFORMANCE, IID_PPV_ARGS(&g_d3d.adapter)) != DXGI_ERROR_NOT_FOUND;
+		 adapter_index += 1)
+	{
+		hr = D3D12CreateDevice(g_d3d.adapter, D3D_FEATURE_LEVEL_11_0, IID_PPV_ARGS(&g_d3d.device));
+
+		if (SUCCEEDED(hr))
+		{
+			break;
+		}
+
+		COM_SAFE_RELEASE(g_d3d.adapter);
+	}
+
+	if (!g_d3d.device)
+	{
+		assert(!"Failed to create D3D12 device");
+	}
+
+	//------------------------------------------------------------------------
+	// Configure info queue for helpful debug messages
+
+	ID3D12InfoQueue *info_queue;
+
+	hr = g_d3d.device->QueryInterface(IID_PPV_ARGS(&info_queue));
+
+	if (SUCCEEDED(hr))
+	{
+		info_queue->SetBreakOnSeverity(D3D12_MESSAGE_SEVERITY_CORRUPTION, TRUE);
+		info_queue->SetBreakOnSeverity(D3D12_MESSAGE_SEVERITY_ERROR, TRUE);
+		info_queue->SetBreakOnSeverity(D3D12_MESSAGE_SEVERITY_WARNING, TRUE);
+
+		D3D12_MESSAGE_SEVERITY severities[] = {
+			D3D12_MESSAGE_SEVERITY_INFO,
+		};
+
+		D3D12_MESSAGE_ID deny_ids[] = {
+			D3D12_MESSAGE_ID_CLEARRENDERTARGETVIEW_MISMATCHINGCLEARVALUE,
+			D3D12_MESSAGE_ID_MAP_INVALID_NULLRANGE,
+			D3D12_MESSAGE_ID_UNMAP_INVALID_NULLRANGE,
+		};
+
+		D3D12_INFO_QUEUE_FILTER filter = {
+			.DenyList = {
+				.NumSeverities = ArrayCount(severities),
+				.pSeverityList = severities,
+				.NumIDs        = ArrayCount(deny_ids),
+				.pIDList       = deny_ids,
+			},
+		};
+
+		hr = info_queue->PushStorageFilter(&filter);
+		CHECK_HR(hr);
+
+		COM_SAFE_RELEASE(info_queue);
+	}
+
+	//------------------------------------------------------------------------
+	// Create command queue
+
+	{
+		D3D12_COMMAND_QUEUE_DESC desc = {
+			.Type     = D3D12_COMMAND_LIST_TYPE_DIRECT,
+			.Priority = D3D12_COMMAND_QUEUE_PRIORITY_NORMAL,
+		};
+
+		hr = g_d3d.device->CreateCommandQueue(&desc, IID_PPV_ARGS(&g_d3d.queue));
+		CHECK_HR(hr);
+
+		g_d3d.queue->SetName(L"Direct Command Queue");
+	}
+
+	//------------------------------------------------------------------------
+	// Create per-frame upload arena
+
+	for (uint32_t i = 0; i < g_max_frame_slots; i++)
+	{
+		D3D12_Frame *frame = &g_d3d.frames[i];
+		frame->upload_arena.Init(g_d3d.device, (uint32_t)KiB(64));
+	}
+
+	//------------------------------------------------------------------------
+	// Create bindless root signature
+
+	{
+		D3D12_ROOT_PARAMETER1 parameters[D3D12_RootParameter_COUNT] = {};
+
+		parameters[D3D12_RootParameter_32bit_constants] = {
+			.ParameterType = D3D12_ROOT_PARAMETER_TYPE_32BIT_CONSTANTS,
+			.Constants = {
+				.ShaderRegister = 0,
+				.RegisterSpace  = 0,
+				.Num32BitValues = 58, // 58 because each root cbv takes 2 uints, and the max is 64
+			},
+		};
+
+		parameters[D3D12_RootParameter_pass_cbv] = {
+			.ParameterType = D3D12_ROOT_PARAMETER_TYPE_CBV,
+			.Descriptor = {
+				.ShaderRegister = 1,
+				.Flags = D3D12_ROOT_DESCRIPTOR_FLAG_DATA_VOLATILE,
+			},
+		};
+
+		parameters[D3D12_RootParameter_view_cbv] = {
+			.ParameterType = D3D12_ROOT_PARAMETER_TYPE_CBV,
+			.Descriptor = {
+				.ShaderRegister = 2,
+				.Flags = D3D12_ROOT_DESCRIPTOR_FLAG_DATA_VOLATILE,
+			},
+		};
+
+		parameters[D3D12_RootParameter_global_cbv] = {
+			.ParameterType = D3D12_ROOT_PARAMETER_TYPE_CBV,
+			.Descriptor = {
+				.ShaderRegister = 3,
+				.Flags = D3D12_ROOT_DESCRIPTOR_FLAG_DATA_VOLATILE,
+			},
+		};
+
+		D3D12_STATIC_SAMPLER_DESC samplers[] = {
+			{ // s_nearest
+				.Filter           = D3D12_FILTER_MIN_MAG_POINT_MIP_LINEAR,
+				.AddressU         = D3D12_TEXTURE_ADDRESS_MODE_WRAP,
+				.AddressV         = D3D12_TEXTURE_ADDRESS_MODE_WRAP,
+				.AddressW         = D3D12_TEXTURE_ADDRESS_MODE_WRAP,
+				.MipLODBias       = 0.0f,
+				.MinLOD           = 0.0f,
+				.MaxLOD           = D3D12_FLOAT32_MAX,
+				.ShaderRegister   = 0,
+				.RegisterSpace    = 0,
+				.ShaderVisibility = D3D12_SHADER_VISIBILITY_ALL,
+			},
+		};
+
+		D3D12_VERSIONED_ROOT_SIGNATURE_DESC desc = {
+			.Version = D3D_ROOT_SIGNATURE_VERSION_1_1,
+			.Desc_1_1 = {
+				.NumParameters     = ArrayCount(parameters),
+				.pParameters       = parameters,
+				.NumStaticSamplers = ArrayCount(samplers),
+				.pStaticSamplers   = samplers,
+				.Flags             = D3D12_ROOT_SIGNATURE_FLAG_CBV_SRV_UAV_HEAP_DIRECTLY_INDEXED,
+			},
+		};
+
+		ID3DBlob *serialized_desc = nullptr;
+
+		hr = D3D12SerializeVersionedRootSignature(&desc, &serialized_desc, nullptr);
+		CHECK_HR(hr);
+
+		hr = g_d3d.device->CreateRootSignature(0, serialized_desc->GetBufferPointer(), serialized_desc->GetBufferSize(), IID_PPV_ARGS(&g_d3d.rs_bindless));
+		CHECK_HR(hr);
+
+		serialized_desc->Release();
+	}
+
+	//------------------------------------------------------------------------
+	// Create Fence
+
+	g_d3d.frame_index = 0;
+
+	hr = g_d3d.device->CreateFence(g_d3d.frame_index, D3D12_FENCE_FLAG_NONE, IID_PPV_ARGS(&g_d3d.fence));
+	CHECK_HR(hr);
+
+	for (uint32_t i = 0; i < ArrayCount(g_d3d.fence_events); i++)
+	{
+		g_d3d.fence_events[i] = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+	}
+
+	//------------------------------------------------------------------------
+	// Create GPU profiler timestamp queries
+
+	{
+		D3D12_GpuProfiler *profiler = &g_d3d.gpu_profiler;
+
+		D3D12_QUERY_HEAP_DESC desc = {
+			.Type  = D3D12_QUERY_HEAP_TYPE_TIMESTAMP,
+			.Count = 2*g_max_gpu_scopes*g_max_frame_slots,
+		};
+
+		hr = g_d3d.device->CreateQueryHeap(&desc, IID_PPV_ARGS(&profiler->query_heap));
+		CHECK_HR(hr);
+
+		profiler->readback = D3D12_CreateBuffer(g_d3d.device, desc.Count*sizeof(uint64_t), L"GPU Profiler Readback", D3D12_HEAP_TYPE_READBACK);
+
+		hr = profiler->readback->Map(0, nullptr, (void **)&profiler->values);
+		CHECK_HR(hr);
+
+		hr = g_d3d.queue->GetTimestampFrequency(&profiler->frequency);
+		CHECK_HR(hr);
+
+		hr = g_d3d.queue->GetClockCalibration(&profiler->calibration_gpu, (UINT64 *)&profiler->calibration_cpu.QuadPart);
+		CHECK_HR(hr);
+	}
+
+	//------------------------------------------------------------------------
+	// Create command pool, with a list per frame in flight to start with
+
+	g_d3d.direct_pool.Init(g_d3d.device, D3D12_COMMAND_LIST_TYPE_DIRECT, g_d3d.fence, g_default_frame_slots);
+
+	//------------------------------------------------------------------------
+	// Initialize descriptor allocators
+
+	g_d3d.cbv_srv_uav.Init(g_d3d.device, D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV, 4096, true,  L"CBV SRV UAV Heap");
+	g_d3d.rtv        .Init(g_d3d.device, D3D12_DESCRIPTOR_HEAP_TYPE_RTV,         64,   false, L"RTV Heap");
+
+	g_d3d.view_cache.Init(g_d3d.device, &g_d3d.cbv_srv_uav);
+
+	//------------------------------------------------------------------------
+	// Initialize resource state tracker
+
+	g_d3d.state_tracker.Init(1024);
+	g_d3d.barrier_scheduler.Init();
+
+	//------------------------------------------------------------------------
+	// Create swap chain
+	//
+	// With a waitable object, which DXGI signals whenever fewer than the maximum frame latency presents
+	// are queued up. D3D12_BeginFrame waits on it, so frames start as late as they can rather than
+	// getting blocked in Present with their input already sampled. Tearing has to be allowed when the
+	// swap chain is made for presents to be allowed to tear later.
+
+	{
+		BOOL allow_tearing = FALSE;
+
+		if (SUCCEEDED(g_d3d.factory->CheckFeatureSupport(DXGI_FEATURE_PRESENT_ALLOW_TEARING, &allow_tearing, sizeof(allow_tearing))))
+		{
+			g_d3d.tearing_supported = allow_tearing != FALSE;
+		}
+
+		UINT flags = DXGI_SWAP_CHAIN_FLAG_FRAME_LATENCY_WAITABLE_OBJECT;
+
+		if (g_d3d.tearing_supported)
+		{
+			flags |= DXGI_SWAP_CHAIN_FLAG_ALLOW_TEARING;
+		}
+
+		DXGI_SWAP_CHAIN_DESC1 desc = {
+			.Format      = DXGI_FORMAT_R8G8B8A8_UNORM,
+			.SampleDesc  = { .Count = 1, .Quality = 0 },
+			.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT,
+			.BufferCount = g_backbuffer_count,
+			.Scaling     = DXGI_SCALING_STRETCH,
+			.SwapEffect  = DXGI_SWAP_EFFECT_FLIP_DISCARD,
+			.Flags       = flags,
+		};
+
+		IDXGISwapChain1 *swap_chain;
+
+		hr = g_d3d.factory->CreateSwapChainForHwnd(g_d3d.queue, window, &desc, nullptr, nullptr, &swap_chain);
+		CHECK_HR(hr);
+
+		hr = swap_chain->QueryInterface(IID_PPV_ARGS(&g_d3d.swap_chain));
+		CHECK_HR(hr);
+
+		swap_chain->Release();
+
+		g_d3d.max_frame_latency = g_default_max_frame_latency;
+		g_d3d.frame_slot_count  = g_default_frame_slots;
+		g_d3d.present_mode      = D3D12_PresentMode_vsync;
+
+		hr = g_d3d.swap_chain->SetMaximumFrameLatency(g_d3d.max_frame_latency);
+		CHECK_HR(hr);
+
+		g_d3d.frame_latency_waitable = g_d3d.swap_chain->GetFrameLatencyWaitableObject();
+
+		for (uint32_t i = 0; i < g_backbuffer_count; i++)
+		{
+			hr = g_d3d.swap_chain->GetBuffer(i, IID_PPV_ARGS(&g_d3d.backbuffers[i]));
+			CHECK_HR(hr);
+
+			g_d3d.state_tracker.Register(g_d3d.backbuffers[i], 1, D3D12_RESOURCE_STATE_PRESENT, false);
+
+			g_d3d.backbuffer_rtvs[i] = g_d3d.rtv.Allocate();
+
+			D3D12_RENDER_TARGET_VIEW_DESC rtv_desc = {
+				.Format        = DXGI_FORMAT_R8G8B8A8_UNORM_SRGB,
+				.ViewDimension = D3D12_RTV_DIMENSION_TEXTURE2D,
+			};
+			g_d3d.device->CreateRenderTargetView(g_d3d.backbuffers[i], &rtv_desc, g_d3d.backbuffer_rtvs[i].cpu);
+		}
+
+		// Figure out window dimensions
+
+		RECT client_rect;
+		GetClientRect(window, &client_rect);
+
+		g_d3d.window_w = client_rect.right;
+		g_d3d.window_h = client_rect.bottom;
+	}
+
+	//------------------------------------------------------------------------
+	// Disable Alt+Enter keybind
+
+	g_d3d.factory->MakeWindowAssociation(window, DXGI_MWA_NO_ALT_ENTER);
+}
+
+//------------------------------------------------------------------------
+
+// Which of the frame slots the frame being recorded uses. Anything kept per frame in flight outside of
+// D3D12_Frame should be indexed by this too.
+uint32_t D3D12_GetFrameSlot()
+{
+	return (uint32_t)(g_d3d.frame_index % g_d3d.frame_slot_count);
+}
+
+D3D12_Frame *D3D12_GetFrameState()
+{
+	return &g_d3d.frames[D3D12_GetFrameSlot()];
+}
+
+// The list everything recorded on the main thread should go into. This changes when recording goes
+// wide with D3D12_RecordParallel, so don't hang on to it across calls that might do that.
+D3D12_CommandList *D3D12_GetCommandList()
+{
+	return D3D12_GetFrameState()->open_list;
+}
+
+// Gets a fresh list from the pool for the current frame, ready to record into with the bindless heap
+// and root signature set. Main thread only, but the list can be recorded into from any thread.
+D3D12_CommandContext *D3D12_OpenCommandContext()
+{
+	D3D12_Frame *frame = D3D12_GetFrameState();
+
+	assert(frame->context_count < g_max_command_lists_per_frame);
+
+	D3D12_CommandContext *context = g_d3d.direct_pool.Acquire();
+	frame->contexts[frame->context_count++] = context;
+
+	context->stream.Reset();
+
+	context->filtered.Reset(context->list, frame->capturing ? &context->stream : nullptr);
+	context->filtered.SetDescriptorHeaps      (1, &g_d3d.cbv_srv_uav.heap);
+	context->filtered.SetGraphicsRootSignature(g_d3d.rs_bindless);
+
+	return context;
+}
+
+//------------------------------------------------------------------------
+// Parallel command list recording
+//
+// Splits a range of items (draws, usually) over the worker threads, with each thread recording its
+// share into its own command list. The lists are submitted in order, so the result is the same as if
+// it had all been recorded on one list. Command lists don't inherit state, so the record function has
+// to set up everything it needs (render targets, viewport, PSO...) besides the root signature and
+// descriptor heap, which are set for it.
+
+typedef void (*D3D12_RecordFunction)(D3D12_CommandList *list, uint32_t first, uint32_t count, void *user_data);
+
+struct D3D12_RecordTask
+{
+	D3D12_CommandContext *context;
+	D3D12_RecordFunction  function;
+	void                 *user_data;
+	uint32_t              first;
+	uint32_t              count;
+};
+
+void D3D12_RecordTaskProc(void *data)
+{
+	D3D12_RecordTask *task = (D3D12_RecordTask *)data;
+
+	CPU_SCOPE("D3D12_RecordTask");
+
+	task->function(&task->context->filtered, task->first, task->count, task->user_data);
+	task->context->list->Close();
+}
+
+void D3D12_RecordParallel(uint32_t item_count, uint32_t min_items_per_list, D3D12_RecordFunction function, void *user_data)
+{
+	D3D12_Frame *frame = D3D12_GetFrameState();
+
+	uint32_t list_count = item_count / min_items_per_list;
+
+	if (list_count > g_work_queue.thread_count) list_count = g_work_queue.thread_count;
+
+	if (list_count <= 1)
+	{
+		// not worth splitting up, just record on the open list
+		function(frame->open_list, 0, item_count, user_data);
+		return;
+	}
+
+	assert(frame->context_count + list_count + 1 <= g_max_command_lists_per_frame);
+
+	//------------------------------------------------------------------------
+	// Everything recorded so far has to go in front of the parallel lists, split barriers can't
+	// carry on into them
+
+	g_d3d.barrier_scheduler.EndSplitBarriers(frame->open_list);
+
+	frame->open_list->list->Close();
+	frame->submission[frame->submission_count++] = frame->open_list->list;
+
+	//------------------------------------------------------------------------
+	// Record
+
+	D3D12_RecordTask tasks[g_max_work_threads];
+
+	uint32_t items_per_list = item_count / list_count;
+	uint32_t remainder      = item_count % list_count;
+	uint32_t first          = 0;
+
+	WorkCounter counter = {};
+
+	for (uint32_t i = 0; i < list_count; i++)
+	{
+		uint32_t count = items_per_list + (i < remainder ? 1 : 0);
+
+		tasks[i] = {
+			.context   = D3D12_OpenCommandContext(),
+			.function  = function,
+			.user_data = user_data,
+			.first     = first,
+			.count     = count,
+		};
+
+		g_work_queue.Add(D3D12_RecordTaskProc, &tasks[i], &counter);
+
+		first += count;
+	}
+
+	g_work_queue.Wait(&counter);
+
+	for (uint32_t i = 0; i < list_count; i++)
+	{
+		frame->submission[frame->submission_count++] = tasks[i].context->list;
+	}
+
+	//------------------------------------------------------------------------
+	// And anything after goes behind them
+
+	frame->open_list = &D3D12_OpenCommandContext()->filtered;
+}
+
+//------------------------------------------------------------------------
+
+// Releases the object once the GPU is done with the frame currently being recorded
+void D3D12_DeferRelease(IUnknown *object)
+{
+	assert(g_d3d.deferred_release_count < ArrayCount(g_d3d.deferred_releases));
+
+	g_d3d.deferred_releases[g_d3d.deferred_release_count++] = {
+		.object      = object,
+		.fence_value = g_d3d.frame_index + 1, // the value D3D12_EndFrame is going to signal for this frame
+	};
+}
+
+// Releases a view from the view cache once the GPU is done with the frame currently being recorded
+void D3D12_DeferReleaseView(D3D12_Descriptor view)
+{
+	assert(g_d3d.deferred_release_count < ArrayCount(g_d3d.deferred_releases));
+
+	g_d3d.deferred_releases[g_d3d.deferred_release_count++] = {
+		.view        = view,
+		.fence_value = g_d3d.frame_index + 1,
+	};
+}
+
+// Does the deferred releases of every frame up to the completed fence value
+void D3D12_ReleaseDeferred(uint64_t completed)
+{
+	for (uint32_t i = 0; i < g_d3d.deferred_release_count;)
+	{
+		D3D12_DeferredRelease *deferred = &g_d3d.deferred_releases[i];
+
+		if (deferred->fence_value <= completed)
+		{
+			if (deferred->object)
+			{
+				deferred->object->Release();
+			}
+			else
+			{
+				g_d3d.view_cache.ReleaseView(deferred->view);
+			}
+
+			*deferred = g_d3d.deferred_releases[--g_d3d.deferred_release_count];
+		}
+		else
+		{
+			i++;
+		}
+	}
+}
+
+//------------------------------------------------------------------------
+
+//------------------------------------------------------------------------
+// GPU profiler
+//
+// D3D12_BeginGpuScope and D3D12_EndGpuScope put a timestamp either side of whatever gets recorded in
+// between, and scopes nest. Begin and end can be on different lists of the same frame, the timestamps
+// are taken in submission order on the one queue. Recording thread only, scopes can't be opened from
+// inside D3D12_RecordParallel's record functions.
+//
+// D3D12_BeginFrame opens a "Frame" scope around everything and D3D12_ExecuteRenderGraph one around
+// each pass, so there's no need to add any for passes. A frame's scopes are read back when its slot
+// comes round again, turned into D3D12_GpuScopeTimings in GetTime's clock with GetClockCalibration,
+// and added to the D3D12_GpuScopeStats of their path, which is where averages come from.
+
+uint32_t D3D12_GetGpuScopeStats(const char *name, uint32_t parent)
+{
+	D3D12_GpuProfiler *profiler = &g_d3d.gpu_profiler;
+
+	for (uint32_t i = 0; i < profiler->stats_count; i++)
+	{
+		D3D12_GpuScopeStats *stats = &profiler->stats[i];
+
+		if (stats->parent == parent && (stats->name == name || strcmp(stats->name, name) == 0))
+		{
+			return i;
+		}
+	}
+
+	if (profiler->stats_count == g_max_gpu_scope_stats)
+	{
+		return UINT32_MAX;
+	}
+
+	profiler->stats[profiler->stats_count] = {
+		.name   = name,
+		.parent = parent,
+		.depth  = parent == UINT32_MAX ? 0 : profiler->stats[parent].depth + 1,
+	};
+
+	return profiler->stats_count++;
+}
+
+// The name has to stay around until the frame has come back, a string literal is best
+void D3D12_BeginGpuScope(D3D12_CommandList *list, const char *name)
+{
+	D3D12_GpuProfiler *profiler = &g_d3d.gpu_profiler;
+	D3D12_Frame       *frame    = D3D12_GetFrameState();
+
+	assert(profiler->open_count < g_max_gpu_scope_depth || !"GPU scopes are nested too deep");
+
+	bool     nested = profiler->open_count > 0;
+	uint32_t parent = nested ? profiler->open_scopes[profiler->open_count - 1] : UINT32_MAX;
+
+	// A scope that doesn't fit is still pushed so its end matches up, but doesn't get timestamps, and
+	// neither do any scopes inside it
+	uint32_t index       = UINT32_MAX;
+	uint32_t stats_index = UINT32_MAX;
+
+	if (frame->gpu_scope_count < g_max_gpu_scopes && !(nested && parent == UINT32_MAX))
+	{
+		stats_index = D3D12_GetGpuScopeStats(name, nested ? frame->gpu_scopes[parent].stats_index : UINT32_MAX);
+	}
+
+	if (stats_index != UINT32_MAX)
+	{
+		index = frame->gpu_scope_count++;
+
+		frame->gpu_scopes[index] = {
+			.stats_index = stats_index,
+			.parent      = parent,
+		};
+
+		uint32_t base = 2*g_max_gpu_scopes*D3D12_GetFrameSlot();
+		list->EndQuery(profiler->query_heap, D3D12_QUERY_TYPE_TIMESTAMP, base + 2*index);
+	}
+	else
+	{
+		profiler->dropped_scopes += 1;
+	}
+
+	profiler->open_scopes[profiler->open_count++] = index;
+}
+
+// Ends the innermost open scope
+void D3D12_EndGpuScope(D3D12_CommandList *list)
+{
+	D3D12_GpuProfiler *profiler = &g_d3d.gpu_profiler;
+
+	assert(profiler->open_count > 0 || !"No GPU scope to end");
+
+	uint32_t index = profiler->open_scopes[--profiler->open_count];
+
+	if (index != UINT32_MAX)
+	{
+		uint32_t base = 2*g_max_gpu_scopes*D3D12_GetFrameSlot();
+		list->EndQuery(profiler->query_heap, D3D12_QUERY_TYPE_TIMESTAMP, base + 2*index + 1);
+	}
+}
+
+// Copies the frame's timestamps into its slot's part of the readback, at the end of the last list
+void D3D12_ResolveGpuScopes(D3D12_CommandList *list)
+{
+	D3D12_GpuProfiler *profiler = &g_d3d.gpu_profiler;
+	D3D12_Frame       *frame    = D3D12_GetFrameState();
+
+	assert(profiler->open_count == 0 || !"GPU scopes left open at the end of the frame");
+
+	uint32_t base = 2*g_max_gpu_scopes*D3D12_GetFrameSlot();
+
+	list->ResolveQueryData(profiler->query_heap, D3D12_QUERY_TYPE_TIMESTAMP, base, 2*frame->gpu_scope_count, profiler->readback, base*sizeof(uint64_t));
+
+	frame->timestamped = true;
+}
+
+LARGE_INTEGER D3D12_GpuToCpuTime(uint64_t gpu_time)
+{
+	D3D12_GpuProfiler *profiler = &g_d3d.gpu_profiler;
+
+	if (!g_qpc_freq.QuadPart)
+	{
+		QueryPerformanceFrequency(&g_qpc_freq);
+	}
+
+	// signed, timestamps from before the calibration come out before it
+	double seconds = (double)(int64_t)(gpu_time - profiler->calibration_gpu) / (double)profiler->frequency;
+
+	LARGE_INTEGER result;
+	result.QuadPart = profiler->calibration_cpu.QuadPart + (LONGLONG)(seconds*(double)g_qpc_freq.QuadPart);
+
+	return result;
+}
+
+// Reads back the scopes of the frame that last used this frame's slot, the GPU has to be done with it
+void D3D12_CollectGpuScopes(D3D12_Frame *frame)
+{
+	D3D12_GpuProfiler *profiler = &g_d3d.gpu_profiler;
+
+	// the two clocks drift apart, so they're lined up again every so often
+	if (TimeElapsed(profiler->calibration_cpu, GetTime()) >= g_gpu_clock_calibration_interval)
+	{
+		HRESULT hr = g_d3d.queue->GetClockCalibration(&profiler->calibration_gpu, (UINT64 *)&profiler->calibration_cpu.QuadPart);
+		CHECK_HR(hr);
+	}
+
+	const uint64_t *values = profiler->values + 2*g_max_gpu_scopes*D3D12_GetFrameSlot();
+
+	for (uint32_t i = 0; i < frame->gpu_scope_count; i++)
+	{
+		const D3D12_GpuScope *scope = &frame->gpu_scopes[i];
+		D3D12_GpuScopeStats  *stats = &profiler->stats[scope->stats_index];
+
+		uint64_t begin = values[2*i + 0];
+		uint64_t end   = values[2*i + 1];
+
+		double duration = end > begin ? (double)(end - begin) / (double)profiler->frequency : 0.0;
+
+		profiler->timings[i] = {
+			.name     = stats->name,
+			.parent   = scope->parent,
+			.depth    = stats->depth,
+			.begin    = D3D12_GpuToCpuTime(begin),
+			.end      = D3D12_GpuToCpuTime(end),
+			.duration = duration,
+		};
+
+		stats->average = stats->frames ? stats->average + (duration - stats->average) / g_gpu_scope_average_frames : duration;
+		stats->frames += 1;
+		stats->total  += duration;
+		stats->last    = duration;
+
+		if (stats->max < duration) stats->max = duration;
+	}
+
+	profiler->timing_count       = frame->gpu_scope_count;
+	profiler->timing_frame_index = frame->fence_value - 1; // the fence value is signalled after the frame
+}
+
+// The stats of the first scope path ending in the name, or null if it hasn't been seen
+const D3D12_GpuScopeStats *D3D12_FindGpuScopeStats(const char *name)
+{
+	D3D12_GpuProfiler *profiler = &g_d3d.gpu_profiler;
+
+	for (uint32_t i = 0; i < profiler->stats_count; i++)
+	{
+		if (strcmp(profiler->stats[i].name, name) == 0)
+		{
+			return &profiler->stats[i];
+		}
+	}
+
+	return nullptr;
+}
+
+// Average GPU time of every scope path under the parent, children indented under theirs
+void D3D12_ReportGpuScopes(uint32_t parent = UINT32_MAX)
+{
+	D3D12_GpuProfiler *profiler = &g_d3d.gpu_profiler;
+
+	for (uint32_t i = 0; i < profiler->stats_count; i++)
+	{
+		const D3D12_GpuScopeStats *stats = &profiler->stats[i];
+
+		if (stats->parent != parent)
+		{
+			continue;
+		}
+
+		char text[256];
+		snprintf(text, sizeof(text), "    %*sGPU %s: %.3f ms average, %.3f ms max\n", 2*stats->depth, "", stats->name, 1000.0*stats->average, 1000.0*stats->max);
+
+		OutputDebugStringA(text);
+
+		D3D12_ReportGpuScopes(i);
+	}
+}
+
+//------------------------------------------------------------------------
+// Fence waits
+//
+// Waits for one or more fences to reach their values through real events, a slice at a time so that a
+// tick callback gets to run while waiting (to report on a long wait, which is all it's used for), and
+// can give up after a timeout. The slice is as long as the report interval, so a long wait wakes the
+// thread about once a second rather than a thousand times; the last slice is cut short to end on the
+// timeout. The completed values decide when the wait is over; the events only say
+// when to look again, so a slice running out or an event left over from before can't end a wait early.
+// One thread at a time, the events are shared.
+
+static constexpr DWORD  g_fence_wait_slice_ms = 1000;
+static constexpr double g_gpu_hang_timeout    = 10.0; // seconds D3D12_BeginFrame waits before deciding the GPU is gone
+
+struct D3D12_FenceWait
+{
+	ID3D12Fence *fence;
+	uint64_t     value;
+};
+
+// Gets the seconds waited so far
+typedef void (*D3D12_WaitTickFunction)(double waited, void *data);
+
+// With wait_all, until every fence gets there, otherwise until any of them does. Returns false if
+// timeout seconds went by first.
+bool D3D12_WaitForFences(const D3D12_FenceWait *waits, uint32_t count, bool wait_all, double timeout = DBL_MAX, D3D12_WaitTickFunction tick = nullptr, void *tick_data = nullptr)
+{
+	assert(count > 0 && count <= ArrayCount(g_d3d.fence_events));
+
+	uint32_t pending_count = 0;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (waits[i].fence->GetCompletedValue() < waits[i].value)
+		{
+			ResetEvent(g_d3d.fence_events[i]);
+
+			HRESULT hr = waits[i].fence->SetEventOnCompletion(waits[i].value, g_d3d.fence_events[i]);
+			CHECK_HR(hr);
+
+			pending_count += 1;
+		}
+	}
+
+	if (pending_count == 0 || (!wait_all && pending_count < count))
+	{
+		return true;
+	}
+
+	LARGE_INTEGER start = GetTime();
+
+	for (;;)
+	{
+		HANDLE   events[ArrayCount(g_d3d.fence_events)];
+		uint32_t event_count = 0;
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			if (waits[i].fence->GetCompletedValue() < waits[i].value)
+			{
+				events[event_count++] = g_d3d.fence_events[i];
+			}
+		}
+
+		if (event_count == 0 || (!wait_all && event_count < count))
+		{
+			return true;
+		}
+
+		double waited = TimeElapsed(start, GetTime());
+
+		if (waited >= timeout)
+		{
+			return false;
+		}
+
+		if (tick)
+		{
+			tick(waited, tick_data);
+		}
+
+		DWORD slice_ms = g_fence_wait_slice_ms;
+
+		if (timeout - waited < 0.001*(double)slice_ms)
+		{
+			slice_ms = (DWORD)(1000.0*(timeout - waited)) + 1;
+		}
+
+		// any one of them coming in is a reason to look again
+		WaitForMultipleObjects(event_count, events, FALSE, slice_ms);
+	}
+}
+
+// The frame fence on the direct queue, which is what nearly everything waits on
+bool D3D12_WaitForFence(uint64_t value, double timeout = DBL_MAX, D3D12_WaitTickFunction tick = nullptr, void *tick_data = nullptr)
+{
+	D3D12_FenceWait wait = {
+		.fence = g_d3d.fence,
+		.value = value,
+	};
+
+	return D3D12_WaitForFences(&wait, 1, true, timeout, tick, tick_data);
+}
+
+struct D3D12_LongWaitReport
+{
+	uint64_t value;
+	double   next_report; // seconds into the wait
+};
+
+// Says something every second or so, so a GPU that has stopped coming back doesn't pass for a hang
+// on the CPU
+void D3D12_ReportLongWait(double waited, void *data)
+{
+	D3D12_LongWaitReport *report = (D3D12_LongWaitReport *)data;
+
+	if (waited < report->next_report)
+	{
+		return;
+	}
+
+	report->next_report += 1.0;
+
+	char text[128];
+	snprintf(text, sizeof(text), "Still waiting on the GPU after %.1f s: fence at %llu, waiting for %llu\n",
+			 waited, (unsigned long long)g_d3d.fence->GetCompletedValue(), (unsigned long long)report->value);
+
+	OutputDebugStringA(text);
+}
+
+// Percentages of the frame time, and which side held the frame up. The GPU time is from a frame or
+// two back, see D3D12_FrameTimes, which is close enough once frames settle down.
+D3D12_FrameOverlap D3D12_GetFrameOverlap(const D3D12_FrameTimes *times)
+{
+	D3D12_FrameOverlap result = {};
+
+	if (times->frame_time <= 0.0)
+	{
+		return result;
+	}
+
+	double waited = times->limiter_wait + times->waitable_wait + times->fence_wait;
+
+	double cpu_busy = 100.0*(times->frame_time - waited) / times->frame_time;
+	double gpu_busy = 100.0*times->gpu_time / times->frame_time;
+
+	result.cpu_busy = (float)(cpu_busy > 0.0 ? cpu_busy : 0.0);
+	result.gpu_busy = (float)(gpu_busy < 100.0 ? gpu_busy : 100.0);
+
+	if      (result.gpu_busy >= 90.0f) result.bound = D3D12_FrameBound_gpu;
+	else if (result.cpu_busy >= 90.0f) result.bound = D3D12_FrameBound_cpu;
+	else                               result.bound = D3D12_FrameBound_display;
+
+	return result;
+}
+
+//------------------------------------------------------------------------
+
+D3D12_LatencyStats *D3D12_GetLatencyStats()
+{
+	return &g_d3d.latency_stats[g_d3d.max_frame_latency - 1][g_d3d.frame_slot_count - 1];
+}
+
+// Matches the last present DXGI says made it to the screen up with its frame's input time
+void D3D12_CollectDisplayLatency()
+{
+	DXGI_FRAME_STATISTICS frame_stats;
+
+	// fails until something has been shown, and whenever DXGI has lost track, e.g. while the window is
+	// being dragged around
+	if (FAILED(g_d3d.swap_chain->GetFrameStatistics(&frame_stats)))
+	{
+		return;
+	}
+
+	if (frame_stats.PresentCount == g_d3d.last_displayed_present)
+	{
+		return;
+	}
+
+	g_d3d.last_displayed_present = frame_stats.PresentCount;
+
+	const D3D12_PresentRecord *record = &g_d3d.presents[frame_stats.PresentCount % ArrayCount(g_d3d.presents)];
+
+	if (record->present_count != frame_stats.PresentCount)
+	{
+		return; // too long ago, the record has been reused
+	}
+
+	double latency = TimeElapsed(record->input_time, frame_stats.SyncQPCTime);
+
+	D3D12_LatencyStats *stats = D3D12_GetLatencyStats();
+
+	stats->displayed       += 1;
+	stats->display_latency += latency;
+
+	if (stats->max_display_latency < latency)
+	{
+		stats->max_display_latency = latency;
+	}
+}
+
+void D3D12_ReportLatencyStats()
+{
+	OutputDebugStringA("Max frame latency, frame slots: frames, waitable wait, fence wait, display latency (max)\n");
+
+	for (uint32_t latency = 1; latency <= g_max_frame_latency; latency++)
+	{
+		for (uint32_t slots = 1; slots <= g_max_frame_slots; slots++)
+		{
+			const D3D12_LatencyStats *stats = &g_d3d.latency_stats[latency - 1][slots - 1];
+
+			if (stats->frames == 0)
+			{
+				continue;
+			}
+
+			double frames    = (double)stats->frames;
+			double displayed = stats->displayed > 0 ? (double)stats->displayed : 1.0;
+
+			char text[256];
+			snprintf(text, sizeof(text), "%u, %u: %u frames, %.2f ms, %.2f ms, %.2f ms (%.2f ms)\n",
+					 latency, slots, stats->frames,
+					 1000.0*stats->waitable_wait   / frames,
+					 1000.0*stats->fence_wait      / frames,
+					 1000.0*stats->display_latency / displayed,
+					 1000.0*stats->max_display_latency);
+
+			OutputDebugStringA(text);
+		}
+	}
+}
+
+// Render thread, between frames. Changing the number of frame slots waits for the GPU to go idle
+// first, since everything in flight was handed a slot by the old count. Slots past the new count
+// aren't used again until it goes back up, so what they hold is dropped rather than collected then as
+// if it were the last frame's; the same goes for anything else kept per slot, see
+// D3D12_DropCullingReadbacks.
+void D3D12_SetFrameLatency(uint32_t max_frame_latency, uint32_t frame_slot_count)
+{
+	assert(max_frame_latency >= 1 && max_frame_latency <= g_max_frame_latency);
+	assert(frame_slot_count  >= 1 && frame_slot_count  <= g_max_frame_slots);
+
+	if (max_frame_latency == g_d3d.max_frame_latency && frame_slot_count == g_d3d.frame_slot_count)
+	{
+		return;
+	}
+
+	// what's been measured so far goes under the old setting
+	D3D12_ReportLatencyStats();
+
+	if (frame_slot_count != g_d3d.frame_slot_count)
+	{
+		D3D12_WaitForFence(g_d3d.frame_index);
+
+		for (uint32_t slot = frame_slot_count; slot < g_max_frame_slots; slot++)
+		{
+			D3D12_Frame *frame = &g_d3d.frames[slot];
+
+			frame->timestamped     = false;
+			frame->gpu_scope_count = 0;
+		}
+
+		g_d3d.frame_slot_count = frame_slot_count;
+	}
+
+	if (max_frame_latency != g_d3d.max_frame_latency)
+	{
+		HRESULT hr = g_d3d.swap_chain->SetMaximumFrameLatency(max_frame_latency);
+		CHECK_HR(hr);
+
+		g_d3d.max_frame_latency = max_frame_latency;
+	}
+
+	char text[128];
+	snprintf(text, sizeof(text), "Max frame latency %u, %u frame slots\n", max_frame_latency, frame_slot_count);
+
+	OutputDebugStringA(text);
+}
+
+// input_time is when whatever the frame is going to show was sampled, it's only used to measure latency
+void D3D12_BeginFrame(LARGE_INTEGER input_time)
+{
+	CPU_SCOPE("D3D12_BeginFrame");
+
+	D3D12_Frame        *frame = D3D12_GetFrameState();
+	D3D12_LatencyStats *stats = D3D12_GetLatencyStats();
+
+	D3D12_FrameTimes *times = &g_d3d.frame_times;
+
+	LARGE_INTEGER waitable_start = GetTime();
+
+	times->frame_time   = g_d3d.frame_start.QuadPart ? TimeElapsed(g_d3d.frame_start, waitable_start) : 0.0;
+	times->limiter_wait = 0.0;
+	times->frames_ahead = (uint32_t)(g_d3d.frame_index - g_d3d.fence->GetCompletedValue());
+
+	g_d3d.frame_start = waitable_start;
+
+	//------------------------------------------------------------------------
+	// Wait for the swap chain to want another frame. The timeout is so that a present that never
+	// comes back doesn't take us down with it.
+
+	WaitForSingleObjectEx(g_d3d.frame_latency_waitable, 1000, TRUE);
+
+	//------------------------------------------------------------------------
+	// Wait for frame
+
+	LARGE_INTEGER fence_start = GetTime();
+
+	D3D12_LongWaitReport report = {
+		.value       = frame->fence_value,
+		.next_report = 1.0,
+	};
+
+	if (!D3D12_WaitForFence(frame->fence_value, g_gpu_hang_timeout, D3D12_ReportLongWait, &report))
+	{
+		char text[128];
+		snprintf(text, sizeof(text), "The GPU hasn't finished frame %llu in %.0f s, device removed reason %08X\n",
+				 (unsigned long long)frame->fence_value, g_gpu_hang_timeout, (uint32_t)g_d3d.device->GetDeviceRemovedReason());
+
+		OutputDebugStringA(text);
+
+		// nothing better to do than keep waiting, a hang that clears up on its own is reported and the
+		// frame goes on
+		D3D12_WaitForFence(frame->fence_value, DBL_MAX, D3D12_ReportLongWait, &report);
+	}
+
+	LARGE_INTEGER waited = GetTime();
+
+	// timed already, no need for scopes
+	CpuProfiler_Record("Swap Chain Wait", waitable_start, fence_start);
+	CpuProfiler_Record("Fence Wait",      fence_start,    waited);
+
+	times->waitable_wait = TimeElapsed(waitable_start, fence_start);
+	times->fence_wait    = TimeElapsed(fence_start, waited);
+
+	stats->frames        += 1;
+	stats->waitable_wait += times->waitable_wait;
+	stats->fence_wait    += times->fence_wait;
+
+	D3D12_CollectDisplayLatency();
+
+	//------------------------------------------------------------------------
+	// The GPU is done with the last frame in this slot, so its timestamps are in
+
+	if (frame->timestamped)
+	{
+		D3D12_CollectGpuScopes(frame);
+		times->gpu_time = g_d3d.gpu_profiler.timings[0].duration;
+
+		frame->timestamped = false;
+	}
+
+	//------------------------------------------------------------------------
+	// Pick up the backbuffer, which doesn't go round in step with the frame slots
+
+	UINT backbuffer_index = g_d3d.swap_chain->GetCurrentBackBufferIndex();
+
+	frame->backbuffer = g_d3d.backbuffers    [backbuffer_index];
+	frame->rtv        = g_d3d.backbuffer_rtvs[backbuffer_index];
+	frame->input_time = input_time;
+
+	//------------------------------------------------------------------------
+	// Release objects the GPU is now done with
+
+	D3D12_ReleaseDeferred(g_d3d.fence->GetCompletedValue());
+
+	//------------------------------------------------------------------------
+	// Clear frame upload arena
+
+	frame->upload_arena.Reset();
+
+	//------------------------------------------------------------------------
+	// Initialize command list
+
+	frame->context_count    = 0;
+	frame->submission_count = 0;
+
+	frame->capturing         = g_d3d.capture_next_frame;
+	g_d3d.capture_next_frame = false;
+
+	frame->open_list = &D3D12_OpenCommandContext()->filtered;
+
+	// this list is the first one D3D12_EndFrame submits
+	frame->gpu_scope_count = 0;
+	D3D12_BeginGpuScope(frame->open_list, "Frame");
+}
+
+//------------------------------------------------------------------------
+
+// Writes out the command streams of a captured frame, as frame_<index>.d3d12cmds for replaying and
+// frame_<index>.txt for reading and diffing
+void D3D12_WriteFrameCapture(D3D12_Frame *frame)
+{
+	const D3D12_CommandStream *streams[g_max_command_lists_per_frame];
+
+	size_t total_size = 0;
+
+	for (uint32_t i = 0; i < frame->context_count; i++)
+	{
+		// contexts are opened in the same order their lists get submitted in, see D3D12_RecordParallel
+		assert(frame->submission[i] == frame->contexts[i]->list);
+
+		streams[i]  = &frame->contexts[i]->stream;
+		total_size += streams[i]->size;
+	}
+
+	char path[64];
+	snprintf(path, sizeof(path), "frame_%llu.d3d12cmds", (unsigned long long)g_d3d.frame_index);
+
+	bool written = D3D12_WriteCommandStreams(path, streams, frame->context_count);
+
+	snprintf(path, sizeof(path), "frame_%llu.txt", (unsigned long long)g_d3d.frame_index);
+
+	FILE *text = fopen(path, "w");
+	if (text)
+	{
+		for (uint32_t i = 0; i < frame->context_count; i++)
+		{
+			fprintf(text, "// command list %u: %u commands, %llu bytes\n", i, streams[i]->command_count, (unsigned long long)streams[i]->size);
+			D3D12_PrintCommandStream(text, streams[i]);
+		}
+
+		fclose(text);
+	}
+
+	char message[256];
+	snprintf(message, sizeof(message), "%s frame %llu: %u command lists, %llu bytes of commands\n",
+			 written ? "Captured" : "Failed to write capture of",
+			 (unsigned long long)g_d3d.frame_index, frame->context_count, (unsigned long long)total_size);
+
+	OutputDebugStringA(message);
+}
+
+//------------------------------------------------------------------------
+
+void D3D12_EndFrame()
+{
+	CPU_SCOPE("D3D12_EndFrame");
+
+	D3D12_Frame *frame = D3D12_GetFrameState();
+
+	//------------------------------------------------------------------------
+	// Switch render target to present state
+
+	D3D12_CommandList *list = frame->open_list;
+
+	g_d3d.state_tracker.Transition(frame->backbuffer, D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES, D3D12_RESOURCE_STATE_PRESENT);
+	g_d3d.state_tracker.Flush(list);
+
+	D3D12_EndGpuScope(list);
+	D3D12_ResolveGpuScopes(list);
+
+	//------------------------------------------------------------------------
+	// Submit command lists
+
+	list->list->Close();
+
+	frame->submission[frame->submission_count++] = list->list;
+	frame->open_list = nullptr;
+
+	g_d3d.queue->ExecuteCommandLists(frame->submission_count, frame->submission);
+
+	if (frame->capturing)
+	{
+		D3D12_WriteFrameCapture(frame);
+		frame->capturing = false;
+	}
+
+	g_d3d.state_tracker.Decay();
+
+	//------------------------------------------------------------------------
+	// Present
+
+	if (g_d3d.present_mode == D3D12_PresentMode_vsync)
+	{
+		g_d3d.swap_chain->Present(1, 0);
+	}
+	else
+	{
+		g_d3d.swap_chain->Present(0, g_d3d.tearing_supported ? DXGI_PRESENT_ALLOW_TEARING : 0);
+	}
+
+	UINT present_count;
+
+	if (SUCCEEDED(g_d3d.swap_chain->GetLastPresentCount(&present_count)))
+	{
+		g_d3d.presents[present_count % ArrayCount(g_d3d.presents)] = {
+			.present_count = present_count,
+			.input_time    = frame->input_time,
+		};
+	}
+
+	//------------------------------------------------------------------------
+	// Advance fence
+
+	frame->fence_value = ++g_d3d.frame_index;
+	g_d3d.queue->Signal(g_d3d.fence, frame->fence_value);
+
+	//------------------------------------------------------------------------
+	// Hand the command lists back, to be reused once the fence passes this frame
+
+	D3D12_CommandListStats *stats = &g_d3d.command_list_stats;
+	ZeroStruct(stats);
+
+	for (uint32_t i = 0; i < frame->context_count; i++)
+	{
+		D3D12_CommandContext *context = frame->contexts[i];
+
+		stats->calls                   += context->filtered.stats.calls;
+		stats->calls_filtered          += context->filtered.stats.calls_filtered;
+		stats->root_constants          += context->filtered.stats.root_constants;
+		stats->root_constants_filtered += context->filtered.stats.root_constants_filtered;
+		stats->draws                   += context->filtered.stats.draws;
+		stats->dispatches              += context->filtered.stats.dispatches;
+
+		g_d3d.direct_pool.Retire(context, frame->fence_value);
+	}
+
+	frame->context_count = 0;
+
+	g_d3d.direct_pool.EndFrame();
+}
+
+//------------------------------------------------------------------------
+// Render graph execution
+
+D3D12_TransientResource *D3D12_GetTransientResource(const D3D12_RGResource *rg_resource)
+{
+	D3D12_TransientHeap *transient_heap = &g_d3d.transient_heap;
+
+	for (uint32_t i = 0; i < transient_heap->resource_count; i++)
+	{
+		D3D12_TransientResource *transient = &transient_heap->resources[i];
+
+		const D3D12_RESOURCE_DESC *a = &transient->desc;
+		const D3D12_RESOURCE_DESC *b = &rg_resource->desc;
+
+		bool same_desc = 
+			a->Dimension          == b->Dimension          &&
+			a->Alignment          == b->Alignment          &&
+			a->Width              == b->Width              &&
+			a->Height             == b->Height             &&
+			a->DepthOrArraySize   == b->DepthOrArraySize   &&
+			a->MipLevels          == b->MipLevels          &&
+			a->Format             == b->Format             &&
+			a->SampleDesc.Count   == b->SampleDesc.Count   &&
+			a->SampleDesc.Quality == b->SampleDesc.Quality &&
+			a->Layout             == b->Layout             &&
+			a->Flags              == b->Flags;
+
+		if (same_desc && transient->heap_offset == rg_resource->heap_offset)
+		{
+			return transient;
+		}
+	}
+
+	HRESULT hr;
+
+	assert(transient_heap->resource_count < g_max_transient_resources);
+
+	D3D12_TransientResource *transient = &transient_heap->resources[transient_heap->resource_count++];
+	ZeroStruct(transient);
+
+	transient->desc        = rg_resource->desc;
+	transient->heap_offset = rg_resource->heap_offset;
+
+	hr = g_d3d.device->CreatePlacedResource(
+		transient_heap->heap,
+		rg_resource->heap_offset,
+		&rg_resource->desc,
+		D3D12_RESOURCE_STATE_COMMON,
+		nullptr,
+		IID_PPV_ARGS(&transient->resource));
+	CHECK_HR(hr);
+
+	g_d3d.state_tracker.Register(transient->resource, D3D12_GetSubresourceCount(&rg_resource->desc), D3D12_RESOURCE_STATE_COMMON, false);
+
+	if (rg_resource->desc.Flags & D3D12_RESOURCE_FLAG_ALLOW_RENDER_TARGET)
+	{
+		transient->rtv     = g_d3d.rtv.Allocate();
+		transient->has_rtv = true;
+		g_d3d.device->CreateRenderTargetView(transient->resource, nullptr, transient->rtv.cpu);
+	}
+
+	if (!(rg_resource->desc.Flags & D3D12_RESOURCE_FLAG_DENY_SHADER_RESOURCE))
+	{
+		transient->srv     = g_d3d.view_cache.GetSRV(transient->resource, nullptr);
+		transient->has_srv = true;
+	}
+
+	return transient;
+}
+
+void D3D12_EvictTransientResource(D3D12_TransientResource *transient)
+{
+	g_d3d.state_tracker.Unregister(transient->resource);
+
+	// RTVs are only read while recording, but in-flight frames could still be sampling through the SRV
+	if (transient->has_rtv)
+	{
+		g_d3d.rtv.Free(transient->rtv);
+	}
+
+	if (transient->has_srv)
+	{
+		D3D12_DeferReleaseView(transient->srv);
+	}
+
+	D3D12_DeferRelease(transient->resource);
+}
+
+void D3D12_ExecuteRenderGraph(D3D12_RenderGraph *graph)
+{
+	D3D12_TransientHeap *transient_heap = &g_d3d.transient_heap;
+
+	//------------------------------------------------------------------------
+	// Grow the heap if the graph doesn't fit, the old one goes away along with everything in it
+
+	if (graph->heap_size > transient_heap->size)
+	{
+		for (uint32_t i = 0; i < transient_heap->resource_count; i++)
+		{
+			D3D12_EvictTransientResource(&transient_heap->resources[i]);
+		}
+		transient_heap->resource_count = 0;
+
+		if (transient_heap->heap)
+		{
+			D3D12_DeferRelease(transient_heap->heap);
+		}
+
+		D3D12_HEAP_DESC desc = {
+			.SizeInBytes = graph->heap_size,
+			.Properties  = { .Type = D3D12_HEAP_TYPE_DEFAULT },
+			.Alignment   = D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT,
+			.Flags       = D3D12_HEAP_FLAG_ALLOW_ONLY_RT_DS_TEXTURES,
+		};
+
+		HRESULT hr = g_d3d.device->CreateHeap(&desc, IID_PPV_ARGS(&transient_heap->heap));
+		CHECK_HR(hr);
+
+		transient_heap->heap->SetName(L"Render Graph Transient Heap");
+		transient_heap->size = graph->heap_size;
+	}
+
+	//------------------------------------------------------------------------
+	// Hook the graph's transient resources up to placed resources
+
+	for (uint32_t i = 0; i < graph->resource_count; i++)
+	{
+		D3D12_RGResource *rg_resource = &graph->resources[i];
+
+		if (rg_resource->imported || rg_resource->first_pass == UINT32_MAX)
+		{
+			continue;
+		}
+
+		D3D12_TransientResource *transient = D3D12_GetTransientResource(rg_resource);
+		transient->last_used_frame = g_d3d.frame_index;
+
+		rg_resource->resource = transient->resource;
+		rg_resource->rtv      = transient->rtv;
+		rg_resource->srv      = transient->srv;
+	}
+
+	// placed resources the graph hasn't asked for in a while are let go
+	for (uint32_t i = 0; i < transient_heap->resource_count;)
+	{
+		D3D12_TransientResource *transient = &transient_heap->resources[i];
+
+		if (g_d3d.frame_index - transient->last_used_frame > g_d3d.frame_slot_count)
+		{
+			D3D12_EvictTransientResource(transient);
+			*transient = transient_heap->resources[--transient_heap->resource_count];
+		}
+		else
+		{
+			i++;
+		}
+	}
+
+	//------------------------------------------------------------------------
+	// Schedule barriers
+
+	D3D12_BarrierScheduler *scheduler = &g_d3d.barrier_scheduler;
+	scheduler->Begin();
+
+	for (uint32_t order_index = 0; order_index < graph->order_count; order_index++)
+	{
+		uint32_t pass_index = graph->order[order_index];
+		scheduler->AddPass(graph->passes[pass_index].work);
+
+		for (uint32_t i = 0; i < graph->access_count; i++)
+		{
+			D3D12_RGAccess *access = &graph->accesses[i];
+
+			if (access->pass_index != pass_index)
+			{
+				continue;
+			}
+
+			D3D12_RGResource *rg_resource = &graph->resources[access->resource_index];
+
+			// aliased memory belongs to someone else until the aliasing barrier in front of the first use
+			bool allow_early_begin = !rg_resource->needs_aliasing_barrier;
+
+			scheduler->AddAccess(graph->GetResource({ access->resource_index }), D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES, access->state, allow_early_begin);
+		}
+	}
+
+	scheduler->Compile(&g_d3d.state_tracker);
+
+	//------------------------------------------------------------------------
+	// Record the passes
+
+	for (uint32_t order_index = 0; order_index < graph->order_count; order_index++)
+	{
+		D3D12_RGPass *pass = &graph->passes[graph->order[order_index]];
+
+		CPU_SCOPE(pass->name);
+
+		// passes may record in parallel, which leaves a different list open afterwards
+		D3D12_CommandList *list = D3D12_GetCommandList();
+
+		// barriers in front of a pass count towards it
+		D3D12_BeginGpuScope(list, pass->name);
+
+		D3D12_RESOURCE_BARRIER aliasing_barriers[g_rg_max_resources];
+		uint32_t               aliasing_barrier_count = 0;
+
+		for (uint32_t i = 0; i < graph->resource_count; i++)
+		{
+			D3D12_RGResource *rg_resource = &graph->resources[i];
+
+			if (rg_resource->first_pass == order_index && rg_resource->needs_aliasing_barrier)
+			{
+				aliasing_barriers[aliasing_barrier_count++] = {
+					.Type     = D3D12_RESOURCE_BARRIER_TYPE_ALIASING,
+					.Aliasing = {
+						.pResourceBefore = nullptr,
+						.pResourceAfter  = rg_resource->resource,
+					},
+				};
+			}
+		}
+
+		if (aliasing_barrier_count > 0)
+		{
+			list->ResourceBarrier(aliasing_barrier_count, aliasing_barriers);
+		}
+
+		scheduler->Issue(order_index, list);
+
+		// Placed render and depth targets have to be initialized before anything else touches them, on
+		// every first use and not just the aliased ones: what a transient held last frame is undefined, and
+		// a placed resource that was only just created was never initialized at all. Copying over the whole
+		// thing counts as initializing it too, anything else has to start with a render or depth write.
+		for (uint32_t i = 0; i < graph->resource_count; i++)
+		{
+			D3D12_RGResource *rg_resource = &graph->resources[i];
+
+			if (rg_resource->imported || rg_resource->first_pass != order_index)
+			{
+				continue;
+			}
+
+			bool discardable = 
+				rg_resource->first_state == D3D12_RESOURCE_STATE_RENDER_TARGET ||
+				rg_resource->first_state == D3D12_RESOURCE_STATE_DEPTH_WRITE;
+
+			assert(discardable || rg_resource->first_state == D3D12_RESOURCE_STATE_COPY_DEST ||
+				   !"A transient render or depth target has to be first written as one, or copied to");
+
+			if (discardable)
+			{
+				list->DiscardResource(rg_resource->resource);
+			}
+		}
+
+		pass->execute(graph, list, pass->user_data);
+
+		D3D12_EndGpuScope(D3D12_GetCommandList());
+	}
+
+	// after recording, which is when splits might have had to end early
+	graph->stats.barriers = scheduler->stats;
+}
+
+//------------------------------------------------------------------------
+// Shader and PSO
+
+struct Vector2D
+{
+	float x, y;
+};
+
+struct Vector3D
+{
+	float x, y, z;
+};
+
+struct Vector4D
+{
+	float x, y, z, w;
+};
+
+struct Rect2D
+{
+	float min_x;
+	float min_y;
+	float max_x;
+	float max_y;
+};
+
+struct Vertex
+{
+	Vector2D position;
+	Vector2D uv;
+	Vector4D color;
+};
+
+struct D3D12_PassConstants
+{
+	uint32_t vbuffer_srv;
+	uint32_t instances_srv; // only for instanced draws
+};
+
+// Per object data. Instanced draws read the same thing per instance from a structured buffer instead.
+struct D3D12_RootConstants
+{
+	Vector2D offset;
+	uint32_t texture_index;
+	uint32_t color; // RGBA8, red in the low byte
+};
+
+static_assert(sizeof(D3D12_RootConstants) % 4 == 0, "Root constants have to be a multiple of 4 bytes");
+
+// One record in an ExecuteIndirect argument buffer, laid out the way scene->draw_signature expects:
+// the root constants for the draw, followed by the draw itself.
+struct D3D12_IndirectDraw
+{
+	D3D12_RootConstants          constants;
+	D3D12_DRAW_INDEXED_ARGUMENTS draw;
+};
+
+static_assert(sizeof(D3D12_IndirectDraw) % 4 == 0, "Command signature byte stride has to be a multiple of 4 bytes");
+
+const char g_shader_source[] = "#line " STRINGIFY(__LINE__) R"(
+
+//------------------------------------------------------------------------
+// Shader inputs
+
+struct Vertex
+{
+	float2 position;
+	float2 uv;
+	float4 color;
+};
+
+struct PassConstants
+{
+	uint vbuffer_index;
+	uint instances_index;
+};
+
+struct RootConstants
+{
+	float2 offset;
+	uint   texture_index;
+	uint   color;
+};
+
+struct VertexOutput
+{
+	                float4 position      : SV_Position;
+	                float2 uv            : TEXCOORD;
+	                float4 color         : COLOR;
+	nointerpolation uint   texture_index : TEXTURE_INDEX;
+};
+
+ConstantBuffer<PassConstants> pass : register(b1);
+ConstantBuffer<RootConstants> root : register(b0);
+
+sampler s_nearest : register(s0);
+
+//------------------------------------------------------------------------
+// Vertex shader
+
+float4 UnpackColor(uint color)
+{
+	return float4(color & 0xFF, (color >> 8) & 0xFF, (color >> 16) & 0xFF, color >> 24) / 255.0f;
+}
+
+VertexOutput TransformVertex(uint vertex_index, RootConstants object)
+{
+    StructuredBuffer<Vertex> vbuffer = ResourceDescriptorHeap[pass.vbuffer_index];
+
+	Vertex vertex = vbuffer.Load(vertex_index);
+
+	VertexOutput result;
+	result.position      = float4(vertex.position + object.offset, 0, 1);
+	result.uv            = vertex.uv;
+	result.color         = vertex.color*UnpackColor(object.color);
+	result.texture_index = object.texture_index;
+
+	return result;
+}
+
+VertexOutput MainVS(in uint in_vertex_index : SV_VertexID)
+{
+	return TransformVertex(in_vertex_index, root);
+}
+
+VertexOutput MainInstancedVS(
+	in uint in_vertex_index   : SV_VertexID,
+	in uint in_instance_index : SV_InstanceID)
+{
+	StructuredBuffer<RootConstants> instances = ResourceDescriptorHeap[pass.instances_index];
+
+	return TransformVertex(in_vertex_index, instances.Load(in_instance_index));
+}
+
+//------------------------------------------------------------------------
+// Pixel shader
+
+float4 MainPS(in VertexOutput input) : SV_Target
+{
+	Texture2D texture = ResourceDescriptorHeap[input.texture_index];
+
+	float4 color = texture.SampleLevel(s_nearest, input.uv, 0);
+
+	color *= input.color;
+
+	return color;
+}
+
+)";
+
+ID3D12PipelineState *D3D12_CreatePSO(const wchar_t *vs_entry_point = L"MainVS")
+{
+	IDxcBlob *error = nullptr;
+
+	//------------------------------------------------------------------------
+	// Compile vertex shader
+
+	IDxcBlob *vs = nullptr;
+	if (!DXC_CompileShader(g_shader_source, sizeof(g_shader_source), vs_entry_point, L"vs_6_6", &vs, &error))
+	{
+		const char *error_message = (char *)error->GetBufferPointer();
+		OutputDebugStringA("Failed to compile vertex shader:\n");
+		OutputDebugStringA(error_message);
+		assert(!"Failed to compile vertex shader, see debugger output for details");
+	}
+	COM_SAFE_RELEASE(error);
+
+	//------------------------------------------------------------------------
+	// Compile pixel shader
+
+	IDxcBlob *ps = nullptr;
+	if (!DXC_CompileShader(g_shader_source, sizeof(g_shader_source), L"MainPS", L"ps_6_6", &ps, &error))
+	{
+		const char *error_message = (char *)error->GetBufferPointer();
+		OutputDebugStringA("Failed to compile pixel shader:\n");
+		OutputDebugStringA(error_message);
+		assert(!"Failed to compile pixel shader, see debugger output for details");
+	}
+	COM_SAFE_RELEASE(error);
+
+	//------------------------------------------------------------------------
+	// Create PSO
+
+	D3D12_GRAPHICS_PIPELINE_STATE_DESC desc = {
+		.pRootSignature = g_d3d.rs_bindless,
+		.VS = {
+			.pShaderBytecode = vs->GetBufferPointer(),
+			.BytecodeLength  = vs->GetBufferSize(),
+		},
+		.PS = {
+			.pShaderBytecode = ps->GetBufferPointer(),
+			.BytecodeLength  = ps->GetBufferSize(),
+		},
+		.BlendState = {
+			.RenderTarget = {
+				{
+					.BlendEnable = true,
+					.SrcBlend              = D3D12_BLEND_SRC_ALPHA,
+					.DestBlend             = D3D12_BLEND_INV_SRC_ALPHA,
+					.BlendOp               = D3D12_BLEND_OP_ADD,
+					.SrcBlendAlpha         = D3D12_BLEND_INV_DEST_ALPHA,
+					.DestBlendAlpha        = D3D12_BLEND_ONE,
+					.BlendOpAlpha          = D3D12_BLEND_OP_ADD,
+					.RenderTargetWriteMask = D3D12_COLOR_WRITE_ENABLE_ALL,
+				},
+			},
+		},
+		.SampleMask = D3D12_DEFAULT_SAMPLE_MASK,
+		.RasterizerState = {
+			.FillMode = D3D12_FILL_MODE_SOLID,
+			.CullMode = D3D12_CULL_MODE_NONE,
+			.FrontCounterClockwise = true,
+		},
+		.PrimitiveTopologyType = D3D12_PRIMITIVE_TOPOLOGY_TYPE_TRIANGLE,
+		.NumRenderTargets = 1,
+		.RTVFormats = {
+			DXGI_FORMAT_R8G8B8A8_UNORM_SRGB,
+		},
+		.SampleDesc = { .Count = 1, .Quality = 0 },
+	};
+
+	ID3D12PipelineState *pso;
+	HRESULT hr = g_d3d.device->CreateGraphicsPipelineState(&desc, IID_PPV_ARGS(&pso));
+	CHECK_HR(hr);
+
+	return pso;
+}
+
+//------------------------------------------------------------------------
+// GPU culling
+//
+// A compute pass tests each object's bounds against the view and appends the draws of the ones that
+// survive to an argument buffer, counting them in a count buffer for ExecuteIndirect to pick up. The
+// scene is 2D, so the view is four lines bounding clip space rather than six planes.
+
+struct D3D12_CullBounds
+{
+	Vector2D center;
+	Vector2D extents;
+};
+
+// Points with dot(normal, p) + distance >= 0 are on the inside
+struct D3D12_CullPlane
+{
+	Vector2D normal;
+	float    distance;
+	float    pad;
+};
+
+struct D3D12_CullConstants
+{
+	D3D12_CullPlane planes[4];
+	uint32_t        object_count;
+	uint32_t        bounds_srv;
+	uint32_t        draws_srv;
+	uint32_t        out_draws_uav;
+	uint32_t        out_count_uav;
+};
+
+static_assert(sizeof(D3D12_CullConstants) % 4 == 0, "Root constants have to be a multiple of 4 bytes");
+
+static constexpr uint32_t g_cull_group_size = 64;
+
+const char g_cull_shader_source[] = "#line " STRINGIFY(__LINE__) R"(
+
+struct CullBounds
+{
+	float2 center;
+	float2 extents;
+};
+
+struct CullPlane
+{
+	float2 normal;
+	float  distance;
+	float  pad;
+};
+
+struct CullConstants
+{
+	CullPlane planes[4];
+	uint      object_count;
+	uint      bounds_srv;
+	uint      draws_srv;
+	uint      out_draws_uav;
+	uint      out_count_uav;
+};
+
+struct IndirectDraw
+{
+	float2 offset;
+	uint   texture_index;
+	uint   color;
+	uint   index_count_per_instance;
+	uint   instance_count;
+	uint   start_index_location;
+	int    base_vertex_location;
+	uint   start_instance_location;
+};
+
+ConstantBuffer<CullConstants> cull : register(b0);
+
+[numthreads(64, 1, 1)]
+void CullCS(uint thread_index : SV_DispatchThreadID)
+{
+	bool visible = false;
+
+	if (thread_index < cull.object_count)
+	{
+		StructuredBuffer<CullBounds> bounds_buffer = ResourceDescriptorHeap[cull.bounds_srv];
+
+		CullBounds bounds = bounds_buffer.Load(thread_index);
+
+		visible = true;
+
+		for (uint i = 0; i < 4; i++)
+		{
+			CullPlane plane = cull.planes[i];
+
+			float distance = dot(plane.normal, bounds.center) + dot(abs(plane.normal), bounds.extents) + plane.distance;
+
+			if (distance < 0.0f)
+			{
+				visible = false;
+			}
+		}
+	}
+
+	// Compact within the wave first, so there's only one atomic per wave rather than per object
+	uint lane_offset = WavePrefixCountBits(visible);
+	uint wave_count  = WaveActiveCountBits(visible);
+	uint wave_offset = 0;
+
+	if (WaveIsFirstLane() && wave_count > 0)
+	{
+		RWByteAddressBuffer out_count = ResourceDescriptorHeap[cull.out_count_uav];
+		out_count.InterlockedAdd(0, wave_count, wave_offset);
+	}
+
+	wave_offset = WaveReadLaneFirst(wave_offset);
+
+	if (visible)
+	{
+		StructuredBuffer<IndirectDraw>   draws     = ResourceDescriptorHeap[cull.draws_srv];
+		RWStructuredBuffer<IndirectDraw> out_draws = ResourceDescriptorHeap[cull.out_draws_uav];
+
+		out_draws[wave_offset + lane_offset] = draws.Load(thread_index);
+	}
+}
+
+)";
+
+ID3D12PipelineState *D3D12_CreateCullPSO()
+{
+	IDxcBlob *error = nullptr;
+
+	IDxcBlob *cs = nullptr;
+	if (!DXC_CompileShader(g_cull_shader_source, sizeof(g_cull_shader_source), L"CullCS", L"cs_6_6", &cs, &error))
+	{
+		const char *error_message = (char *)error->GetBufferPointer();
+		OutputDebugStringA("Failed to compile culling shader:\n");
 		OutputDebugStringA(error_message);
-		assert(!"Failed to compile vertex shader, see debugger output for details");
+		assert(!"Failed to compile culling shader, see debugger output for details");
+	}
+	COM_SAFE_RELEASE(error);
+
+	D3D12_COMPUTE_PIPELINE_STATE_DESC desc = {
+		.pRootSignature = g_d3d.rs_bindless,
+		.CS = {
+			.pShaderBytecode = cs->GetBufferPointer(),
+			.BytecodeLength  = cs->GetBufferSize(),
+		},
+	};
+
+	ID3D12PipelineState *pso;
+	HRESULT hr = g_d3d.device->CreateComputePipelineState(&desc, IID_PPV_ARGS(&pso));
+	CHECK_HR(hr);
+
+	return pso;
+}
+
+// The edges of clip space
+void D3D12_GetClipSpaceCullPlanes(D3D12_CullPlane out[4])
+{
+	out[0] = { .normal = {  1.0f,  0.0f }, .distance = 1.0f };
+	out[1] = { .normal = { -1.0f,  0.0f }, .distance = 1.0f };
+	out[2] = { .normal = {  0.0f,  1.0f }, .distance = 1.0f };
+	out[3] = { .normal = {  0.0f, -1.0f }, .distance = 1.0f };
+}
+
+// Must stay the same test as CullCS
+bool D3D12_CullIsVisible(const D3D12_CullPlane planes[4], const D3D12_CullBounds *bounds)
+{
+	for (uint32_t i = 0; i < 4; i++)
+	{
+		const D3D12_CullPlane *plane = &planes[i];
+
+		float distance = 
+			plane->normal.x*bounds->center.x + plane->normal.y*bounds->center.y +
+			fabsf(plane->normal.x)*bounds->extents.x + fabsf(plane->normal.y)*bounds->extents.y +
+			plane->distance;
+
+		if (distance < 0.0f)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// CPU reference for CullCS, to validate the GPU results against. The GPU appends in whatever order the
+// waves happen to finish in, so only the count and the set of draws are comparable, not their order.
+uint32_t D3D12_CullDrawsReference(
+	const D3D12_CullPlane     planes[4],
+	const D3D12_CullBounds   *bounds,
+	const D3D12_IndirectDraw *draws,
+	uint32_t                  object_count,
+	D3D12_IndirectDraw       *out_draws)
+{
+	uint32_t visible_count = 0;
+
+	for (uint32_t i = 0; i < object_count; i++)
+	{
+		if (D3D12_CullIsVisible(planes, &bounds[i]))
+		{
+			if (out_draws) out_draws[visible_count] = draws[i];
+			visible_count += 1;
+		}
+	}
+
+	return visible_count;
+}
+
+//------------------------------------------------------------------------
+// Triangle guys
+//
+// Kept as a structure of arrays, so the per frame update streams through exactly the data it needs and
+// does g_simd_width guys per instruction. Every array is 64 byte aligned and padded out to a whole number
+// of vectors, so the SIMD loops never need a scalar tail. The padding is kept zeroed when it's handed
+// out, and the update is free to write garbage into it.
+//
+// Each guy bobs around on two sines, whose phases are worked out in double precision and wrapped to
+// [0, 2pi) up front. Adding a frame's time to those stays small enough for a float, so the sines can
+// be done with a cheap polynomial instead of calling sin twice per guy in double.
+
+static constexpr uint32_t g_triangle_guy_align = 64;
+
+// The update and the interpolation work on FloatV through the macros below instead of on SSE directly,
+// so another instruction set is a typedef and a set of macros away. With AVX turned on (/arch:AVX or
+// /arch:AVX2) that's eight guys at a time, and NEON's float32x4_t would drop in the same way.
+#if defined(__AVX__)
+
+typedef __m256 FloatV;
+
+static constexpr uint32_t g_simd_width = 8;
+
+#define FloatV_Set1(x)       _mm256_set1_ps(x)
+#define FloatV_Zero()        _mm256_setzero_ps()
+#define FloatV_Load(p)       _mm256_load_ps(p)
+#define FloatV_Store(p, x)   _mm256_store_ps(p, x)
+#define FloatV_Add(a, b)     _mm256_add_ps(a, b)
+#define FloatV_Sub(a, b)     _mm256_sub_ps(a, b)
+#define FloatV_Mul(a, b)     _mm256_mul_ps(a, b)
+#define FloatV_And(a, b)     _mm256_and_ps(a, b)
+#define FloatV_Or(a, b)      _mm256_or_ps(a, b)
+#define FloatV_AndNot(a, b)  _mm256_andnot_ps(a, b)
+#define FloatV_Greater(a, b) _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#define FloatV_Less(a, b)    _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define FloatV_Round(x)      _mm256_cvtepi32_ps(_mm256_cvtps_epi32(x))
+
+#else
+
+typedef __m128 FloatV;
+
+static constexpr uint32_t g_simd_width = 4;
+
+#define FloatV_Set1(x)       _mm_set1_ps(x)
+#define FloatV_Zero()        _mm_setzero_ps()
+#define FloatV_Load(p)       _mm_load_ps(p)
+#define FloatV_Store(p, x)   _mm_store_ps(p, x)
+#define FloatV_Add(a, b)     _mm_add_ps(a, b)
+#define FloatV_Sub(a, b)     _mm_sub_ps(a, b)
+#define FloatV_Mul(a, b)     _mm_mul_ps(a, b)
+#define FloatV_And(a, b)     _mm_and_ps(a, b)
+#define FloatV_Or(a, b)      _mm_or_ps(a, b)
+#define FloatV_AndNot(a, b)  _mm_andnot_ps(a, b)
+#define FloatV_Greater(a, b) _mm_cmpgt_ps(a, b)
+#define FloatV_Less(a, b)    _mm_cmplt_ps(a, b)
+#define FloatV_Round(x)      _mm_cvtepi32_ps(_mm_cvtps_epi32(x))
+
+#endif
+
+static_assert(g_triangle_guy_align % (g_simd_width*sizeof(float)) == 0, "The arrays have to be aligned for whole vector loads");
+
+// Below this many guys it isn't worth handing the update to another thread
+static constexpr uint32_t g_min_triangle_guys_per_update_task = 16384;
+
+static constexpr float g_pi     = 3.14159265358979f;
+static constexpr float g_two_pi = 6.28318530717959f;
+
+struct TriangleGuys
+{
+	uint32_t count;
+	uint32_t capacity; // a multiple of g_simd_width
+
+	float    *position_x; // where they get drawn
+	float    *position_y;
+	float    *step_x;     // where the last two simulation steps put them, see TriangleGuys_Step
+	float    *step_y;
+	float    *previous_step_x;
+	float    *previous_step_y;
+	float    *phase_x;
+	float    *phase_y;
+	float    *extent_x; // half size of the bounding box around the position
+	float    *extent_y;
+	uint32_t *texture;
+	uint32_t *color;
+
+	void Grow(uint32_t min_capacity)
+	{
+		if (capacity >= min_capacity)
+		{
+			return;
+		}
+
+		uint32_t new_capacity = capacity ? capacity : 16;
+		while (new_capacity < min_capacity) new_capacity *= 2;
+
+		GrowArray((void **)&position_x,      new_capacity);
+		GrowArray((void **)&position_y,      new_capacity);
+		GrowArray((void **)&step_x,          new_capacity);
+		GrowArray((void **)&step_y,          new_capacity);
+		GrowArray((void **)&previous_step_x, new_capacity);
+		GrowArray((void **)&previous_step_y, new_capacity);
+		GrowArray((void **)&phase_x,         new_capacity);
+		GrowArray((void **)&phase_y,         new_capacity);
+		GrowArray((void **)&extent_x,        new_capacity);
+		GrowArray((void **)&extent_y,        new_capacity);
+		GrowArray((void **)&texture,         new_capacity);
+		GrowArray((void **)&color,           new_capacity);
+
+		capacity = new_capacity;
+	}
+
+	// All the arrays hold 4 byte elements
+	void GrowArray(void **array, uint32_t new_capacity)
+	{
+		void *new_array = _aligned_malloc(new_capacity*sizeof(uint32_t), g_triangle_guy_align);
+
+		if (*array)
+		{
+			memcpy(new_array, *array, capacity*sizeof(uint32_t));
+			_aligned_free(*array);
+		}
+
+		memset((uint32_t *)new_array + capacity, 0, (new_capacity - capacity)*sizeof(uint32_t));
+
+		*array = new_array;
+	}
+
+	void Release()
+	{
+		_aligned_free(position_x);
+		_aligned_free(position_y);
+		_aligned_free(step_x);
+		_aligned_free(step_y);
+		_aligned_free(previous_step_x);
+		_aligned_free(previous_step_y);
+		_aligned_free(phase_x);
+		_aligned_free(phase_y);
+		_aligned_free(extent_x);
+		_aligned_free(extent_y);
+		_aligned_free(texture);
+		_aligned_free(color);
+
+		ZeroStruct(this);
+	}
+};
+
+// sin of a vector of floats, only meant for arguments within a handful of turns of zero as the range
+// reduction is done in float. Wraps to [-pi, pi], folds to [-pi/2, pi/2] with sin(x) = sin(pi - x),
+// then uses the Taylor series up to x^11, which is good to about 1e-7 in there.
+FloatV FastSin(FloatV x)
+{
+	FloatV pi      = FloatV_Set1(g_pi);
+	FloatV half_pi = FloatV_Set1(0.5f*g_pi);
+
+	// rounds to nearest under the default rounding mode
+	FloatV turns = FloatV_Round(FloatV_Mul(x, FloatV_Set1(1.0f / g_two_pi)));
+	x = FloatV_Sub(x, FloatV_Mul(turns, FloatV_Set1(g_two_pi)));
+
+	FloatV above = FloatV_Greater(x, half_pi);
+	x = FloatV_Or(FloatV_And(above, FloatV_Sub(pi, x)), FloatV_AndNot(above, x));
+
+	FloatV below = FloatV_Less(x, FloatV_Sub(FloatV_Zero(), half_pi));
+	x = FloatV_Or(FloatV_And(below, FloatV_Sub(FloatV_Sub(FloatV_Zero(), pi), x)), FloatV_AndNot(below, x));
+
+	FloatV x2     = FloatV_Mul(x, x);
+	FloatV result = FloatV_Set1(-1.0f/39916800.0f);
+	result = FloatV_Add(FloatV_Mul(result, x2), FloatV_Set1( 1.0f/362880.0f));
+	result = FloatV_Add(FloatV_Mul(result, x2), FloatV_Set1(-1.0f/5040.0f));
+	result = FloatV_Add(FloatV_Mul(result, x2), FloatV_Set1( 1.0f/120.0f));
+	result = FloatV_Add(FloatV_Mul(result, x2), FloatV_Set1(-1.0f/6.0f));
+	result = FloatV_Add(FloatV_Mul(result, x2), FloatV_Set1( 1.0f));
+
+	return FloatV_Mul(result, x);
+}
+
+struct TriangleGuyUpdate
+{
+	TriangleGuys *guys;
+	float        *out_x;
+	float        *out_y;
+	float         time_x; // the time dependent part of the phases, wrapped to [0, 2pi)
+	float         time_y;
+};
+
+// Moves a range of guys, in whole vectors. The last one may write to the padding past the last guy.
+void TriangleGuyUpdateRange(uint32_t first_vector, uint32_t vector_count, void *data)
+{
+	TriangleGuyUpdate *update = (TriangleGuyUpdate *)data;
+	TriangleGuys      *guys   = update->guys;
+
+	FloatV time_x      = FloatV_Set1(update->time_x);
+	FloatV time_y      = FloatV_Set1(update->time_y);
+	FloatV amplitude_x = FloatV_Set1(0.5f);
+	FloatV amplitude_y = FloatV_Set1(0.3f);
+
+	uint32_t end = (first_vector + vector_count)*g_simd_width;
+
+	for (uint32_t i = first_vector*g_simd_width; i < end; i += g_simd_width)
+	{
+		FloatV phase_x = FloatV_Load(&guys->phase_x[i]);
+		FloatV phase_y = FloatV_Load(&guys->phase_y[i]);
+
+		FloatV_Store(&update->out_x[i], FloatV_Mul(amplitude_x, FastSin(FloatV_Add(phase_x, time_x))));
+		FloatV_Store(&update->out_y[i], FloatV_Mul(amplitude_y, FastSin(FloatV_Add(phase_y, time_y))));
+	}
+}
+
+// Works out where every guy should be at the given time, spread over the work queue if there are
+// enough of them
+void TriangleGuys_Evaluate(TriangleGuys *guys, double current_time, float *out_x, float *out_y, WorkQueue *queue)
+{
+	TriangleGuyUpdate update = {
+		.guys   = guys,
+		.out_x  = out_x,
+		.out_y  = out_y,
+		.time_x = (float)fmod(1.25*current_time, 2.0*3.14159265358979323846),
+		.time_y = (float)fmod(0.65*current_time, 2.0*3.14159265358979323846),
+	};
+
+	uint32_t vector_count = (guys->count + g_simd_width - 1) / g_simd_width;
+
+	ParallelFor(queue, vector_count, g_min_triangle_guys_per_update_task / g_simd_width, TriangleGuyUpdateRange, &update);
+}
+
+// Moves every guy straight to where it should be drawn at the given time
+void TriangleGuys_Update(TriangleGuys *guys, double current_time, WorkQueue *queue = nullptr)
+{
+	TriangleGuys_Evaluate(guys, current_time, guys->position_x, guys->position_y, queue);
+}
+
+// Runs one simulation step, ending at the given simulation time. The state from the step before is
+// kept around to interpolate from.
+void TriangleGuys_Step(TriangleGuys *guys, double simulation_time, WorkQueue *queue = nullptr)
+{
+	float *swap_x = guys->previous_step_x;
+	float *swap_y = guys->previous_step_y;
+
+	guys->previous_step_x = guys->step_x;
+	guys->previous_step_y = guys->step_y;
+	guys->step_x          = swap_x;
+	guys->step_y          = swap_y;
+
+	TriangleGuys_Evaluate(guys, simulation_time, guys->step_x, guys->step_y, queue);
+}
+
+struct TriangleGuyInterpolate
+{
+	TriangleGuys *guys;
+	float         alpha;
+};
+
+void TriangleGuyInterpolateRange(uint32_t first_vector, uint32_t vector_count, void *data)
+{
+	TriangleGuyInterpolate *interpolate = (TriangleGuyInterpolate *)data;
+	TriangleGuys           *guys        = interpolate->guys;
+
+	FloatV alpha = FloatV_Set1(interpolate->alpha);
+
+	uint32_t end = (first_vector + vector_count)*g_simd_width;
+
+	for (uint32_t i = first_vector*g_simd_width; i < end; i += g_simd_width)
+	{
+		FloatV from_x = FloatV_Load(&guys->previous_step_x[i]);
+		FloatV from_y = FloatV_Load(&guys->previous_step_y[i]);
+		FloatV to_x   = FloatV_Load(&guys->step_x[i]);
+		FloatV to_y   = FloatV_Load(&guys->step_y[i]);
+
+		FloatV_Store(&guys->position_x[i], FloatV_Add(from_x, FloatV_Mul(alpha, FloatV_Sub(to_x, from_x))));
+		FloatV_Store(&guys->position_y[i], FloatV_Add(from_y, FloatV_Mul(alpha, FloatV_Sub(to_y, from_y))));
+	}
+}
+
+// Puts the guys alpha of the way from the previous simulation step to the last one, for drawing
+void TriangleGuys_Interpolate(TriangleGuys *guys, float alpha, WorkQueue *queue = nullptr)
+{
+	TriangleGuyInterpolate interpolate = {
+		.guys  = guys,
+		.alpha = alpha,
+	};
+
+	uint32_t vector_count = (guys->count + g_simd_width - 1) / g_simd_width;
+
+	ParallelFor(queue, vector_count, g_min_triangle_guys_per_update_task / g_simd_width, TriangleGuyInterpolateRange, &interpolate);
+}
+
+// What the update used to be, kept for the benchmark to compare against
+void TriangleGuys_UpdateReference(TriangleGuys *guys, double current_time)
+{
+	for (uint32_t i = 0; i < guys->count; i++)
+	{
+		guys->position_x[i] = (float)(0.5 * sin(0.6 * (double)i + 1.25*current_time));
+		guys->position_y[i] = (float)(0.3 * sin(0.4 * (double)i + 0.65*current_time));
+	}
+}
+
+// Grows or shrinks the number of guys, new ones start out at the origin with the given bounds
+void TriangleGuys_SetCount(TriangleGuys *guys, uint32_t count, Vector2D extents)
+{
+	guys->Grow((count + g_simd_width - 1) & ~(g_simd_width - 1));
+
+	for (uint32_t i = guys->count; i < count; i++)
+	{
+		guys->position_x     [i] = 0.0f;
+		guys->position_y     [i] = 0.0f;
+		guys->step_x         [i] = 0.0f;
+		guys->step_y         [i] = 0.0f;
+		guys->previous_step_x[i] = 0.0f;
+		guys->previous_step_y[i] = 0.0f;
+		guys->phase_x        [i] = (float)fmod(0.6*(double)i, 2.0*3.14159265358979323846);
+		guys->phase_y        [i] = (float)fmod(0.4*(double)i, 2.0*3.14159265358979323846);
+		guys->extent_x       [i] = extents.x;
+		guys->extent_y       [i] = extents.y;
+		guys->texture        [i] = 3 - i % 4;
+
+		// the first few stay white, the rest get a random tint so you can tell them apart
+		if (i < 4)
+		{
+			guys->color[i] = 0xFFFFFFFF;
+		}
+		else
+		{
+			guys->color[i] = 0xFF000000 | 0x808080 | (uint32_t)HashBytes(&i, sizeof(i));
+		}
+	}
+
+	guys->count = count;
+}
+
+//------------------------------------------------------------------------
+// Triangle guy culling
+//
+// Tests the guys' bounding boxes against a rectangle (the scene is 2D and drawn straight into clip
+// space, so that's all a frustum comes down to) four at a time, and writes out the indices of the
+// ones that overlap it, in order. The indices for each group of four get written in one go, packed
+// down to the visible ones with a lookup table on the visibility mask, so there are no branches on
+// whether a guy is visible.
+//
+// Big counts are split into fixed size blocks that are culled in parallel, each into its own part of
+// the output, and then moved down next to each other.
+//
+// This stays SSE and four wide whatever g_simd_width is, since the lookup table goes by 4 bit masks.
+
+static constexpr uint32_t g_cull_width      = 4;
+static constexpr uint32_t g_cull_block_size = 16384; // guys, a multiple of g_simd_width
+
+static_assert(g_simd_width % g_cull_width == 0, "The guys' padding has to cover the cull's vectors");
+
+// Clip space, the same as D3D12_GetClipSpaceCullPlanes
+static constexpr Rect2D g_clip_space_rect = { -1.0f, -1.0f, 1.0f, 1.0f };
+
+struct CullStats
+{
+	uint32_t tested;
+	uint32_t visible;
+};
+
+// For each 4 bit visibility mask, the lanes that are set, packed to the front
+alignas(16) static const uint32_t g_cull_compact_lanes[16][4] = {
+	{ 0, 0, 0, 0 }, { 0, 0, 0, 0 }, { 1, 0, 0, 0 }, { 0, 1, 0, 0 },
+	{ 2, 0, 0, 0 }, { 0, 2, 0, 0 }, { 1, 2, 0, 0 }, { 0, 1, 2, 0 },
+	{ 3, 0, 0, 0 }, { 0, 3, 0, 0 }, { 1, 3, 0, 0 }, { 0, 1, 3, 0 },
+	{ 2, 3, 0, 0 }, { 0, 2, 3, 0 }, { 1, 2, 3, 0 }, { 0, 1, 2, 3 },
+};
+
+static const uint8_t g_cull_mask_bit_count[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+// Culls guys [first, first + count), first a multiple of g_cull_width. Writes the visible indices to out
+// and returns how many there were. Always writes whole vectors, so out needs room for count rounded up
+// to g_cull_width.
+uint32_t TriangleGuys_CullRange(const TriangleGuys *guys, uint32_t first, uint32_t count, Rect2D rect, uint32_t *out)
+{
+	assert(first % g_cull_width == 0);
+
+	__m128 min_x = _mm_set1_ps(rect.min_x);
+	__m128 min_y = _mm_set1_ps(rect.min_y);
+	__m128 max_x = _mm_set1_ps(rect.max_x);
+	__m128 max_y = _mm_set1_ps(rect.max_y);
+
+	uint32_t end           = first + count;
+	uint32_t visible_count = 0;
+
+	for (uint32_t i = first; i < end; i += g_cull_width)
+	{
+		__m128 x  = _mm_load_ps(&guys->position_x[i]);
+		__m128 y  = _mm_load_ps(&guys->position_y[i]);
+		__m128 ex = _mm_load_ps(&guys->extent_x  [i]);
+		__m128 ey = _mm_load_ps(&guys->extent_y  [i]);
+
+		__m128 inside_x = _mm_and_ps(_mm_cmpge_ps(_mm_add_ps(x, ex), min_x), _mm_cmple_ps(_mm_sub_ps(x, ex), max_x));
+		__m128 inside_y = _mm_and_ps(_mm_cmpge_ps(_mm_add_ps(y, ey), min_y), _mm_cmple_ps(_mm_sub_ps(y, ey), max_y));
+
+		uint32_t mask = (uint32_t)_mm_movemask_ps(_mm_and_ps(inside_x, inside_y));
+
+		// the padding past the last guy doesn't count
+		if (end - i < g_cull_width)
+		{
+			mask &= (1u << (end - i)) - 1;
+		}
+
+		__m128i lanes   = _mm_load_si128((const __m128i *)g_cull_compact_lanes[mask]);
+		__m128i indices = _mm_add_epi32(_mm_set1_epi32((int)i), lanes);
+
+		_mm_storeu_si128((__m128i *)&out[visible_count], indices);
+
+		visible_count += g_cull_mask_bit_count[mask];
+	}
+
+	return visible_count;
+}
+
+struct TriangleGuyCull
+{
+	const TriangleGuys *guys;
+	Rect2D              rect;
+	uint32_t           *out;
+	uint32_t           *block_counts;
+};
+
+void TriangleGuyCullBlocks(uint32_t first_block, uint32_t block_count, void *data)
+{
+	TriangleGuyCull *cull = (TriangleGuyCull *)data;
+
+	for (uint32_t block = first_block; block < first_block + block_count; block++)
+	{
+		uint32_t first = block*g_cull_block_size;
+		uint32_t count = cull->guys->count - first < g_cull_block_size ? cull->guys->count - first : g_cull_block_size;
+
+		cull->block_counts[block] = TriangleGuys_CullRange(cull->guys, first, count, cull->rect, cull->out + first);
+	}
+}
+
+// How many blocks TriangleGuys_Cull needs counts for
+uint32_t TriangleGuys_GetCullBlockCount(uint32_t count)
+{
+	return (count + g_cull_block_size - 1) / g_cull_block_size;
+}
+
+// Writes the indices of the guys overlapping the rectangle to out, in order, and returns how many there
+// were. out needs room for guys->capacity indices, and block_counts for TriangleGuys_GetCullBlockCount.
+uint32_t TriangleGuys_Cull(const TriangleGuys *guys, Rect2D rect, uint32_t *out, uint32_t *block_counts, CullStats *stats, WorkQueue *queue = nullptr)
+{
+	uint32_t block_count = TriangleGuys_GetCullBlockCount(guys->count);
+
+	TriangleGuyCull cull = {
+		.guys         = guys,
+		.rect         = rect,
+		.out          = out,
+		.block_counts = block_counts,
+	};
+
+	ParallelFor(queue, block_count, 1, TriangleGuyCullBlocks, &cull);
+
+	// the first block is already in place
+	uint32_t visible_count = block_count > 0 ? block_counts[0] : 0;
+
+	for (uint32_t block = 1; block < block_count; block++)
+	{
+		memmove(out + visible_count, out + block*g_cull_block_size, block_counts[block]*sizeof(uint32_t));
+		visible_count += block_counts[block];
+	}
+
+	stats->tested  = guys->count;
+	stats->visible = visible_count;
+
+	return visible_count;
+}
+
+//------------------------------------------------------------------------
+// Bounding volume hierarchy
+//
+// A binary tree of boxes over the triangle guys, for finding the ones in a rectangle, inside a set of
+// planes or hit by a ray without looking at all of them. Built top down, splitting each node where the
+// surface area heuristic says the children will be cheapest to search (the scene is 2D, so perimeter
+// stands in for area), trying the boundaries of a handful of bins along the longer axis rather than
+// every possible split.
+//
+// Nodes live in one array, the two children of a node next to each other and always after it, so a
+// refit is a pass over the leaves followed by a pass backwards over the array. Refitting keeps queries
+// right as the guys move, but the boxes get looser the further they move from where the tree was
+// built, so it's worth rebuilding now and then. The items of a leaf are contiguous, with copies of
+// their boxes next to them so leaf tests don't have to go back to the guys.
+
+static constexpr uint32_t g_bvh_bin_count     = 16;
+static constexpr uint32_t g_bvh_max_leaf_size = 4;
+static constexpr uint32_t g_bvh_max_depth     = 64; // deeper nodes become leaves, whatever their size
+
+static constexpr uint32_t g_min_bvh_nodes_per_refit_task = 4096;
+
+struct BVHNode
+{
+	Rect2D   bounds;
+	uint32_t first; // leaf: index of the first item, interior: the left child, the right one is first + 1
+	uint32_t count; // items in the leaf, 0 for interior nodes
+};
+
+struct BVH
+{
+	uint32_t object_count;
+	uint32_t node_count;
+	uint32_t capacity; // objects the arrays below have room for
+
+	BVHNode  *nodes;
+	uint32_t *items;       // object indices, grouped by leaf
+	Rect2D   *item_bounds; // the box of each item, in the same order
+
+	void Release()
+	{
+		_aligned_free(nodes);
+		free(items);
+		free(item_bounds);
+
+		*this = {};
+	}
+};
+
+struct BVHRayHit
+{
+	uint32_t object;
+	float    t; // distance along the ray, in lengths of its direction
+};
+
+Rect2D TriangleGuys_GetBounds(const TriangleGuys *guys, uint32_t index)
+{
+	Rect2D result = {
+		.min_x = guys->position_x[index] - guys->extent_x[index],
+		.min_y = guys->position_y[index] - guys->extent_y[index],
+		.max_x = guys->position_x[index] + guys->extent_x[index],
+		.max_y = guys->position_y[index] + guys->extent_y[index],
+	};
+
+	return result;
+}
+
+static constexpr Rect2D g_empty_rect = { FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+Rect2D Rect2D_Union(Rect2D a, Rect2D b)
+{
+	Rect2D result = {
+		.min_x = a.min_x < b.min_x ? a.min_x : b.min_x,
+		.min_y = a.min_y < b.min_y ? a.min_y : b.min_y,
+		.max_x = a.max_x > b.max_x ? a.max_x : b.max_x,
+		.max_y = a.max_y > b.max_y ? a.max_y : b.max_y,
+	};
+
+	return result;
+}
+
+bool Rect2D_Overlaps(Rect2D a, Rect2D b)
+{
+	return a.max_x >= b.min_x && a.min_x <= b.max_x && a.max_y >= b.min_y && a.min_y <= b.max_y;
+}
+
+float Rect2D_HalfPerimeter(Rect2D rect)
+{
+	return (rect.max_x - rect.min_x) + (rect.max_y - rect.min_y);
+}
+
+void BVH_Build(BVH *bvh, const TriangleGuys *guys)
+{
+	uint32_t count = guys->count;
+
+	if (bvh->capacity < count)
+	{
+		bvh->Release();
+
+		bvh->nodes       = (BVHNode  *)_aligned_malloc(2*count*sizeof(BVHNode), 64);
+		bvh->items       = (uint32_t *)malloc(count*sizeof(uint32_t));
+		bvh->item_bounds = (Rect2D   *)malloc(count*sizeof(Rect2D));
+		bvh->capacity    = count;
+	}
+
+	bvh->object_count = count;
+	bvh->node_count   = 0;
+
+	if (count == 0)
+	{
+		return;
+	}
+
+	Rect2D root_bounds = g_empty_rect;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		bvh->items      [i] = i;
+		bvh->item_bounds[i] = TriangleGuys_GetBounds(guys, i);
+
+		root_bounds = Rect2D_Union(root_bounds, bvh->item_bounds[i]);
+	}
+
+	bvh->nodes[0] = {
+		.bounds = root_bounds,
+		.first  = 0,
+		.count  = count,
+	};
+
+	bvh->node_count = 1;
+
+	// nodes still to be split, with their depth
+	uint32_t stack      [g_bvh_max_depth + 2];
+	uint32_t stack_depth[g_bvh_max_depth + 2];
+	uint32_t stack_count = 0;
+
+	stack      [stack_count] = 0;
+	stack_depth[stack_count] = 0;
+	stack_count += 1;
+
+	while (stack_count > 0)
+	{
+		stack_count -= 1;
+
+		uint32_t node_index = stack      [stack_count];
+		uint32_t depth      = stack_depth[stack_count];
+
+		BVHNode *node  = &bvh->nodes[node_index];
+		uint32_t first = node->first;
+		uint32_t n     = node->count;
+
+		if (n <= 1 || depth >= g_bvh_max_depth)
+		{
+			continue;
+		}
+
+		//------------------------------------------------------------------------
+		// Bin the centroids along the axis they're most spread out on
+
+		Rect2D centroid_bounds = g_empty_rect;
+
+		for (uint32_t i = first; i < first + n; i++)
+		{
+			Rect2D *b = &bvh->item_bounds[i];
+
+			float cx = 0.5f*(b->min_x + b->max_x);
+			float cy = 0.5f*(b->min_y + b->max_y);
+
+			centroid_bounds = Rect2D_Union(centroid_bounds, { cx, cy, cx, cy });
+		}
+
+		float extent_x = centroid_bounds.max_x - centroid_bounds.min_x;
+		float extent_y = centroid_bounds.max_y - centroid_bounds.min_y;
+
+		uint32_t axis       = extent_x >= extent_y ? 0 : 1;
+		float    axis_min   = axis == 0 ? centroid_bounds.min_x : centroid_bounds.min_y;
+		float    axis_range = axis == 0 ? extent_x : extent_y;
+
+		uint32_t split_count;    // items going left
+		Rect2D   left_bounds;
+		Rect2D   right_bounds;
+
+		if (axis_range <= 0.0f)
+		{
+			// all the centroids are in the same spot, there is no good split, only splitting the list in
+			// half keeps the tree from degenerating into a list
+			if (n <= g_bvh_max_leaf_size)
+			{
+				continue;
+			}
+
+			split_count  = n / 2;
+			left_bounds  = g_empty_rect;
+			right_bounds = g_empty_rect;
+
+			for (uint32_t i = first;               i < first + split_count; i++) left_bounds  = Rect2D_Union(left_bounds,  bvh->item_bounds[i]);
+			for (uint32_t i = first + split_count; i < first + n;           i++) right_bounds = Rect2D_Union(right_bounds, bvh->item_bounds[i]);
+		}
+		else
+		{
+			Rect2D   bin_bounds[g_bvh_bin_count];
+			uint32_t bin_counts[g_bvh_bin_count] = {};
+
+			for (uint32_t i = 0; i < g_bvh_bin_count; i++)
+			{
+				bin_bounds[i] = g_empty_rect;
+			}
+
+			float bin_scale = (float)g_bvh_bin_count / axis_range;
+
+			for (uint32_t i = first; i < first + n; i++)
+			{
+				Rect2D *b = &bvh->item_bounds[i];
+
+				float    centroid = axis == 0 ? 0.5f*(b->min_x + b->max_x) : 0.5f*(b->min_y + b->max_y);
+				uint32_t bin      = (uint32_t)((centroid - axis_min)*bin_scale);
+				if (bin >= g_bvh_bin_count) bin = g_bvh_bin_count - 1;
+
+				bin_bounds[bin]  = Rect2D_Union(bin_bounds[bin], *b);
+				bin_counts[bin] += 1;
+			}
+
+			//------------------------------------------------------------------------
+			// Cost of splitting after each bin: sweep from the right to get the right hand sides, then
+			// from the left
+
+			float  right_costs[g_bvh_bin_count];
+			Rect2D right_sweep[g_bvh_bin_count];
+
+			Rect2D   accumulated       = g_empty_rect;
+			uint32_t accumulated_count = 0;
+
+			for (uint32_t i = g_bvh_bin_count - 1; i > 0; i--)
+			{
+				accumulated        = Rect2D_Union(accumulated, bin_bounds[i]);
+				accumulated_count += bin_counts[i];
+
+				right_sweep[i] = accumulated;
+				right_costs[i] = accumulated_count > 0 ? (float)accumulated_count*Rect2D_HalfPerimeter(accumulated) : 0.0f;
+			}
+
+			float    best_cost  = FLT_MAX;
+			uint32_t best_split = 0; // bins [0, best_split] go left
+
+			accumulated       = g_empty_rect;
+			accumulated_count = 0;
+
+			for (uint32_t i = 0; i < g_bvh_bin_count - 1; i++)
+			{
+				accumulated        = Rect2D_Union(accumulated, bin_bounds[i]);
+				accumulated_count += bin_counts[i];
+
+				if (accumulated_count == 0 || accumulated_count == n)
+				{
+					continue;
+				}
+
+				float cost = (float)accumulated_count*Rect2D_HalfPerimeter(accumulated) + right_costs[i + 1];
+
+				if (best_cost > cost)
+				{
+					best_cost  = cost;
+					best_split = i;
+				}
+			}
+
+			// Searching the children costs a box test each plus their items weighted by how likely a query
+			// is to land in them, a leaf costs its items
+			float node_perimeter = Rect2D_HalfPerimeter(node->bounds);
+			float split_cost     = 2.0f + (node_perimeter > 0.0f ? best_cost / node_perimeter : 0.0f);
+
+			if (n <= g_bvh_max_leaf_size && split_cost >= (float)n)
+			{
+				continue;
+			}
+
+			//------------------------------------------------------------------------
+			// Partition the items, left ones to the front
+
+			uint32_t left  = first;
+			uint32_t right = first + n;
+
+			while (left < right)
+			{
+				Rect2D *b = &bvh->item_bounds[left];
+
+				float    centroid = axis == 0 ? 0.5f*(b->min_x + b->max_x) : 0.5f*(b->min_y + b->max_y);
+				uint32_t bin      = (uint32_t)((centroid - axis_min)*bin_scale);
+				if (bin >= g_bvh_bin_count) bin = g_bvh_bin_count - 1;
+
+				if (bin <= best_split)
+				{
+					left += 1;
+				}
+				else
+				{
+					right -= 1;
+
+					uint32_t item        = bvh->items[left];
+					Rect2D   item_bounds = bvh->item_bounds[left];
+
+					bvh->items      [left]  = bvh->items      [right];
+					bvh->item_bounds[left]  = bvh->item_bounds[right];
+					bvh->items      [right] = item;
+					bvh->item_bounds[right] = item_bounds;
+				}
+			}
+
+			split_count  = left - first;
+			left_bounds  = g_empty_rect;
+			right_bounds = right_sweep[best_split + 1];
+
+			for (uint32_t i = 0; i <= best_split; i++)
+			{
+				left_bounds = Rect2D_Union(left_bounds, bin_bounds[i]);
+			}
+
+			assert(split_count > 0 && split_count < n);
+		}
+
+		//------------------------------------------------------------------------
+		// Children go next to each other at the end
+
+		uint32_t child_index = bvh->node_count;
+		bvh->node_count += 2;
+
+		assert(bvh->node_count <= 2*bvh->capacity);
+
+		bvh->nodes[child_index + 0] = { .bounds = left_bounds,  .first = first,               .count = split_count };
+		bvh->nodes[child_index + 1] = { .bounds = right_bounds, .first = first + split_count, .count = n - split_count };
+
+		node->first = child_index;
+		node->count = 0;
+
+		stack      [stack_count] = child_index + 1;
+		stack_depth[stack_count] = depth + 1;
+		stack_count += 1;
+
+		stack      [stack_count] = child_index;
+		stack_depth[stack_count] = depth + 1;
+		stack_count += 1;
+	}
+}
+
+struct BVHRefit
+{
+	BVH                *bvh;
+	const TriangleGuys *guys;
+};
+
+void BVHRefitLeaves(uint32_t first_node, uint32_t node_count, void *data)
+{
+	BVHRefit *refit = (BVHRefit *)data;
+	BVH      *bvh   = refit->bvh;
+
+	for (uint32_t node_index = first_node; node_index < first_node + node_count; node_index++)
+	{
+		BVHNode *node = &bvh->nodes[node_index];
+
+		if (node->count == 0)
+		{
+			continue;
+		}
+
+		Rect2D bounds = g_empty_rect;
+
+		for (uint32_t i = node->first; i < node->first + node->count; i++)
+		{
+			bvh->item_bounds[i] = TriangleGuys_GetBounds(refit->guys, bvh->items[i]);
+			bounds = Rect2D_Union(bounds, bvh->item_bounds[i]);
+		}
+
+		node->bounds = bounds;
+	}
+}
+
+// Fits the boxes to where the guys are now. The guys can have moved, but not come or gone.
+void BVH_Refit(BVH *bvh, const TriangleGuys *guys, WorkQueue *queue = nullptr)
+{
+	assert(bvh->object_count == guys->count || !"The BVH has to be rebuilt when the number of objects changes");
+
+	BVHRefit refit = {
+		.bvh  = bvh,
+		.guys = guys,
+	};
+
+	ParallelFor(queue, bvh->node_count, g_min_bvh_nodes_per_refit_task, BVHRefitLeaves, &refit);
+
+	// children always come after their parent
+	for (uint32_t node_index = bvh->node_count; node_index > 0; node_index--)
+	{
+		BVHNode *node = &bvh->nodes[node_index - 1];
+
+		if (node->count == 0)
+		{
+			node->bounds = Rect2D_Union(bvh->nodes[node->first].bounds, bvh->nodes[node->first + 1].bounds);
+		}
+	}
+}
+
+// Finds the objects whose boxes overlap the rectangle. Writes up to max_count of them to out, in no
+// particular order, and returns how many there were in total.
+uint32_t BVH_QueryRect(const BVH *bvh, Rect2D rect, uint32_t *out, uint32_t max_count)
+{
+	uint32_t result = 0;
+
+	if (bvh->node_count == 0)
+	{
+		return result;
+	}
+
+	uint32_t stack[g_bvh_max_depth + 2];
+	uint32_t stack_count = 0;
+
+	stack[stack_count++] = 0;
+
+	while (stack_count > 0)
+	{
+		const BVHNode *node = &bvh->nodes[stack[--stack_count]];
+
+		if (!Rect2D_Overlaps(node->bounds, rect))
+		{
+			continue;
+		}
+
+		if (node->count == 0)
+		{
+			stack[stack_count++] = node->first + 1;
+			stack[stack_count++] = node->first;
+			continue;
+		}
+
+		for (uint32_t i = node->first; i < node->first + node->count; i++)
+		{
+			if (Rect2D_Overlaps(bvh->item_bounds[i], rect))
+			{
+				if (result < max_count) out[result] = bvh->items[i];
+				result += 1;
+			}
+		}
+	}
+
+	return result;
+}
+
+// Finds the objects whose boxes are at least partly on the inside of all the planes, with the same
+// test as D3D12_CullIsVisible. Once a node is entirely inside a plane, nothing under it gets tested
+// against that plane again. Output works like BVH_QueryRect.
+uint32_t BVH_QueryPlanes(const BVH *bvh, const D3D12_CullPlane *planes, uint32_t plane_count, uint32_t *out, uint32_t max_count)
+{
+	assert(plane_count <= 32);
+
+	uint32_t result = 0;
+
+	if (bvh->node_count == 0)
+	{
+		return result;
+	}
+
+	// node and the planes it still has to be tested against
+	uint32_t stack      [g_bvh_max_depth + 2];
+	uint32_t stack_masks[g_bvh_max_depth + 2];
+	uint32_t stack_count = 0;
+
+	stack      [stack_count] = 0;
+	stack_masks[stack_count] = plane_count == 32 ? 0xFFFFFFFF : (1u << plane_count) - 1;
+	stack_count += 1;
+
+	while (stack_count > 0)
+	{
+		stack_count -= 1;
+
+		const BVHNode *node = &bvh->nodes[stack[stack_count]];
+		uint32_t       mask = stack_masks[stack_count];
+
+		D3D12_CullBounds bounds = {
+			.center  = { 0.5f*(node->bounds.min_x + node->bounds.max_x), 0.5f*(node->bounds.min_y + node->bounds.max_y) },
+			.extents = { 0.5f*(node->bounds.max_x - node->bounds.min_x), 0.5f*(node->bounds.max_y - node->bounds.min_y) },
+		};
+
+		bool outside = false;
+
+		for (uint32_t plane_index = 0; plane_index < plane_count && !outside; plane_index++)
+		{
+			if (!(mask & (1u << plane_index)))
+			{
+				continue;
+			}
+
+			const D3D12_CullPlane *plane = &planes[plane_index];
+
+			float center = plane->normal.x*bounds.center.x + plane->normal.y*bounds.center.y + plane->distance;
+			float radius = fabsf(plane->normal.x)*bounds.extents.x + fabsf(plane->normal.y)*bounds.extents.y;
+
+			if (center + radius < 0.0f) outside = true;
+			if (center - radius >= 0.0f) mask &= ~(1u << plane_index);
+		}
+
+		if (outside)
+		{
+			continue;
+		}
+
+		if (node->count == 0)
+		{
+			stack      [stack_count] = node->first + 1;
+			stack_masks[stack_count] = mask;
+			stack_count += 1;
+
+			stack      [stack_count] = node->first;
+			stack_masks[stack_count] = mask;
+			stack_count += 1;
+
+			continue;
+		}
+
+		for (uint32_t i = node->first; i < node->first + node->count; i++)
+		{
+			Rect2D b = bvh->item_bounds[i];
+
+			D3D12_CullBounds item_bounds = {
+				.center  = { 0.5f*(b.min_x + b.max_x), 0.5f*(b.min_y + b.max_y) },
+				.extents = { 0.5f*(b.max_x - b.min_x), 0.5f*(b.max_y - b.min_y) },
+			};
+
+			bool visible = true;
+
+			for (uint32_t plane_index = 0; plane_index < plane_count && visible; plane_index++)
+			{
+				if (mask & (1u << plane_index))
+				{
+					const D3D12_CullPlane *plane = &planes[plane_index];
+
+					float distance =
+						plane->normal.x*item_bounds.center.x + plane->normal.y*item_bounds.center.y +
+						fabsf(plane->normal.x)*item_bounds.extents.x + fabsf(plane->normal.y)*item_bounds.extents.y +
+						plane->distance;
+
+					visible = distance >= 0.0f;
+				}
+			}
+
+			if (visible)
+			{
+				if (result < max_count) out[result] = bvh->items[i];
+				result += 1;
+			}
+		}
+	}
+
+	return result;
+}
+
+// Slab test, returns where the ray enters the box if it does so before max_t
+bool BVH_RayHitsBox(Rect2D box, Vector2D origin, Vector2D inverse_direction, float max_t, float *t_enter)
+{
+	float tx0 = (box.min_x - origin.x)*inverse_direction.x;
+	float tx1 = (box.max_x - origin.x)*inverse_direction.x;
+	float ty0 = (box.min_y - origin.y)*inverse_direction.y;
+	float ty1 = (box.max_y - origin.y)*inverse_direction.y;
+
+	// fminf and fmaxf drop the NaNs from a ray running exactly along an edge
+	float t_min = fmaxf(fmaxf(fminf(tx0, tx1), fminf(ty0, ty1)), 0.0f);
+	float t_max = fminf(fminf(fmaxf(tx0, tx1), fmaxf(ty0, ty1)), max_t);
+
+	*t_enter = t_min;
+
+	return t_min <= t_max;
+}
+
+// Finds the first object box along origin + t*direction, t in [0, max_t]. Boxes the ray starts inside
+// of are hit at t = 0.
+bool BVH_RayCast(const BVH *bvh, Vector2D origin, Vector2D direction, float max_t, BVHRayHit *hit)
+{
+	if (bvh->node_count == 0)
+	{
+		return false;
+	}
+
+	Vector2D inverse_direction = { 1.0f / direction.x, 1.0f / direction.y };
+
+	bool  result = false;
+	float best_t = max_t;
+
+	uint32_t stack[g_bvh_max_depth + 2];
+	uint32_t stack_count = 0;
+
+	float t_enter;
+
+	if (BVH_RayHitsBox(bvh->nodes[0].bounds, origin, inverse_direction, best_t, &t_enter))
+	{
+		stack[stack_count++] = 0;
+	}
+
+	while (stack_count > 0)
+	{
+		const BVHNode *node = &bvh->nodes[stack[--stack_count]];
+
+		// might have been beaten since it was pushed
+		if (!BVH_RayHitsBox(node->bounds, origin, inverse_direction, best_t, &t_enter))
+		{
+			continue;
+		}
+
+		if (node->count == 0)
+		{
+			float t_left, t_right;
+
+			bool hits_left  = BVH_RayHitsBox(bvh->nodes[node->first + 0].bounds, origin, inverse_direction, best_t, &t_left);
+			bool hits_right = BVH_RayHitsBox(bvh->nodes[node->first + 1].bounds, origin, inverse_direction, best_t, &t_right);
+
+			// the nearer one goes on top, so it gets to shrink best_t before the other is looked at
+			if (hits_left && hits_right)
+			{
+				bool left_first = t_left <= t_right;
+
+				stack[stack_count++] = node->first + (left_first ? 1 : 0);
+				stack[stack_count++] = node->first + (left_first ? 0 : 1);
+			}
+			else if (hits_left)
+			{
+				stack[stack_count++] = node->first;
+			}
+			else if (hits_right)
+			{
+				stack[stack_count++] = node->first + 1;
+			}
+
+			continue;
+		}
+
+		for (uint32_t i = node->first; i < node->first + node->count; i++)
+		{
+			float t;
+
+			if (BVH_RayHitsBox(bvh->item_bounds[i], origin, inverse_direction, best_t, &t) && (!result || t < best_t))
+			{
+				best_t = t;
+				result = true;
+
+				hit->object = bvh->items[i];
+				hit->t      = t;
+			}
+		}
+	}
+
+	return result;
+}
+
+//------------------------------------------------------------------------
+// Fixed timestep
+//
+// The simulation moves in steps of a fixed length, however fast or slow frames come in. Each frame
+// adds the real time that went by to an accumulator and takes whole steps out of it; what's left over
+// is how far into the next step the frame is, which rendering uses to interpolate between the last
+// two steps. Stepping a fixed amount keeps the simulation's cost tied to simulated time rather than to
+// the frame rate, and makes it come out the same whatever the frame timing was.
+//
+// After a hitch (a breakpoint, a window drag, a slow frame) there can be more steps owed than are
+// worth catching up on, so at most max_steps are taken per frame and the rest of the time is dropped:
+// the simulation slows down instead of spending even longer catching up and falling further behind.
+
+static constexpr double   g_simulation_step      = 1.0 / 60.0;
+static constexpr uint32_t g_max_simulation_steps = 4; // per frame
+
+struct FixedTimestep
+{
+	double   step;
+	uint32_t max_steps;
+
+	bool     started;
+	double   last_time;
+	double   accumulator;    // real time not simulated yet, less than a step once a frame's steps are done
+	uint64_t step_count;     // the simulation time is step_count*step
+
+	// stats
+	uint32_t frame_steps;    // taken since the last Advance
+	uint64_t capped_frames;  // frames that owed more than max_steps
+	double   dropped_time;   // total real time thrown away by the cap
+};
+
+FixedTimestep FixedTimestep_Make(double step = g_simulation_step, uint32_t max_steps = g_max_simulation_steps)
+{
+	assert(step > 0.0 && max_steps > 0);
+
+	FixedTimestep result = {
+		.step      = step,
+		.max_steps = max_steps,
+	};
+
+	return result;
+}
+
+// Adds the time since the last call. The first call starts the clock and owes one step, so there is
+// a state to draw straight away.
+void FixedTimestep_Advance(FixedTimestep *timestep, double current_time)
+{
+	if (!timestep->started)
+	{
+		timestep->started     = true;
+		timestep->last_time   = current_time;
+		timestep->accumulator = timestep->step;
+	}
+
+	double elapsed = current_time - timestep->last_time;
+	if (elapsed < 0.0) elapsed = 0.0;
+
+	timestep->last_time    = current_time;
+	timestep->accumulator += elapsed;
+	timestep->frame_steps  = 0;
+
+	double max_accumulator = timestep->step*(double)timestep->max_steps;
+
+	if (timestep->accumulator > max_accumulator)
+	{
+		timestep->capped_frames += 1;
+		timestep->dropped_time  += timestep->accumulator - max_accumulator;
+		timestep->accumulator    = max_accumulator;
+	}
+}
+
+// Takes a step if a whole one is owed, and gives the simulation time it should end at
+bool FixedTimestep_Step(FixedTimestep *timestep, double *simulation_time)
+{
+	if (timestep->accumulator < timestep->step)
+	{
+		return false;
+	}
+
+	timestep->accumulator -= timestep->step;
+	timestep->step_count  += 1;
+	timestep->frame_steps += 1;
+
+	*simulation_time = (double)timestep->step_count*timestep->step;
+
+	return true;
+}
+
+// How far the frame is from the last step towards the next one, in [0, 1). An accumulator a hair
+// under a step can still round up to 1 as a float, hence the clamp to the float just below it.
+float FixedTimestep_GetAlpha(const FixedTimestep *timestep)
+{
+	float alpha = (float)(timestep->accumulator / timestep->step);
+	return alpha < 1.0f ? alpha : 0.99999994f;
+}
+
+//------------------------------------------------------------------------
+// Frame pacing
+//
+// How many frame slots to use trades keeping the GPU busy against latency: every frame queued up
+// ahead of the GPU is one more frame between input and the screen, but with too few the GPU goes idle
+// whenever the CPU has a slow frame. FramePacer picks the count from measured frame times. When the
+// GPU is the bottleneck it wants enough slots that the slowest CPU frame of the last window still gets
+// its work in before the GPU runs dry. When the CPU is the bottleneck the queue never fills up anyway,
+// so it wants the minimum. More slots are taken straight away, fewer only once a few windows in a row
+// agree.
+//
+// With the GPU as the bottleneck, the CPU also ends up waiting for it every frame, after having
+// sampled input. FramePacer can move that wait in front of input sampling, by asking for input to be
+// delayed by the least slack seen over the last window, less a margin. Delaying by more than the slack
+// would starve the GPU, so a frame that comes in with less than half the margin left halves the delay
+// straight away.
+//
+// It only ever sees numbers, so it can be driven by a made up timing trace, see Bench_RunPacing.
+
+static constexpr uint32_t g_pacing_window           = 30;    // frames per decision
+static constexpr uint32_t g_pacing_decrease_windows = 3;     // windows in a row wanting fewer slots before getting them
+static constexpr double   g_pacing_slack_margin     = 0.001; // seconds of slack to leave when delaying input
+static constexpr uint32_t g_min_paced_frame_slots   = 2;
+
+struct FramePacerSample
+{
+	double cpu_time; // the slowest CPU stage of the frame
+	double gpu_time;
+	double slack;    // how long the frame's CPU work waited, once done, before it could go to the GPU
+};
+
+struct FramePacer
+{
+	bool     delay_input;
+	uint32_t min_slots;
+	uint32_t max_slots;
+
+	uint32_t frame_slot_count;
+	double   input_delay; // seconds
+
+	// the window so far
+	uint32_t window_frames;
+	double   window_cpu_sum;
+	double   window_cpu_max;
+	double   window_gpu_sum;
+	double   window_slack_min;
+	uint32_t decrease_windows;
+
+	// stats
+	uint32_t slot_changes;
+	uint32_t delay_backoffs;
+};
+
+FramePacer FramePacer_Make(uint32_t frame_slot_count, bool delay_input, uint32_t min_slots = g_min_paced_frame_slots, uint32_t max_slots = g_max_frame_slots)
+{
+	assert(min_slots >= 1 && min_slots <= max_slots);
+
+	if (frame_slot_count < min_slots) frame_slot_count = min_slots;
+	if (frame_slot_count > max_slots) frame_slot_count = max_slots;
+
+	FramePacer result = {
+		.delay_input      = delay_input,
+		.min_slots        = min_slots,
+		.max_slots        = max_slots,
+		.frame_slot_count = frame_slot_count,
+		.window_slack_min = DBL_MAX,
+	};
+
+	return result;
+}
+
+// Takes a frame's times, and returns whether frame_slot_count changed
+bool FramePacer_Update(FramePacer *pacer, const FramePacerSample *sample)
+{
+	if (pacer->input_delay > 0.0 && sample->slack < 0.5*g_pacing_slack_margin)
+	{
+		pacer->input_delay    *= 0.5;
+		pacer->delay_backoffs += 1;
+	}
+
+	pacer->window_frames  += 1;
+	pacer->window_cpu_sum += sample->cpu_time;
+	pacer->window_gpu_sum += sample->gpu_time;
+
+	if (pacer->window_cpu_max   < sample->cpu_time) pacer->window_cpu_max   = sample->cpu_time;
+	if (pacer->window_slack_min > sample->slack)    pacer->window_slack_min = sample->slack;
+
+	if (pacer->window_frames < g_pacing_window)
+	{
+		return false;
+	}
+
+	double frames      = (double)pacer->window_frames;
+	double cpu_average = pacer->window_cpu_sum / frames;
+	double gpu_average = pacer->window_gpu_sum / frames;
+
+	//------------------------------------------------------------------------
+	// Frame slots
+
+	uint32_t wanted = pacer->min_slots;
+
+	if (gpu_average > cpu_average)
+	{
+		// one slot for the frame the GPU is on, and enough to cover the slowest CPU frame
+		double frames_ahead = (pacer->window_cpu_max + pacer->input_delay) / gpu_average;
+		wanted = 1 + (uint32_t)ceil(frames_ahead);
+	}
+
+	if (wanted < pacer->min_slots) wanted = pacer->min_slots;
+	if (wanted > pacer->max_slots) wanted = pacer->max_slots;
+
+	bool changed = false;
+
+	if (wanted > pacer->frame_slot_count)
+	{
+		pacer->frame_slot_count = wanted;
+		changed = true;
+	}
+	else if (wanted < pacer->frame_slot_count && ++pacer->decrease_windows >= g_pacing_decrease_windows)
+	{
+		pacer->frame_slot_count -= 1;
+		changed = true;
+	}
+
+	if (wanted >= pacer->frame_slot_count)
+	{
+		pacer->decrease_windows = 0;
+	}
+
+	//------------------------------------------------------------------------
+	// Input delay, which starts over whenever the slots change since the slack goes with them
+
+	if (changed)
+	{
+		pacer->input_delay       = 0.0;
+		pacer->decrease_windows  = 0;
+		pacer->slot_changes     += 1;
+	}
+	else if (pacer->delay_input)
+	{
+		if (pacer->window_slack_min > g_pacing_slack_margin) pacer->input_delay += 0.5*(pacer->window_slack_min - g_pacing_slack_margin);
+		else                                                 pacer->input_delay -= g_pacing_slack_margin - pacer->window_slack_min;
+
+		if (pacer->input_delay < 0.0)         pacer->input_delay = 0.0;
+		if (pacer->input_delay > gpu_average) pacer->input_delay = gpu_average;
+	}
+
+	pacer->window_frames    = 0;
+	pacer->window_cpu_sum   = 0.0;
+	pacer->window_cpu_max   = 0.0;
+	pacer->window_gpu_sum   = 0.0;
+	pacer->window_slack_min = DBL_MAX;
+
+	return changed;
+}
+
+//------------------------------------------------------------------------
+// Frame limiter
+//
+// Holds frames to a steady rate under what they'd run at otherwise. Frame starts are kept on a grid of
+// whole periods rather than a period after whenever the last one started, so the rate doesn't drift
+// with how late each wait happened to wake up. A frame that's late, but by less than a period, goes
+// straight through and the grid stays put, so the next one makes up for it. One that's late by more
+// has missed its slot altogether, and the grid starts over from it rather than letting a run of frames
+// through back to back to catch up.
+//
+// Times are seconds on whatever clock the caller likes, so it can be driven by a made up one, see
+// Bench_Limiter. Waiting is up to the caller, e.g. with WaitSeconds.
+
+static constexpr double g_default_frame_rate_limit = 120.0;
+
+struct FrameLimiter
+{
+	double period;
+
+	bool   started;
+	double next; // where the grid says the next frame starts
+
+	// stats
+	uint64_t frames;
+	uint64_t late_frames; // came in after their slot, less than a period late
+	uint64_t restarts;    // came in more than a period late
+};
+
+FrameLimiter FrameLimiter_Make(double frame_rate)
+{
+	assert(frame_rate > 0.0);
+
+	FrameLimiter result = {
+		.period = 1.0 / frame_rate,
+	};
+
+	return result;
+}
+
+// Takes the time a frame is ready to start, and gives the time it should start at, never earlier
+double FrameLimiter_Next(FrameLimiter *limiter, double now)
+{
+	limiter->frames += 1;
+
+	if (!limiter->started)
+	{
+		limiter->started = true;
+		limiter->next    = now + limiter->period;
+
+		return now;
+	}
+
+	double start = limiter->next;
+
+	if (now <= start)
+	{
+		limiter->next = start + limiter->period;
+	}
+	else if (now - start <= limiter->period)
+	{
+		limiter->late_frames += 1;
+		limiter->next         = start + limiter->period;
+
+		start = now;
+	}
+	else
+	{
+		limiter->restarts += 1;
+		limiter->next      = now + limiter->period;
+
+		start = now;
+	}
+
+	return start;
+}
+
+//------------------------------------------------------------------------
+// Frame statistics
+//
+// Durations go into a ring of the most recent ones, which is what stutters get judged against, and
+// into a histogram over the whole run for percentiles. The histogram is log-linear in the manner of
+// HdrHistogram: exact up to 256 microseconds, then every power of two split into 128 buckets, which
+// keeps any value within 0.4% and covers up to an hour in 13 KiB, without keeping every sample.
+//
+// A stutter is a frame that took more than g_stutter_threshold times the median of the frames just
+// before it. Only the frame series looks for them, the others are there to explain them.
+
+static constexpr uint32_t g_frame_stats_ring_size     = 4096; // a power of two
+static constexpr uint32_t g_stutter_window            = 128;  // frames the median is taken over
+static constexpr double   g_stutter_threshold         = 2.0;
+static constexpr uint32_t g_histogram_sub_bucket_bits = 8;
+static constexpr uint32_t g_histogram_sub_bucket_half = 1 << (g_histogram_sub_bucket_bits - 1);
+static constexpr uint32_t g_histogram_bucket_count    = (34 - g_histogram_sub_bucket_bits)*g_histogram_sub_bucket_half; // values below 2^32
+static constexpr double   g_histogram_relative_error  = 0.5 / g_histogram_sub_bucket_half; // half a bucket against the lowest value in it
+
+// Values are whole microseconds
+struct Histogram
+{
+	uint32_t counts[g_histogram_bucket_count];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+};
+
+uint32_t Histogram_GetBucket(uint64_t value)
+{
+	if (value > UINT32_MAX) value = UINT32_MAX;
+
+	// the top g_histogram_sub_bucket_bits bits pick the bucket, the shift which power of two it's in
+	uint32_t shift = 0;
+
+	while ((value >> shift) >= 2*g_histogram_sub_bucket_half)
+	{
+		shift += 1;
+	}
+
+	return shift*g_histogram_sub_bucket_half + (uint32_t)(value >> shift);
+}
+
+// The middle of the range of values that land in the bucket
+double Histogram_GetBucketValue(uint32_t bucket)
+{
+	if (bucket < 2*g_histogram_sub_bucket_half)
+	{
+		return (double)bucket;
+	}
+
+	uint32_t shift = bucket / g_histogram_sub_bucket_half - 1;
+	uint64_t low   = (uint64_t)(bucket % g_histogram_sub_bucket_half + g_histogram_sub_bucket_half) << shift;
+
+	return (double)low + 0.5*(double)((1ull << shift) - 1);
+}
+
+void Histogram_Record(Histogram *histogram, uint64_t value)
+{
+	histogram->counts[Histogram_GetBucket(value)] += 1;
+
+	histogram->count += 1;
+	histogram->sum   += value;
+
+	if (histogram->max < value) histogram->max = value;
+}
+
+// The value percentile percent of the recorded values are at or below
+double Histogram_GetPercentile(const Histogram *histogram, double percentile)
+{
+	if (histogram->count == 0)
+	{
+		return 0.0;
+	}
+
+	uint64_t rank = (uint64_t)ceil(percentile / 100.0*(double)histogram->count);
+	if (rank < 1) rank = 1;
+
+	uint64_t seen = 0;
+
+	for (uint32_t i = 0; i < g_histogram_bucket_count; i++)
+	{
+		seen += histogram->counts[i];
+
+		if (seen >= rank)
+		{
+			double value = Histogram_GetBucketValue(i);
+			return value < (double)histogram->max ? value : (double)histogram->max;
+		}
+	}
+
+	return (double)histogram->max;
+}
+
+enum FrameStat
+{
+	FrameStat_frame,   // from the start of one frame to the start of the next
+	FrameStat_wait,    // on the GPU, the swap chain or the frame limiter
+	FrameStat_present,
+	FrameStat_COUNT,
+};
+
+const char *g_frame_stat_names[FrameStat_COUNT] = {
+	"frame",
+	"wait",
+	"present",
+};
+
+struct FrameStatSeries
+{
+	Histogram histogram;
+	uint32_t  ring[g_frame_stats_ring_size]; // microseconds
+};
+
+struct Stutter
+{
+	uint64_t frame;
+	uint32_t duration; // microseconds
+	uint32_t median;
+};
+
+struct FrameStats
+{
+	uint64_t        frame_count;
+	FrameStatSeries series[FrameStat_COUNT];
+
+	uint64_t stutter_count;
+	Stutter  stutters[64]; // the most recent ones
+};
+
+// The median of the last g_stutter_window frames before the current one
+uint32_t FrameStats_GetRecentMedian(const FrameStats *stats)
+{
+	const uint32_t *ring = stats->series[FrameStat_frame].ring;
+
+	uint32_t window[g_stutter_window];
+	uint32_t count = stats->frame_count < g_stutter_window ? (uint32_t)stats->frame_count : g_stutter_window;
+
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		window[i] = ring[(stats->frame_count - 1 - i) & (g_frame_stats_ring_size - 1)];
+	}
+
+	// quickselect, only the side the middle is on gets partitioned further
+	uint32_t middle = count / 2;
+	uint32_t low    = 0;
+	uint32_t high   = count - 1;
+
+	while (low < high)
+	{
+		uint32_t pivot = window[(low + high) / 2];
+		uint32_t i     = low;
+		uint32_t j     = high;
+
+		while (i <= j)
+		{
+			while (window[i] < pivot) i++;
+			while (window[j] > pivot) j--;
+
+			if (i <= j)
+			{
+				uint32_t swap = window[i];
+				window[i] = window[j];
+				window[j] = swap;
+
+				i++;
+				if (j == 0) break;
+				j--;
+			}
+		}
+
+		if      (middle <= j) high = j;
+		else if (middle >= i) low  = i;
+		else                  break;
+	}
+
+	return window[middle];
+}
+
+// Durations in seconds, one per FrameStat. Returns whether the frame was a stutter.
+bool FrameStats_Record(FrameStats *stats, const double durations[FrameStat_COUNT])
+{
+	uint32_t values[FrameStat_COUNT];
+
+	for (uint32_t i = 0; i < FrameStat_COUNT; i++)
+	{
+		double microseconds = durations[i] > 0.0 ? durations[i]*1000000.0 + 0.5 : 0.0;
+		values[i] = microseconds < (double)UINT32_MAX ? (uint32_t)microseconds : UINT32_MAX;
+	}
+
+	//------------------------------------------------------------------------
+	// Judged against the frames before it, once there are enough of them
+
+	bool stutter = false;
+
+	if (stats->frame_count >= g_stutter_window)
+	{
+		uint32_t median = FrameStats_GetRecentMedian(stats);
+
+		if ((double)values[FrameStat_frame] > g_stutter_threshold*(double)median)
+		{
+			stats->stutters[stats->stutter_count % ArrayCount(stats->stutters)] = {
+				.frame    = stats->frame_count,
+				.duration = values[FrameStat_frame],
+				.median   = median,
+			};
+
+			stats->stutter_count += 1;
+			stutter = true;
+		}
+	}
+
+	uint32_t slot = (uint32_t)(stats->frame_count & (g_frame_stats_ring_size - 1));
+
+	for (uint32_t i = 0; i < FrameStat_COUNT; i++)
+	{
+		stats->series[i].ring[slot] = values[i];
+		Histogram_Record(&stats->series[i].histogram, values[i]);
+	}
+
+	stats->frame_count += 1;
+
+	return stutter;
+}
+
+// Percentiles of the whole run, plus the most recent stutters
+bool FrameStats_WriteJSON(const FrameStats *stats, const char *path)
+{
+	FILE *file = fopen(path, "w");
+	if (!file)
+	{
+		return false;
+	}
+
+	double      percentiles[]      = { 50.0, 95.0, 99.0, 99.9 };
+	const char *percentile_names[] = { "p50", "p95", "p99", "p99_9" };
+
+	fprintf(file, "{\n");
+	fprintf(file, "\t\"frames\": %llu,\n", (unsigned long long)stats->frame_count);
+	fprintf(file, "\t\"stutter_threshold\": %g,\n", g_stutter_threshold);
+	fprintf(file, "\t\"stutters\": %llu,\n", (unsigned long long)stats->stutter_count);
+	fprintf(file, "\t\"series_ms\": {\n");
+
+	for (uint32_t i = 0; i < FrameStat_COUNT; i++)
+	{
+		const Histogram *histogram = &stats->series[i].histogram;
+
+		double mean = histogram->count ? (double)histogram->sum / (double)histogram->count : 0.0;
+
+		fprintf(file, "\t\t\"%s\": { \"mean\": %.3f, \"max\": %.3f", g_frame_stat_names[i], mean / 1000.0, (double)histogram->max / 1000.0);
+
+		for (size_t j = 0; j < ArrayCount(percentiles); j++)
+		{
+			fprintf(file, ", \"%s\": %.3f", percentile_names[j], Histogram_GetPercentile(histogram, percentiles[j]) / 1000.0);
+		}
+
+		fprintf(file, " }%s\n", i + 1 < FrameStat_COUNT ? "," : "");
+	}
+
+	fprintf(file, "\t},\n");
+	fprintf(file, "\t\"recent_stutters\": [");
+
+	uint64_t kept  = stats->stutter_count < ArrayCount(stats->stutters) ? stats->stutter_count : ArrayCount(stats->stutters);
+	uint64_t first = stats->stutter_count - kept;
+
+	for (uint64_t i = first; i < stats->stutter_count; i++)
+	{
+		const Stutter *stutter = &stats->stutters[i % ArrayCount(stats->stutters)];
+
+		fprintf(file, "%s\n\t\t{ \"frame\": %llu, \"ms\": %.3f, \"median_ms\": %.3f }", i > first ? "," : "",
+				(unsigned long long)stutter->frame, (double)stutter->duration / 1000.0, (double)stutter->median / 1000.0);
+	}
+
+	fprintf(file, "%s]\n}\n", kept ? "\n\t" : "");
+
+	fclose(file);
+
+	return true;
+}
+
+//------------------------------------------------------------------------
+
+// Enough to see where the CPU cost of each draw mode goes
+static constexpr uint32_t g_max_triangle_guys = 1000000;
+
+enum D3D12_SceneDrawMode
+{
+	D3D12_SceneDrawMode_direct,         // a DrawIndexedInstanced per triangle guy, recorded in parallel
+	D3D12_SceneDrawMode_indirect,       // one ExecuteIndirect, draw count from the CPU
+	D3D12_SceneDrawMode_indirect_count, // one ExecuteIndirect, draw count read from a count buffer
+	D3D12_SceneDrawMode_gpu_culled,     // one ExecuteIndirect, draws and count written by the culling pass
+	D3D12_SceneDrawMode_instanced,      // one DrawIndexedInstanced, per instance data in a structured buffer
+	D3D12_SceneDrawMode_COUNT,
+};
+
+const char *g_scene_draw_mode_names[D3D12_SceneDrawMode_COUNT] = {
+	"direct",
+	"indirect",
+	"indirect_count",
+	"gpu_culled",
+	"instanced",
+};
+
+// Reads back how many draws the GPU let through and checks it against D3D12_CullDrawsReference
+static constexpr bool g_validate_gpu_culling = true;
+
+struct D3D12_CullStats
+{
+	uint32_t objects;
+	uint32_t visible_expected; // from the CPU reference, for the frame being recorded
+	uint32_t visible_gpu;      // read back, for the last frame that was validated
+	uint32_t frames_validated;
+	uint32_t mismatches;
+};
+
+struct D3D12_SceneCulling
+{
+	ID3D12PipelineState *pso;
+
+	ID3D12Resource  *out_draws;
+	D3D12_Descriptor out_draws_uav;
+	uint32_t         capacity;
+
+	ID3D12Resource  *out_count;
+	D3D12_Descriptor out_count_uav;
+
+	// a count per frame in flight
+	ID3D12Resource *readback;
+	uint32_t       *readback_counts;
+	uint32_t        expected_counts[g_max_frame_slots];
+	bool            pending        [g_max_frame_slots];
+
+	D3D12_CullStats stats;
+};
+
+// The GPU side is set up and used by the render thread, the triangle guys and the rest of the
+// simulation belong to the main thread, see D3D12_FramePacket
+struct D3D12_Scene
+{
+	bool initialized;            // render thread
+	bool simulation_initialized; // main thread
+	bool capture_next_frame;     // main thread, passed on in the next packet
+
+	D3D12_SceneDrawMode draw_mode;
+
+	ID3D12PipelineState    *pso;
+	ID3D12PipelineState    *instanced_pso;
+	ID3D12CommandSignature *draw_signature; // root constants followed by DrawIndexed, see D3D12_IndirectDraw
+
+	ID3D12Resource *ibuffer;
+	ID3D12Resource *vbuffer;
+
+	D3D12_Descriptor vbuffer_srv;
+
+	ID3D12Resource  *textures     [4];
+	D3D12_Descriptor textures_srvs[4];
+
+	TriangleGuys  triangle_guys;
+	Vector2D      triangle_extents;
+	FixedTimestep timestep;
+
+	// how many guys the sort and cull buffers below have room for
+	uint32_t draw_order_capacity;
+
+	// The order to draw the visible triangle guys in, see D3D12_SortSceneDraws
+	uint32_t  draw_count;
+	uint32_t *draw_order;
+	SortItem *sort_items;
+	SortItem *sort_scratch;
+
+	// Guys overlapping the viewport, rebuilt each frame unless culling is off (V) or the GPU culls
+	bool      cpu_culling;
+	uint32_t *visible;
+	uint32_t *cull_block_counts;
+	CullStats cull_stats;
+
+	// Over the triangle guys, built or refit when something asks for it, see D3D12_GetSceneBVH
+	BVH  bvh;
+	bool bvh_stale;
+
+	D3D12_SceneCulling culling;
+
+	uint32_t    texture_index_offset;
+
+	// main thread, asked of the render thread with every packet, see D3D12_SetFrameLatency. With
+	// adaptive pacing on (P), the render thread's FramePacer picks the frame slot count instead.
+	uint32_t max_frame_latency;
+	uint32_t frame_slot_count;
+	bool     adaptive_pacing;
+
+	// main thread, passed on with every packet, changed with M
+	D3D12_PresentMode present_mode;
+	double            frame_rate_limit;
+};
+
+void D3D12_SetTriangleGuyCount(D3D12_Scene *scene, uint32_t count)
+{
+	assert(count <= g_max_triangle_guys);
+
+	TriangleGuys_SetCount(&scene->triangle_guys, count, scene->triangle_extents);
+
+	if (scene->draw_order_capacity < count)
+	{
+		uint32_t capacity = scene->triangle_guys.capacity;
+
+		// these get rebuilt every frame, no need to keep what's in them
+		free(scene->draw_order);
+		free(scene->visible);
+		free(scene->cull_block_counts);
+		_aligned_free(scene->sort_items);
+		_aligned_free(scene->sort_scratch);
+
+		scene->draw_order        = (uint32_t *)malloc(capacity*sizeof(uint32_t));
+		scene->visible           = (uint32_t *)malloc(capacity*sizeof(uint32_t));
+		scene->cull_block_counts = (uint32_t *)malloc(TriangleGuys_GetCullBlockCount(capacity)*sizeof(uint32_t));
+		scene->sort_items        = (SortItem *)_aligned_malloc(capacity*sizeof(SortItem), 16);
+		scene->sort_scratch      = (SortItem *)_aligned_malloc(capacity*sizeof(SortItem), 16);
+
+		scene->draw_order_capacity = capacity;
+	}
+}
+
+//------------------------------------------------------------------------
+// Draw sorting
+
+// Packs a draw's state into a key that sorts draws sharing state next to each other, most significant
+// first:
+//
+//     opaque:      pass (6) | pso (12) | material (16) | depth (30)
+//     translucent: pass (6) | depth (30) | pso (12) | material (16)
+//
+// Opaque draws go front to back within their state, to get the most out of early depth testing.
+// Translucent ones have to be drawn back to front to blend correctly, which beats any state sorting.
+uint64_t D3D12_MakeDrawSortKey(uint32_t pass, uint32_t pso, uint32_t material, float depth, bool translucent)
+{
+	assert(pass     < (1u << 6));
+	assert(pso      < (1u << 12));
+	assert(material < (1u << 16));
+
+	if (depth < 0.0f) depth = 0.0f;
+	if (depth > 1.0f) depth = 1.0f;
+
+	// in double, a float can't hold 2^30 - 1 and rounds it up to 2^30, which spills out of the field
+	uint64_t depth_bits = (uint64_t)((double)depth*(double)((1u << 30) - 1));
+	uint64_t state_bits = ((uint64_t)pso << 16) | material;
+
+	uint64_t result;
+
+	if (translucent)
+	{
+		depth_bits = ((1u << 30) - 1) - depth_bits;
+		result     = ((uint64_t)pass << 58) | (depth_bits << 28) | state_bits;
+	}
+	else
+	{
+		result = ((uint64_t)pass << 58) | (state_bits << 30) | depth_bits;
+	}
+
+	return result;
+}
+
+// Culls the triangle guys against the viewport and sorts the ones left into scene->draw_order. They all
+// share a PSO and are opaque, so it comes down to grouping them by texture. The scene is 2D and has no
+// depth to speak of, so the position in the array stands in for it, which keeps guys with the same
+// texture in their original order.
+//
+// The GPU culled draw mode does its own culling, so it gets all of them.
+void D3D12_SortSceneDraws(D3D12_Scene *scene)
+{
+	const TriangleGuys *guys = &scene->triangle_guys;
+
+	uint32_t count = guys->count;
+
+	if (scene->cpu_culling && scene->draw_mode != D3D12_SceneDrawMode_gpu_culled)
+	{
+		count = TriangleGuys_Cull(guys, g_clip_space_rect, scene->visible, scene->cull_block_counts, &scene->cull_stats, &g_work_queue);
+	}
+	else
+	{
+		for (uint32_t i = 0; i < count; i++)
+		{
+			scene->visible[i] = i;
+		}
+
+		scene->cull_stats = { .tested = 0, .visible = count };
+	}
+
+	float depth_scale = guys->count > 1 ? 1.0f / (float)(guys->count - 1) : 0.0f;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t guy_index = scene->visible[i];
+		uint32_t material  = (guys->texture[guy_index] + scene->texture_index_offset) % 4;
+
+		scene->sort_items[i] = {
+			.key   = D3D12_MakeDrawSortKey(0, 0, material, (float)guy_index*depth_scale, false),
+			.value = guy_index,
+		};
+	}
+
+	SortItem *sorted = RadixSort(scene->sort_items, scene->sort_scratch, count, &g_work_queue);
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		scene->draw_order[i] = sorted[i].value;
+	}
+
+	scene->draw_count = count;
+}
+
+// Half the height of a triangle guy is 0.5, the width is picked to make them look equilateral
+float D3D12_GetTriangleWidth()
+{
+	float aspect_ratio = (float)g_d3d.window_w / (float)g_d3d.window_h;
+	return 0.577f / aspect_ratio;
+}
+
+// Sets up the half of the scene that belongs to the main thread. Needs the window size, so it has to
+// come after D3D12_Init.
+void D3D12_InitSceneSimulation(D3D12_Scene *scene)
+{
+	scene->triangle_extents = { D3D12_GetTriangleWidth(), 0.5f };
+	scene->timestep         = FixedTimestep_Make();
+	scene->cpu_culling      = true;
+	scene->draw_mode        = D3D12_SceneDrawMode_indirect;
+
+	if (!scene->max_frame_latency) scene->max_frame_latency = g_default_max_frame_latency;
+	if (!scene->frame_slot_count)  scene->frame_slot_count  = g_default_frame_slots;
+	if (!scene->frame_rate_limit)  scene->frame_rate_limit  = g_default_frame_rate_limit;
+
+	D3D12_SetTriangleGuyCount(scene, 4);
+
+	scene->simulation_initialized = true;
+}
+
+// The half that belongs to the render thread, in the first frame it draws
+void D3D12_InitScene(D3D12_Scene *scene)
+{
+	//------------------------------------------------------------------------
+	// Create PSO
+
+	scene->pso           = D3D12_CreatePSO();
+	scene->instanced_pso = D3D12_CreatePSO(L"MainInstancedVS");
+
+	//------------------------------------------------------------------------
+	// Create command signature for indirect draws
+
+	{
+		D3D12_INDIRECT_ARGUMENT_DESC arguments[] = {
+			{
+				.Type = D3D12_INDIRECT_ARGUMENT_TYPE_CONSTANT,
+				.Constant = {
+					.RootParameterIndex      = D3D12_RootParameter_32bit_constants,
+					.DestOffsetIn32BitValues = 0,
+					.Num32BitValuesToSet     = sizeof(D3D12_RootConstants) / sizeof(uint32_t),
+				},
+			},
+			{
+				.Type = D3D12_INDIRECT_ARGUMENT_TYPE_DRAW_INDEXED,
+			},
+		};
+
+		D3D12_COMMAND_SIGNATURE_DESC desc = {
+			.ByteStride       = sizeof(D3D12_IndirectDraw),
+			.NumArgumentDescs = ArrayCount(arguments),
+			.pArgumentDescs   = arguments,
+		};
+
+		// the root signature is needed because the arguments change root constants
+		HRESULT hr = g_d3d.device->CreateCommandSignature(&desc, g_d3d.rs_bindless, IID_PPV_ARGS(&scene->draw_signature));
+		CHECK_HR(hr);
+	}
+
+	//------------------------------------------------------------------------
+	// Create index and vertex buffer
+
+	uint16_t indices[] = {
+		0, 1, 2,
+	};
+
+	float triangle_width = D3D12_GetTriangleWidth();
+
+	Vertex vertices[] = {
+		{ {            0.0f,  0.5f }, {  5.0f, 10.0f }, { 1, 1, 1, 1 } },
+		{ {  triangle_width, -0.5f }, { 10.0f,  0.0f }, { 1, 1, 1, 1 } },
+		{ { -triangle_width, -0.5f }, {  0.0f,  0.0f }, { 1, 1, 1, 1 } },
+	};
+
+	scene->ibuffer = D3D12_CreateUploadBuffer(g_d3d.device, sizeof(indices),  L"Index Buffer",  indices,  sizeof(indices));
+	scene->vbuffer = D3D12_CreateUploadBuffer(g_d3d.device, sizeof(vertices), L"Vertex Buffer", vertices, sizeof(vertices));
+
+	{
+		D3D12_SHADER_RESOURCE_VIEW_DESC desc = {
+			.Format        = DXGI_FORMAT_UNKNOWN,
+			.ViewDimension = D3D12_SRV_DIMENSION_BUFFER,
+			.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING,
+			.Buffer = {
+				.FirstElement        = 0,
+				.NumElements         = 3,
+				.StructureByteStride = sizeof(Vertex),
+			},
+		};
+
+		scene->vbuffer_srv = g_d3d.view_cache.GetSRV(scene->vbuffer, &desc);
+	}
+
+	//------------------------------------------------------------------------
+	// Make textures
+
+	D3D12_Frame *frame = D3D12_GetFrameState();
+
+	const uint32_t texture_pixels[][4*4] = {
+		{ // checkerboard
+			0xFF444444, 0xFF444444, 0xFFFFFFAA, 0xFFFFFFAA,
+			0xFF444444, 0xFF444444, 0xFFFFFFAA, 0xFFFFFFAA,
+			0xFFFFFFAA, 0xFFFFFFAA, 0xFF444444, 0xFF444444,
+			0xFFFFFFAA, 0xFFFFFFAA, 0xFF444444, 0xFF444444,
+		},
+		{ // shifting checkerboard
+			0xFF444444, 0xFF444444, 0xFFFFFFFF, 0xFFFFFFFF,
+			0xFFFFFFFF, 0xFF444444, 0xFF444444, 0xFFFFFFFF,
+			0xFFFFFFFF, 0xFFFFFFFF, 0xFF444444, 0xFF444444,
+			0xFF444444, 0xFFFFFFFF, 0xFFFFFFFF, 0xFF444444,
+		},
+		{ // partytown
+			0xFFFF0000, 0xFF00FF00, 0xFF0000FF, 0xFFFF00FF,
+			0xFFFF00FF, 0xFF0000FF, 0xFF00FF00, 0xFFFF0000,
+			0xFFFF0000, 0xFF00FF00, 0xFF0000FF, 0xFFFF00FF,
+			0xFFFF00FF, 0xFF0000FF, 0xFF00FF00, 0xFFFF0000,
+		},
+		{ // rainbow stripes
+			0xFFFF0000, 0xFFFF0000, 0xFFFF0000, 0xFFFF0000,
+			0xFFFFFF00, 0xFFFFFF00, 0xFFFFFF00, 0xFFFFFF00,
+			0xFF0000FF, 0xFF0000FF, 0xFF0000FF, 0xFF0000FF,
+			0xFFFF00FF, 0xFFFF00FF, 0xFFFF00FF, 0xFFFF00FF,
+		},
+	};
+
+	for (size_t i = 0; i < ArrayCount(texture_pixels); i++)
+	{
+		scene->textures     [i] = D3D12_CreateTexture(g_d3d.device, &g_d3d.state_tracker, 4, 4, L"Checkerboard", texture_pixels[i], frame->open_list, &frame->upload_arena);
+		scene->textures_srvs[i] = g_d3d.view_cache.GetSRV(scene->textures[i], nullptr);
+	}
+
+	//------------------------------------------------------------------------
+	// Set up GPU culling. The output buffers are sized on first use.
+
+	{
+		D3D12_SceneCulling *culling = &scene->culling;
+
+		culling->pso = D3D12_CreateCullPSO();
+
+		culling->out_count = D3D12_CreateBuffer(g_d3d.device, sizeof(uint32_t), L"Culled Draw Count", D3D12_HEAP_TYPE_DEFAULT, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+		g_d3d.state_tracker.Register(culling->out_count, 1, D3D12_RESOURCE_STATE_COMMON, true);
+
+		D3D12_UNORDERED_ACCESS_VIEW_DESC desc = {
+			.Format        = DXGI_FORMAT_R32_TYPELESS,
+			.ViewDimension = D3D12_UAV_DIMENSION_BUFFER,
+			.Buffer = {
+				.FirstElement = 0,
+				.NumElements  = 1,
+				.Flags        = D3D12_BUFFER_UAV_FLAG_RAW,
+			},
+		};
+
+		culling->out_count_uav = g_d3d.view_cache.GetUAV(culling->out_count, nullptr, &desc);
+
+		culling->readback = D3D12_CreateBuffer(g_d3d.device, g_max_frame_slots*sizeof(uint32_t), L"Culled Draw Count Readback", D3D12_HEAP_TYPE_READBACK);
+
+		// readback buffers can stay mapped, so long as we only look at what the GPU is done with
+		HRESULT hr = culling->readback->Map(0, nullptr, (void **)&culling->readback_counts);
+		CHECK_HR(hr);
+	}
+
+	//------------------------------------------------------------------------
+
+	scene->initialized = true;
+}
+
+// Steps the simulation as far as current_time allows, then puts the guys where they should be drawn in
+// between the last two steps
+void D3D12_UpdateScene(D3D12_Scene *scene, double current_time)
+{
+	CPU_SCOPE("D3D12_UpdateScene");
+
+	FixedTimestep_Advance(&scene->timestep, current_time);
+
+	double simulation_time;
+
+	while (FixedTimestep_Step(&scene->timestep, &simulation_time))
+	{
+		TriangleGuys_Step(&scene->triangle_guys, simulation_time, &g_work_queue);
+	}
+
+	TriangleGuys_Interpolate(&scene->triangle_guys, FixedTimestep_GetAlpha(&scene->timestep), &g_work_queue);
+
+	scene->bvh_stale = true;
+}
+
+// Most frames nothing asks, so the BVH is only brought up to date when it's needed. The guys move
+// around the same few spots, so refitting doesn't let it get much worse than a fresh build.
+const BVH *D3D12_GetSceneBVH(D3D12_Scene *scene)
+{
+	if (scene->bvh.object_count != scene->triangle_guys.count)
+	{
+		BVH_Build(&scene->bvh, &scene->triangle_guys);
+	}
+	else if (scene->bvh_stale)
+	{
+		BVH_Refit(&scene->bvh, &scene->triangle_guys, &g_work_queue);
+	}
+
+	scene->bvh_stale = false;
+
+	return &scene->bvh;
+}
+
+//------------------------------------------------------------------------
+// Frame packets
+//
+// The main thread simulates and the render thread records and presents, with frame packets going from
+// one to the other: everything the render thread needs to draw a frame, built by the main thread and
+// left alone by it until the render thread is done and hands the packet back. Packets go round a
+// bounded single producer, single consumer ring. Each side only ever writes its own index, publishing
+// it with release semantics once it's done with the packet and reading the other side's with acquire,
+// so the ring needs no locks and neither side makes a system call while there's room. Only a producer
+// facing a full ring or a consumer facing an empty one sleeps, on an event the other side sets after
+// moving its index. A deeper queue lets the main thread get further ahead, which soaks up hitches on
+// either side but draws older frames.
+
+static constexpr uint32_t g_max_frame_packets          = 8;
+static constexpr uint32_t g_default_frame_packet_depth = 2;
+
+// Linear allocator for a packet's memory, like D3D12_LinearAllocator but in plain memory
+struct FrameArena
+{
+	char  *base;
+	size_t at;
+	size_t capacity;
+
+	// Blocks outgrown since the last reset, allocations made from them are still in use until then
+	char    *outgrown[8];
+	uint32_t outgrown_count;
+
+	void *Allocate(size_t size, size_t align)
+	{
+		assert((align & (align - 1)) == 0);
+
+		size_t at_aligned = (at + (align - 1)) & ~(align - 1);
+
+		if (!base || at_aligned + size > capacity)
+		{
+			if (base)
+			{
+				assert(outgrown_count < ArrayCount(outgrown) || !"Frame arena outgrown too often in one frame");
+				outgrown[outgrown_count++] = base;
+			}
+
+			size_t new_capacity = capacity ? 2*capacity : KiB(64);
+			while (new_capacity < size + align) new_capacity *= 2;
+
+			base       = (char *)_aligned_malloc(new_capacity, 64);
+			capacity   = new_capacity;
+			at_aligned = 0;
+		}
+
+		at = at_aligned + size;
+
+		return base + at_aligned;
+	}
+
+	void Reset()
+	{
+		for (uint32_t i = 0; i < outgrown_count; i++)
+		{
+			_aligned_free(outgrown[i]);
+		}
+
+		outgrown_count = 0;
+		at             = 0;
+	}
+
+	void Release()
+	{
+		Reset();
+
+		_aligned_free(base);
+		ZeroStruct(this);
+	}
+};
+
+// A triangle guy as it's drawn
+struct D3D12_PacketDraw
+{
+	Vector2D offset;
+	Vector2D extents; // for GPU culling
+	uint32_t texture; // which of the scene's textures, the render thread turns it into a descriptor
+	uint32_t color;
+};
+
+struct D3D12_FramePacket
+{
+	uint64_t index;
+	bool     quit;    // nothing to draw, the render thread stops at this one
+	bool     capture; // write the frame's command lists to disk, see D3D12_WriteFrameCapture
+
+	uint32_t max_frame_latency;
+	uint32_t frame_slot_count;
+	bool     adaptive_pacing;
+
+	D3D12_PresentMode present_mode;
+	double            frame_rate_limit; // for D3D12_PresentMode_limited
+
+	D3D12_SceneDrawMode draw_mode;
+	uint32_t            draw_count;
+	D3D12_PacketDraw   *draws; // in the order to draw them
+
+	// Filled in by the main thread, the render thread times its own stages
+	LARGE_INTEGER started;       // when the main thread started on the packet
+	double        producer_wait; // seconds waiting for a free packet
+	double        simulate;      // seconds spent filling it in
+
+	FrameArena arena;
+};
+
+struct D3D12_FramePacketQueue
+{
+	D3D12_FramePacket packets[g_max_frame_packets];
+	uint32_t          depth;
+
+	// each only written by its own side, and on its own cache line
+	alignas(64) volatile LONG64 write_index;
+	alignas(64) volatile LONG64 read_index;
+
+	// Set by a side before it goes to sleep on its event. Raising the flag and moving the index are
+	// both followed by a full barrier before the other is read, so either the sleeper sees the index
+	// move when it checks again, or the other side sees the flag and sets the event.
+	alignas(64) volatile long producer_waiting;
+	volatile long             consumer_waiting;
+
+	HANDLE packet_read;    // auto-reset, set by the consumer for a producer waiting on a full ring
+	HANDLE packet_written; // auto-reset, set by the producer for a consumer waiting on an empty one
+
+	void Init(uint32_t in_depth)
+	{
+		assert(in_depth >= 1 && in_depth <= g_max_frame_packets);
+
+		depth            = in_depth;
+		write_index      = 0;
+		read_index       = 0;
+		producer_waiting = 0;
+		consumer_waiting = 0;
+
+		packet_read    = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+		packet_written = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+	}
+
+	// Main thread, waits for the render thread to hand a packet back if they're all in use
+	D3D12_FramePacket *BeginWrite()
+	{
+		LONG64 w = write_index;
+
+		if (w - ReadAcquire64(&read_index) == (LONG64)depth)
+		{
+			InterlockedExchange(&producer_waiting, 1);
+
+			// the event can be left set by a wakeup that came after the last check, hence the loop
+			while (w - ReadAcquire64(&read_index) == (LONG64)depth)
+			{
+				WaitForSingleObject(packet_read, INFINITE);
+			}
+
+			InterlockedExchange(&producer_waiting, 0);
+		}
+
+		return &packets[(uint64_t)w % depth];
+	}
+
+	void EndWrite()
+	{
+		WriteRelease64(&write_index, write_index + 1);
+		MemoryBarrier();
+
+		if (consumer_waiting)
+		{
+			SetEvent(packet_written);
+		}
+	}
+
+	// Render thread, waits for the main thread if there is nothing to draw
+	D3D12_FramePacket *BeginRead()
+	{
+		LONG64 r = read_index;
+
+		if (ReadAcquire64(&write_index) == r)
+		{
+			InterlockedExchange(&consumer_waiting, 1);
+
+			while (ReadAcquire64(&write_index) == r)
+			{
+				WaitForSingleObject(packet_written, INFINITE);
+			}
+
+			InterlockedExchange(&consumer_waiting, 0);
+		}
+
+		return &packets[(uint64_t)r % depth];
+	}
+
+	void EndRead()
+	{
+		WriteRelease64(&read_index, read_index + 1);
+		MemoryBarrier();
+
+		if (producer_waiting)
+		{
+			SetEvent(packet_read);
+		}
+	}
+
+	// Only once the render thread has stopped
+	void Release()
+	{
+		for (uint32_t i = 0; i < ArrayCount(packets); i++)
+		{
+			packets[i].arena.Release();
+		}
+
+		CloseHandle(packet_read);
+		CloseHandle(packet_written);
+	}
+};
+
+D3D12_FramePacketQueue g_frame_packets;
+
+struct D3D12_PacketDrawBuild
+{
+	const D3D12_Scene *scene;
+	D3D12_PacketDraw  *draws;
+};
+
+void D3D12_PacketDrawBuildRange(uint32_t first, uint32_t count, void *data)
+{
+	D3D12_PacketDrawBuild *build = (D3D12_PacketDrawBuild *)data;
+	const D3D12_Scene     *scene = build->scene;
+	const TriangleGuys    *guys  = &scene->triangle_guys;
+
+	for (uint32_t i = first; i < first + count; i++)
+	{
+		uint32_t guy_index = scene->draw_order[i];
+
+		build->draws[i] = {
+			.offset  = { guys->position_x[guy_index], guys->position_y[guy_index] },
+			.extents = { guys->extent_x  [guy_index], guys->extent_y  [guy_index] },
+			.texture = (guys->texture[guy_index] + scene->texture_index_offset) % 4,
+			.color   = guys->color[guy_index],
+		};
+	}
+}
+
+// Main thread, after D3D12_UpdateScene. Culls and sorts the guys, and copies what's left into the packet.
+void D3D12_BuildFramePacket(D3D12_Scene *scene, D3D12_FramePacket *packet)
+{
+	D3D12_SortSceneDraws(scene);
+
+	packet->arena.Reset();
+
+	packet->quit       = false;
+	packet->capture    = scene->capture_next_frame;
+	packet->draw_mode  = scene->draw_mode;
+	packet->draw_count = scene->draw_count;
+	packet->draws      = (D3D12_PacketDraw *)packet->arena.Allocate(scene->draw_count*sizeof(D3D12_PacketDraw), alignof(D3D12_PacketDraw));
+
+	packet->max_frame_latency = scene->max_frame_latency;
+	packet->frame_slot_count  = scene->frame_slot_count;
+	packet->adaptive_pacing   = scene->adaptive_pacing;
+	packet->present_mode      = scene->present_mode;
+	packet->frame_rate_limit  = scene->frame_rate_limit;
+
+	scene->capture_next_frame = false;
+
+	D3D12_PacketDrawBuild build = {
+		.scene = scene,
+		.draws = packet->draws,
+	};
+
+	ParallelFor(&g_work_queue, scene->draw_count, g_min_triangle_guys_per_update_task, D3D12_PacketDrawBuildRange, &build);
+}
+
+// Render thread
+D3D12_RootConstants D3D12_GetDrawConstants(const D3D12_Scene *scene, const D3D12_PacketDraw *draw)
+{
+	D3D12_RootConstants result = {
+		.offset        = draw->offset,
+		.texture_index = scene->textures_srvs[draw->texture].index,
+		.color         = draw->color,
+	};
+
+	return result;
+}
+
+// Writes out the ExecuteIndirect arguments for a range of a packet's draws. Doesn't touch the device,
+// so it can be checked against what the direct path would have recorded without a GPU in sight, which
+// the indirect benchmark does.
+void D3D12_BuildIndirectDraws(const D3D12_Scene *scene, const D3D12_FramePacket *packet, uint32_t first, uint32_t count, D3D12_IndirectDraw *out)
+{
+	assert(first + count <= packet->draw_count);
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		out[i] = {
+			.constants = D3D12_GetDrawConstants(scene, &packet->draws[first + i]),
+			.draw = {
+				.IndexCountPerInstance = 3,
+				.InstanceCount         = 1,
+				.StartIndexLocation    = 0,
+				.BaseVertexLocation    = 0,
+				.StartInstanceLocation = 0,
+			},
+		};
+	}
+}
+
+//------------------------------------------------------------------------
+// Do the actually actual rendering!! FINALLY!!
+
+// Below this many draws it isn't worth the overhead of another command list
+static constexpr uint32_t g_min_draws_per_list = 2048;
+
+struct D3D12_ScenePassData
+{
+	D3D12_Scene             *scene;
+	const D3D12_FramePacket *packet;
+	D3D12_RGHandle           target;
+};
+
+struct D3D12_SceneDrawData
+{
+	D3D12_Scene               *scene;
+	const D3D12_FramePacket   *packet;
+	D3D12_Descriptor           rtv;
+	D3D12_GPU_VIRTUAL_ADDRESS  pass_cbv;
+};
+
+// Everything the draws need besides the per draw root constants
+void D3D12_SetSceneDrawState(D3D12_CommandList *list, D3D12_SceneDrawData *data)
+{
+	D3D12_Scene *scene = data->scene;
+
+	//------------------------------------------------------------------------
+	// Set rendertarget
+
+	list->OMSetRenderTargets(1, &data->rtv.cpu, nullptr);
+
+	//------------------------------------------------------------------------
+	// Input Assembler
+
+	list->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+
+	D3D12_INDEX_BUFFER_VIEW ibv = {
+		.BufferLocation = scene->ibuffer->GetGPUVirtualAddress(),
+		.SizeInBytes    = 3*sizeof(uint16_t),
+		.Format         = DXGI_FORMAT_R16_UINT,
+	};
+	list->IASetIndexBuffer(&ibv);
+
+	//------------------------------------------------------------------------
+	// Rasterizer State
+
+	D3D12_VIEWPORT viewport = {
+		.TopLeftX = 0.0f,
+		.TopLeftY = 0.0f,
+		.Width    = (float)g_d3d.window_w,
+		.Height   = (float)g_d3d.window_h,
+		.MinDepth = 0.0f,
+		.MaxDepth = 1.0f,
+	};
+
+	list->RSSetViewports(1, &viewport);
+
+	D3D12_RECT scissor_rect = {
+		.left   = 0,
+		.top    = 0,
+		.right  = g_d3d.window_w,
+		.bottom = g_d3d.window_h,
+	};
+
+	list->RSSetScissorRects(1, &scissor_rect);
+
+	//------------------------------------------------------------------------
+	// Set PSO
+
+	list->SetPipelineState(scene->pso);
+
+	//------------------------------------------------------------------------
+	// Set pass constants
+
+	list->SetGraphicsRootConstantBufferView(D3D12_RootParameter_pass_cbv, data->pass_cbv);
+}
+
+// The per draw part of the direct path, which D3D12_BuildIndirectDraws has to match record for record
+void D3D12_RecordDraws(D3D12_CommandList *list, const D3D12_Scene *scene, const D3D12_FramePacket *packet, uint32_t first, uint32_t count)
+{
+	assert(first + count <= packet->draw_count);
+
+	for (uint32_t i = first; i < first + count; i++)
+	{
+		//------------------------------------------------------------------------
+		// Set root constants
+
+		D3D12_RootConstants root_constants = D3D12_GetDrawConstants(scene, &packet->draws[i]);
+
+		uint32_t uint_count = sizeof(root_constants) / sizeof(uint32_t);
+		list->SetGraphicsRoot32BitConstants(D3D12_RootParameter_32bit_constants, uint_count, &root_constants, 0);
+
+		//------------------------------------------------------------------------
+		// Draw the triangle
+
+		list->DrawIndexedInstanced(3, 1, 0, 0, 0);
+	}
+}
+
+// Runs on the worker threads for D3D12_RecordParallel
+void D3D12_RecordSceneDraws(D3D12_CommandList *list, uint32_t first, uint32_t count, void *user_data)
+{
+	D3D12_SceneDrawData *data = (D3D12_SceneDrawData *)user_data;
+
+	D3D12_SetSceneDrawState(list, data);
+	D3D12_RecordDraws(list, data->scene, data->packet, first, count);
+}
+
+void D3D12_ScenePass(D3D12_RenderGraph *graph, D3D12_CommandList *list, void *user_data)
+{
+	D3D12_ScenePassData     *data   = (D3D12_ScenePassData *)user_data;
+	D3D12_Scene             *scene  = data->scene;
+	const D3D12_FramePacket *packet = data->packet;
+	D3D12_Frame             *frame  = D3D12_GetFrameState();
+
+	//------------------------------------------------------------------------
+	// Clear rendertarget
+
+	D3D12_Descriptor rtv = graph->GetRTV(data->target);
+
+	float clear_color[4] = { 0.2f, 0.3f, 0.2f, 1.0f };
+	list->ClearRenderTargetView(rtv.cpu, clear_color);
+
+	//------------------------------------------------------------------------
+	// Allocate pass constants up front, the upload arena isn't thread safe
+
+	D3D12_BufferAllocation pass_alloc = 
+		frame->upload_arena.Allocate(
+			sizeof(D3D12_PassConstants), 
+			D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT);
+
+	D3D12_PassConstants *pass_constants = (D3D12_PassConstants *)pass_alloc.cpu_base;
+	pass_constants->vbuffer_srv = scene->vbuffer_srv.index;
+
+	//------------------------------------------------------------------------
+	// Draw
+
+	D3D12_SceneDrawData draw_data = {
+		.scene    = scene,
+		.packet   = packet,
+		.rtv      = rtv,
+		.pass_cbv = pass_alloc.gpu_base,
+	};
+
+	switch (packet->draw_mode)
+	{
+		case D3D12_SceneDrawMode_direct:
+		{
+			D3D12_RecordParallel(packet->draw_count, g_min_draws_per_list, D3D12_RecordSceneDraws, &draw_data);
+		} break;
+
+		case D3D12_SceneDrawMode_indirect:
+		case D3D12_SceneDrawMode_indirect_count:
+		{
+			uint32_t draw_count = packet->draw_count;
+
+			D3D12_BufferAllocation args_alloc = 
+				frame->upload_arena.Allocate(
+					draw_count*(uint32_t)sizeof(D3D12_IndirectDraw), 
+					alignof(D3D12_IndirectDraw));
+
+			D3D12_BuildIndirectDraws(scene, packet, 0, draw_count, (D3D12_IndirectDraw *)args_alloc.cpu_base);
+
+			D3D12_SetSceneDrawState(list, &draw_data);
+
+			if (packet->draw_mode == D3D12_SceneDrawMode_indirect)
+			{
+				list->ExecuteIndirect(scene->draw_signature, draw_count, args_alloc.buffer, args_alloc.offset, nullptr, 0);
+			}
+			else
+			{
+				// The count buffer is what lets the GPU decide how many draws there are, which is the point
+				// once culling moves to the GPU. Here the CPU writes it, the draw count passed along is an
+				// upper bound.
+				D3D12_BufferAllocation count_alloc = frame->upload_arena.Allocate(sizeof(uint32_t), sizeof(uint32_t));
+				*(uint32_t *)count_alloc.cpu_base = draw_count;
+
+				list->ExecuteIndirect(scene->draw_signature, draw_count, args_alloc.buffer, args_alloc.offset, count_alloc.buffer, count_alloc.offset);
+			}
+		} break;
+
+		case D3D12_SceneDrawMode_gpu_culled:
+		{
+			// D3D12_Render skips the cull when there's nothing to draw, so there's no output to draw from
+			if (packet->draw_count == 0)
+			{
+				break;
+			}
+
+			D3D12_SceneCulling *culling = &scene->culling;
+
+			D3D12_SetSceneDrawState(list, &draw_data);
+
+			list->ExecuteIndirect(scene->draw_signature, packet->draw_count, culling->out_draws, 0, culling->out_count, 0);
+		} break;
+
+		case D3D12_SceneDrawMode_instanced:
+		{
+			uint32_t instance_count = packet->draw_count;
+
+			if (instance_count == 0)
+			{
+				break;
+			}
+
+			D3D12_BufferAllocation instances_alloc = 
+				frame->upload_arena.Allocate(
+					instance_count*(uint32_t)sizeof(D3D12_RootConstants), 
+					sizeof(D3D12_RootConstants));
+
+			D3D12_RootConstants *instances = (D3D12_RootConstants *)instances_alloc.cpu_base;
+
+			for (uint32_t i = 0; i < instance_count; i++)
+			{
+				instances[i] = D3D12_GetDrawConstants(scene, &packet->draws[i]);
+			}
+
+			D3D12_SHADER_RESOURCE_VIEW_DESC desc = {
+				.Format        = DXGI_FORMAT_UNKNOWN,
+				.ViewDimension = D3D12_SRV_DIMENSION_BUFFER,
+				.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING,
+				.Buffer = {
+					.FirstElement        = instances_alloc.offset / sizeof(D3D12_RootConstants),
+					.NumElements         = instance_count,
+					.StructureByteStride = sizeof(D3D12_RootConstants),
+				},
+			};
+
+			D3D12_Descriptor instances_srv = g_d3d.view_cache.GetSRV(instances_alloc.buffer, &desc);
+			D3D12_DeferReleaseView(instances_srv);
+
+			// the pass constants haven't been read yet, it's not too late to fill this in
+			pass_constants->instances_srv = instances_srv.index;
+
+			D3D12_SetSceneDrawState(list, &draw_data);
+			list->SetPipelineState(scene->instanced_pso);
+
+			list->DrawIndexedInstanced(3, instance_count, 0, 0, 0);
+		} break;
+
+		default:
+		{
+			assert(!"Unknown draw mode");
+		} break;
+	}
+}
+
+struct D3D12_CullPassData
+{
+	D3D12_Scene           *scene;
+	D3D12_CullConstants    constants;
+	D3D12_BufferAllocation zero;
+	uint32_t               readback_slot;
+};
+
+// Render thread, after D3D12_SetFrameLatency changed the number of frame slots. Counts waiting in slots
+// past the new count would otherwise be validated whenever the count goes back up, long after the
+// frame they belong to.
+void D3D12_DropCullingReadbacks(D3D12_SceneCulling *culling, uint32_t frame_slot_count)
+{
+	for (uint32_t slot = frame_slot_count; slot < g_max_frame_slots; slot++)
+	{
+		culling->pending[slot] = false;
+	}
+}
+
+// Fills in the culling inputs for this frame, grows the output buffers if needed, and checks the results
+// that came back from the last time this frame slot was used
+void D3D12_PrepareCulling(D3D12_Scene *scene, const D3D12_FramePacket *packet, D3D12_CullPassData *data)
+{
+	D3D12_Frame        *frame   = D3D12_GetFrameState();
+	D3D12_SceneCulling *culling = &scene->culling;
+
+	uint32_t object_count = packet->draw_count;
+
+	//------------------------------------------------------------------------
+	// Validate the count from the last time around, the GPU is done with this frame slot
+
+	uint32_t slot = D3D12_GetFrameSlot();
+
+	if (culling->pending[slot])
+	{
+		culling->stats.visible_gpu       = culling->readback_counts[slot];
+		culling->stats.frames_validated += 1;
+
+		if (culling->stats.visible_gpu != culling->expected_counts[slot])
+		{
+			culling->stats.mismatches += 1;
+
+			char text[192];
+			snprintf(text, sizeof(text), "GPU culling let %u draws through where the CPU reference expected %u (%u mismatches in %u frames validated)\n",
+					 culling->stats.visible_gpu, culling->expected_counts[slot], culling->stats.mismatches, culling->stats.frames_validated);
+
+			OutputDebugStringA(text);
+		}
+
+		culling->pending[slot] = false;
+	}
+
+	//------------------------------------------------------------------------
+	// Grow the output
+
+	if (culling->capacity < object_count)
+	{
+		if (culling->out_draws)
+		{
+			g_d3d.state_tracker.Unregister(culling->out_draws);
+
+			D3D12_DeferReleaseView(culling->out_draws_uav);
+			D3D12_DeferRelease(culling->out_draws);
+		}
+
+		uint32_t capacity = culling->capacity ? culling->capacity : 1024;
+		while (capacity < object_count) capacity *= 2;
+
+		culling->capacity  = capacity;
+		culling->out_draws = D3D12_CreateBuffer(g_d3d.device, capacity*sizeof(D3D12_IndirectDraw), L"Culled Draws", D3D12_HEAP_TYPE_DEFAULT, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+
+		g_d3d.state_tracker.Register(culling->out_draws, 1, D3D12_RESOURCE_STATE_COMMON, true);
+
+		D3D12_UNORDERED_ACCESS_VIEW_DESC desc = {
+			.Format        = DXGI_FORMAT_UNKNOWN,
+			.ViewDimension = D3D12_UAV_DIMENSION_BUFFER,
+			.Buffer = {
+				.FirstElement        = 0,
+				.NumElements         = capacity,
+				.StructureByteStride = sizeof(D3D12_IndirectDraw),
+			},
+		};
+
+		culling->out_draws_uav = g_d3d.view_cache.GetUAV(culling->out_draws, nullptr, &desc);
+	}
+
+	//------------------------------------------------------------------------
+	// Write the inputs. Allocations are aligned to their stride, so the views can start on them.
+
+	data->scene         = scene;
+	data->readback_slot = slot;
+
+	data->zero = frame->upload_arena.Allocate(sizeof(uint32_t), sizeof(uint32_t));
+	*(uint32_t *)data->zero.cpu_base = 0;
+
+	D3D12_CullConstants *constants = &data->constants;
+	ZeroStruct(constants);
+
+	D3D12_GetClipSpaceCullPlanes(constants->planes);
+
+	constants->object_count  = object_count;
+	constants->out_draws_uav = culling->out_draws_uav.index;
+	constants->out_count_uav = culling->out_count_uav.index;
+
+	culling->stats.objects = object_count;
+
+	if (object_count > 0)
+	{
+		D3D12_BufferAllocation bounds_alloc = frame->upload_arena.Allocate(object_count*(uint32_t)sizeof(D3D12_CullBounds),   sizeof(D3D12_CullBounds));
+		D3D12_BufferAllocation draws_alloc  = frame->upload_arena.Allocate(object_count*(uint32_t)sizeof(D3D12_IndirectDraw), sizeof(D3D12_IndirectDraw));
+
+		D3D12_CullBounds   *bounds = (D3D12_CullBounds   *)bounds_alloc.cpu_base;
+		D3D12_IndirectDraw *draws  = (D3D12_IndirectDraw *)draws_alloc .cpu_base;
+
+		for (uint32_t i = 0; i < object_count; i++)
+		{
+			bounds[i] = {
+				.center  = packet->draws[i].offset,
+				.extents = packet->draws[i].extents,
+			};
+		}
+
+		D3D12_BuildIndirectDraws(scene, packet, 0, object_count, draws);
+
+		D3D12_SHADER_RESOURCE_VIEW_DESC bounds_desc = {
+			.Format        = DXGI_FORMAT_UNKNOWN,
+			.ViewDimension = D3D12_SRV_DIMENSION_BUFFER,
+			.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING,
+			.Buffer = {
+				.FirstElement        = bounds_alloc.offset / sizeof(D3D12_CullBounds),
+				.NumElements         = object_count,
+				.StructureByteStride = sizeof(D3D12_CullBounds),
+			},
+		};
+
+		D3D12_SHADER_RESOURCE_VIEW_DESC draws_desc = {
+			.Format        = DXGI_FORMAT_UNKNOWN,
+			.ViewDimension = D3D12_SRV_DIMENSION_BUFFER,
+			.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING,
+			.Buffer = {
+				.FirstElement        = draws_alloc.offset / sizeof(D3D12_IndirectDraw),
+				.NumElements         = object_count,
+				.StructureByteStride = sizeof(D3D12_IndirectDraw),
+			},
+		};
+
+		// the views only need to live as long as this frame
+		D3D12_Descriptor bounds_srv = g_d3d.view_cache.GetSRV(bounds_alloc.buffer, &bounds_desc);
+		D3D12_Descriptor draws_srv  = g_d3d.view_cache.GetSRV(draws_alloc .buffer, &draws_desc);
+
+		D3D12_DeferReleaseView(bounds_srv);
+		D3D12_DeferReleaseView(draws_srv);
+
+		constants->bounds_srv = bounds_srv.index;
+		constants->draws_srv  = draws_srv .index;
+
+		if (g_validate_gpu_culling)
+		{
+			culling->stats.visible_expected = D3D12_CullDrawsReference(constants->planes, bounds, draws, object_count, nullptr);
+		}
+	}
+	else
+	{
+		culling->stats.visible_expected = 0;
+	}
+
+	culling->expected_counts[slot] = culling->stats.visible_expected;
+}
+
+void D3D12_ClearCullCountPass(D3D12_RenderGraph *, D3D12_CommandList *list, void *user_data)
+{
+	D3D12_CullPassData *data = (D3D12_CullPassData *)user_data;
+
+	list->CopyBufferRegion(data->scene->culling.out_count, 0, data->zero.buffer, data->zero.offset, sizeof(uint32_t));
+}
+
+void D3D12_CullPass(D3D12_RenderGraph *, D3D12_CommandList *list, void *user_data)
+{
+	D3D12_CullPassData *data = (D3D12_CullPassData *)user_data;
+
+	if (data->constants.object_count == 0)
+	{
+		return;
+	}
+
+	list->SetComputeRootSignature(g_d3d.rs_bindless);
+	list->SetPipelineState(data->scene->culling.pso);
+
+	uint32_t uint_count = sizeof(data->constants) / sizeof(uint32_t);
+	list->SetComputeRoot32BitConstants(D3D12_RootParameter_32bit_constants, uint_count, &data->constants, 0);
+
+	list->Dispatch((data->constants.object_count + g_cull_group_size - 1) / g_cull_group_size, 1, 1);
+}
+
+void D3D12_CullReadbackPass(D3D12_RenderGraph *, D3D12_CommandList *list, void *user_data)
+{
+	D3D12_CullPassData *data    = (D3D12_CullPassData *)user_data;
+	D3D12_SceneCulling *culling = &data->scene->culling;
+
+	list->CopyBufferRegion(culling->readback, data->readback_slot*sizeof(uint32_t), culling->out_count, 0, sizeof(uint32_t));
+
+	culling->pending[data->readback_slot] = true;
+}
+
+void D3D12_Render(D3D12_Scene *scene, const D3D12_FramePacket *packet)
+{
+	CPU_SCOPE("D3D12_Render");
+
+	D3D12_Frame *frame = D3D12_GetFrameState();
+
+	D3D12_RenderGraph *graph = &g_d3d.render_graph;
+	graph->Reset();
+
+	D3D12_RGHandle backbuffer = graph->Import("Backbuffer", frame->backbuffer, frame->rtv);
+
+	//------------------------------------------------------------------------
+	// Cull
+
+	// With nothing to draw there's nothing to cull, and the output buffer may not even exist yet. Counts
+	// waiting in this frame slot are left for the next frame that does cull.
+	bool gpu_culled = packet->draw_mode == D3D12_SceneDrawMode_gpu_culled && packet->draw_count > 0;
+
+	D3D12_CullPassData cull_pass    = {};
+	D3D12_RGHandle     culled_draws = {};
+	D3D12_RGHandle     culled_count = {};
+
+	if (gpu_culled)
+	{
+		D3D12_PrepareCulling(scene, packet, &cull_pass);
+
+		culled_draws = graph->Import("Culled Draws",      scene->culling.out_draws);
+		culled_count = graph->Import("Culled Draw Count", scene->culling.out_count);
+
+		graph->AddPass("Clear Cull Count", 0, D3D12_ClearCullCountPass, &cull_pass);
+		graph->Write(culled_count, D3D12_RESOURCE_STATE_COPY_DEST);
+
+		graph->AddPass("Cull", packet->draw_count, D3D12_CullPass, &cull_pass);
+		graph->Write(culled_draws, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+		graph->Write(culled_count, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+	}
+
+	//------------------------------------------------------------------------
+	// Draw
+
+	D3D12_ScenePassData scene_pass = {
+		.scene  = scene,
+		.packet = packet,
+		.target = backbuffer,
+	};
+
+	graph->AddPass("Scene", packet->draw_count, D3D12_ScenePass, &scene_pass);
+	graph->Write(backbuffer, D3D12_RESOURCE_STATE_RENDER_TARGET);
+
+	if (gpu_culled)
+	{
+		graph->Read(culled_draws, D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT);
+		graph->Read(culled_count, D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT);
+
+		if (g_validate_gpu_culling)
+		{
+			graph->AddPass("Cull Readback", 0, D3D12_CullReadbackPass, &cull_pass, true);
+			graph->Read(culled_count, D3D12_RESOURCE_STATE_COPY_SOURCE);
+		}
+	}
+
+	graph->Compile();
+
+	D3D12_ExecuteRenderGraph(graph);
+}
+
+//------------------------------------------------------------------------
+// Render thread
+//
+// Takes frame packets off the queue and draws them. Every second or so it reports how long each stage
+// took on average: simulating on the main thread, each side waiting on the other, recording, and
+// submitting and presenting, plus the latency from the main thread starting on a packet to it being
+// presented.
+//
+// With adaptive pacing on, it feeds the frame times to a FramePacer, which picks the number of frame
+// slots and how long the main thread should hold off on starting each packet. In the limited present
+// mode it holds each frame back until its FrameLimiter says it can start.
+//
+// Frame, wait and present times also go into FrameStats for the whole run, which get written to
+// frame_stats.json when the render thread stops.
+
+struct D3D12_StageTimings
+{
+	uint32_t frames;
+
+	double producer_wait;
+	double simulate;
+	double consumer_wait;
+	double record;
+	double present;
+	double latency;
+	double gpu;
+
+	// see D3D12_FrameOverlap
+	double   cpu_busy;
+	double   gpu_busy;
+	double   frames_ahead;
+	uint32_t bound_frames[D3D12_FrameBound_COUNT];
+
+	uint32_t stutters;
+
+	LARGE_INTEGER since;
+};
+
+struct D3D12_RenderThread
+{
+	HANDLE thread;
+
+	D3D12_Scene            *scene;
+	D3D12_FramePacketQueue *packets;
+	D3D12_StageTimings      timings;
+
+	bool       pacing;
+	FramePacer pacer;
+
+	FrameLimiter  limiter;
+	LARGE_INTEGER limiter_epoch; // the limiter counts seconds from here
+
+	// read by the main thread before it starts on a packet
+	volatile long input_delay_us;
+
+	FrameStats stats;
+};
+
+D3D12_RenderThread g_render_thread;
+
+void D3D12_ReportStageTimings(D3D12_StageTimings *timings)
+{
+	double frames = timings->frames > 0 ? (double)timings->frames : 1.0;
+
+	char text[512];
+	snprintf(text, sizeof(text),
+			 "%u frames %s, max frame latency %u, %u frame slots: simulate %.2f ms (waited %.2f), render waited %.2f ms, record %.2f ms, present %.2f ms, GPU %.2f ms, latency %.2f ms, input delay %.2f ms\n",
+			 timings->frames, g_present_mode_names[g_d3d.present_mode], g_d3d.max_frame_latency, g_d3d.frame_slot_count,
+			 1000.0*timings->simulate      / frames,
+			 1000.0*timings->producer_wait / frames,
+			 1000.0*timings->consumer_wait / frames,
+			 1000.0*timings->record        / frames,
+			 1000.0*timings->present       / frames,
+			 1000.0*timings->gpu           / frames,
+			 1000.0*timings->latency       / frames,
+			 (double)g_render_thread.input_delay_us / 1000.0);
+
+	OutputDebugStringA(text);
+
+	int length = snprintf(text, sizeof(text), "    CPU busy %.0f%%, GPU busy %.0f%%, %.1f frames ahead of the GPU, frames held up by",
+						  timings->cpu_busy     / frames,
+						  timings->gpu_busy     / frames,
+						  timings->frames_ahead / frames);
+
+	for (uint32_t i = 0; i < D3D12_FrameBound_COUNT && length < (int)sizeof(text); i++)
+	{
+		length += snprintf(text + length, sizeof(text) - length, " the %s %u%s", g_frame_bound_names[i], timings->bound_frames[i], i + 1 < D3D12_FrameBound_COUNT ? "," : "\n");
+	}
+
+	OutputDebugStringA(text);
+
+	const D3D12_CullStats *cull_stats = &g_render_thread.scene->culling.stats;
+
+	if (cull_stats->frames_validated > 0)
+	{
+		snprintf(text, sizeof(text), "    GPU culling: %u of %u visible last validated, %u mismatches with the CPU reference in %u frames\n",
+				 cull_stats->visible_gpu, cull_stats->objects, cull_stats->mismatches, cull_stats->frames_validated);
+
+		OutputDebugStringA(text);
+	}
+
+	const D3D12_RenderGraphStats *graph_stats = &g_d3d.render_graph.stats;
+
+	snprintf(text, sizeof(text), "    render graph: %u passes, %u culled, %u transients in %.1f MiB (%.1f MiB without aliasing)\n",
+			 graph_stats->passes_declared, graph_stats->passes_culled, graph_stats->transient_resources,
+			 (double)graph_stats->transient_bytes_aliased   / (1024.0*1024.0),
+			 (double)graph_stats->transient_bytes_unaliased / (1024.0*1024.0));
+
+	OutputDebugStringA(text);
+
+	const D3D12_BarrierScheduleStats *barrier_stats = &graph_stats->barriers;
+
+	snprintf(text, sizeof(text), "    barriers: %u split over %u passes (%u ended early), %u regular\n",
+			 barrier_stats->split_barriers, barrier_stats->passes_overlapped, barrier_stats->splits_ended_early, barrier_stats->regular_barriers);
+
+	OutputDebugStringA(text);
+
+	D3D12_ReportGpuScopes();
+
+	const Histogram *histogram = &g_render_thread.stats.series[FrameStat_frame].histogram;
+
+	snprintf(text, sizeof(text), "    %u stutters, frame time so far p50 %.2f ms, p95 %.2f ms, p99 %.2f ms, p99.9 %.2f ms, max %.2f ms\n",
+			 timings->stutters,
+			 Histogram_GetPercentile(histogram, 50.0) / 1000.0,
+			 Histogram_GetPercentile(histogram, 95.0) / 1000.0,
+			 Histogram_GetPercentile(histogram, 99.0) / 1000.0,
+			 Histogram_GetPercentile(histogram, 99.9) / 1000.0,
+			 (double)histogram->max / 1000.0);
+
+	OutputDebugStringA(text);
+}
+
+DWORD WINAPI D3D12_RenderThreadProc(LPVOID param)
+{
+	D3D12_RenderThread *render_thread = (D3D12_RenderThread *)param;
+	D3D12_StageTimings *timings       = &render_thread->timings;
+
+	g_work_queue.RegisterThread();
+	CpuProfiler_SetThreadName("Render");
+
+	timings->since = GetTime();
+
+	for (;;)
+	{
+		LARGE_INTEGER wait_start = GetTime();
+
+		D3D12_FramePacket *packet = render_thread->packets->BeginRead();
+
+		if (packet->quit)
+		{
+			render_thread->packets->EndRead();
+			D3D12_ReportLatencyStats();
+
+			if (!FrameStats_WriteJSON(&render_thread->stats, "frame_stats.json"))
+			{
+				OutputDebugStringA("Couldn't write frame_stats.json\n");
+			}
+
+			break;
+		}
+
+		LARGE_INTEGER record_start = GetTime();
+
+		CpuProfiler_Record("Packet Wait", wait_start, record_start);
+
+		g_d3d.capture_next_frame = packet->capture;
+
+		if (packet->adaptive_pacing != render_thread->pacing)
+		{
+			render_thread->pacing = packet->adaptive_pacing;
+			render_thread->pacer  = FramePacer_Make(g_d3d.frame_slot_count, true);
+
+			render_thread->input_delay_us = 0;
+		}
+
+		uint32_t frame_slot_count = render_thread->pacing ? render_thread->pacer.frame_slot_count : packet->frame_slot_count;
+
+		if (frame_slot_count != g_d3d.frame_slot_count)
+		{
+			D3D12_DropCullingReadbacks(&render_thread->scene->culling, frame_slot_count);
+		}
+
+		D3D12_SetFrameLatency(packet->max_frame_latency, frame_slot_count);
+
+		//------------------------------------------------------------------------
+		// Present mode, the limiter starts over whenever it's switched to or its rate changes
+
+		double limiter_wait = 0.0;
+
+		if (packet->present_mode == D3D12_PresentMode_limited)
+		{
+			FrameLimiter *limiter = &render_thread->limiter;
+
+			if (g_d3d.present_mode != D3D12_PresentMode_limited || limiter->period != 1.0 / packet->frame_rate_limit)
+			{
+				*limiter = FrameLimiter_Make(packet->frame_rate_limit);
+				render_thread->limiter_epoch = GetTime();
+			}
+
+			double now   = TimeElapsed(render_thread->limiter_epoch, GetTime());
+			double start = FrameLimiter_Next(limiter, now);
+
+			if (start > now)
+			{
+				LARGE_INTEGER limiter_start = GetTime();
+
+				WaitSeconds(start - now);
+				limiter_wait = start - now;
+
+				CpuProfiler_Record("Frame Limiter Wait", limiter_start, GetTime());
+			}
+		}
+
+		if (g_d3d.present_mode != packet->present_mode)
+		{
+			g_d3d.present_mode = packet->present_mode;
+
+			OutputDebugStringA("Present mode: ");
+			OutputDebugStringA(g_present_mode_names[packet->present_mode]);
+			OutputDebugStringA(g_d3d.present_mode != D3D12_PresentMode_vsync && !g_d3d.tearing_supported ? " (tearing isn't supported)\n" : "\n");
+		}
+
+		D3D12_BeginFrame(packet->started);
+
+		g_d3d.frame_times.limiter_wait = limiter_wait;
+
+		LARGE_INTEGER begun = GetTime();
+
+		if (!render_thread->scene->initialized)
+		{
+			D3D12_InitScene(render_thread->scene);
+		}
+
+		D3D12_Render(render_thread->scene, packet);
+
+		LARGE_INTEGER present_start = GetTime();
+
+		D3D12_EndFrame();
+
+		LARGE_INTEGER end = GetTime();
+
+		//------------------------------------------------------------------------
+		// Everything in the packet has been copied into the frame's upload memory by now
+
+		timings->frames        += 1;
+		timings->producer_wait += packet->producer_wait;
+		timings->simulate      += packet->simulate;
+		timings->consumer_wait += TimeElapsed(wait_start,    record_start);
+		timings->record        += TimeElapsed(record_start,  present_start);
+		timings->present       += TimeElapsed(present_start, end);
+		timings->latency       += TimeElapsed(packet->started, end);
+		timings->gpu           += g_d3d.frame_times.gpu_time;
+
+		D3D12_FrameOverlap overlap = D3D12_GetFrameOverlap(&g_d3d.frame_times);
+
+		timings->cpu_busy     += overlap.cpu_busy;
+		timings->gpu_busy     += overlap.gpu_busy;
+		timings->frames_ahead += g_d3d.frame_times.frames_ahead;
+
+		timings->bound_frames[overlap.bound] += 1;
+
+		// the first frame has nothing before it to be timed from
+		if (g_d3d.frame_times.frame_time > 0.0)
+		{
+			const D3D12_FrameTimes *frame_times = &g_d3d.frame_times;
+
+			double durations[FrameStat_COUNT];
+			durations[FrameStat_frame]   = frame_times->frame_time;
+			durations[FrameStat_wait]    = frame_times->limiter_wait + frame_times->waitable_wait + frame_times->fence_wait;
+			durations[FrameStat_present] = TimeElapsed(present_start, end);
+
+			if (FrameStats_Record(&render_thread->stats, durations))
+			{
+				timings->stutters += 1;
+			}
+		}
+
+		//------------------------------------------------------------------------
+		// Pacing. The slack is from the packet being done to the frame slot being ready for it.
+
+		if (render_thread->pacing && g_d3d.frame_times.gpu_time > 0.0)
+		{
+			double render = TimeElapsed(begun, end);
+
+			FramePacerSample sample = {
+				.cpu_time = packet->simulate > render ? packet->simulate : render,
+				.gpu_time = g_d3d.frame_times.gpu_time,
+				.slack    = TimeElapsed(packet->started, begun) - packet->simulate,
+			};
+
+			FramePacer_Update(&render_thread->pacer, &sample);
+
+			render_thread->input_delay_us = (long)(render_thread->pacer.input_delay*1000000.0);
+		}
+
+		render_thread->packets->EndRead();
+
+		if (TimeElapsed(timings->since, end) >= 1.0)
+		{
+			D3D12_ReportStageTimings(timings);
+
+			ZeroStruct(timings);
+			timings->since = end;
+		}
+	}
+
+	return 0;
+}
+
+void D3D12_StartRenderThread(D3D12_Scene *scene, D3D12_FramePacketQueue *packets)
+{
+	g_render_thread.scene   = scene;
+	g_render_thread.packets = packets;
+	g_render_thread.thread  = CreateThread(nullptr, 0, D3D12_RenderThreadProc, &g_render_thread, 0, nullptr);
+}
+
+// Sends a last packet to stop it, and waits until it has
+void D3D12_StopRenderThread()
+{
+	D3D12_FramePacket *packet = g_render_thread.packets->BeginWrite();
+	packet->quit = true;
+	g_render_thread.packets->EndWrite();
+
+	WaitForSingleObject(g_render_thread.thread, INFINITE);
+	CloseHandle(g_render_thread.thread);
+}
+
+//------------------------------------------------------------------------
+// Window
+
+LRESULT CALLBACK Win32_WindowProc(HWND hwnd, UINT message, WPARAM w_param, LPARAM l_param)
+{
+	LRESULT result = 0;
+
+	D3D12_Scene *scene = (D3D12_Scene *)GetWindowLongPtrW(hwnd, GWLP_USERDATA);
+
+	switch (message)
+	{
+		case WM_DESTROY:
+		{
+			PostQuitMessage(0);
+		} break;
+
+		case WM_LBUTTONDOWN:
+		{
+			// Lists the guys under the cursor
+			if (scene && scene->simulation_initialized && g_d3d.window_w > 0 && g_d3d.window_h > 0)
+			{
+				float x = 2.0f*(float)(short)LOWORD(l_param) / (float)g_d3d.window_w - 1.0f;
+				float y = 1.0f - 2.0f*(float)(short)HIWORD(l_param) / (float)g_d3d.window_h;
+
+				uint32_t picked[8];
+				uint32_t picked_count = BVH_QueryRect(D3D12_GetSceneBVH(scene), { x, y, x, y }, picked, (uint32_t)ArrayCount(picked));
+
+				char text[256];
+				int  length = snprintf(text, sizeof(text), "%u guys under the cursor:", picked_count);
+
+				for (uint32_t i = 0; i < picked_count && i < ArrayCount(picked) && length < (int)sizeof(text); i++)
+				{
+					length += snprintf(text + length, sizeof(text) - length, " %u", picked[i]);
+				}
+
+				OutputDebugStringA(text);
+				OutputDebugStringA("\n");
+			}
+		} break;
+
+		case WM_KEYDOWN:
+		{
+			switch (w_param)
+			{
+				case VK_SPACE:
+				{
+					if (scene)
+					{
+						scene->texture_index_offset += 1;
+					}
+				} break;
+
+				case VK_UP:
+				case VK_DOWN:
+				{
+					if (scene && scene->simulation_initialized)
+					{
+						uint32_t count = scene->triangle_guys.count;
+
+						if (w_param == VK_UP) count = count*10 < g_max_triangle_guys ? count*10 : g_max_triangle_guys;
+						else                  count = count/10 > 4 ? count/10 : 4;
+
+						D3D12_SetTriangleGuyCount(scene, count);
+					}
+				} break;
+
+				case 'C':
+				{
+					if (scene)
+					{
+						scene->capture_next_frame = true;
+					}
+				} break;
+
+				case 'T':
+				{
+					bool written = CpuProfiler_WriteChromeTrace("cpu_trace.json");
+					OutputDebugStringA(written ? "Wrote the CPU profiler's scopes to cpu_trace.json\n" : "Couldn't write cpu_trace.json\n");
+				} break;
+
+				case 'V':
+				{
+					if (scene)
+					{
+						scene->cpu_culling = !scene->cpu_culling;
+
+						OutputDebugStringA(scene->cpu_culling ? "CPU culling: on\n" : "CPU culling: off\n");
+					}
+				} break;
+
+				case 'P':
+				{
+					if (scene && scene->simulation_initialized)
+					{
+						scene->adaptive_pacing = !scene->adaptive_pacing;
+
+						OutputDebugStringA(scene->adaptive_pacing ? "Adaptive pacing: on\n" : "Adaptive pacing: off\n");
+					}
+				} break;
+
+				case 'M':
+				{
+					if (scene && scene->simulation_initialized)
+					{
+						scene->present_mode = (D3D12_PresentMode)((scene->present_mode + 1) % D3D12_PresentMode_COUNT);
+					}
+				} break;
+
+				case 'L':
+				case 'F':
+				{
+					if (scene && scene->simulation_initialized)
+					{
+						if (w_param == 'L') scene->max_frame_latency = scene->max_frame_latency % g_max_frame_latency + 1;
+						else                scene->frame_slot_count  = scene->frame_slot_count  % g_max_frame_slots   + 1;
+					}
+				} break;
+
+				case VK_TAB:
+				{
+					if (scene)
+					{
+						scene->draw_mode = (D3D12_SceneDrawMode)((scene->draw_mode + 1) % D3D12_SceneDrawMode_COUNT);
+
+						OutputDebugStringA("Draw mode: ");
+						OutputDebugStringA(g_scene_draw_mode_names[scene->draw_mode]);
+						OutputDebugStringA("\n");
+					}
+				} break;
+			}
+		} break;
+
+		default:
+		{
+			result = DefWindowProcW(hwnd, message, w_param, l_param);
+		} break;
+	}
+
+	return result;
+}
+
+HWND Win32_CreateWindow()
+{
+	HWND result = NULL;
+
+	int desktop_w = GetSystemMetrics(SM_CXFULLSCREEN);
+	int desktop_h = GetSystemMetrics(SM_CYFULLSCREEN);
+
+	int w = 3*desktop_w / 4;
+	int h = 3*desktop_h / 4;
+
+	WNDCLASSEXW wclass = 
+	{
+		.cbSize        = sizeof(wclass),
+		.style         = CS_HREDRAW|CS_VREDRAW,
+		.lpfnWndProc   = Win32_WindowProc,
+		.hIcon         = LoadIconW(NULL, L"APPICON"),
+		.hCursor       = NULL, 
+		.lpszClassName = L"HelloBindlessD3D12",
+	};
+
+	if (!RegisterClassExW(&wclass))
+	{
+		assert(!"Failed to register window class");
+	}
+
+	RECT wrect = {
+		.left   = 0,
+		.top    = 0,
+		.right  = w,
+		.bottom = h,
+	};
+
+	AdjustWindowRect(&wrect, WS_OVERLAPPEDWINDOW, FALSE);
+
+	result = CreateWindowExW(0, L"HelloBindlessD3D12", L"Hello Bindless",
+							WS_OVERLAPPEDWINDOW,
+							64, 64,
+							wrect.right - wrect.left,
+							wrect.bottom - wrect.top,
+							NULL, NULL, NULL, NULL);
+
+	assert(result || !"Failed to create window");
+
+	ShowWindow(result, SW_SHOW);
+
+	return result;
+}
+
+//------------------------------------------------------------------------
+// Benchmarks
+//
+// Run with -bench to run all of them, or -bench followed by the names of the ones you want. They
+// don't touch the window or the device.
+
+uint64_t Bench_Random(uint64_t *state)
+{
+	// xorshift64
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+
+	return x;
+}
+
+// Checks that keys keep their fields apart at the ends of the depth range, and order the way
+// D3D12_MakeDrawSortKey says
+void Bench_CheckDrawSortKeys()
+{
+	uint32_t materials[] = { 0, 1, 2, 0xFFFF };
+
+	for (size_t i = 0; i < ArrayCount(materials); i++)
+	{
+		uint32_t material = materials[i];
+
+		uint64_t near_opaque = D3D12_MakeDrawSortKey(1, 7, material, 0.0f, false);
+		uint64_t far_opaque  = D3D12_MakeDrawSortKey(1, 7, material, 1.0f, false);
+
+		assert(far_opaque >> 58 == 1                     || !"Opaque depth spilled into the pass");
+		assert(((far_opaque >> 30) & 0xFFFF) == material || !"Opaque depth spilled into the material");
+		assert(near_opaque < far_opaque                  || !"Opaque draws should go front to back");
+
+		if (material < 0xFFFF)
+		{
+			assert(far_opaque < D3D12_MakeDrawSortKey(1, 7, material + 1, 0.0f, false) || !"Opaque draws should group by material before depth");
+		}
+
+		uint64_t near_translucent = D3D12_MakeDrawSortKey(1, 7, material, 0.0f, true);
+		uint64_t far_translucent  = D3D12_MakeDrawSortKey(1, 7, material, 1.0f, true);
+
+		assert((near_translucent >> 58 == 1 && far_translucent >> 58 == 1) || !"Translucent depth spilled into the pass");
+		assert((far_translucent & 0xFFFFFFF) == ((7u << 16) | material)  || !"Translucent depth spilled into the state");
+		assert(far_translucent < near_translucent                        || !"Translucent draws should go back to front");
+		assert(near_translucent < D3D12_MakeDrawSortKey(2, 0, 0, 1.0f, true) || !"Passes should come before depth");
+	}
+
+	printf("sort: draw keys keep their fields apart and order correctly at depth 0 and 1\n");
+}
+
+void Bench_Sort()
+{
+	Bench_CheckDrawSortKeys();
+
+	uint32_t counts[] = { 10000, 100000, 1000000 };
+
+	for (size_t count_index = 0; count_index < ArrayCount(counts); count_index++)
+	{
+		uint32_t count = counts[count_index];
+
+		SortItem *source  = (SortItem *)_aligned_malloc(count*sizeof(SortItem), 16);
+		SortItem *items   = (SortItem *)_aligned_malloc(count*sizeof(SortItem), 16);
+		SortItem *scratch = (SortItem *)_aligned_malloc(count*sizeof(SortItem), 16);
+
+		// something like a real frame: a handful of passes and PSOs, a lot more materials
+		uint64_t random = 0x9E3779B97F4A7C15ull;
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			uint32_t pass     = (uint32_t)(Bench_Random(&random) % 4);
+			uint32_t pso      = (uint32_t)(Bench_Random(&random) % 64);
+			uint32_t material = (uint32_t)(Bench_Random(&random) % 1024);
+			float    depth    = (float)(Bench_Random(&random) % 65536) / 65535.0f;
+
+			source[i] = {
+				.key   = D3D12_MakeDrawSortKey(pass, pso, material, depth, false),
+				.value = i,
+			};
+		}
+
+		uint32_t repetitions = 20000000 / count;
+		if (repetitions < 5) repetitions = 5;
+
+		for (uint32_t threaded = 0; threaded < 2; threaded++)
+		{
+			WorkQueue *queue = threaded ? &g_work_queue : nullptr;
+
+			double best_time  = 1e30;
+			double total_time = 0.0;
+
+			SortItem *sorted = nullptr;
+
+			for (uint32_t repetition = 0; repetition < repetitions; repetition++)
+			{
+				memcpy(items, source, count*sizeof(SortItem));
+
+				LARGE_INTEGER start = GetTime();
+				sorted = RadixSort(items, scratch, count, queue);
+				double time = TimeElapsed(start, GetTime());
+
+				if (best_time > time) best_time = time;
+				total_time += time;
+			}
+
+			for (uint32_t i = 1; i < count; i++)
+			{
+				assert(sorted[i - 1].key <= sorted[i].key || !"Sort benchmark came out unsorted");
+			}
+
+			uint32_t thread_count = queue && count >= g_radix_parallel_threshold ? queue->thread_count : 1;
+
+			printf("sort: %7u draws, %2u threads: best %8.3f ms, average %8.3f ms, %7.1f M draws/s\n",
+				   count, thread_count,
+				   1000.0*best_time, 1000.0*total_time / (double)repetitions,
+				   (double)count / best_time / 1000000.0);
+		}
+
+		_aligned_free(source);
+		_aligned_free(items);
+		_aligned_free(scratch);
+	}
+}
+
+// Records a frame's worth of draws the way D3D12_RecordSceneDraws does, on a wrapper with no list
+// under it, with and without a command stream attached. The objects are made up, nothing gets called
+// on them. Then round trips the stream through a file, and checks that corrupted and truncated
+// streams are turned away instead of walked.
+void Bench_CommandStream()
+{
+	uint32_t draw_count  = 100000;
+	uint32_t repetitions = 20;
+
+	ID3D12PipelineState *pso       = (ID3D12PipelineState *)(uintptr_t)0x1000;
+	ID3D12RootSignature *signature = (ID3D12RootSignature *)(uintptr_t)0x2000;
+
+	D3D12_CommandStream stream = {};
+	D3D12_CommandList   list;
+
+	for (uint32_t capture = 0; capture < 2; capture++)
+	{
+		double best_time = 1e30;
+
+		for (uint32_t repetition = 0; repetition < repetitions; repetition++)
+		{
+			stream.Reset();
+
+			LARGE_INTEGER start = GetTime();
+
+			list.Reset(nullptr, capture ? &stream : nullptr);
+			list.SetGraphicsRootSignature(signature);
+
+			D3D12_CPU_DESCRIPTOR_HANDLE rtv      = { 0x100 };
+			D3D12_VIEWPORT              viewport = { 0.0f, 0.0f, 1280.0f, 720.0f, 0.0f, 1.0f };
+			D3D12_RECT                  scissor  = { 0, 0, 1280, 720 };
+
+			list.OMSetRenderTargets(1, &rtv, nullptr);
+			list.IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+			list.RSSetViewports(1, &viewport);
+			list.RSSetScissorRects(1, &scissor);
+			list.SetPipelineState(pso);
+
+			for (uint32_t i = 0; i < draw_count; i++)
+			{
+				D3D12_RootConstants constants = {
+					.offset        = { (float)(i % 1000), (float)(i / 1000) },
+					.texture_index = i % 4,
+					.color         = 0xFFFFFFFF,
+				};
+
+				list.SetGraphicsRoot32BitConstants(D3D12_RootParameter_32bit_constants, sizeof(constants) / sizeof(uint32_t), &constants, 0);
+				list.DrawIndexedInstanced(3, 1, 0, 0, 0);
+			}
+
+			double time = TimeElapsed(start, GetTime());
+			if (best_time > time) best_time = time;
+		}
+
+		printf("command_stream: %u draws, %-9s %8.3f ms, %6.1f ns/draw",
+			   draw_count, capture ? "captured:" : "filtered:", 1000.0*best_time, 1e9*best_time / (double)draw_count);
+
+		if (capture)
+		{
+			printf(", %u commands, %.1f bytes/draw", stream.command_count, (double)stream.size / (double)draw_count);
+		}
+
+		printf("\n");
+	}
+
+	//------------------------------------------------------------------------
+	// Round trip through a file
+
+	const char *path = "bench.d3d12cmds";
+
+	const D3D12_CommandStream *streams[] = { &stream };
+
+	LARGE_INTEGER start = GetTime();
+	bool written = D3D12_WriteCommandStreams(path, streams, 1);
+	double write_time = TimeElapsed(start, GetTime());
+
+	D3D12_CommandStream loaded = {};
+
+	start = GetTime();
+	uint32_t loaded_count = written ? D3D12_ReadCommandStreams(path, &loaded, 1) : 0;
+	double read_time = TimeElapsed(start, GetTime());
+
+	bool same = loaded_count == 1 && loaded.size == stream.size && memcmp(loaded.data, stream.data, stream.size) == 0 && loaded.object_count == stream.object_count;
+
+	for (uint32_t i = 0; same && i < stream.object_count; i++)
+	{
+		same = loaded.ObjectId(i) == stream.ObjectId(i);
+	}
+
+	printf("command_stream: %.1f MiB written in %.3f ms, read in %.3f ms, %s\n",
+		   (double)stream.size / (1024.0*1024.0), 1000.0*write_time, 1000.0*read_time,
+		   same ? "round trip matches" : "ROUND TRIP FAILED");
+
+	//------------------------------------------------------------------------
+	// Corrupted streams
+
+	ID3D12Resource *resource = (ID3D12Resource *)(uintptr_t)0x3000;
+
+	D3D12_RESOURCE_BARRIER barrier = {
+		.Type       = D3D12_RESOURCE_BARRIER_TYPE_TRANSITION,
+		.Transition = {
+			.pResource   = resource,
+			.Subresource = D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES,
+			.StateBefore = D3D12_RESOURCE_STATE_RENDER_TARGET,
+			.StateAfter  = D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE,
+		},
+	};
+
+	// the pipeline is object #0, the resource #1
+	stream.Reset();
+	stream.SetPipelineState(pso);
+	stream.ResourceBarrier(1, &barrier);
+	stream.DrawIndexedInstanced(3, 1, 0, 0, 0);
+
+	assert(D3D12_ValidateCommandStream(stream.data, stream.size, stream.command_count, stream.object_count) || !"A recorded stream should be valid");
+
+	D3D12_StreamCommand      *first           = (D3D12_StreamCommand *)stream.data;
+	D3D12_StreamArrayCommand *barrier_command = (D3D12_StreamArrayCommand *)(stream.data + first->size);
+	D3D12_StreamBarrier      *stream_barrier  = (D3D12_StreamBarrier *)(barrier_command + 1);
+
+	uint32_t rejected = 0;
+	uint32_t tried    = 0;
+
+	// zero sized, which used to have the walk going round forever
+	first->size = 0;
+	rejected += D3D12_ValidateCommandStream(stream.data, stream.size, stream.command_count, stream.object_count) ? 0 : 1;
+	tried    += 1;
+	first->size = sizeof(D3D12_StreamObjectCommand);
+
+	// bigger than the stream
+	first->size = 0x7FFFFFF8;
+	rejected += D3D12_ValidateCommandStream(stream.data, stream.size, stream.command_count, stream.object_count) ? 0 : 1;
+	tried    += 1;
+	first->size = sizeof(D3D12_StreamObjectCommand);
+
+	// not a command
+	first->type = D3D12_StreamCommand_COUNT;
+	rejected += D3D12_ValidateCommandStream(stream.data, stream.size, stream.command_count, stream.object_count) ? 0 : 1;
+	tried    += 1;
+	first->type = D3D12_StreamCommand_SetPipelineState;
+
+	// more barriers than the command holds
+	barrier_command->count = 1000;
+	rejected += D3D12_ValidateCommandStream(stream.data, stream.size, stream.command_count, stream.object_count) ? 0 : 1;
+	tried    += 1;
+	barrier_command->count = 1;
+
+	// an object past the end of the table
+	stream_barrier->resource = 2;
+	rejected += D3D12_ValidateCommandStream(stream.data, stream.size, stream.command_count, stream.object_count) ? 0 : 1;
+	tried    += 1;
+	stream_barrier->resource = 1;
+
+	// a command count that doesn't add up
+	stream.command_count += 1;
+	rejected += D3D12_ValidateCommandStream(stream.data, stream.size, stream.command_count, stream.object_count) ? 0 : 1;
+	tried    += 1;
+	stream.command_count -= 1;
+
+	// replaying with fewer objects than the stream refers to, which never gets as far as the list
+	IUnknown *objects[] = { pso };
+	rejected += D3D12_ReplayCommandStream(nullptr, &stream, objects, ArrayCount(objects)) ? 0 : 1;
+	tried    += 1;
+
+	// replaying a stream read from disk without passing in its objects
+	if (D3D12_WriteCommandStreams(path, streams, 1) && D3D12_ReadCommandStreams(path, &loaded, 1) == 1)
+	{
+		rejected += D3D12_ReplayCommandStream(nullptr, &loaded) ? 0 : 1;
+		tried    += 1;
+	}
+
+	assert(D3D12_ValidateCommandStream(stream.data, stream.size, stream.command_count, stream.object_count) || !"The stream should be back the way it was");
+
+	// cut short in the middle of the object table
+	written = D3D12_WriteCommandStreams(path, streams, 1);
+
+	FILE *file = written ? fopen(path, "rb") : nullptr;
+	if (file)
+	{
+		uint8_t bytes[KiB(1)];
+		size_t  byte_count = fread(bytes, 1, sizeof(bytes), file);
+		fclose(file);
+
+		file = fopen(path, "wb");
+		if (file)
+		{
+			fwrite(bytes, 1, byte_count - sizeof(uint64_t), file);
+			fclose(file);
+
+			rejected += D3D12_ReadCommandStreams(path, &loaded, 1) == 0 ? 1 : 0;
+			tried    += 1;
+			assert(loaded.size == 0 || !"A stream that failed to read shouldn't keep a size");
+		}
+	}
+
+	printf("command_stream: %u of %u corrupted or truncated streams turned away\n", rejected, tried);
+	assert(rejected == tried || !"A corrupted stream got through");
+
+	remove(path);
+
+	stream.Release();
+	loaded.Release();
+}
+
+// Checks the tracker's pending barriers against what a step of the script should have produced, in
+// any order, then flushes them
+void Bench_ExpectBarriers(D3D12_StateTracker *tracker, const char *step, uint32_t count, const D3D12_RESOURCE_TRANSITION_BARRIER *expected)
+{
+	bool matches = tracker->pending_count == count;
+
+	for (uint32_t i = 0; i < count && matches; i++)
+	{
+		bool found = false;
+
+		for (uint32_t j = 0; j < tracker->pending_count && !found; j++)
+		{
+			const D3D12_RESOURCE_TRANSITION_BARRIER *transition = &tracker->pending[j].Transition;
+
+			found = transition->pResource   == expected[i].pResource   &&
+					transition->Subresource == expected[i].Subresource &&
+					transition->StateBefore == expected[i].StateBefore &&
+					transition->StateAfter  == expected[i].StateAfter;
+		}
+
+		matches = found;
+	}
+
+	if (!matches)
+	{
+		printf("state_tracker: %s: expected %u barriers, got %u:\n", step, count, tracker->pending_count);
+
+		for (uint32_t i = 0; i < tracker->pending_count; i++)
+		{
+			const D3D12_RESOURCE_TRANSITION_BARRIER *transition = &tracker->pending[i].Transition;
+			printf("    %p subresource %u: 0x%X -> 0x%X\n", (void *)transition->pResource, transition->Subresource, transition->StateBefore, transition->StateAfter);
+		}
+	}
+
+	assert(matches || !"The state tracker didn't produce the expected barriers");
+
+	D3D12_CommandList list;
+	list.Reset(nullptr);
+
+	tracker->Flush(&list);
+}
+
+// A scripted run of the state tracker, without a device, checking the barriers after every step:
+//
+//     split:     a texture transitioned as a whole takes one ALL_SUBRESOURCES barrier, then single mips
+//                take one each, with two transitions of the same mip before a flush merged into one
+//     collapse:  a whole transition while the mips disagree goes per mip, skipping the ones already
+//                there, and once they agree again the next whole transition is one barrier again
+//     cancel:    a transition undone before the flush leaves nothing to issue
+//     mixed:     a single mip after a whole transition still waiting splits it into one barrier per mip,
+//                and a whole transition after every mip took its own one folds into those
+//     decay:     after a submit, promoted buffers and promoted read-only textures are back in COMMON and
+//                promote again without a barrier, textures that got there with a barrier stay put
+
+D3D12_StateTracker g_bench_state_tracker;
+
+void Bench_StateTracker()
+{
+	D3D12_StateTracker *tracker = &g_bench_state_tracker;
+	tracker->Init(16);
+
+	ID3D12Resource *texture = (ID3D12Resource *)(uintptr_t)0x1000; // 4 mips
+	ID3D12Resource *buffer  = (ID3D12Resource *)(uintptr_t)0x2000;
+	ID3D12Resource *sampled = (ID3D12Resource *)(uintptr_t)0x3000; // only ever read
+	ID3D12Resource *target  = (ID3D12Resource *)(uintptr_t)0x4000;
+
+	uint32_t all = D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES;
+
+	D3D12_RESOURCE_STATES rt  = D3D12_RESOURCE_STATE_RENDER_TARGET;
+	D3D12_RESOURCE_STATES srv = D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE;
+	D3D12_RESOURCE_STATES src = D3D12_RESOURCE_STATE_COPY_SOURCE;
+
+	tracker->Register(texture, 4, rt, false);
+	tracker->Register(buffer,  1, D3D12_RESOURCE_STATE_COMMON, true);
+	tracker->Register(sampled, 1, D3D12_RESOURCE_STATE_COMMON, false);
+	tracker->Register(target,  1, D3D12_RESOURCE_STATE_COMMON, false);
+
+	//------------------------------------------------------------------------
+	// Split
+
+	tracker->Transition(texture, all, srv);
+
+	D3D12_RESOURCE_TRANSITION_BARRIER whole_to_srv[] = {
+		{ texture, all, rt, srv },
+	};
+
+	Bench_ExpectBarriers(tracker, "whole texture to SRV", ArrayCount(whole_to_srv), whole_to_srv);
+
+	// rendering into mips 1 and 2, then copying out of mip 2
+	tracker->Transition(texture, 1, rt);
+	tracker->Transition(texture, 2, rt);
+	tracker->Transition(texture, 2, src);
+
+	D3D12_RESOURCE_TRANSITION_BARRIER mips[] = {
+		{ texture, 1, srv, rt  },
+		{ texture, 2, srv, src },
+	};
+
+	Bench_ExpectBarriers(tracker, "single mips", ArrayCount(mips), mips);
+
+	assert((tracker->GetState(texture, 0) == srv &&
+			tracker->GetState(texture, 1) == rt  &&
+			tracker->GetState(texture, 2) == src &&
+			tracker->GetState(texture, 3) == srv) || !"Mips out of step with the barriers issued");
+
+	//------------------------------------------------------------------------
+	// Collapse
+
+	tracker->Transition(texture, all, srv);
+
+	D3D12_RESOURCE_TRANSITION_BARRIER mips_to_srv[] = {
+		{ texture, 1, rt,  srv },
+		{ texture, 2, src, srv },
+	};
+
+	Bench_ExpectBarriers(tracker, "whole texture to SRV with mips apart", ArrayCount(mips_to_srv), mips_to_srv);
+
+	tracker->Transition(texture, all, rt);
+
+	D3D12_RESOURCE_TRANSITION_BARRIER whole_to_rt[] = {
+		{ texture, all, srv, rt },
+	};
+
+	Bench_ExpectBarriers(tracker, "whole texture back to RT", ArrayCount(whole_to_rt), whole_to_rt);
+
+	//------------------------------------------------------------------------
+	// Cancel
+
+	tracker->Transition(texture, all, srv);
+	tracker->Transition(texture, all, rt);
+
+	Bench_ExpectBarriers(tracker, "there and back before a flush", 0, nullptr);
+
+	//------------------------------------------------------------------------
+	// Mixed
+
+	tracker->Transition(texture, all, srv);
+	tracker->Transition(texture, 1, src);
+
+	D3D12_RESOURCE_TRANSITION_BARRIER whole_then_mip[] = {
+		{ texture, 0, rt, srv },
+		{ texture, 1, rt, src },
+		{ texture, 2, rt, srv },
+		{ texture, 3, rt, srv },
+	};
+
+	Bench_ExpectBarriers(tracker, "whole texture then one mip", ArrayCount(whole_then_mip), whole_then_mip);
+
+	// mip 1 is there already, the others take a barrier each
+	for (uint32_t i = 0; i < 4; i++)
+	{
+		tracker->Transition(texture, i, src);
+	}
+
+	tracker->Transition(texture, all, rt);
+
+	D3D12_RESOURCE_TRANSITION_BARRIER mips_then_whole[] = {
+		{ texture, 0, srv, rt },
+		{ texture, 1, src, rt },
+		{ texture, 2, srv, rt },
+		{ texture, 3, srv, rt },
+	};
+
+	Bench_ExpectBarriers(tracker, "every mip then the whole texture", ArrayCount(mips_then_whole), mips_then_whole);
+
+	//------------------------------------------------------------------------
+	// Decay
+
+	tracker->Transition(buffer,  all, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+	tracker->Transition(sampled, all, srv);
+	tracker->Transition(sampled, all, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE);
+	tracker->Transition(target,  all, rt);
+
+	D3D12_RESOURCE_TRANSITION_BARRIER first_use[] = {
+		{ target, all, D3D12_RESOURCE_STATE_COMMON, rt },
+	};
+
+	Bench_ExpectBarriers(tracker, "first use", ArrayCount(first_use), first_use);
+
+	assert(tracker->GetState(sampled) == (srv|D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE) || !"Promoted reads should combine");
+
+	tracker->Decay();
+
+	assert(tracker->GetState(buffer)  == D3D12_RESOURCE_STATE_COMMON || !"Buffers decay to COMMON");
+	assert(tracker->GetState(sampled) == D3D12_RESOURCE_STATE_COMMON || !"Promoted read-only textures decay to COMMON");
+	assert(tracker->GetState(target)  == rt                          || !"Textures transitioned with a barrier don't decay");
+
+	for (uint32_t i = 0; i < 4; i++)
+	{
+		assert(tracker->GetState(texture, i) == rt || !"Textures transitioned with a barrier don't decay");
+	}
+
+	tracker->Transition(buffer,  all, D3D12_RESOURCE_STATE_COPY_DEST);
+	tracker->Transition(sampled, all, srv);
+
+	Bench_ExpectBarriers(tracker, "promoted again after the decay", 0, nullptr);
+
+	const D3D12_StateTrackerStats *stats = &tracker->stats;
+
+	printf("state_tracker: %llu transitions, %llu redundant, %llu promoted, %llu merged, %llu barriers in %llu flushes\n",
+		   (unsigned long long)stats->transitions_requested, (unsigned long long)stats->transitions_redundant,
+		   (unsigned long long)stats->transitions_promoted,  (unsigned long long)stats->barriers_merged,
+		   (unsigned long long)stats->barriers_issued,       (unsigned long long)stats->flushes);
+
+	tracker->Release();
+}
+
+// The view cache and deferred view releases, without a device. -bench never creates one, so this
+// borrows g_d3d's view cache and release list:
+//
+//     hits:     the same view of the same resource twice is one descriptor with two references, another
+//               desc or another kind of view of it is a descriptor of its own
+//     release:  views released while a frame might still use them keep their descriptors until that
+//               frame's fence value completes, and only then are the indices handed out again
+void Bench_ViewCache()
+{
+	D3D12_DescriptorAllocator allocator = {
+		.capacity     = 64,
+		.free_indices = (uint32_t *)malloc(sizeof(uint32_t)*64),
+	};
+
+	D3D12_ViewCache *cache = &g_d3d.view_cache;
+	cache->Init(nullptr, &allocator);
+
+	ID3D12Resource *texture = (ID3D12Resource *)(uintptr_t)0x1000;
+	ID3D12Resource *buffer  = (ID3D12Resource *)(uintptr_t)0x2000;
+
+	D3D12_SHADER_RESOURCE_VIEW_DESC mip_desc = {
+		.Format                  = DXGI_FORMAT_R8G8B8A8_UNORM,
+		.ViewDimension           = D3D12_SRV_DIMENSION_TEXTURE2D,
+		.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING,
+		.Texture2D = {
+			.MostDetailedMip = 1,
+			.MipLevels       = 1,
+		},
+	};
+
+	//------------------------------------------------------------------------
+	// Hits
+
+	D3D12_Descriptor whole = cache->GetSRV(texture, nullptr);
+	D3D12_Descriptor again = cache->GetSRV(texture, nullptr);
+	D3D12_Descriptor mip   = cache->GetSRV(texture, &mip_desc);
+	D3D12_Descriptor uav   = cache->GetUAV(texture, nullptr, nullptr);
+
+	assert(again.index == whole.index                                                     || !"The same view twice should be one descriptor");
+	assert((mip.index != whole.index && uav.index != whole.index && uav.index != mip.index) || !"Different views shouldn't share a descriptor");
+	assert((cache->hits == 1 && cache->misses == 3 && cache->count == 3)                  || !"Hits and misses don't add up");
+
+	//------------------------------------------------------------------------
+	// Release
+
+	g_d3d.frame_index = 10;
+
+	D3D12_DeferReleaseView(whole);
+	D3D12_DeferReleaseView(again);
+	D3D12_DeferReleaseView(mip);
+
+	// the GPU is still on the frame before
+	D3D12_ReleaseDeferred(g_d3d.frame_index);
+
+	D3D12_Descriptor other = cache->GetSRV(buffer, nullptr);
+
+	assert((allocator.free_count == 0 && cache->count == 4)        || !"Views freed before the GPU was done with them");
+	assert((other.index != whole.index && other.index != mip.index) || !"A descriptor the GPU may still read was handed out again");
+
+	D3D12_ReleaseDeferred(g_d3d.frame_index + 1);
+
+	assert(g_d3d.deferred_release_count == 0                || !"Releases left over after their frame completed");
+	assert((allocator.free_count == 2 && cache->count == 2) || !"Both views should be gone, the one released twice once");
+
+	D3D12_Descriptor reused = cache->GetSRV(texture, nullptr);
+
+	assert((reused.index == whole.index || reused.index == mip.index) || !"Freed descriptors should be handed out again first");
+	assert(cache->misses == 5                                        || !"A released view should miss");
+
+	printf("view_cache: %llu hits, %llu misses, %u live views, %u descriptors used, %u free\n",
+		   (unsigned long long)cache->hits, (unsigned long long)cache->misses, cache->count, allocator.at, allocator.free_count);
+
+	cache->Release();
+	free(allocator.free_indices);
+
+	g_d3d.frame_index = 0;
+}
+
+void Bench_EmptyPass(D3D12_RenderGraph *graph, D3D12_CommandList *list, void *user_data)
+{
+	(void)graph;
+	(void)list;
+	(void)user_data;
+}
+
+D3D12_RGHandle Bench_CreateTarget(D3D12_RenderGraph *graph, const char *name, uint32_t w, uint32_t h, DXGI_FORMAT format, uint32_t bytes_per_pixel)
+{
+	bool depth = format == DXGI_FORMAT_D32_FLOAT;
+
+	D3D12_RESOURCE_DESC desc = {
+		.Dimension        = D3D12_RESOURCE_DIMENSION_TEXTURE2D,
+		.Width            = w,
+		.Height           = h,
+		.DepthOrArraySize = 1,
+		.MipLevels        = 1,
+		.Format           = format,
+		.SampleDesc       = { .Count = 1 },
+		.Flags            = depth ? D3D12_RESOURCE_FLAG_ALLOW_DEPTH_STENCIL : D3D12_RESOURCE_FLAG_ALLOW_RENDER_TARGET,
+	};
+
+	// what GetResourceAllocationInfo would say, give or take
+	uint64_t align = D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT;
+
+	D3D12_RESOURCE_ALLOCATION_INFO allocation = {
+		.SizeInBytes = ((uint64_t)w*h*bytes_per_pixel + align - 1) & ~(align - 1),
+		.Alignment   = align,
+	};
+
+	return graph->CreateTexture(name, desc, allocation);
+}
+
+// A deferred-ish frame's worth of render graph at 1080p, compiled without a device:
+//
+//     culling:   a debug view and a blur of it that nothing downstream reads have to be culled, and
+//                everything else kept
+//     aliasing:  transients whose lifetimes overlap can't share memory, the rest should, and how
+//                much that saves over giving each its own
+//     barriers:  the graph's barrier schedule against a state tracker, how many transitions got split
+//                and how many passes they overlap, then issued with the list closed partway through
+//                the way D3D12_RecordParallel does, which has to end the open splits on the old list
+
+D3D12_BarrierScheduler g_bench_barrier_scheduler;
+
+D3D12_RenderGraph g_bench_render_graph;
+
+void Bench_RenderGraph()
+{
+	D3D12_RenderGraph *graph = &g_bench_render_graph;
+
+	uint32_t w = 1920;
+	uint32_t h = 1080;
+
+	double best_time = 1e30;
+
+	for (uint32_t repetition = 0; repetition < 100; repetition++)
+	{
+		LARGE_INTEGER start = GetTime();
+
+		graph->Reset();
+
+		D3D12_RGHandle backbuffer = graph->Import("Backbuffer", (ID3D12Resource *)(uintptr_t)0x1000);
+
+		D3D12_RGHandle albedo     = Bench_CreateTarget(graph, "Albedo",     w,     h,     DXGI_FORMAT_R8G8B8A8_UNORM,     4);
+		D3D12_RGHandle normal     = Bench_CreateTarget(graph, "Normal",     w,     h,     DXGI_FORMAT_R16G16B16A16_FLOAT, 8);
+		D3D12_RGHandle depth      = Bench_CreateTarget(graph, "Depth",      w,     h,     DXGI_FORMAT_D32_FLOAT,          4);
+		D3D12_RGHandle ao         = Bench_CreateTarget(graph, "AO",         w,     h,     DXGI_FORMAT_R8_UNORM,           1);
+		D3D12_RGHandle hdr        = Bench_CreateTarget(graph, "HDR",        w,     h,     DXGI_FORMAT_R16G16B16A16_FLOAT, 8);
+		D3D12_RGHandle debug      = Bench_CreateTarget(graph, "Debug",      w,     h,     DXGI_FORMAT_R8G8B8A8_UNORM,     4);
+		D3D12_RGHandle debug_blur = Bench_CreateTarget(graph, "Debug Blur", w,     h,     DXGI_FORMAT_R8G8B8A8_UNORM,     4);
+		D3D12_RGHandle bloom_half = Bench_CreateTarget(graph, "Bloom Half", w / 2, h / 2, DXGI_FORMAT_R16G16B16A16_FLOAT, 8);
+		D3D12_RGHandle bloom      = Bench_CreateTarget(graph, "Bloom",      w,     h,     DXGI_FORMAT_R16G16B16A16_FLOAT, 8);
+
+		D3D12_RESOURCE_STATES srv = D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE;
+		D3D12_RESOURCE_STATES rt  = D3D12_RESOURCE_STATE_RENDER_TARGET;
+
+		graph->AddPass("GBuffer", 1000, Bench_EmptyPass, nullptr);
+		graph->Write(albedo, rt);
+		graph->Write(normal, rt);
+		graph->Write(depth,  D3D12_RESOURCE_STATE_DEPTH_WRITE);
+
+		graph->AddPass("SSAO", 1, Bench_EmptyPass, nullptr);
+		graph->Read (normal, srv);
+		graph->Read (depth,  srv);
+		graph->Write(ao,     rt);
+
+		graph->AddPass("Debug View", 1, Bench_EmptyPass, nullptr);
+		graph->Read (normal, srv);
+		graph->Write(debug,  rt);
+
+		graph->AddPass("Lighting", 1, Bench_EmptyPass, nullptr);
+		graph->Read (albedo, srv);
+		graph->Read (normal, srv);
+		graph->Read (depth,  srv);
+		graph->Read (ao,     srv);
+		graph->Write(hdr,    rt);
+
+		graph->AddPass("Debug Blur", 1, Bench_EmptyPass, nullptr);
+		graph->Read (debug,      srv);
+		graph->Write(debug_blur, rt);
+
+		graph->AddPass("Bloom Down", 1, Bench_EmptyPass, nullptr);
+		graph->Read (hdr,        srv);
+		graph->Write(bloom_half, rt);
+
+		graph->AddPass("Bloom Up", 1, Bench_EmptyPass, nullptr);
+		graph->Read (bloom_half, srv);
+		graph->Write(bloom,      rt);
+
+		graph->AddPass("Tonemap", 1, Bench_EmptyPass, nullptr);
+		graph->Read (hdr,        srv);
+		graph->Read (bloom,      srv);
+		graph->Write(backbuffer, rt);
+
+		graph->Compile();
+
+		double time = TimeElapsed(start, GetTime());
+		if (best_time > time) best_time = time;
+	}
+
+	//------------------------------------------------------------------------
+	// Culling
+
+	const D3D12_RenderGraphStats *stats = &graph->stats;
+
+	for (uint32_t i = 0; i < graph->pass_count; i++)
+	{
+		bool debug = strncmp(graph->passes[i].name, "Debug", 5) == 0;
+		assert(graph->passes[i].culled == debug || !"Render graph culled the wrong passes");
+	}
+
+	printf("render_graph: %u passes declared, %u culled, %u left, compiled in %.1f us\n",
+		   stats->passes_declared, stats->passes_culled, graph->order_count, 1000000.0*best_time);
+
+	//------------------------------------------------------------------------
+	// Aliasing
+
+	uint32_t shared = 0;
+
+	for (uint32_t i = 0; i < graph->resource_count; i++)
+	{
+		D3D12_RGResource *a = &graph->resources[i];
+
+		if (a->imported || a->first_pass == UINT32_MAX)
+		{
+			continue;
+		}
+
+		for (uint32_t j = i + 1; j < graph->resource_count; j++)
+		{
+			D3D12_RGResource *b = &graph->resources[j];
+
+			if (b->imported || b->first_pass == UINT32_MAX)
+			{
+				continue;
+			}
+
+			bool lifetimes_overlap = a->first_pass <= b->last_pass && b->first_pass <= a->last_pass;
+			bool memory_overlaps   = a->heap_offset < b->heap_offset + b->allocation.SizeInBytes && b->heap_offset < a->heap_offset + a->allocation.SizeInBytes;
+
+			assert(!(lifetimes_overlap && memory_overlaps) || !"Render graph aliased resources that are alive at the same time");
+
+			if (memory_overlaps) shared += 1;
+		}
+	}
+
+	double unaliased = (double)stats->transient_bytes_unaliased / (1024.0*1024.0);
+	double aliased   = (double)stats->transient_bytes_aliased   / (1024.0*1024.0);
+
+	printf("render_graph: %u transients in %.1f MiB instead of %.1f MiB, %.0f%% saved, %u pairs sharing memory\n",
+		   stats->transient_resources, aliased, unaliased, 100.0*(1.0 - aliased / unaliased), shared);
+
+	//------------------------------------------------------------------------
+	// Barriers, with made up resource pointers standing in for the placed resources
+
+	D3D12_StateTracker     *tracker   = &g_bench_state_tracker;
+	D3D12_BarrierScheduler *scheduler = &g_bench_barrier_scheduler;
+
+	tracker->Init(g_rg_max_resources);
+	scheduler->Init();
+
+	ID3D12Resource *fake_resources[g_rg_max_resources];
+
+	for (uint32_t i = 0; i < graph->resource_count; i++)
+	{
+		fake_resources[i] = (ID3D12Resource *)(uintptr_t)(0x10000 + 0x100*i);
+		tracker->Register(fake_resources[i], 1, D3D12_RESOURCE_STATE_COMMON, false);
+	}
+
+	scheduler->Begin();
+
+	for (uint32_t order_index = 0; order_index < graph->order_count; order_index++)
+	{
+		uint32_t pass_index = graph->order[order_index];
+		scheduler->AddPass(graph->passes[pass_index].work);
+
+		for (uint32_t i = 0; i < graph->access_count; i++)
+		{
+			D3D12_RGAccess *access = &graph->accesses[i];
+
+			if (access->pass_index == pass_index)
+			{
+				bool allow_early_begin = !graph->resources[access->resource_index].needs_aliasing_barrier;
+				scheduler->AddAccess(fake_resources[access->resource_index], D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES, access->state, allow_early_begin);
+			}
+		}
+	}
+
+	scheduler->Compile(tracker);
+
+	// every BEGIN_ONLY needs its END_ONLY in front of a later pass
+	for (uint32_t pass_index = 0; pass_index < scheduler->pass_count; pass_index++)
+	{
+		D3D12_PlannedPass *pass = &scheduler->passes[pass_index];
+
+		for (uint32_t i = pass->first_barrier; i < pass->first_barrier + pass->barrier_count; i++)
+		{
+			if (scheduler->barriers[i].Flags != D3D12_RESOURCE_BARRIER_FLAG_BEGIN_ONLY)
+			{
+				continue;
+			}
+
+			bool ended = false;
+
+			for (uint32_t j = pass->first_barrier + pass->barrier_count; j < scheduler->barrier_count && !ended; j++)
+			{
+				ended = scheduler->barriers[j].Flags == D3D12_RESOURCE_BARRIER_FLAG_END_ONLY && D3D12_BarrierScheduler::IsSameTransition(scheduler->barriers[i], scheduler->barriers[j]);
+			}
+
+			assert(ended || !"Split barrier never ends");
+		}
+	}
+
+	const D3D12_BarrierScheduleStats *barrier_stats = &scheduler->stats;
+
+	printf("render_graph: %u barriers split over %u passes in total, %u regular\n",
+		   barrier_stats->split_barriers, barrier_stats->passes_overlapped, barrier_stats->regular_barriers);
+
+	// the Lighting pass goes wide: the list it started on is closed right after its barriers
+	D3D12_CommandStream stream = {};
+	D3D12_CommandList   list;
+	list.Reset(nullptr, &stream);
+
+	for (uint32_t order_index = 0; order_index < graph->order_count; order_index++)
+	{
+		scheduler->Issue(order_index, &list);
+
+		if (strcmp(graph->passes[graph->order[order_index]].name, "Lighting") == 0)
+		{
+			scheduler->EndSplitBarriers(&list);
+		}
+	}
+
+	assert(scheduler->open_split_count == 0 || !"Split barriers left open at the end of the graph");
+
+	// what got issued: each begin has exactly one end, either planned or early
+	uint32_t begins = 0;
+	uint32_t ends   = 0;
+
+	for (size_t at = 0; at < stream.size;)
+	{
+		const D3D12_StreamCommand *header = (const D3D12_StreamCommand *)(stream.data + at);
+		at += header->size;
+
+		if (header->type != D3D12_StreamCommand_ResourceBarrier)
+		{
+			continue;
+		}
+
+		const D3D12_StreamArrayCommand *command  = (const D3D12_StreamArrayCommand *)header;
+		const D3D12_StreamBarrier      *barriers = (const D3D12_StreamBarrier *)(command + 1);
+
+		for (uint32_t i = 0; i < command->count; i++)
+		{
+			if (barriers[i].flags == D3D12_RESOURCE_BARRIER_FLAG_BEGIN_ONLY) begins += 1;
+			if (barriers[i].flags == D3D12_RESOURCE_BARRIER_FLAG_END_ONLY)   ends   += 1;
+		}
+	}
+
+	assert((begins == ends && begins == barrier_stats->split_barriers) || !"Split barriers came out unpaired");
+
+	printf("render_graph: with the list closed after Lighting, %u of %u splits ended early, %u begins and %u ends issued\n",
+		   barrier_stats->splits_ended_early, barrier_stats->split_barriers, begins, ends);
+
+	stream.Release();
+	scheduler->Release();
+	tracker->Release();
+}
+
+// The ExecuteIndirect arguments for a frame's worth of draws, built without a device and checked
+// against the direct path recorded into a command stream on a wrapper with no list under it. At every
+// draw, the root constants the direct path has set by then (with whatever the filter dropped still
+// holding from before) and the draw itself have to match that draw's record in the argument buffer.
+// A range starting partway through the packet has to come out the same as that part of the whole.
+
+D3D12_Scene g_bench_scene;
+
+void Bench_IndirectDraws()
+{
+	uint32_t draw_count  = 100000;
+	uint32_t repetitions = 20;
+
+	D3D12_Scene *scene = &g_bench_scene;
+
+	for (uint32_t i = 0; i < ArrayCount(scene->textures_srvs); i++)
+	{
+		scene->textures_srvs[i].index = 100 + 7*i;
+	}
+
+	D3D12_FramePacket packet = {};
+	packet.draw_count = draw_count;
+	packet.draws      = (D3D12_PacketDraw *)malloc(draw_count*sizeof(D3D12_PacketDraw));
+
+	uint64_t random = 0x9E3779B97F4A7C15ull;
+
+	for (uint32_t i = 0; i < draw_count; i++)
+	{
+		// runs of the same texture and color, so the filter has constants to drop
+		packet.draws[i] = {
+			.offset  = { (float)(Bench_Random(&random) % 2048) / 1024.0f - 1.0f, (float)(Bench_Random(&random) % 2048) / 1024.0f - 1.0f },
+			.extents = { 0.05f, 0.05f },
+			.texture = (uint32_t)((i / 16) % ArrayCount(scene->textures_srvs)),
+			.color   = (i / 64) % 2 ? 0xFFFFFFFF : 0xFF00FFFF,
+		};
+	}
+
+	D3D12_IndirectDraw *args = (D3D12_IndirectDraw *)malloc(draw_count*sizeof(D3D12_IndirectDraw));
+
+	double best_time = 1e30;
+
+	for (uint32_t repetition = 0; repetition < repetitions; repetition++)
+	{
+		LARGE_INTEGER start = GetTime();
+		D3D12_BuildIndirectDraws(scene, &packet, 0, draw_count, args);
+		double time = TimeElapsed(start, GetTime());
+
+		if (best_time > time) best_time = time;
+	}
+
+	printf("indirect: %u draws built in %.3f ms, %.1f ns/draw\n", draw_count, 1000.0*best_time, 1e9*best_time / (double)draw_count);
+
+	//------------------------------------------------------------------------
+	// Against the direct path
+
+	D3D12_CommandStream stream = {};
+	D3D12_CommandList   list;
+	list.Reset(nullptr, &stream);
+
+	D3D12_RecordDraws(&list, scene, &packet, 0, draw_count);
+
+	uint32_t constants[sizeof(D3D12_RootConstants) / sizeof(uint32_t)] = {};
+	uint32_t draw_index = 0;
+	uint32_t mismatches = 0;
+
+	for (size_t at = 0; at < stream.size;)
+	{
+		const D3D12_StreamCommand *header = (const D3D12_StreamCommand *)(stream.data + at);
+		at += header->size;
+
+		if (header->type == D3D12_StreamCommand_SetGraphicsRoot32BitConstants)
+		{
+			const D3D12_StreamConstantsCommand *command = (const D3D12_StreamConstantsCommand *)header;
+
+			assert(command->parameter == D3D12_RootParameter_32bit_constants);
+			assert(command->offset + command->count <= ArrayCount(constants));
+
+			memcpy(&constants[command->offset], command + 1, command->count*sizeof(uint32_t));
+		}
+		else if (header->type == D3D12_StreamCommand_DrawIndexedInstanced)
+		{
+			const D3D12_StreamDrawCommand *command = (const D3D12_StreamDrawCommand *)header;
+			const D3D12_IndirectDraw      *record  = &args[draw_index++];
+
+			bool same =
+				memcmp(constants, &record->constants, sizeof(constants)) == 0       &&
+				command->index_count    == record->draw.IndexCountPerInstance       &&
+				command->instance_count == record->draw.InstanceCount               &&
+				command->start_index    == record->draw.StartIndexLocation          &&
+				command->base_vertex    == record->draw.BaseVertexLocation          &&
+				command->start_instance == record->draw.StartInstanceLocation;
+
+			mismatches += same ? 0 : 1;
+		}
+	}
+
+	assert(draw_index == draw_count || !"The direct path should record one draw per packet draw");
+	assert(mismatches == 0          || !"Indirect arguments don't match what the direct path draws");
+
+	//------------------------------------------------------------------------
+	// Partway through
+
+	uint32_t first = draw_count / 3;
+	uint32_t count = draw_count - first;
+
+	D3D12_IndirectDraw *range = (D3D12_IndirectDraw *)malloc(count*sizeof(D3D12_IndirectDraw));
+	D3D12_BuildIndirectDraws(scene, &packet, first, count, range);
+
+	bool range_same = memcmp(range, &args[first], count*sizeof(D3D12_IndirectDraw)) == 0;
+	assert(range_same || !"A range of draws should build the same as that part of the whole");
+
+	printf("indirect: %u of %u draws match the direct path, %u of %u root constants filtered out of it, ranges %s\n",
+		   draw_count - mismatches, draw_count, list.stats.root_constants_filtered, list.stats.root_constants,
+		   range_same ? "match" : "DON'T MATCH");
+
+	free(range);
+	free(args);
+	free(packet.draws);
+	stream.Release();
+}
+
+// Moves 1M and 4M triangle guys the old way (two double precision sins each) and with the SIMD update,
+// single threaded and on the work queue, and checks how far the fast sine strays from the real one
+void Bench_SceneUpdate()
+{
+	uint32_t counts[] = { 1000000, 4000000 };
+
+	for (size_t count_index = 0; count_index < ArrayCount(counts); count_index++)
+	{
+		uint32_t count = counts[count_index];
+
+		TriangleGuys guys = {};
+		TriangleGuys_SetCount(&guys, count, { 0.1f, 0.1f });
+
+		float *expected_x = (float *)malloc(count*sizeof(float));
+		float *expected_y = (float *)malloc(count*sizeof(float));
+
+		uint32_t repetitions = 10;
+		double   frame_time  = 1.0 / 60.0;
+
+		for (uint32_t method = 0; method < 3; method++)
+		{
+			const char *method_names[] = { "reference", "simd", "simd threaded" };
+
+			double best_time    = 1e30;
+			double max_error    = 0.0;
+			double current_time = 12345.0; // far enough from zero that the time part of the phase isn't tiny
+
+			for (uint32_t repetition = 0; repetition < repetitions; repetition++)
+			{
+				current_time += frame_time;
+
+				LARGE_INTEGER start = GetTime();
+
+				switch (method)
+				{
+					case 0:  TriangleGuys_UpdateReference(&guys, current_time);       break;
+					case 1:  TriangleGuys_Update(&guys, current_time);                break;
+					default: TriangleGuys_Update(&guys, current_time, &g_work_queue); break;
+				}
+
+				double elapsed = TimeElapsed(start, GetTime());
+				if (best_time > elapsed) best_time = elapsed;
+			}
+
+			if (method == 0)
+			{
+				memcpy(expected_x, guys.position_x, count*sizeof(float));
+				memcpy(expected_y, guys.position_y, count*sizeof(float));
+			}
+			else
+			{
+				for (uint32_t i = 0; i < count; i++)
+				{
+					double error_x = fabs((double)guys.position_x[i] - (double)expected_x[i]);
+					double error_y = fabs((double)guys.position_y[i] - (double)expected_y[i]);
+
+					if (max_error < error_x) max_error = error_x;
+					if (max_error < error_y) max_error = error_y;
+				}
+			}
+
+			printf("scene_update: %7u guys, %-13s %8.3f ms, %7.1f M guys/s, max error %.2e\n",
+				   count, method_names[method], 1000.0*best_time, (double)count / best_time / 1000000.0, max_error);
+		}
+
+		free(expected_x);
+		free(expected_y);
+
+		guys.Release();
+	}
+}
+
+// Culls 1M triangle guys scattered over [-2, 2], so a bit over a quarter of them end up overlapping the
+// viewport, one at a time with the same test the GPU culling uses, and with the SIMD cull single
+// threaded and on the work queue. All of them have to come up with the same list.
+void Bench_Cull()
+{
+	uint32_t count = 1000000;
+
+	TriangleGuys guys = {};
+	TriangleGuys_SetCount(&guys, count, { 0.1f, 0.1f });
+
+	uint64_t random = 0x9E3779B97F4A7C15ull;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		guys.position_x[i] = 4.0f*(float)(Bench_Random(&random) % 65536) / 65535.0f - 2.0f;
+		guys.position_y[i] = 4.0f*(float)(Bench_Random(&random) % 65536) / 65535.0f - 2.0f;
+		guys.extent_x  [i] = 0.01f + 0.1f*(float)(Bench_Random(&random) % 256) / 255.0f;
+		guys.extent_y  [i] = 0.01f + 0.1f*(float)(Bench_Random(&random) % 256) / 255.0f;
+	}
+
+	uint32_t *expected     = (uint32_t *)malloc(guys.capacity*sizeof(uint32_t));
+	uint32_t *visible      = (uint32_t *)malloc(guys.capacity*sizeof(uint32_t));
+	uint32_t *block_counts = (uint32_t *)malloc(TriangleGuys_GetCullBlockCount(count)*sizeof(uint32_t));
+
+	D3D12_CullPlane planes[4];
+	D3D12_GetClipSpaceCullPlanes(planes);
+
+	uint32_t repetitions    = 10;
+	uint32_t expected_count = 0;
+
+	for (uint32_t method = 0; method < 3; method++)
+	{
+		const char *method_names[] = { "reference", "simd", "simd threaded" };
+
+		double    best_time     = 1e30;
+		CullStats stats         = {};
+		uint32_t  visible_count = 0;
+
+		for (uint32_t repetition = 0; repetition < repetitions; repetition++)
+		{
+			LARGE_INTEGER start = GetTime();
+
+			if (method == 0)
+			{
+				visible_count = 0;
+
+				for (uint32_t i = 0; i < count; i++)
+				{
+					D3D12_CullBounds bounds = {
+						.center  = { guys.position_x[i], guys.position_y[i] },
+						.extents = { guys.extent_x  [i], guys.extent_y  [i] },
+					};
+
+					if (D3D12_CullIsVisible(planes, &bounds))
+					{
+						expected[visible_count++] = i;
+					}
+				}
+
+				stats = { .tested = count, .visible = visible_count };
+			}
+			else
+			{
+				visible_count = TriangleGuys_Cull(&guys, g_clip_space_rect, visible, block_counts, &stats, method == 2 ? &g_work_queue : nullptr);
+			}
+
+			double elapsed = TimeElapsed(start, GetTime());
+			if (best_time > elapsed) best_time = elapsed;
+		}
+
+		bool matches = true;
+
+		if (method == 0)
+		{
+			expected_count = visible_count;
+		}
+		else
+		{
+			matches = visible_count == expected_count && memcmp(visible, expected, visible_count*sizeof(uint32_t)) == 0;
+		}
+
+		printf("cull: %u tested, %u visible, %-13s %8.3f ms, %7.1f M objects/s\n",
+			   stats.tested, stats.visible, method_names[method], 1000.0*best_time, (double)count / best_time / 1000000.0);
+
+		assert(matches                        || !"The SIMD cull doesn't match the reference");
+		assert(stats.tested == count          || !"The cull didn't test every guy");
+		assert(stats.visible == visible_count || !"The cull stats don't match what it returned");
+	}
+
+	free(expected);
+	free(visible);
+	free(block_counts);
+
+	guys.Release();
+}
+
+// A rectangle and a rotated square of about the same size around a random spot, and a ray from there
+// in a random direction
+struct Bench_BVHQuery
+{
+	Rect2D          rect;
+	D3D12_CullPlane planes[4];
+	Vector2D        origin;
+	Vector2D        direction;
+};
+
+Bench_BVHQuery Bench_MakeBVHQuery(uint64_t *random)
+{
+	float x     = 8.0f*(float)(Bench_Random(random) % 65536) / 65535.0f - 4.0f;
+	float y     = 8.0f*(float)(Bench_Random(random) % 65536) / 65535.0f - 4.0f;
+	float size  = 0.005f + 0.02f*(float)(Bench_Random(random) % 256) / 255.0f;
+	float angle = g_two_pi*(float)(Bench_Random(random) % 65536) / 65536.0f;
+
+	Bench_BVHQuery result = {
+		.rect      = { x - size, y - size, x + size, y + size },
+		.origin    = { x, y },
+		.direction = { cosf(angle), sinf(angle) },
+	};
+
+	for (uint32_t i = 0; i < 4; i++)
+	{
+		float    plane_angle = angle + 0.25f*g_two_pi*(float)i;
+		Vector2D normal      = { -cosf(plane_angle), -sinf(plane_angle) };
+
+		result.planes[i] = { .normal = normal, .distance = size - (normal.x*x + normal.y*y) };
+	}
+
+	return result;
+}
+
+// Runs one query of the given kind, 0 rect, 1 planes, 2 ray, and returns how many results it found.
+// With expected, also tests every guy the way the query would have and returns whether they agree.
+uint32_t Bench_RunBVHQuery(const BVH *bvh, const TriangleGuys *guys, uint32_t kind, const Bench_BVHQuery *q,
+						   uint32_t *results, uint32_t max_results, uint8_t *expected, bool *matches)
+{
+	uint32_t  result_count = 0;
+	BVHRayHit hit          = {};
+
+	switch (kind)
+	{
+		case 0:  result_count = BVH_QueryRect  (bvh, q->rect,      results, max_results); break;
+		case 1:  result_count = BVH_QueryPlanes(bvh, q->planes, 4, results, max_results); break;
+		default: result_count = BVH_RayCast    (bvh, q->origin, q->direction, 8.0f, &hit) ? 1 : 0; break;
+	}
+
+	if (!expected)
+	{
+		return result_count;
+	}
+
+	uint32_t expected_count = 0;
+	float    expected_t     = 8.0f;
+
+	for (uint32_t i = 0; i < guys->count; i++)
+	{
+		Rect2D bounds = TriangleGuys_GetBounds(guys, i);
+
+		D3D12_CullBounds cull_bounds = {
+			.center  = { 0.5f*(bounds.min_x + bounds.max_x), 0.5f*(bounds.min_y + bounds.max_y) },
+			.extents = { 0.5f*(bounds.max_x - bounds.min_x), 0.5f*(bounds.max_y - bounds.min_y) },
+		};
+
+		float t;
+
+		switch (kind)
+		{
+			case 0:  expected[i] = Rect2D_Overlaps(bounds, q->rect);              break;
+			case 1:  expected[i] = D3D12_CullIsVisible(q->planes, &cull_bounds); break;
+			default:
+			{
+				expected[i] = 0;
+
+				if (BVH_RayHitsBox(bounds, q->origin, { 1.0f / q->direction.x, 1.0f / q->direction.y }, expected_t, &t) &&
+					(expected_count == 0 || t < expected_t))
+				{
+					expected_t     = t;
+					expected_count = 1;
+				}
+			} break;
+		}
+
+		if (kind != 2) expected_count += expected[i];
+	}
+
+	bool same = result_count == expected_count;
+
+	if (kind == 2)
+	{
+		same = same && (result_count == 0 || hit.t == expected_t);
+	}
+	else
+	{
+		// each guy at most once, so the counts matching means nothing was missed either
+		for (uint32_t i = 0; i < result_count && same; i++)
+		{
+			same = expected[results[i]] == 1;
+			expected[results[i]] = 2;
+		}
+	}
+
+	*matches = same;
+
+	return result_count;
+}
+
+// Builds a BVH over 1M triangle guys scattered over [-4, 4], nudges them all and refits it, then times
+// rectangle, plane and ray queries against it. A few queries of each kind are checked against testing
+// every guy right after the build, after each refit, and before the timed run.
+void Bench_BVH()
+{
+	uint32_t count = 1000000;
+
+	TriangleGuys guys = {};
+	TriangleGuys_SetCount(&guys, count, { 0.01f, 0.01f });
+
+	uint64_t random = 0x2545F4914F6CDD1Dull;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		guys.position_x[i] = 8.0f*(float)(Bench_Random(&random) % 65536) / 65535.0f - 4.0f;
+		guys.position_y[i] = 8.0f*(float)(Bench_Random(&random) % 65536) / 65535.0f - 4.0f;
+	}
+
+	BVH bvh = {};
+
+	uint32_t  max_results   = count;
+	uint32_t *results       = (uint32_t *)malloc(max_results*sizeof(uint32_t));
+	uint8_t  *expected      = (uint8_t  *)malloc(count);
+	uint32_t  checked_count = 16;
+
+	//------------------------------------------------------------------------
+	// Build and refit
+
+	LARGE_INTEGER start = GetTime();
+	BVH_Build(&bvh, &guys);
+	double build_time = TimeElapsed(start, GetTime());
+
+	printf("bvh: %u objects, %u nodes, build %8.3f ms\n", count, bvh.node_count, 1000.0*build_time);
+
+	for (uint32_t i = 0; i < 3*checked_count; i++)
+	{
+		Bench_BVHQuery q = Bench_MakeBVHQuery(&random);
+
+		bool matches = false;
+		Bench_RunBVHQuery(&bvh, &guys, i % 3, &q, results, max_results, expected, &matches);
+
+		assert(matches || !"BVH query doesn't match testing every guy after the build");
+	}
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		guys.position_x[i] += 0.02f*((float)(Bench_Random(&random) % 256) / 255.0f - 0.5f);
+		guys.position_y[i] += 0.02f*((float)(Bench_Random(&random) % 256) / 255.0f - 0.5f);
+	}
+
+	for (uint32_t threaded = 0; threaded < 2; threaded++)
+	{
+		double best_time = 1e30;
+
+		for (uint32_t repetition = 0; repetition < 10; repetition++)
+		{
+			start = GetTime();
+			BVH_Refit(&bvh, &guys, threaded ? &g_work_queue : nullptr);
+
+			double elapsed = TimeElapsed(start, GetTime());
+			if (best_time > elapsed) best_time = elapsed;
+		}
+
+		printf("bvh: refit%-9s %8.3f ms\n", threaded ? " threaded" : "", 1000.0*best_time);
+
+		// the nudge moved most guys out of their old boxes, so these only pass if the refit caught up
+		for (uint32_t i = 0; i < 3*checked_count; i++)
+		{
+			Bench_BVHQuery q = Bench_MakeBVHQuery(&random);
+
+			bool matches = false;
+			Bench_RunBVHQuery(&bvh, &guys, i % 3, &q, results, max_results, expected, &matches);
+
+			assert(matches || !"BVH query doesn't match testing every guy after a refit");
+		}
+	}
+
+	//------------------------------------------------------------------------
+	// Queries
+
+	uint32_t query_counts[] = { 100000, 100000, 100000 };
+
+	for (uint32_t kind = 0; kind < 3; kind++)
+	{
+		const char *kind_names[] = { "rect", "planes", "ray" };
+
+		uint32_t query_count   = query_counts[kind];
+		uint64_t total_results = 0;
+		uint64_t query_random  = random;
+
+		// The first few queries are checked before the timed run, which then goes through the same ones
+		for (uint32_t i = 0; i < checked_count; i++)
+		{
+			Bench_BVHQuery q = Bench_MakeBVHQuery(&random);
+
+			bool matches = false;
+			Bench_RunBVHQuery(&bvh, &guys, kind, &q, results, max_results, expected, &matches);
+
+			assert(matches || !"BVH query doesn't match testing every guy");
+		}
+
+		random = query_random;
+		start  = GetTime();
+
+		for (uint32_t query = 0; query < query_count; query++)
+		{
+			Bench_BVHQuery q = Bench_MakeBVHQuery(&random);
+			total_results += Bench_RunBVHQuery(&bvh, &guys, kind, &q, results, max_results, nullptr, nullptr);
+		}
+
+		double elapsed = TimeElapsed(start, GetTime());
+
+		printf("bvh: %-6s %7u queries %8.3f ms, %8.2f M queries/s, %.1f results per query\n",
+			   kind_names[kind], query_count, 1000.0*elapsed, (double)query_count / elapsed / 1000000.0,
+			   (double)total_results / (double)query_count);
+	}
+
+	free(results);
+	free(expected);
+
+	bvh.Release();
+	guys.Release();
+}
+
+// Runs the guys through the fixed timestep frame by frame, the way D3D12_UpdateScene does, for
+// duration seconds of made up frame times: frame_time apart, or anywhere from 2 to 50 ms apart when
+// it's 0. Returns the seconds spent in the update.
+double Bench_RunTimestep(TriangleGuys *guys, FixedTimestep *timestep, double duration, double frame_time, bool fixed, uint64_t *random, WorkQueue *queue)
+{
+	double current_time = 0.0;
+	double elapsed      = 0.0;
+
+	for (;;)
+	{
+		LARGE_INTEGER start = GetTime();
+
+		if (fixed)
+		{
+			FixedTimestep_Advance(timestep, current_time);
+
+			double simulation_time;
+
+			while (FixedTimestep_Step(timestep, &simulation_time))
+			{
+				TriangleGuys_Step(guys, simulation_time, queue);
+			}
+
+			float alpha = FixedTimestep_GetAlpha(timestep);
+
+			assert(timestep->frame_steps <= timestep->max_steps || !"A frame took more steps than the cap");
+			assert((alpha >= 0.0f && alpha < 1.0f)              || !"Interpolation alpha out of [0, 1)");
+
+			TriangleGuys_Interpolate(guys, alpha, queue);
+		}
+		else
+		{
+			TriangleGuys_Update(guys, current_time, queue);
+		}
+
+		elapsed += TimeElapsed(start, GetTime());
+
+		if (current_time >= duration)
+		{
+			break;
+		}
+
+		double frame = frame_time > 0.0 ? frame_time : 0.002 + 0.048*(double)(Bench_Random(random) % 65536) / 65535.0;
+
+		current_time = current_time + frame < duration ? current_time + frame : duration;
+	}
+
+	return elapsed;
+}
+
+// Drives the fixed timestep with made up frame times, so it runs without a window or a device:
+//
+//     determinism: 60 Hz, 240 Hz and jittery frames over the same stretch of time have to end on the
+//                  same step with bit for bit the same guys, drawn somewhere between their last two
+//                  steps
+//     hitch:       a frame a second late only takes max_steps steps and drops the rest of the time
+//     cost:        update time per second at 1M guys and a range of frame rates, stepping at 60 Hz
+//                  against updating every frame
+void Bench_Timestep()
+{
+	uint64_t random = 0x853C49E6748FEA9Bull;
+
+	//------------------------------------------------------------------------
+	// Determinism
+
+	{
+		// half way through a step, so the accumulators drifting apart by a rounding error doesn't matter
+		double   duration = 10.0 + 0.5*g_simulation_step;
+		uint32_t count    = 10000;
+
+		TriangleGuys reference = {};
+		TriangleGuys_SetCount(&reference, count, { 0.1f, 0.1f });
+
+		FixedTimestep reference_timestep = FixedTimestep_Make();
+		Bench_RunTimestep(&reference, &reference_timestep, duration, 1.0 / 60.0, true, &random, nullptr);
+
+		double frame_times[] = { 1.0 / 240.0, 0.0 };
+
+		for (size_t i = 0; i < ArrayCount(frame_times); i++)
+		{
+			TriangleGuys guys = {};
+			TriangleGuys_SetCount(&guys, count, { 0.1f, 0.1f });
+
+			FixedTimestep timestep = FixedTimestep_Make();
+			Bench_RunTimestep(&guys, &timestep, duration, frame_times[i], true, &random, &g_work_queue);
+
+			bool same_steps = timestep.step_count == reference_timestep.step_count;
+			bool same_state =
+				memcmp(guys.step_x,          reference.step_x,          count*sizeof(float)) == 0 &&
+				memcmp(guys.step_y,          reference.step_y,          count*sizeof(float)) == 0 &&
+				memcmp(guys.previous_step_x, reference.previous_step_x, count*sizeof(float)) == 0 &&
+				memcmp(guys.previous_step_y, reference.previous_step_y, count*sizeof(float)) == 0;
+
+			bool interpolated = true;
+
+			for (uint32_t j = 0; j < count; j++)
+			{
+				float from = guys.previous_step_x[j];
+				float to   = guys.step_x[j];
+				float x    = guys.position_x[j];
+
+				interpolated = interpolated && x >= (from < to ? from : to) && x <= (from < to ? to : from);
+			}
+
+			printf("timestep: %-7s frames, %llu steps (%llu at 60 Hz), state %s, positions %s\n",
+				   frame_times[i] > 0.0 ? "240 Hz" : "jittery",
+				   (unsigned long long)timestep.step_count, (unsigned long long)reference_timestep.step_count,
+				   same_steps && same_state ? "matches" : "MISMATCH", interpolated ? "interpolated" : "OUT OF RANGE");
+
+			assert((same_steps && same_state) || !"The simulation depends on the frame times");
+			assert(interpolated               || !"Guys drawn outside of their last two steps");
+
+			guys.Release();
+		}
+
+		reference.Release();
+	}
+
+	//------------------------------------------------------------------------
+	// Hitch
+
+	{
+		FixedTimestep timestep = FixedTimestep_Make();
+
+		double current_time = 0.0;
+		double simulation_time;
+
+		for (uint32_t frame = 0; frame < 60; frame++)
+		{
+			FixedTimestep_Advance(&timestep, current_time);
+			while (FixedTimestep_Step(&timestep, &simulation_time)) {}
+
+			current_time += 1.0 / 60.0;
+		}
+
+		current_time += 1.0;
+
+		FixedTimestep_Advance(&timestep, current_time);
+		while (FixedTimestep_Step(&timestep, &simulation_time)) {}
+
+		double expected_dropped = 1.0 + 1.0 / 60.0 - (double)g_max_simulation_steps*g_simulation_step;
+
+		printf("timestep: 1 s hitch took %u steps (max %u), dropped %.4f s (expected about %.4f), %llu capped frames\n",
+			   timestep.frame_steps, g_max_simulation_steps, timestep.dropped_time, expected_dropped,
+			   (unsigned long long)timestep.capped_frames);
+
+		assert(timestep.frame_steps == g_max_simulation_steps                || !"A hitch should take exactly max_steps steps");
+		assert(timestep.capped_frames == 1                                   || !"Only the hitch should have been capped");
+		assert(fabs(timestep.dropped_time - expected_dropped) < 0.5*g_simulation_step || !"The cap dropped the wrong amount of time");
+	}
+
+	//------------------------------------------------------------------------
+	// Cost
+
+	{
+		uint32_t count = 1000000;
+
+		TriangleGuys guys = {};
+		TriangleGuys_SetCount(&guys, count, { 0.1f, 0.1f });
+
+		double frame_rates[] = { 30.0, 60.0, 144.0, 480.0 };
+		double duration      = 2.0;
+
+		for (size_t i = 0; i < ArrayCount(frame_rates); i++)
+		{
+			FixedTimestep timestep = FixedTimestep_Make();
+
+			double fixed_time     = Bench_RunTimestep(&guys, &timestep, duration, 1.0 / frame_rates[i], true,  &random, &g_work_queue);
+			double per_frame_time = Bench_RunTimestep(&guys, &timestep, duration, 1.0 / frame_rates[i], false, &random, &g_work_queue);
+
+			printf("timestep: %3.0f fps, %7.3f ms/s stepping at 60 Hz, %7.3f ms/s updating every frame\n",
+				   frame_rates[i], 1000.0*fixed_time / duration, 1000.0*per_frame_time / duration);
+		}
+
+		guys.Release();
+	}
+}
+
+// A CPU and a GPU taking turns on frames, for driving FramePacer without either. The CPU samples input
+// (after the pacer's delay) and simulates, then waits for a frame slot to come free, records into it
+// and hands the frame over. The GPU takes frames in order as soon as it's done with the last one.
+struct Bench_PacingTrace
+{
+	const char *name;
+	double      cpu_time;          // simulating
+	double      cpu_spike_time;
+	uint32_t    cpu_spike_percent; // of frames
+	double      record_time;
+	double      gpu_time;
+};
+
+struct Bench_PacingResult
+{
+	uint32_t frames;
+	double   duration;
+	double   gpu_busy;
+	double   latency_sum; // input to the GPU being done with the frame
+	double   latency_max;
+	uint32_t frame_slot_count;
+	double   input_delay;
+};
+
+// pacer is null for a fixed frame_slot_count and no input delay. Frames before warmup count for the
+// pacer but not for the result.
+Bench_PacingResult Bench_RunPacing(const Bench_PacingTrace *trace, FramePacer *pacer, uint32_t frame_slot_count, uint32_t frame_count, uint32_t warmup, uint64_t *random)
+{
+	Bench_PacingResult result = {};
+
+	// when each of the last few frames came off the GPU
+	double gpu_done[g_max_frame_slots + 1] = {};
+
+	double cpu_free  = 0.0;
+	double warmed_up = 0.0;
+
+	for (uint32_t i = 0; i < frame_count; i++)
+	{
+		double jitter   = 0.9 + 0.2*(double)(Bench_Random(random) % 65536) / 65535.0;
+		bool   spike    = Bench_Random(random) % 100 < trace->cpu_spike_percent;
+		double cpu_time = (spike ? trace->cpu_spike_time : trace->cpu_time)*jitter;
+		double gpu_time = trace->gpu_time*(0.95 + 0.1*(double)(Bench_Random(random) % 65536) / 65535.0);
+
+		uint32_t slots = pacer ? pacer->frame_slot_count : frame_slot_count;
+		double   delay = pacer ? pacer->input_delay      : 0.0;
+
+		double input = cpu_free + delay;
+		double ready = input + cpu_time;
+
+		// the slot this frame uses was last used slots frames ago
+		double slot_free    = i >= slots ? gpu_done[(i - slots) % ArrayCount(gpu_done)] : 0.0;
+		double record_start = ready > slot_free ? ready : slot_free;
+		double submit       = record_start + trace->record_time;
+
+		double last_done = i > 0 ? gpu_done[(i - 1) % ArrayCount(gpu_done)] : 0.0;
+		double gpu_start = submit > last_done ? submit : last_done;
+		double done      = gpu_start + gpu_time;
+
+		gpu_done[i % ArrayCount(gpu_done)] = done;
+		cpu_free = submit;
+
+		if (pacer)
+		{
+			FramePacerSample sample = {
+				.cpu_time = cpu_time + trace->record_time,
+				.gpu_time = gpu_time,
+				.slack    = record_start - ready,
+			};
+
+			FramePacer_Update(pacer, &sample);
+		}
+
+		if (i == warmup)
+		{
+			warmed_up = last_done;
+		}
+
+		if (i >= warmup)
+		{
+			double latency = done - input;
+
+			result.frames      += 1;
+			result.gpu_busy    += gpu_time;
+			result.latency_sum += latency;
+
+			if (result.latency_max < latency) result.latency_max = latency;
+
+			result.duration = done - warmed_up;
+		}
+	}
+
+	result.frame_slot_count = pacer ? pacer->frame_slot_count : frame_slot_count;
+	result.input_delay      = pacer ? pacer->input_delay      : 0.0;
+
+	return result;
+}
+
+// FramePacer against fixed frame slot counts, on made up frame times:
+//
+//     gpu_bound:  the GPU takes longer than the CPU every frame
+//     cpu_bound:  the other way round, the queue never fills
+//     cpu_spikes: GPU bound, but one CPU frame in ten takes longer than a GPU frame
+//
+// For each, the frame time, how busy the GPU was, and the latency from input to the GPU finishing the
+// frame. The adaptive rows have to keep the GPU within a point of as busy as the busiest fixed count,
+// at no more latency than the fixed count that gets that busy for the least latency.
+static constexpr double g_bench_pacing_busy_tolerance = 0.01;
+
+void Bench_Pacing()
+{
+	Bench_PacingTrace traces[] = {
+		{ .name = "gpu_bound",  .cpu_time = 0.004, .cpu_spike_time = 0.004, .cpu_spike_percent = 0,  .record_time = 0.0015, .gpu_time = 0.010 },
+		{ .name = "cpu_bound",  .cpu_time = 0.012, .cpu_spike_time = 0.012, .cpu_spike_percent = 0,  .record_time = 0.0015, .gpu_time = 0.006 },
+		{ .name = "cpu_spikes", .cpu_time = 0.005, .cpu_spike_time = 0.016, .cpu_spike_percent = 10, .record_time = 0.0015, .gpu_time = 0.010 },
+	};
+
+	uint32_t frame_count = 3000;
+	uint32_t warmup      = 600;
+
+	for (size_t i = 0; i < ArrayCount(traces); i++)
+	{
+		const Bench_PacingTrace *trace = &traces[i];
+
+		Bench_PacingResult results[g_max_frame_slots + 2];
+
+		// every run sees the same frame times
+		for (uint32_t setting = 0; setting < g_max_frame_slots + 2; setting++)
+		{
+			uint64_t random = 0x853C49E6748FEA9Bull;
+
+			FramePacer pacer = FramePacer_Make(g_default_frame_slots, setting == g_max_frame_slots + 1);
+
+			bool     adaptive = setting >= g_max_frame_slots;
+			uint32_t slots    = adaptive ? 0 : setting + 1;
+
+			Bench_PacingResult result = Bench_RunPacing(trace, adaptive ? &pacer : nullptr, slots, frame_count, warmup, &random);
+			results[setting] = result;
+
+			char name[32];
+			if (!adaptive)                       snprintf(name, sizeof(name), "%u slots", slots);
+			else if (setting == g_max_frame_slots) snprintf(name, sizeof(name), "adaptive");
+			else                                 snprintf(name, sizeof(name), "adaptive+delay");
+
+			double frames = (double)result.frames;
+
+			printf("pacing: %-10s %-14s %6.2f ms/frame, GPU %5.1f%% busy, latency %6.2f ms (max %6.2f), %u slots, delay %5.2f ms\n",
+				   trace->name, name, 1000.0*result.duration / frames, 100.0*result.gpu_busy / result.duration,
+				   1000.0*result.latency_sum / frames, 1000.0*result.latency_max, result.frame_slot_count, 1000.0*result.input_delay);
+		}
+
+		//------------------------------------------------------------------------
+		// The adaptive rows against the best fixed count
+
+		double max_busy = 0.0;
+
+		for (uint32_t slots = 1; slots <= g_max_frame_slots; slots++)
+		{
+			const Bench_PacingResult *result = &results[slots - 1];
+			double busy = result->gpu_busy / result->duration;
+
+			if (max_busy < busy) max_busy = busy;
+		}
+
+		double best_latency = DBL_MAX;
+
+		for (uint32_t slots = 1; slots <= g_max_frame_slots; slots++)
+		{
+			const Bench_PacingResult *result = &results[slots - 1];
+
+			double busy    = result->gpu_busy / result->duration;
+			double latency = result->latency_sum / (double)result->frames;
+
+			if (busy >= max_busy - g_bench_pacing_busy_tolerance && best_latency > latency) best_latency = latency;
+		}
+
+		for (uint32_t setting = g_max_frame_slots; setting < g_max_frame_slots + 2; setting++)
+		{
+			const Bench_PacingResult *result = &results[setting];
+
+			double busy    = result->gpu_busy / result->duration;
+			double latency = result->latency_sum / (double)result->frames;
+
+			// a hundredth of a millisecond for the runs drifting apart in the last few bits
+			assert(busy >= max_busy - g_bench_pacing_busy_tolerance || !"The adaptive pacer left the GPU idle where a fixed count didn't");
+			assert(latency <= best_latency + 0.00001               || !"The adaptive pacer added latency over the best fixed count");
+		}
 	}
-	COM_SAFE_RELEASE(error);
+}
+
+// FrameLimiter on a made up clock, then WaitSeconds on the real one:
+//
+//     steady:  frames that take 2 to 6 ms at a 144 Hz limit, with waits that wake up to 0.3 ms late,
+//              have to average out to the limit, not the limit plus the wake up error
+//     late:    a 15 ms frame at a 100 Hz limit is made up for by the next one, a 50 ms one
+//              starts the grid over
+//     wait:    how far past the asked for time WaitSeconds comes back, for a few wait lengths
+void Bench_Limiter()
+{
+	uint64_t random = 0x853C49E6748FEA9Bull;
 
 	//------------------------------------------------------------------------
-	// Compile pixel shader
+	// Steady
 
-	IDxcBlob *ps = nullptr;
-	if (!DXC_CompileShader(g_shader_source, sizeof(g_shader_source), L"MainPS", L"ps_6_6", &ps, &error))
 	{
-		const char *error_message = (char *)error->GetBufferPointer();
-		OutputDebugStringA("Failed to compile pixel shader:\n");
-		OutputDebugStringA(error_message);
-		assert(!"Failed to compile pixel shader, see debugger output for details");
+		double   frame_rate  = 144.0;
+		uint32_t frame_count = 10000;
+
+		FrameLimiter limiter = FrameLimiter_Make(frame_rate);
+
+		double now        = 0.0;
+		double first      = 0.0;
+		double last       = 0.0;
+		double max_period = 0.0;
+
+		for (uint32_t i = 0; i < frame_count; i++)
+		{
+			double start = FrameLimiter_Next(&limiter, now);
+
+			// waking up is never early, and never quite on time
+			if (start > now) now = start + 0.0003*(double)(Bench_Random(&random) % 65536) / 65535.0;
+
+			if (i == 0) first = now;
+			if (i > 0 && now - last > max_period) max_period = now - last;
+
+			last = now;
+			now += 0.002 + 0.004*(double)(Bench_Random(&random) % 65536) / 65535.0;
+		}
+
+		double average = (last - first) / (double)(frame_count - 1);
+
+		printf("limiter: steady %.0f Hz, average %.4f ms (limit %.4f ms), longest %.4f ms, %llu late, %llu restarts\n",
+			   frame_rate, 1000.0*average, 1000.0*limiter.period, 1000.0*max_period,
+			   (unsigned long long)limiter.late_frames, (unsigned long long)limiter.restarts);
+
+		// every frame fits in its slot even waking up late, so only the first and last wake ups are off the grid
+		assert(fabs(average - limiter.period) < 0.001*limiter.period || !"The limiter drifted off its rate");
+		assert((limiter.late_frames == 0 && limiter.restarts == 0)   || !"Frames that fit their slot were counted late");
 	}
-	COM_SAFE_RELEASE(error);
 
 	//------------------------------------------------------------------------
-	// Create PSO
+	// Late
 
-	D3D12_GRAPHICS_PIPELINE_STATE_DESC desc = {
-		.pRootSignature = g_d3d.rs_bindless,
-		.VS = {
-			.pShaderBytecode = vs->GetBufferPointer(),
-			.BytecodeLength  = vs->GetBufferSize(),
-		},
-		.PS = {
-			.pShaderBytecode = ps->GetBufferPointer(),
-			.BytecodeLength  = ps->GetBufferSize(),
-		},
-		.BlendState = {
-			.RenderTarget = {
-				{
-					.BlendEnable = true,
-					.SrcBlend              = D3D12_BLEND_SRC_ALPHA,
-					.DestBlend             = D3D12_BLEND_INV_SRC_ALPHA,
-					.BlendOp               = D3D12_BLEND_OP_ADD,
-					.SrcBlendAlpha         = D3D12_BLEND_INV_DEST_ALPHA,
-					.DestBlendAlpha        = D3D12_BLEND_ONE,
-					.BlendOpAlpha          = D3D12_BLEND_OP_ADD,
-					.RenderTargetWriteMask = D3D12_COLOR_WRITE_ENABLE_ALL,
-				},
-			},
-		},
-		.SampleMask = D3D12_DEFAULT_SAMPLE_MASK,
-		.RasterizerState = {
-			.FillMode = D3D12_FILL_MODE_SOLID,
-			.CullMode = D3D12_CULL_MODE_NONE,
-			.FrontCounterClockwise = true,
-		},
-		.PrimitiveTopologyType = D3D12_PRIMITIVE_TOPOLOGY_TYPE_TRIANGLE,
-		.NumRenderTargets = 1,
-		.RTVFormats = {
-			DXGI_FORMAT_R8G8B8A8_UNORM_SRGB,
-		},
-		.SampleDesc = { .Count = 1, .Quality = 0 },
-	};
+	{
+		double   frame_times[] = { 0.015, 0.050 };
+		uint64_t late_frames[] = { 1, 0 };
+		uint64_t restarts[]    = { 0, 1 };
+
+		// the 15 ms frame keeps the grid, so the frame after it starts on time, the 50 ms one moves it
+		double expected[][8] = {
+			{ 0.0, 0.010, 0.020, 0.030, 0.045, 0.050, 0.060, 0.070 },
+			{ 0.0, 0.010, 0.020, 0.030, 0.080, 0.090, 0.100, 0.110 },
+		};
 
-	ID3D12PipelineState *pso;
-	HRESULT hr = g_d3d.device->CreateGraphicsPipelineState(&desc, IID_PPV_ARGS(&pso));
-	CHECK_HR(hr);
+		for (size_t i = 0; i < ArrayCount(frame_times); i++)
+		{
+			FrameLimiter limiter = FrameLimiter_Make(100.0);
 
-	return pso;
+			double now = 0.0;
+			double starts[8];
+
+			for (uint32_t frame = 0; frame < ArrayCount(starts); frame++)
+			{
+				starts[frame] = FrameLimiter_Next(&limiter, now);
+				now           = starts[frame] + (frame == 3 ? frame_times[i] : 0.001);
+			}
+
+			printf("limiter: %2.0f ms frame at 100 Hz, starts at", 1000.0*frame_times[i]);
+
+			for (uint32_t frame = 0; frame < ArrayCount(starts); frame++)
+			{
+				printf(" %.0f", 1000.0*starts[frame]);
+			}
+
+			printf(" ms, %llu late, %llu restarts\n", (unsigned long long)limiter.late_frames, (unsigned long long)limiter.restarts);
+
+			assert(limiter.late_frames == late_frames[i] || !"Wrong number of late frames");
+			assert(limiter.restarts    == restarts[i]    || !"Wrong number of restarts");
+
+			for (uint32_t frame = 0; frame < ArrayCount(starts); frame++)
+			{
+				assert(fabs(starts[frame] - expected[i][frame]) < 0.000001 || !"A frame started off the expected grid");
+			}
+		}
+	}
+
+	//------------------------------------------------------------------------
+	// Wait
+
+	{
+		double waits[] = { 0.0005, 0.002, 0.007, 0.016 };
+
+		for (size_t i = 0; i < ArrayCount(waits); i++)
+		{
+			uint32_t count     = 50;
+			double   total     = 0.0;
+			double   max_error = 0.0;
+
+			for (uint32_t j = 0; j < count; j++)
+			{
+				LARGE_INTEGER start = GetTime();
+				WaitSeconds(waits[i]);
+				double error = TimeElapsed(start, GetTime()) - waits[i];
+
+				total += error;
+				if (error > max_error) max_error = error;
+			}
+
+			printf("limiter: WaitSeconds(%5.1f ms) comes back %6.3f ms late on average, %6.3f ms at worst\n",
+				   1000.0*waits[i], 1000.0*total / (double)count, 1000.0*max_error);
+		}
+	}
 }
 
-//------------------------------------------------------------------------
+int Bench_CompareUint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
 
-struct TriangleGuy
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+int Bench_CompareDouble(const void *a, const void *b)
 {
-	Vector2D position;
-	uint32_t texture;
-};
+	double x = *(const double *)a;
+	double y = *(const double *)b;
 
-struct D3D12_Scene
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// FrameStats on made up frame times:
+//
+//     accuracy:  histogram percentiles against exact ones from sorting every sample, for frame times
+//                spread around 16.7 ms with a long tail of slow ones
+//     stutters:  steady 60 Hz frames with 20 spikes to 40 ms that should be flagged, and 20 to 25 ms
+//                that shouldn't, at the default threshold of twice the median
+//     record:    what recording a frame costs, median and all
+void Bench_FrameStats()
 {
-	bool initialized;
+	uint64_t random = 0x853C49E6748FEA9Bull;
 
-	ID3D12PipelineState *pso;
+	//------------------------------------------------------------------------
+	// Accuracy
 
-	ID3D12Resource *ibuffer;
-	ID3D12Resource *vbuffer;
+	{
+		uint32_t  count   = 200000;
+		uint32_t *samples = (uint32_t *)malloc(sizeof(uint32_t)*count);
 
-	D3D12_Descriptor vbuffer_srv;
+		Histogram *histogram = (Histogram *)calloc(1, sizeof(Histogram));
 
-	ID3D12Resource  *textures     [4];
-	D3D12_Descriptor textures_srvs[4];
+		for (uint32_t i = 0; i < count; i++)
+		{
+			// 15 to 18.5 ms, one in 50 up to 4 times that, one in 1000 up to 250 ms
+			double value = 15000.0 + 3500.0*(double)(Bench_Random(&random) % 65536) / 65535.0;
 
-	uint32_t    triangle_guy_count;
-	TriangleGuy triangle_guys[16];
+			uint64_t roll = Bench_Random(&random) % 1000;
+			if      (roll == 0) value += 250000.0*(double)(Bench_Random(&random) % 65536) / 65535.0;
+			else if (roll < 20) value *= 1.0 + 3.0*(double)(Bench_Random(&random) % 65536) / 65535.0;
 
-	uint32_t    texture_index_offset;
-};
+			samples[i] = (uint32_t)value;
+			Histogram_Record(histogram, samples[i]);
+		}
+
+		qsort(samples, count, sizeof(uint32_t), Bench_CompareUint32);
+
+		double percentiles[] = { 50.0, 95.0, 99.0, 99.9 };
+
+		for (size_t i = 0; i < ArrayCount(percentiles); i++)
+		{
+			uint64_t rank  = (uint64_t)ceil(percentiles[i] / 100.0*(double)count);
+			double   exact = (double)samples[rank - 1];
+			double   value = Histogram_GetPercentile(histogram, percentiles[i]);
+
+			printf("frame_stats: p%-4g exact %8.3f ms, histogram %8.3f ms, error %.3f%%\n",
+				   percentiles[i], exact / 1000.0, value / 1000.0, 100.0*fabs(value - exact) / exact);
+
+			assert(fabs(value - exact) <= g_histogram_relative_error*exact || !"Histogram percentile off by more than a bucket allows");
+		}
+
+		printf("frame_stats: %u samples in a %llu byte histogram\n", count, (unsigned long long)sizeof(Histogram));
+
+		free(histogram);
+		free(samples);
+	}
 
-void D3D12_InitScene(D3D12_Scene *scene)
-{
 	//------------------------------------------------------------------------
-	// Create PSO
+	// Stutters
+
+	{
+		FrameStats *stats = (FrameStats *)calloc(1, sizeof(FrameStats));
+
+		uint32_t frame_count = 6400;
+		uint32_t flagged     = 0;
+		uint32_t missed      = 0;
+		uint32_t false_alarm = 0;
+
+		for (uint32_t i = 0; i < frame_count; i++)
+		{
+			double frame = 1.0 / 60.0 + 0.001*((double)(Bench_Random(&random) % 65536) / 65535.0 - 0.5);
+
+			// spikes from frame 200 on, every 150 frames, alternating between ones that count and ones that don't
+			bool spike = i >= 200 && i % 150 == 0 && (i / 150) % 2 == 0 && i < 200 + 40*150;
+			bool bump  = i >= 200 && i % 150 == 0 && (i / 150) % 2 == 1 && i < 200 + 40*150;
+
+			if (spike) frame = 0.040;
+			if (bump)  frame = 0.025;
+
+			double durations[FrameStat_COUNT] = { frame, 0.6*frame, 0.0002 };
+
+			bool stutter = FrameStats_Record(stats, durations);
+
+			if (stutter)            flagged     += 1;
+			if (spike && !stutter)  missed      += 1;
+			if (!spike && stutter)  false_alarm += 1;
+		}
+
+		printf("frame_stats: %u stutters flagged, %u missed, %u false alarms\n", flagged, missed, false_alarm);
 
-	scene->pso = D3D12_CreatePSO();
+		assert(missed == 0      || !"A spike to 40 ms wasn't flagged");
+		assert(false_alarm == 0 || !"A frame under twice the median was flagged");
+
+		free(stats);
+	}
 
 	//------------------------------------------------------------------------
-	// Create index and vertex buffer
+	// Record
 
-	uint16_t indices[] = {
-		0, 1, 2,
-	};
+	{
+		FrameStats *stats = (FrameStats *)calloc(1, sizeof(FrameStats));
 
-	float aspect_ratio = (float)g_d3d.window_w / (float)g_d3d.window_h;
-	float triangle_width = 0.577f / aspect_ratio;
+		uint32_t frame_count = 100000;
 
-	Vertex vertices[] = {
-		{ {            0.0f,  0.5f }, {  5.0f, 10.0f }, { 1, 1, 1, 1 } },
-		{ {  triangle_width, -0.5f }, { 10.0f,  0.0f }, { 1, 1, 1, 1 } },
-		{ { -triangle_width, -0.5f }, {  0.0f,  0.0f }, { 1, 1, 1, 1 } },
-	};
+		LARGE_INTEGER start = GetTime();
 
-	scene->ibuffer = D3D12_CreateUploadBuffer(g_d3d.device, sizeof(indices),  L"Index Buffer",  indices,  sizeof(indices));
-	scene->vbuffer = D3D12_CreateUploadBuffer(g_d3d.device, sizeof(vertices), L"Vertex Buffer", vertices, sizeof(vertices));
+		for (uint32_t i = 0; i < frame_count; i++)
+		{
+			double frame = 1.0 / 60.0 + 0.002*(double)(Bench_Random(&random) % 65536) / 65535.0;
 
-	scene->vbuffer_srv = g_d3d.cbv_srv_uav.Allocate();
+			double durations[FrameStat_COUNT] = { frame, 0.5*frame, 0.0003 };
+			FrameStats_Record(stats, durations);
+		}
+
+		double elapsed = TimeElapsed(start, GetTime());
+
+		printf("frame_stats: %.0f ns per frame recorded, %llu bytes of stats\n",
+			   1000000000.0*elapsed / (double)frame_count, (unsigned long long)sizeof(FrameStats));
+
+		free(stats);
+	}
+}
+
+struct Bench_ProfiledRange
+{
+	volatile LONGLONG ticks; // spent in ranges, summed over every thread
+	volatile long     sum;   // so the loops have something to do
+};
+
+void Bench_ProfiledRangeProc(uint32_t first, uint32_t count, void *data)
+{
+	Bench_ProfiledRange *range = (Bench_ProfiledRange *)data;
+
+	LARGE_INTEGER start = GetTime();
 
+	// local, so threads aren't fighting over it
+	uint32_t sum = 0;
+
+	for (uint32_t i = first; i < first + count; i++)
 	{
-		D3D12_SHADER_RESOURCE_VIEW_DESC desc = {
-			.Format        = DXGI_FORMAT_UNKNOWN,
-			.ViewDimension = D3D12_SRV_DIMENSION_BUFFER,
-			.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING,
-			.Buffer = {
-				.FirstElement        = 0,
-				.NumElements         = 3,
-				.StructureByteStride = sizeof(Vertex),
-			},
-		};
+		CPU_SCOPE("Bench Scope");
+		sum += i;
+	}
+
+	InterlockedExchangeAdd64(&range->ticks, GetTime().QuadPart - start.QuadPart);
+	InterlockedExchangeAdd(&range->sum, (long)sum);
+}
+
+volatile long g_bench_profiler_quit;
+
+DWORD WINAPI Bench_ProfiledThreadProc(LPVOID param)
+{
+	(void)param;
+
+	CpuProfiler_SetThreadName("Bench Recorder");
+
+	while (!g_bench_profiler_quit)
+	{
+		CPU_SCOPE("Bench Outer");
 
-		g_d3d.device->CreateShaderResourceView(scene->vbuffer, &desc, scene->vbuffer_srv.cpu);
+		for (uint32_t i = 0; i < 64; i++)
+		{
+			CPU_SCOPE("Bench Inner");
+		}
 	}
 
+	return 0;
+}
+
+// The CPU profiler's overhead, and exporting:
+//
+//     overhead:  an empty scope against an empty loop, and a GetTime on its own, since that's most of it,
+//                over a few batches. The median scope can't cost more than its two GetTimes and
+//                g_bench_scope_budget on top
+//     threads:   scopes on every thread of the work queue at once, which shouldn't cost any more per
+//                scope than on one, the buffers share nothing
+//     export:    writing a Chrome trace while another thread keeps recording into its ring
+
+static constexpr double g_bench_scope_budget = 0.00000005; // seconds a scope may cost on top of its two GetTimes
+
+void Bench_CpuProfiler()
+{
+	uint32_t count = 1 << 22;
+
 	//------------------------------------------------------------------------
-	// Make textures
+	// Overhead
 
-	D3D12_Frame *frame = D3D12_GetFrameState();
+	{
+		Bench_ProfiledRange range = {};
 
-	const uint32_t texture_pixels[][4*4] = {
-		{ // checkerboard
-			0xFF444444, 0xFF444444, 0xFFFFFFAA, 0xFFFFFFAA,
-			0xFF444444, 0xFF444444, 0xFFFFFFAA, 0xFFFFFFAA,
-			0xFFFFFFAA, 0xFFFFFFAA, 0xFF444444, 0xFF444444,
-			0xFFFFFFAA, 0xFFFFFFAA, 0xFF444444, 0xFF444444,
-		},
-		{ // shifting checkerboard
-			0xFF444444, 0xFF444444, 0xFFFFFFFF, 0xFFFFFFFF,
-			0xFFFFFFFF, 0xFF444444, 0xFF444444, 0xFFFFFFFF,
-			0xFFFFFFFF, 0xFFFFFFFF, 0xFF444444, 0xFF444444,
-			0xFF444444, 0xFFFFFFFF, 0xFFFFFFFF, 0xFF444444,
-		},
-		{ // partytown
-			0xFFFF0000, 0xFF00FF00, 0xFF0000FF, 0xFFFF00FF,
-			0xFFFF00FF, 0xFF0000FF, 0xFF00FF00, 0xFFFF0000,
-			0xFFFF0000, 0xFF00FF00, 0xFF0000FF, 0xFFFF00FF,
-			0xFFFF00FF, 0xFF0000FF, 0xFF00FF00, 0xFFFF0000,
-		},
-		{ // rainbow stripes
-			0xFFFF0000, 0xFFFF0000, 0xFFFF0000, 0xFFFF0000,
-			0xFFFFFF00, 0xFFFFFF00, 0xFFFFFF00, 0xFFFFFF00,
-			0xFF0000FF, 0xFF0000FF, 0xFF0000FF, 0xFF0000FF,
-			0xFFFF00FF, 0xFFFF00FF, 0xFFFF00FF, 0xFFFF00FF,
-		},
-	};
+		uint32_t batch_count = 16;
+		uint32_t batch_size  = count / batch_count;
+
+		double scopes[16];
+		double times [16];
+
+		for (uint32_t batch = 0; batch < batch_count; batch++)
+		{
+			LARGE_INTEGER start = GetTime();
+
+			for (uint32_t i = 0; i < batch_size; i++)
+			{
+				range.sum = (long)i;
+			}
+
+			LARGE_INTEGER loop_end = GetTime();
+
+			Bench_ProfiledRangeProc(0, batch_size, &range);
+
+			LARGE_INTEGER scope_end = GetTime();
+
+			for (uint32_t i = 0; i < batch_size; i++)
+			{
+				range.sum = (long)GetTime().QuadPart;
+			}
 
-	for (size_t i = 0; i < ArrayCount(texture_pixels); i++)
-	{
-		scene->textures     [i] = D3D12_CreateTexture(g_d3d.device, 4, 4, L"Checkerboard", texture_pixels[i], frame->command_list, &frame->upload_arena);
-		scene->textures_srvs[i] = g_d3d.cbv_srv_uav.Allocate();
-		g_d3d.device->CreateShaderResourceView(scene->textures[i], nullptr, scene->textures_srvs[i].cpu);
-	}
+			LARGE_INTEGER time_end = GetTime();
 
-	//------------------------------------------------------------------------
-	// Initialize triangle guys
+			double loop = TimeElapsed(start, loop_end) / (double)batch_size;
+
+			scopes[batch] = TimeElapsed(loop_end,  scope_end) / (double)batch_size - loop;
+			times [batch] = TimeElapsed(scope_end, time_end)  / (double)batch_size - loop;
+		}
 
-	scene->triangle_guy_count = 4;
+		qsort(scopes, batch_count, sizeof(double), Bench_CompareDouble);
+		qsort(times,  batch_count, sizeof(double), Bench_CompareDouble);
 
-	for (size_t i = 0; i < scene->triangle_guy_count; i++)
-	{
-		scene->triangle_guys[i].texture = 3 - (uint32_t)i;
+		double scope = scopes[batch_count / 2];
+		double time  = times [batch_count / 2];
+
+		printf("cpu_profiler: %.1f ns per scope (median of %u batches), of which %.1f ns is the two GetTimes\n",
+			   1000000000.0*scope, batch_count, 2000000000.0*time);
+
+		assert(scope <= 2.0*time + g_bench_scope_budget || !"Scopes cost more than their budget on top of the clock");
 	}
 
 	//------------------------------------------------------------------------
+	// Threads
 
-	scene->initialized = true;
-}
-
-void D3D12_UpdateScene(D3D12_Scene *scene, double current_time)
-{
-	for (size_t i = 0; i < scene->triangle_guy_count; i++)
 	{
-		TriangleGuy *guy = &scene->triangle_guys[i];
-		
-		guy->position.x = (float)(0.5 * sin(0.6 * (double)i + 1.25*current_time));
-		guy->position.y = (float)(0.3 * sin(0.4 * (double)i + 0.65*current_time));
-	}
-}
+		Bench_ProfiledRange range = {};
 
-//------------------------------------------------------------------------
-// Do the actually actual rendering!! FINALLY!!
+		ParallelFor(&g_work_queue, count, 1 << 14, Bench_ProfiledRangeProc, &range);
 
-void D3D12_Render(D3D12_Scene *scene)
-{
-	D3D12_Frame *frame = D3D12_GetFrameState();
+		LARGE_INTEGER ticks = {};
+		ticks.QuadPart = range.ticks;
 
-	ID3D12GraphicsCommandList *list = frame->command_list;
+		printf("cpu_profiler: %u threads, %.1f ns per scope\n", g_work_queue.thread_count, 1000000000.0*TimeElapsed({}, ticks) / (double)count);
+	}
 
 	//------------------------------------------------------------------------
-	// Set and clear rendertarget
+	// Export
 
 	{
-		D3D12_RESOURCE_BARRIER barrier;
-		if (D3D12_Transition(frame->backbuffer, &frame->backbuffer_state, D3D12_RESOURCE_STATE_RENDER_TARGET, &barrier))
-		{
-			list->ResourceBarrier(1, &barrier);
-		}
-	}
-
-	list->OMSetRenderTargets(1, &frame->rtv.cpu, false, nullptr);
+		g_bench_profiler_quit = 0;
 
-	float clear_color[4] = { 0.2f, 0.3f, 0.2f, 1.0f };
-	list->ClearRenderTargetView(frame->rtv.cpu, clear_color, 0, nullptr);
+		HANDLE thread = CreateThread(nullptr, 0, Bench_ProfiledThreadProc, nullptr, 0, nullptr);
 
-	//------------------------------------------------------------------------
-	// Input Assembler
+		// long enough for the recorder to go round its ring a few times
+		WaitSeconds(0.05);
 
-	list->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+		const char *path = "bench_cpu_trace.json";
 
-	D3D12_INDEX_BUFFER_VIEW ibv = {
-		.BufferLocation = scene->ibuffer->GetGPUVirtualAddress(),
-		.SizeInBytes    = 3*sizeof(uint16_t),
-		.Format         = DXGI_FORMAT_R16_UINT,
-	};
-	list->IASetIndexBuffer(&ibv);
+		LARGE_INTEGER start = GetTime();
 
-	//------------------------------------------------------------------------
-	// Rasterizer State
+		bool written = CpuProfiler_WriteChromeTrace(path);
 
-	D3D12_VIEWPORT viewport = {
-		.TopLeftX = 0.0f,
-		.TopLeftY = 0.0f,
-		.Width    = (float)g_d3d.window_w,
-		.Height   = (float)g_d3d.window_h,
-		.MinDepth = 0.0f,
-		.MaxDepth = 1.0f,
-	};
+		double elapsed = TimeElapsed(start, GetTime());
 
-	list->RSSetViewports(1, &viewport);
+		g_bench_profiler_quit = 1;
+		WaitForSingleObject(thread, INFINITE);
+		CloseHandle(thread);
 
-	D3D12_RECT scissor_rect = {
-		.left   = 0,
-		.top    = 0,
-		.right  = g_d3d.window_w,
-		.bottom = g_d3d.window_h,
-	};
+		FILE *file = written ? fopen(path, "rb") : nullptr;
+		long  size = 0;
 
-	list->RSSetScissorRects(1, &scissor_rect);
+		if (file)
+		{
+			fseek(file, 0, SEEK_END);
+			size = ftell(file);
+			fclose(file);
+		}
 
-	//------------------------------------------------------------------------
-	// Set PSO
+		printf("cpu_profiler: %s %ld KiB of trace from %ld threads in %.2f ms, while recording\n",
+			   written ? "wrote" : "failed to write", size / 1024, g_cpu_profiler.buffer_count, 1000.0*elapsed);
 
-	list->SetPipelineState(scene->pso);
+		remove(path);
+	}
+}
 
-	//------------------------------------------------------------------------
-	// Set pass constants
+// Work queue scaling, with a queue per thread count from 1 up to one per logical processor:
+//
+//     even:   a parallel for where every index costs the same
+//     uneven: a parallel for where the cost goes up with the index, so the last ranges are the slow
+//             ones and the threads that finish early have to steal to keep busy
+//     tree:   entries that fork two more entries and wait on them, 64k leaves, which is mostly
+//             overhead of adding, stealing and waiting
+//
+// Both parallel fors have to come out the same as when run on the calling thread alone, and with more
+// than one thread they have to be at least g_bench_min_job_scaling of n times as fast on n threads as
+// on one. Workers only get work by stealing it, so they have to have stolen some too.
 
-	D3D12_BufferAllocation pass_alloc = 
-		frame->upload_arena.Allocate(
-			sizeof(D3D12_PassConstants), 
-			D3D12_CONSTANT_BUFFER_DATA_PLACEMENT_ALIGNMENT);
+static constexpr double g_bench_min_job_scaling = 0.35; // of perfect scaling, for the parallel fors
 
-	D3D12_PassConstants *pass_constants = (D3D12_PassConstants *)pass_alloc.cpu_base;
-	pass_constants->vbuffer_srv = scene->vbuffer_srv.index;
+WorkQueue g_bench_work_queue;
 
-	list->SetGraphicsRootConstantBufferView(D3D12_RootParameter_pass_cbv, pass_alloc.gpu_base);
+struct Bench_JobData
+{
+	uint32_t *out;
+	uint32_t  count;
+	bool      uneven;
+};
 
-	//------------------------------------------------------------------------
-	// Draw
+void Bench_JobRange(uint32_t first, uint32_t count, void *data)
+{
+	Bench_JobData *job = (Bench_JobData *)data;
 
-	for (size_t i = 0; i < scene->triangle_guy_count; i++)
+	for (uint32_t i = first; i < first + count; i++)
 	{
-		TriangleGuy *guy = &scene->triangle_guys[i];
+		uint32_t iterations = job->uneven ? (uint32_t)((uint64_t)i*256 / job->count) : 128;
 
-		//------------------------------------------------------------------------
-		// Set root constants
+		uint32_t x = i;
 
-		uint32_t texture_index = (guy->texture + scene->texture_index_offset) % 4;
+		for (uint32_t j = 0; j < iterations; j++)
+		{
+			x = x*1664525u + 1013904223u;
+		}
 
-		D3D12_RootConstants root_constants = {
-			.offset        = guy->position,
-			.texture_index = scene->textures_srvs[texture_index].index,
-		};
+		job->out[i] = x;
+	}
+}
 
-		uint32_t uint_count = sizeof(root_constants) / sizeof(uint32_t);
-		list->SetGraphicsRoot32BitConstants(D3D12_RootParameter_32bit_constants, uint_count, &root_constants, 0);
+struct Bench_JobTree
+{
+	WorkQueue *queue;
+	uint32_t   depth;
+	uint32_t   leaves; // counted on the way back up
+};
 
-		//------------------------------------------------------------------------
-		// Draw the triangle
+void Bench_JobTreeProc(void *data)
+{
+	Bench_JobTree *node = (Bench_JobTree *)data;
 
-		list->DrawIndexedInstanced(3, 1, 0, 0, 0);
+	if (node->depth == 0)
+	{
+		node->leaves = 1;
+		return;
 	}
-}
 
-//------------------------------------------------------------------------
-// Window
+	Bench_JobTree children[2] = {
+		{ .queue = node->queue, .depth = node->depth - 1 },
+		{ .queue = node->queue, .depth = node->depth - 1 },
+	};
 
-LRESULT CALLBACK Win32_WindowProc(HWND hwnd, UINT message, WPARAM w_param, LPARAM l_param)
+	WorkCounter counter = {};
+
+	node->queue->Add(Bench_JobTreeProc, &children[0], &counter);
+	node->queue->Add(Bench_JobTreeProc, &children[1], &counter);
+	node->queue->Wait(&counter);
+
+	node->leaves = children[0].leaves + children[1].leaves;
+}
+
+void Bench_Jobs()
 {
-	LRESULT result = 0;
+	uint32_t max_thread_count = std::thread::hardware_concurrency();
+	if (max_thread_count > g_max_worker_threads + 1) max_thread_count = g_max_worker_threads + 1;
+	if (max_thread_count < 1)                        max_thread_count = 1;
 
-	D3D12_Scene *scene = (D3D12_Scene *)GetWindowLongPtrW(hwnd, GWLP_USERDATA);
+	uint32_t  count = 1 << 20;
+	uint32_t *out   = (uint32_t *)malloc(count*sizeof(uint32_t));
 
-	switch (message)
+	// what the parallel fors should come out as, run without a queue
+	uint64_t expected_hashes[2];
+
+	for (uint32_t test = 0; test < 2; test++)
 	{
-		case WM_DESTROY:
-		{
-			PostQuitMessage(0);
-		} break;
+		Bench_JobData job = {
+			.out    = out,
+			.count  = count,
+			.uneven = test == 1,
+		};
 
-		case WM_KEYDOWN:
+		ParallelFor(nullptr, count, 1024, Bench_JobRange, &job);
+		expected_hashes[test] = HashBytes(out, count*sizeof(uint32_t));
+	}
+
+	double base_times[3] = {};
+
+	for (uint32_t thread_count = 1; thread_count <= max_thread_count;)
+	{
+		WorkQueue *queue = &g_bench_work_queue;
+		queue->Init(thread_count - 1);
+
+		double best_times[3] = { 1e30, 1e30, 1e30 };
+
+		for (uint32_t repetition = 0; repetition < 5; repetition++)
 		{
-			switch (w_param)
+			for (uint32_t test = 0; test < 3; test++)
 			{
-				case VK_SPACE:
+				// so ranges that never ran can't pass for ones that did
+				memset(out, 0, count*sizeof(uint32_t));
+
+				LARGE_INTEGER start = GetTime();
+
+				if (test < 2)
 				{
-					if (scene)
-					{
-						scene->texture_index_offset += 1;
-					}
-				} break;
+					Bench_JobData job = {
+						.out    = out,
+						.count  = count,
+						.uneven = test == 1,
+					};
+
+					ParallelFor(queue, count, 1024, Bench_JobRange, &job);
+				}
+				else
+				{
+					Bench_JobTree root = { .queue = queue, .depth = 16 };
+					Bench_JobTreeProc(&root);
+
+					assert(root.leaves == 1u << 16 || !"Lost some work queue entries");
+				}
+
+				double time = TimeElapsed(start, GetTime());
+				if (best_times[test] > time) best_times[test] = time;
+
+				if (test < 2)
+				{
+					assert(HashBytes(out, count*sizeof(uint32_t)) == expected_hashes[test] || !"A parallel for came out different on the work queue");
+				}
 			}
-		} break;
+		}
 
-		default:
+		uint32_t stolen = 0;
+
+		for (uint32_t i = 0; i < queue->thread_count; i++)
 		{
-			result = DefWindowProcW(hwnd, message, w_param, l_param);
-		} break;
+			stolen += queue->deques[i].stolen;
+		}
+
+		queue->Release();
+
+		if (thread_count == 1)
+		{
+			memcpy(base_times, best_times, sizeof(base_times));
+		}
+
+		printf("jobs: %2u threads: even %7.2f ms (%4.1fx), uneven %7.2f ms (%4.1fx), tree %7.2f ms (%4.1fx), %u steals\n",
+			   thread_count,
+			   1000.0*best_times[0], base_times[0] / best_times[0],
+			   1000.0*best_times[1], base_times[1] / best_times[1],
+			   1000.0*best_times[2], base_times[2] / best_times[2],
+			   stolen);
+
+		if (thread_count > 1)
+		{
+			double min_scaling = g_bench_min_job_scaling*(double)thread_count;
+
+			assert(base_times[0] / best_times[0] >= min_scaling || !"The even parallel for doesn't scale with threads");
+			assert(base_times[1] / best_times[1] >= min_scaling || !"The uneven parallel for doesn't scale with threads");
+			assert(stolen > 0                                   || !"The workers never stole anything");
+		}
+
+		// powers of two, plus the actual maximum
+		if (thread_count == max_thread_count) break;
+		thread_count = thread_count*2 < max_thread_count ? thread_count*2 : max_thread_count;
 	}
 
-	return result;
+	free(out);
 }
 
-HWND Win32_CreateWindow()
+struct Benchmark
 {
-	HWND result = NULL;
+	const char *name;
+	void      (*run)();
+};
 
-	int desktop_w = GetSystemMetrics(SM_CXFULLSCREEN);
-	int desktop_h = GetSystemMetrics(SM_CYFULLSCREEN);
+Benchmark g_benchmarks[] = {
+	{ "sort",           Bench_Sort },
+	{ "command_stream", Bench_CommandStream },
+	{ "state_tracker",  Bench_StateTracker },
+	{ "view_cache",     Bench_ViewCache },
+	{ "render_graph",   Bench_RenderGraph },
+	{ "indirect",       Bench_IndirectDraws },
+	{ "scene_update",   Bench_SceneUpdate },
+	{ "cull",           Bench_Cull },
+	{ "bvh",            Bench_BVH },
+	{ "timestep",       Bench_Timestep },
+	{ "pacing",         Bench_Pacing },
+	{ "limiter",        Bench_Limiter },
+	{ "frame_stats",    Bench_FrameStats },
+	{ "cpu_profiler",   Bench_CpuProfiler },
+	{ "jobs",           Bench_Jobs },
+};
 
-	int w = 3*desktop_w / 4;
-	int h = 3*desktop_h / 4;
+int Bench_Main(int name_count, char **names)
+{
+	int result = 0;
 
-	WNDCLASSEXW wclass = 
+	for (int i = 0; i < name_count; i++)
 	{
-		.cbSize        = sizeof(wclass),
-		.style         = CS_HREDRAW|CS_VREDRAW,
-		.lpfnWndProc   = Win32_WindowProc,
-		.hIcon         = LoadIconW(NULL, L"APPICON"),
-		.hCursor       = NULL, 
-		.lpszClassName = L"HelloBindlessD3D12",
-	};
+		bool found = false;
 
-	if (!RegisterClassExW(&wclass))
-	{
-		assert(!"Failed to register window class");
-	}
+		for (size_t j = 0; j < ArrayCount(g_benchmarks); j++)
+		{
+			found |= strcmp(names[i], g_benchmarks[j].name) == 0;
+		}
 
-	RECT wrect = {
-		.left   = 0,
-		.top    = 0,
-		.right  = w,
-		.bottom = h,
-	};
+		if (!found)
+		{
+			fprintf(stderr, "Unknown benchmark '%s'\n", names[i]);
+			result = 1;
+		}
+	}
 
-	AdjustWindowRect(&wrect, WS_OVERLAPPEDWINDOW, FALSE);
+	for (size_t i = 0; i < ArrayCount(g_benchmarks); i++)
+	{
+		Benchmark *benchmark = &g_benchmarks[i];
 
-	result = CreateWindowExW(0, L"HelloBindlessD3D12", L"Hello Bindless",
-							WS_OVERLAPPEDWINDOW,
-							64, 64,
-							wrect.right - wrect.left,
-							wrect.bottom - wrect.top,
-							NULL, NULL, NULL, NULL);
+		bool selected = name_count == 0;
 
-	assert(result || !"Failed to create window");
+		for (int j = 0; j < name_count; j++)
+		{
+			selected |= strcmp(names[j], benchmark->name) == 0;
+		}
 
-	ShowWindow(result, SW_SHOW);
+		if (selected)
+		{
+			benchmark->run();
+		}
+	}
 
 	return result;
 }
@@ -1364,37 +13465,96 @@ HWND Win32_CreateWindow()
 //------------------------------------------------------------------------
 // Main
 
-LARGE_INTEGER g_qpc_freq;
+D3D12_Scene g_scene;
 
-LARGE_INTEGER GetTime()
+int main(int argc, char **argv)
 {
-	LARGE_INTEGER result;
-	QueryPerformanceCounter(&result);
+	//------------------------------------------------------------------------
+	// Start worker threads, leaving a core each for the main and render threads. The render thread
+	// adds work too, so it needs a deque of its own.
 
-	return result;
-}
+	SYSTEM_INFO system_info;
+	GetSystemInfo(&system_info);
 
-double TimeElapsed(LARGE_INTEGER start, LARGE_INTEGER end)
-{
-	if (!g_qpc_freq.QuadPart)
+	uint32_t worker_count = system_info.dwNumberOfProcessors > 2 ? system_info.dwNumberOfProcessors - 2 : 0;
+	if (worker_count > g_max_worker_threads) worker_count = g_max_worker_threads;
+
+	g_work_queue.Init(worker_count, g_pin_worker_threads, 1);
+
+	//------------------------------------------------------------------------
+
+	if (argc > 1 && strcmp(argv[1], "-bench") == 0)
 	{
-		QueryPerformanceFrequency(&g_qpc_freq);
+		int result = Bench_Main(argc - 2, argv + 2);
+
+		// the workers are std::threads, which end the process if they're still running at exit
+		g_work_queue.Release();
+
+		return result;
 	}
 
-	return (double)(end.QuadPart - start.QuadPart) / (double)g_qpc_freq.QuadPart;
-}
+	// -frame_packets N sets how many frames the main thread can get ahead of the render thread,
+	// -frame_latency N and -frame_slots N what the render thread starts out with, see D3D12_SetFrameLatency,
+	// and -adaptive_pacing hands the frame slots over to a FramePacer. -present_mode vsync|immediate|limited
+	// picks how frames are presented, and -fps_limit N the rate limited holds them to.
+	uint32_t frame_packet_depth = g_default_frame_packet_depth;
 
-D3D12_Scene g_scene;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-adaptive_pacing") == 0)
+		{
+			g_scene.adaptive_pacing = true;
+		}
+
+		if (i + 1 == argc)
+		{
+			break;
+		}
+
+		int value = atoi(argv[i + 1]);
+
+		if (strcmp(argv[i], "-frame_packets") == 0)
+		{
+			if (value >= 1 && value <= (int)g_max_frame_packets) frame_packet_depth = (uint32_t)value;
+		}
+		else if (strcmp(argv[i], "-frame_latency") == 0)
+		{
+			if (value >= 1 && value <= (int)g_max_frame_latency) g_scene.max_frame_latency = (uint32_t)value;
+		}
+		else if (strcmp(argv[i], "-frame_slots") == 0)
+		{
+			if (value >= 1 && value <= (int)g_max_frame_slots) g_scene.frame_slot_count = (uint32_t)value;
+		}
+		else if (strcmp(argv[i], "-fps_limit") == 0)
+		{
+			if (value >= 1) g_scene.frame_rate_limit = (double)value;
+		}
+		else if (strcmp(argv[i], "-present_mode") == 0)
+		{
+			for (uint32_t mode = 0; mode < D3D12_PresentMode_COUNT; mode++)
+			{
+				if (strcmp(argv[i + 1], g_present_mode_names[mode]) == 0) g_scene.present_mode = (D3D12_PresentMode)mode;
+			}
+		}
+	}
 
-int main(int, char **)
-{
 	HWND window = Win32_CreateWindow();
 	
 	SetWindowLongPtrW(window, GWLP_USERDATA, (LONG_PTR)&g_scene);
 
+	CpuProfiler_SetThreadName("Main");
+
 	DXC_Init();
 	D3D12_Init(window);
 
+	//------------------------------------------------------------------------
+	// Start the render thread, from here on the main thread only simulates
+
+	D3D12_InitSceneSimulation(&g_scene);
+
+	g_frame_packets.Init(frame_packet_depth);
+	D3D12_StartRenderThread(&g_scene, &g_frame_packets);
+
 	//------------------------------------------------------------------------
 	// Main loop
 
@@ -1422,20 +13582,44 @@ int main(int, char **)
 			}
 		}
 
-		double current_time = TimeElapsed(start_time, GetTime());
+		if (!running)
+		{
+			break;
+		}
+
+		LARGE_INTEGER wait_start = GetTime();
 
-		D3D12_BeginFrame();
+		D3D12_FramePacket *packet = g_frame_packets.BeginWrite();
 
-		if (!g_scene.initialized)
+		LARGE_INTEGER delay_start = GetTime();
+
+		CpuProfiler_Record("Packet Wait", wait_start, delay_start);
+
+		// sampling input later when the frame would only end up waiting for the GPU, see FramePacer
+		long input_delay_us = g_render_thread.input_delay_us;
+
+		if (input_delay_us > 0 && g_scene.adaptive_pacing)
 		{
-			D3D12_InitScene(&g_scene);
+			WaitSeconds((double)input_delay_us / 1000000.0);
 		}
 
+		LARGE_INTEGER simulate_start = GetTime();
+
+		double current_time = TimeElapsed(start_time, simulate_start);
+
 		D3D12_UpdateScene(&g_scene, current_time);
-		D3D12_Render(&g_scene);
+		D3D12_BuildFramePacket(&g_scene, packet);
 
-		D3D12_EndFrame();
+		packet->started       = simulate_start;
+		packet->producer_wait = TimeElapsed(wait_start, delay_start);
+		packet->simulate      = TimeElapsed(simulate_start, GetTime());
+
+		g_frame_packets.EndWrite();
 	}
+
+	D3D12_StopRenderThread();
+	g_frame_packets.Release();
+	g_work_queue.Release();
 }
 
 /*